@@ -0,0 +1,21 @@
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+// The FreeRTOS primitives used by the OTA engine, implemented with pthreads
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define portMAX_DELAY ((TickType_t)0xffffffff)
+#define portTICK_PERIOD_MS 1
+
+#endif
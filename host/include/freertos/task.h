@@ -0,0 +1,17 @@
+#ifndef HOST_FREERTOS_TASK_H
+#define HOST_FREERTOS_TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *);
+typedef struct host_task *TaskHandle_t;
+
+// Tasks are detached threads, the stack size and priority are ignored
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name,
+                       uint32_t stack_depth, void *parameters,
+                       UBaseType_t priority, TaskHandle_t *created_task);
+void vTaskDelay(TickType_t ticks);
+// Always 0, the stack usage of the threads is not tracked
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+
+#endif
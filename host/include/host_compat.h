@@ -0,0 +1,14 @@
+#ifndef HOST_COMPAT_H
+#define HOST_COMPAT_H
+
+// Functions of the ESP-IDF C library missing from older glibc, included in
+// every source file by CMakeLists.txt
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t size);
+#endif
+
+#endif
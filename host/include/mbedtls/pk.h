@@ -0,0 +1,31 @@
+#ifndef HOST_MBEDTLS_PK_H
+#define HOST_MBEDTLS_PK_H
+
+// The part of the mbedtls public key API verifying the manifest signatures,
+// over OpenSSL
+
+#include <openssl/evp.h>
+#include <stddef.h>
+
+#define MBEDTLS_ERR_PK_KEY_INVALID_FORMAT -0x3D00
+#define MBEDTLS_ERR_PK_BAD_INPUT_DATA -0x3E80
+#define MBEDTLS_ERR_ECP_VERIFY_FAILED -0x4E00
+
+typedef enum {
+  MBEDTLS_MD_SHA256 = 9,
+} mbedtls_md_type_t;
+
+typedef struct {
+  EVP_PKEY *key;
+} mbedtls_pk_context;
+
+void mbedtls_pk_init(mbedtls_pk_context *ctx);
+void mbedtls_pk_free(mbedtls_pk_context *ctx);
+// `key` is a NUL terminated PEM, `keylen` includes the NUL
+int mbedtls_pk_parse_public_key(mbedtls_pk_context *ctx,
+                                const unsigned char *key, size_t keylen);
+int mbedtls_pk_verify(mbedtls_pk_context *ctx, mbedtls_md_type_t md_alg,
+                      const unsigned char *hash, size_t hash_len,
+                      const unsigned char *sig, size_t sig_len);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef HOST_MBEDTLS_SHA256_H
+#define HOST_MBEDTLS_SHA256_H
+
+// mbedtls SHA-256 API over OpenSSL. The context is a plain struct, so it can
+// be copied and stored like the mbedtls one.
+
+#include <openssl/sha.h>
+#include <stddef.h>
+
+typedef struct {
+  SHA256_CTX ctx;
+} mbedtls_sha256_context;
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx);
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx);
+void mbedtls_sha256_clone(mbedtls_sha256_context *dst,
+                          const mbedtls_sha256_context *src);
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224);
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx,
+                          const unsigned char *input, size_t len);
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx,
+                          unsigned char output[32]);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef HOST_SDKCONFIG_H
+#define HOST_SDKCONFIG_H
+
+// Defaults of main/Kconfig.projbuild. The boolean options are set by the
+// CMake options of the same name, the values can be overridden with -D.
+
+#ifndef CONFIG_OTA_PIPELINE_BUFFER_SIZE
+#define CONFIG_OTA_PIPELINE_BUFFER_SIZE 8
+#endif
+#ifndef CONFIG_OTA_PIPELINE_BUFFERS
+#define CONFIG_OTA_PIPELINE_BUFFERS 2
+#endif
+#ifndef CONFIG_OTA_FLASH_TASK_STACK_SIZE
+#define CONFIG_OTA_FLASH_TASK_STACK_SIZE 6144
+#endif
+#ifndef CONFIG_OTA_RESUME_CHECKPOINT_INTERVAL
+#define CONFIG_OTA_RESUME_CHECKPOINT_INTERVAL 64
+#endif
+#ifndef CONFIG_OTA_BLOCK_RETRIES
+#define CONFIG_OTA_BLOCK_RETRIES 3
+#endif
+
+#endif
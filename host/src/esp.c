@@ -0,0 +1,155 @@
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "host.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/sha256.h"
+#include <openssl/pem.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+esp_log_level_t esp_log_level = ESP_LOG_INFO;
+
+const char *esp_err_to_name(esp_err_t code) {
+  switch (code) {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_FAIL:
+    return "ESP_FAIL";
+  case ESP_ERR_NO_MEM:
+    return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:
+    return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_INVALID_STATE:
+    return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_INVALID_SIZE:
+    return "ESP_ERR_INVALID_SIZE";
+  case ESP_ERR_NOT_FOUND:
+    return "ESP_ERR_NOT_FOUND";
+  case ESP_ERR_NOT_SUPPORTED:
+    return "ESP_ERR_NOT_SUPPORTED";
+  case ESP_ERR_TIMEOUT:
+    return "ESP_ERR_TIMEOUT";
+  case ESP_ERR_INVALID_RESPONSE:
+    return "ESP_ERR_INVALID_RESPONSE";
+  case ESP_ERR_INVALID_CRC:
+    return "ESP_ERR_INVALID_CRC";
+  case ESP_ERR_INVALID_VERSION:
+    return "ESP_ERR_INVALID_VERSION";
+  case ESP_ERR_OTA_VALIDATE_FAILED:
+    return "ESP_ERR_OTA_VALIDATE_FAILED";
+  default:
+    return "UNKNOWN ERROR";
+  }
+}
+
+// Time skipped by host_clock_advance()
+static int64_t clock_offset_us;
+
+int64_t esp_timer_get_time(void) {
+  static struct timespec start;
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (start.tv_sec == 0 && start.tv_nsec == 0) {
+    start = now;
+  }
+  return (int64_t)(now.tv_sec - start.tv_sec) * 1000000 +
+         (now.tv_nsec - start.tv_nsec) / 1000 + clock_offset_us;
+}
+
+void host_clock_advance(int64_t us) { clock_offset_us += us; }
+
+// Same format as ESP-IDF: level letter, milliseconds since start, tag
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format,
+                   ...) {
+  static const char letters[] = "NEWIDV";
+  va_list args;
+
+  fprintf(stderr, "%c (%lld) %s: ", letters[level],
+          (long long)(esp_timer_get_time() / 1000), tag);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t size) {
+  size_t len = strlen(src);
+  if (size > 0) {
+    size_t copy = len < size - 1 ? len : size - 1;
+    memcpy(dst, src, copy);
+    dst[copy] = '\0';
+  }
+  return len;
+}
+#endif
+
+// ---- mbedtls SHA-256 --------------------------------------------------------
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_clone(mbedtls_sha256_context *dst,
+                          const mbedtls_sha256_context *src) {
+  *dst = *src;
+}
+
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224) {
+  return is224 ? SHA224_Init(&ctx->ctx) != 1 : SHA256_Init(&ctx->ctx) != 1;
+}
+
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx,
+                          const unsigned char *input, size_t len) {
+  return SHA256_Update(&ctx->ctx, input, len) != 1;
+}
+
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx,
+                          unsigned char output[32]) {
+  return SHA256_Final(output, &ctx->ctx) != 1;
+}
+
+// ---- mbedtls public keys ----------------------------------------------------
+
+void mbedtls_pk_init(mbedtls_pk_context *ctx) { ctx->key = NULL; }
+
+void mbedtls_pk_free(mbedtls_pk_context *ctx) {
+  EVP_PKEY_free(ctx->key);
+  ctx->key = NULL;
+}
+
+int mbedtls_pk_parse_public_key(mbedtls_pk_context *ctx,
+                                const unsigned char *key, size_t keylen) {
+  if (keylen == 0 || key[keylen - 1] != '\0') {
+    return MBEDTLS_ERR_PK_KEY_INVALID_FORMAT;
+  }
+  BIO *bio = BIO_new_mem_buf(key, (int)keylen - 1);
+  if (bio == NULL) {
+    return MBEDTLS_ERR_PK_KEY_INVALID_FORMAT;
+  }
+  ctx->key = PEM_read_bio_PUBKEY(bio, NULL, NULL, NULL);
+  BIO_free(bio);
+  return ctx->key != NULL ? 0 : MBEDTLS_ERR_PK_KEY_INVALID_FORMAT;
+}
+
+int mbedtls_pk_verify(mbedtls_pk_context *ctx, mbedtls_md_type_t md_alg,
+                      const unsigned char *hash, size_t hash_len,
+                      const unsigned char *sig, size_t sig_len) {
+  if (ctx->key == NULL || md_alg != MBEDTLS_MD_SHA256) {
+    return MBEDTLS_ERR_PK_BAD_INPUT_DATA;
+  }
+  EVP_PKEY_CTX *verify = EVP_PKEY_CTX_new(ctx->key, NULL);
+  int ok = verify != NULL && EVP_PKEY_verify_init(verify) == 1 &&
+           EVP_PKEY_CTX_set_signature_md(verify, EVP_sha256()) == 1 &&
+           EVP_PKEY_verify(verify, sig, sig_len, hash, hash_len) == 1;
+  EVP_PKEY_CTX_free(verify);
+  return ok ? 0 : MBEDTLS_ERR_ECP_VERIFY_FAILED;
+}
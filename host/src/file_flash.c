@@ -0,0 +1,410 @@
+#include "esp_app_format.h"
+#include "esp_log.h"
+#include "host.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE 4096
+#define SLOT_COUNT 2
+#define FIRST_SLOT_ADDRESS 0x10000
+#define PATH_MAX_LEN 512
+
+// Same values as esp_ota_img_states_t
+#define OTA_IMG_NEW 0x0
+#define OTA_IMG_PENDING_VERIFY 0x1
+#define OTA_IMG_VALID 0x2
+#define OTA_IMG_INVALID 0x3
+#define OTA_IMG_ABORTED 0x4
+#define OTA_IMG_UNDEFINED 0xFFFFFFFF
+
+static const char *FLASH_TAG = "FLASH";
+
+// Entry of the OTA data partition, same layout as esp_ota_select_entry_t.
+// The partition has one entry at the start of each of its two sectors, the
+// valid entry with the highest sequence number selects the boot slot.
+typedef struct {
+  uint32_t ota_seq;
+  uint8_t seq_label[20];
+  uint32_t ota_state;
+  uint32_t crc; // CRC32 of ota_seq
+} otadata_entry_t;
+
+typedef struct {
+  file_flash_config_t config;
+  int slots[SLOT_COUNT]; // Partition files
+  int otadata;           // OTA data partition file
+  int running;           // Slot booted when the flash was created, or -1
+  int update;            // Slot being written
+  uint32_t write_pos;    // Next offset written in the update slot
+  bool fault_injected;
+} file_flash_t;
+
+// CRC32 as computed by esp_rom_crc32_le(UINT32_MAX, ...)
+static uint32_t crc32_le(const uint8_t *data, size_t len) {
+  uint32_t crc = 0;
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static bool entry_is_valid(const otadata_entry_t *entry) {
+  return entry->ota_seq != UINT32_MAX &&
+         entry->crc == crc32_le((const uint8_t *)&entry->ota_seq,
+                                sizeof(entry->ota_seq));
+}
+
+static bool entry_is_bootable(const otadata_entry_t *entry) {
+  return entry_is_valid(entry) && entry->ota_state != OTA_IMG_INVALID &&
+         entry->ota_state != OTA_IMG_ABORTED;
+}
+
+static void read_otadata(file_flash_t *flash,
+                         otadata_entry_t entries[2]) {
+  for (int i = 0; i < 2; ++i) {
+    if (pread(flash->otadata, &entries[i], sizeof(entries[i]),
+              i * SECTOR_SIZE) != sizeof(entries[i])) {
+      memset(&entries[i], 0xFF, sizeof(entries[i]));
+    }
+  }
+}
+
+// Index of the bootable entry with the highest sequence number, or -1
+static int current_entry(const otadata_entry_t entries[2]) {
+  int current = -1;
+  for (int i = 0; i < 2; ++i) {
+    if (entry_is_bootable(&entries[i]) &&
+        (current < 0 || entries[i].ota_seq > entries[current].ota_seq)) {
+      current = i;
+    }
+  }
+  return current;
+}
+
+static bool slot_has_image(file_flash_t *flash, int slot) {
+  uint8_t magic;
+  return pread(flash->slots[slot], &magic, 1, 0) == 1 &&
+         magic == ESP_IMAGE_HEADER_MAGIC;
+}
+
+int file_flash_boot_slot(void *ctx) {
+  file_flash_t *flash = ctx;
+  otadata_entry_t entries[2];
+
+  read_otadata(flash, entries);
+  int current = current_entry(entries);
+  if (current >= 0) {
+    return (entries[current].ota_seq - 1) % SLOT_COUNT;
+  }
+  // Like the bootloader without OTA data, boot the first slot
+  return slot_has_image(flash, 0) ? 0 : -1;
+}
+
+// Write the OTA data selecting the slot, in the sector not holding the
+// current entry so that a power cut leaves one of them valid
+static esp_err_t set_boot_slot(file_flash_t *flash, int slot) {
+  otadata_entry_t entries[2];
+  read_otadata(flash, entries);
+
+  int current = current_entry(entries);
+  uint32_t seq = current >= 0 ? entries[current].ota_seq + 1 : 1;
+  while ((seq - 1) % SLOT_COUNT != (uint32_t)slot) {
+    seq++;
+  }
+
+  int sector = current >= 0 ? 1 - current : 0;
+  otadata_entry_t entry;
+  memset(&entry, 0xFF, sizeof(entry));
+  entry.ota_seq = seq;
+  entry.ota_state = OTA_IMG_NEW;
+  entry.crc = crc32_le((const uint8_t *)&entry.ota_seq, sizeof(entry.ota_seq));
+
+  uint8_t sector_data[SECTOR_SIZE];
+  memset(sector_data, 0xFF, sizeof(sector_data));
+  memcpy(sector_data, &entry, sizeof(entry));
+  if (pwrite(flash->otadata, sector_data, sizeof(sector_data),
+             sector * SECTOR_SIZE) != sizeof(sector_data) ||
+      fsync(flash->otadata) != 0) {
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t read_desc(file_flash_t *flash, int slot,
+                           esp_app_desc_t *desc) {
+  if (slot < 0 ||
+      pread(flash->slots[slot], desc, sizeof(*desc),
+            sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)) !=
+          sizeof(*desc) ||
+      desc->magic_word != ESP_APP_DESC_MAGIC_WORD) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t flash_update_partition(void *ctx, uint32_t *address,
+                                        uint32_t *size) {
+  file_flash_t *flash = ctx;
+
+  ESP_LOGI(FLASH_TAG, "Running slot %d", flash->running);
+  flash->update = flash->running >= 0 ? (flash->running + 1) % SLOT_COUNT : 0;
+  *address = FIRST_SLOT_ADDRESS + flash->update * flash->config.partition_size;
+  *size = flash->config.partition_size;
+  return ESP_OK;
+}
+
+static esp_err_t flash_begin(void *ctx, uint32_t offset) {
+  file_flash_t *flash = ctx;
+
+  if (offset % SECTOR_SIZE != 0 || offset >= flash->config.partition_size) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  flash->write_pos = offset;
+  ESP_LOGI(FLASH_TAG, "Writing slot %d from offset %" PRIu32, flash->update,
+           offset);
+  return ESP_OK;
+}
+
+static esp_err_t flash_write(void *ctx, const void *data, size_t len) {
+  file_flash_t *flash = ctx;
+  const file_flash_config_t *config = &flash->config;
+  int fd = flash->slots[flash->update];
+
+  if (flash->write_pos + len > config->partition_size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  uint32_t end = flash->write_pos + len;
+  if (config->power_cut_at > 0 && flash->write_pos < config->power_cut_at &&
+      end >= config->power_cut_at) {
+    len = config->power_cut_at - flash->write_pos;
+    pwrite(fd, data, len, flash->write_pos);
+    ESP_LOGW(FLASH_TAG, "Injected power cut at %" PRIu32,
+             config->power_cut_at);
+    _exit(3);
+  }
+  if (config->fail_at > 0 && !flash->fault_injected &&
+      flash->write_pos < config->fail_at && end >= config->fail_at) {
+    flash->fault_injected = true;
+    ESP_LOGW(FLASH_TAG, "Injected write failure at %" PRIu32, config->fail_at);
+    return ESP_FAIL;
+  }
+
+  // Sequential writes erase every sector they enter
+  static const uint8_t erased[SECTOR_SIZE] = {[0 ... SECTOR_SIZE - 1] = 0xFF};
+  uint32_t sector = (flash->write_pos + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  for (; sector * SECTOR_SIZE < end; ++sector) {
+    if (pwrite(fd, erased, SECTOR_SIZE, sector * SECTOR_SIZE) != SECTOR_SIZE) {
+      return ESP_FAIL;
+    }
+  }
+  if (pwrite(fd, data, len, flash->write_pos) != (ssize_t)len) {
+    return ESP_FAIL;
+  }
+  flash->write_pos = end;
+
+  if (config->write_kbps > 0) {
+    usleep((uint64_t)len * 1000000 / (config->write_kbps * 1024));
+  }
+  return ESP_OK;
+}
+
+static void flash_abort(void *ctx) {
+  file_flash_t *flash = ctx;
+  fsync(flash->slots[flash->update]);
+}
+
+static esp_err_t flash_finish(void *ctx) {
+  file_flash_t *flash = ctx;
+  esp_app_desc_t desc;
+
+  // The bootloader only checks the headers here, the engine checked the hash
+  if (!slot_has_image(flash, flash->update) ||
+      read_desc(flash, flash->update, &desc) != ESP_OK) {
+    ESP_LOGE(FLASH_TAG, "Image validation failed, image is corrupted");
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  }
+  if (fsync(flash->slots[flash->update]) != 0 ||
+      set_boot_slot(flash, flash->update) != ESP_OK) {
+    ESP_LOGE(FLASH_TAG, "Failed to write the OTA data");
+    return ESP_FAIL;
+  }
+  ESP_LOGI(FLASH_TAG, "Slot %d boots next", flash->update);
+  return ESP_OK;
+}
+
+static esp_err_t flash_read_running(void *ctx, uint32_t offset, void *data,
+                                    size_t len) {
+  file_flash_t *flash = ctx;
+
+  if (flash->running < 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (offset + len > flash->config.partition_size ||
+      pread(flash->slots[flash->running], data, len, offset) != (ssize_t)len) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t flash_read_update(void *ctx, uint32_t offset, void *data,
+                                   size_t len) {
+  file_flash_t *flash = ctx;
+
+  if (offset + len > flash->config.partition_size ||
+      pread(flash->slots[flash->update], data, len, offset) != (ssize_t)len) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t flash_running_desc(void *ctx, esp_app_desc_t *desc) {
+  file_flash_t *flash = ctx;
+  return read_desc(flash, flash->running, desc);
+}
+
+static esp_err_t flash_invalid_desc(void *ctx, esp_app_desc_t *desc) {
+  file_flash_t *flash = ctx;
+  otadata_entry_t entries[2];
+
+  read_otadata(flash, entries);
+  for (int i = 0; i < 2; ++i) {
+    if (entry_is_valid(&entries[i]) &&
+        (entries[i].ota_state == OTA_IMG_INVALID ||
+         entries[i].ota_state == OTA_IMG_ABORTED)) {
+      return read_desc(flash, (entries[i].ota_seq - 1) % SLOT_COUNT, desc);
+    }
+  }
+  return ESP_ERR_NOT_FOUND;
+}
+
+const ota_flash_t file_flash = {
+    .update_partition = flash_update_partition,
+    .begin = flash_begin,
+    .write = flash_write,
+    .abort = flash_abort,
+    .finish = flash_finish,
+    .read_running = flash_read_running,
+    .read_update = flash_read_update,
+    .running_desc = flash_running_desc,
+    .invalid_desc = flash_invalid_desc,
+};
+
+static int open_partition(const char *dir, const char *name, off_t size) {
+  char path[PATH_MAX_LEN];
+  struct stat st;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    ESP_LOGE(FLASH_TAG, "Failed to open %s", path);
+    return -1;
+  }
+  if (fstat(fd, &st) == 0 && st.st_size < size && ftruncate(fd, size) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void *file_flash_create(const file_flash_config_t *config) {
+  file_flash_t *flash = calloc(1, sizeof(*flash));
+  if (flash == NULL) {
+    return NULL;
+  }
+  flash->config = *config;
+  mkdir(config->dir, 0755);
+
+  char name[16];
+  for (int i = 0; i < SLOT_COUNT; ++i) {
+    snprintf(name, sizeof(name), "ota_%d.bin", i);
+    flash->slots[i] = open_partition(config->dir, name,
+                                     config->partition_size);
+  }
+  flash->otadata = open_partition(config->dir, "otadata.bin", 2 * SECTOR_SIZE);
+  if (flash->slots[0] < 0 || flash->slots[1] < 0 || flash->otadata < 0) {
+    file_flash_destroy(flash);
+    return NULL;
+  }
+
+  flash->running = file_flash_boot_slot(flash);
+  flash->update = flash->running >= 0 ? (flash->running + 1) % SLOT_COUNT : 0;
+  return flash;
+}
+
+void file_flash_destroy(void *ctx) {
+  file_flash_t *flash = ctx;
+  for (int i = 0; i < SLOT_COUNT; ++i) {
+    if (flash->slots[i] >= 0) {
+      close(flash->slots[i]);
+    }
+  }
+  if (flash->otadata >= 0) {
+    close(flash->otadata);
+  }
+  free(flash);
+}
+
+esp_err_t file_flash_install(void *ctx, const char *image_path) {
+  file_flash_t *flash = ctx;
+  static uint8_t buffer[64 * 1024];
+
+  FILE *image = fopen(image_path, "rb");
+  if (image == NULL) {
+    ESP_LOGE(FLASH_TAG, "Failed to open %s", image_path);
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  uint32_t written = 0;
+  size_t len;
+  while ((len = fread(buffer, 1, sizeof(buffer), image)) > 0) {
+    if (written + len > flash->config.partition_size ||
+        pwrite(flash->slots[0], buffer, len, written) != (ssize_t)len) {
+      fclose(image);
+      return ESP_ERR_INVALID_SIZE;
+    }
+    written += len;
+  }
+  fclose(image);
+
+  // Erase the OTA data, the bootloader then boots the first slot
+  uint8_t erased[2 * SECTOR_SIZE];
+  memset(erased, 0xFF, sizeof(erased));
+  if (pwrite(flash->otadata, erased, sizeof(erased), 0) != sizeof(erased)) {
+    return ESP_FAIL;
+  }
+  flash->running = 0;
+  ESP_LOGI(FLASH_TAG, "Installed %s (%" PRIu32 " bytes) in slot 0",
+           image_path, written);
+  return ESP_OK;
+}
+
+esp_err_t file_flash_rollback(void *ctx) {
+  file_flash_t *flash = ctx;
+  otadata_entry_t entries[2];
+
+  read_otadata(flash, entries);
+  int current = current_entry(entries);
+  if (current < 0) {
+    ESP_LOGE(FLASH_TAG, "No OTA update to roll back");
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  entries[current].ota_state = OTA_IMG_INVALID;
+  if (pwrite(flash->otadata, &entries[current], sizeof(entries[current]),
+             current * SECTOR_SIZE) != sizeof(entries[current])) {
+    return ESP_FAIL;
+  }
+  flash->running = file_flash_boot_slot(flash);
+  ESP_LOGW(FLASH_TAG, "Rolled back to slot %d", flash->running);
+  return ESP_OK;
+}
@@ -0,0 +1,86 @@
+#include "esp_log.h"
+#include "host.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define PATH_MAX_LEN 512
+
+static const char *STORE_TAG = "STORE";
+
+typedef struct {
+  char dir[PATH_MAX_LEN / 2];
+} file_store_t;
+
+static void value_path(const file_store_t *store, const char *key, char *path,
+                       size_t len) {
+  snprintf(path, len, "%s/%s", store->dir, key);
+}
+
+static esp_err_t store_load(void *ctx, const char *key, void *data,
+                            size_t *len) {
+  char path[PATH_MAX_LEN];
+  value_path(ctx, key, path, sizeof(path));
+
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  // Like NVS, a value larger than the buffer is not read
+  size_t read = fread(data, 1, *len, file);
+  bool larger = fgetc(file) != EOF;
+  fclose(file);
+  if (larger) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  *len = read;
+  return ESP_OK;
+}
+
+// Values are replaced atomically, like NVS entries
+static esp_err_t store_save(void *ctx, const char *key, const void *data,
+                            size_t len) {
+  char path[PATH_MAX_LEN];
+  char tmp_path[PATH_MAX_LEN + 4];
+  value_path(ctx, key, path, sizeof(path));
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *file = fopen(tmp_path, "wb");
+  if (file == NULL) {
+    ESP_LOGE(STORE_TAG, "Failed to write %s (%s)", tmp_path, strerror(errno));
+    return ESP_FAIL;
+  }
+  bool written = fwrite(data, 1, len, file) == len;
+  if (fclose(file) != 0 || !written || rename(tmp_path, path) != 0) {
+    remove(tmp_path);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+static void store_erase(void *ctx, const char *key) {
+  char path[PATH_MAX_LEN];
+  value_path(ctx, key, path, sizeof(path));
+  remove(path);
+}
+
+const ota_store_t file_store = {
+    .load = store_load,
+    .save = store_save,
+    .erase = store_erase,
+};
+
+void *file_store_create(const char *dir) {
+  file_store_t *store = calloc(1, sizeof(*store));
+  if (store == NULL) {
+    return NULL;
+  }
+  snprintf(store->dir, sizeof(store->dir), "%s/nvs", dir);
+  mkdir(dir, 0755);
+  mkdir(store->dir, 0755);
+  return store;
+}
+
+void file_store_destroy(void *store) { free(store); }
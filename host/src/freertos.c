@@ -0,0 +1,154 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Ring of fixed size items, senders and receivers block on the condition
+struct host_queue {
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+  size_t length;
+  size_t item_size;
+  size_t head;
+  size_t count;
+  uint8_t items[];
+};
+
+// Entry point and argument of a task
+typedef struct {
+  TaskFunction_t function;
+  void *parameters;
+} task_start_t;
+
+// Absolute deadline of a wait of `ticks` milliseconds
+static struct timespec deadline(TickType_t ticks) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ticks / 1000;
+  ts.tv_nsec += (long)(ticks % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec += 1;
+    ts.tv_nsec -= 1000000000;
+  }
+  return ts;
+}
+
+// Wait for the queue to change, returns false on timeout
+static bool wait_changed(QueueHandle_t queue, TickType_t ticks,
+                         const struct timespec *until) {
+  if (ticks == portMAX_DELAY) {
+    pthread_cond_wait(&queue->changed, &queue->mutex);
+    return true;
+  }
+  return ticks > 0 &&
+         pthread_cond_timedwait(&queue->changed, &queue->mutex, until) == 0;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  QueueHandle_t queue = calloc(1, sizeof(*queue) + length * item_size);
+  if (queue == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->changed, NULL);
+  queue->length = length;
+  queue->item_size = item_size;
+  return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item,
+                      TickType_t ticks_to_wait) {
+  struct timespec until = deadline(ticks_to_wait);
+
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->count == queue->length) {
+    if (!wait_changed(queue, ticks_to_wait, &until)) {
+      pthread_mutex_unlock(&queue->mutex);
+      return pdFAIL;
+    }
+  }
+  size_t tail = (queue->head + queue->count) % queue->length;
+  if (queue->item_size > 0) {
+    memcpy(&queue->items[tail * queue->item_size], item, queue->item_size);
+  }
+  queue->count++;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->mutex);
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item,
+                         TickType_t ticks_to_wait) {
+  struct timespec until = deadline(ticks_to_wait);
+
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->count == 0) {
+    if (!wait_changed(queue, ticks_to_wait, &until)) {
+      pthread_mutex_unlock(&queue->mutex);
+      return pdFAIL;
+    }
+  }
+  if (queue->item_size > 0) {
+    memcpy(item, &queue->items[queue->head * queue->item_size],
+           queue->item_size);
+  }
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->mutex);
+  return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) { return xQueueCreate(1, 0); }
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  return xQueueSend(semaphore, NULL, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore,
+                          TickType_t ticks_to_wait) {
+  return xQueueReceive(semaphore, NULL, ticks_to_wait);
+}
+
+static void *task_main(void *arg) {
+  task_start_t start = *(task_start_t *)arg;
+  free(arg);
+  start.function(start.parameters);
+  return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name,
+                       uint32_t stack_depth, void *parameters,
+                       UBaseType_t priority, TaskHandle_t *created_task) {
+  pthread_t thread;
+  task_start_t *start = malloc(sizeof(*start));
+  if (start == NULL) {
+    return pdFAIL;
+  }
+  start->function = function;
+  start->parameters = parameters;
+  if (pthread_create(&thread, NULL, task_main, start) != 0) {
+    free(start);
+    return pdFAIL;
+  }
+  pthread_detach(thread);
+  if (created_task != NULL) {
+    *created_task = NULL;
+  }
+  return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  struct timespec ts = {
+      .tv_sec = ticks / 1000,
+      .tv_nsec = (long)(ticks % 1000) * 1000000,
+  };
+  nanosleep(&ts, NULL);
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) { return 0; }
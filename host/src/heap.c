@@ -0,0 +1,80 @@
+#include "host.h"
+#include <malloc.h>
+#include <openssl/crypto.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// The program is linked with --wrap for the allocation functions, every
+// allocation made by the engine, cJSON and this program goes through these
+// wrappers. OpenSSL allocates through CRYPTO_set_mem_functions().
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static atomic_size_t current;
+static atomic_size_t peak;
+
+static void *count_alloc(void *ptr) {
+  if (ptr != NULL) {
+    size_t used = atomic_fetch_add(&current, malloc_usable_size(ptr)) +
+                  malloc_usable_size(ptr);
+    size_t old_peak = atomic_load(&peak);
+    while (used > old_peak &&
+           !atomic_compare_exchange_weak(&peak, &old_peak, used)) {
+    }
+  }
+  return ptr;
+}
+
+static void count_free(void *ptr) {
+  if (ptr != NULL) {
+    atomic_fetch_sub(&current, malloc_usable_size(ptr));
+  }
+}
+
+void *__wrap_malloc(size_t size) { return count_alloc(__real_malloc(size)); }
+
+void *__wrap_calloc(size_t count, size_t size) {
+  return count_alloc(__real_calloc(count, size));
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  count_free(ptr);
+  void *new_ptr = __real_realloc(ptr, size);
+  if (new_ptr == NULL && size > 0) {
+    // The old block is still allocated
+    count_alloc(ptr);
+    return NULL;
+  }
+  return count_alloc(new_ptr);
+}
+
+void __wrap_free(void *ptr) {
+  count_free(ptr);
+  __real_free(ptr);
+}
+
+static void *crypto_malloc(size_t size, const char *file, int line) {
+  return __wrap_malloc(size);
+}
+
+static void *crypto_realloc(void *ptr, size_t size, const char *file,
+                            int line) {
+  return __wrap_realloc(ptr, size);
+}
+
+static void crypto_free(void *ptr, const char *file, int line) {
+  __wrap_free(ptr);
+}
+
+void heap_init(void) {
+  CRYPTO_set_mem_functions(crypto_malloc, crypto_realloc, crypto_free);
+}
+
+size_t heap_current(void) { return atomic_load(&current); }
+
+size_t heap_peak(void) { return atomic_load(&peak); }
+
+void heap_reset_peak(void) { atomic_store(&peak, atomic_load(&current)); }
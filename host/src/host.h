@@ -0,0 +1,84 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include "ota_engine.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// ---- HTTP transport ---------------------------------------------------------
+
+// HTTP/1.1 client over a socket, with TLS for https URLs
+typedef struct {
+  const char *ca_cert; // PEM file of the CA verifying the server
+  int timeout_ms;      // Receive timeout
+  bool keep_alive;     // Reuse the connection for the next request
+  bool tls_resume;     // Resume the last TLS session on new connections
+  // Fault injection: fail a read once this many response body bytes were
+  // received, 0 to never fail. Only the first failure is injected.
+  uint64_t fail_at;
+  // Fault injection: flip a bit of the response body byte at this offset
+  // (counted over all the responses), 0 to never corrupt. Only once.
+  uint64_t corrupt_at;
+} http_transport_config_t;
+
+extern const ota_transport_t http_transport;
+
+// Create a transport, NULL if the TLS context cannot be set up
+void *http_transport_create(const http_transport_config_t *config);
+void http_transport_destroy(void *transport);
+// Drop the connection but keep the TLS session, as turning the radio off does
+void http_transport_disconnect(void *transport);
+// Drop the connection and the TLS session, as restarting the device does. The
+// faults already injected are not injected again: they belong to the link.
+void http_transport_restart(void *transport);
+
+// ---- Simulated flash --------------------------------------------------------
+
+// Two OTA partitions and the OTA data partition, each backed by a file of
+// the state directory (ota_0.bin, ota_1.bin, otadata.bin)
+typedef struct {
+  const char *dir;
+  uint32_t partition_size;
+  uint32_t write_kbps; // Throttle writes to this speed (KB/s), 0 for no limit
+  // Fault injection, 0 to disable: fail the write reaching this offset of the
+  // update partition, or exit the process as if power was cut
+  uint32_t fail_at;
+  uint32_t power_cut_at;
+} file_flash_config_t;
+
+extern const ota_flash_t file_flash;
+
+void *file_flash_create(const file_flash_config_t *config);
+void file_flash_destroy(void *flash);
+// Write an image to the first partition and boot it, as a serial flasher does
+esp_err_t file_flash_install(void *flash, const char *image_path);
+// Mark the running firmware invalid and boot the previous one, as a failed
+// diagnostic does
+esp_err_t file_flash_rollback(void *flash);
+// Slot the next boot runs, -1 if nothing was installed
+int file_flash_boot_slot(void *flash);
+
+// ---- Simulated NVS ----------------------------------------------------------
+
+// Values are files of the `nvs` subdirectory of the state directory
+extern const ota_store_t file_store;
+
+void *file_store_create(const char *dir);
+void file_store_destroy(void *store);
+
+// ---- Simulated clock --------------------------------------------------------
+
+// Move esp_timer_get_time() forward, to simulate hours of sleep at once
+void host_clock_advance(int64_t us);
+
+// ---- Heap usage -------------------------------------------------------------
+
+// Start counting OpenSSL allocations, before any other OpenSSL call
+void heap_init(void);
+size_t heap_current(void);
+size_t heap_peak(void);
+// Restart peak tracking from the current usage
+void heap_reset_peak(void);
+
+#endif
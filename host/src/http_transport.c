@@ -0,0 +1,667 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "host.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define HOST_MAX_LEN 128
+#define PORT_MAX_LEN 8
+#define REQUEST_MAX_LEN 1024
+#define HEADERS_MAX_LEN 4096
+#define RECV_BUFFSIZE 4096
+
+static const char *HTTP_TAG = "HTTP";
+
+typedef struct {
+  http_transport_config_t config;
+  SSL_CTX *tls;
+  SSL_SESSION *session; // Last TLS session the server sent, to resume
+  ota_transport_stats_t stats;
+  uint64_t body_total; // Body bytes received, for fault injection
+  bool failed;         // The fault was injected
+  bool corrupted;      // The corruption was injected
+  int timeout_ms;      // Receive timeout, config.timeout_ms if 0
+
+  // ---- Connection -------------------------------------------------------
+  int fd;
+  SSL *ssl;
+  bool https;
+  char host[HOST_MAX_LEN];
+  char port[PORT_MAX_LEN];
+  uint8_t recv[RECV_BUFFSIZE]; // Received but not yet consumed
+  size_t recv_pos;
+  size_t recv_len;
+
+  // ---- Response ---------------------------------------------------------
+  char headers[HEADERS_MAX_LEN]; // Header lines, NUL terminated
+  int64_t content_length;        // -1 if the body ends with the connection
+  int64_t received;              // Body bytes received
+  bool chunked;
+  int64_t chunk_left; // Bytes left in the current chunk, -1 before a chunk
+  bool complete;      // The whole body was received
+  bool reusable;      // The connection can carry the next request
+} http_transport_t;
+
+// Split an http(s)://host[:port]/path URL
+static esp_err_t parse_url(const char *url, bool *https, char *host,
+                           char *port, const char **path) {
+  const char *rest;
+  if (strncmp(url, "https://", 8) == 0) {
+    *https = true;
+    rest = url + 8;
+  } else if (strncmp(url, "http://", 7) == 0) {
+    *https = false;
+    rest = url + 7;
+  } else {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  size_t authority_len = strcspn(rest, "/");
+  const char *colon = memchr(rest, ':', authority_len);
+  size_t host_len = colon != NULL ? (size_t)(colon - rest) : authority_len;
+  if (host_len == 0 || host_len >= HOST_MAX_LEN) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  memcpy(host, rest, host_len);
+  host[host_len] = '\0';
+
+  if (colon != NULL) {
+    size_t port_len = authority_len - host_len - 1;
+    if (port_len == 0 || port_len >= PORT_MAX_LEN) {
+      return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(port, colon + 1, port_len);
+    port[port_len] = '\0';
+  } else {
+    strcpy(port, *https ? "443" : "80");
+  }
+
+  *path = rest[authority_len] != '\0' ? &rest[authority_len] : "/";
+  return ESP_OK;
+}
+
+// Keep the last session (or TLS 1.3 ticket) the server sent
+static int new_session(SSL *ssl, SSL_SESSION *session) {
+  http_transport_t *transport = SSL_get_app_data(ssl);
+  SSL_SESSION_free(transport->session);
+  transport->session = session;
+  return 1; // The session reference is kept
+}
+
+static void forget_session(http_transport_t *transport) {
+  SSL_SESSION_free(transport->session);
+  transport->session = NULL;
+}
+
+static void disconnect(http_transport_t *transport) {
+  if (transport->ssl != NULL) {
+    SSL_shutdown(transport->ssl);
+    SSL_free(transport->ssl);
+    transport->ssl = NULL;
+  }
+  if (transport->fd >= 0) {
+    close(transport->fd);
+    transport->fd = -1;
+  }
+  transport->recv_pos = 0;
+  transport->recv_len = 0;
+  transport->reusable = false;
+}
+
+// Set the receive and send timeouts of the connection
+static void apply_timeout(http_transport_t *transport) {
+  int timeout_ms = transport->timeout_ms > 0 ? transport->timeout_ms
+                                             : transport->config.timeout_ms;
+  struct timeval timeout = {
+      .tv_sec = timeout_ms / 1000,
+      .tv_usec = (timeout_ms % 1000) * 1000,
+  };
+  setsockopt(transport->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+             sizeof(timeout));
+  setsockopt(transport->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+             sizeof(timeout));
+}
+
+static esp_err_t connect_to(http_transport_t *transport) {
+  struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo *addresses;
+  int64_t start = esp_timer_get_time();
+
+  if (getaddrinfo(transport->host, transport->port, &hints, &addresses) != 0) {
+    ESP_LOGE(HTTP_TAG, "Failed to resolve %s", transport->host);
+    return ESP_FAIL;
+  }
+  for (struct addrinfo *a = addresses; a != NULL; a = a->ai_next) {
+    transport->fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (transport->fd < 0) {
+      continue;
+    }
+    if (connect(transport->fd, a->ai_addr, a->ai_addrlen) == 0) {
+      break;
+    }
+    close(transport->fd);
+    transport->fd = -1;
+  }
+  freeaddrinfo(addresses);
+  if (transport->fd < 0) {
+    ESP_LOGE(HTTP_TAG, "Failed to connect to %s:%s (%s)", transport->host,
+             transport->port, strerror(errno));
+    return ESP_FAIL;
+  }
+
+  int nodelay = 1;
+  apply_timeout(transport);
+  setsockopt(transport->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+             sizeof(nodelay));
+
+  if (transport->https) {
+    int64_t handshake_start = esp_timer_get_time();
+    transport->ssl = SSL_new(transport->tls);
+    if (transport->ssl == NULL) {
+      disconnect(transport);
+      return ESP_ERR_NO_MEM;
+    }
+    SSL_set_app_data(transport->ssl, transport);
+    SSL_set_fd(transport->ssl, transport->fd);
+    SSL_set_tlsext_host_name(transport->ssl, transport->host);
+    if (transport->config.tls_resume && transport->session != NULL) {
+      SSL_set_session(transport->ssl, transport->session);
+    }
+    if (SSL_connect(transport->ssl) != 1) {
+      ESP_LOGE(HTTP_TAG, "TLS handshake with %s failed: %s", transport->host,
+               ERR_reason_error_string(ERR_get_error()));
+      forget_session(transport);
+      disconnect(transport);
+      return ESP_FAIL;
+    }
+    transport->stats.handshake_us += esp_timer_get_time() - handshake_start;
+    if (SSL_session_reused(transport->ssl)) {
+      transport->stats.resumed++;
+    }
+    ESP_LOGD(HTTP_TAG, "TLS %s with %s",
+             SSL_session_reused(transport->ssl) ? "session resumed"
+                                                : "full handshake",
+             transport->host);
+  }
+
+  transport->stats.connections++;
+  transport->stats.connect_us += esp_timer_get_time() - start;
+  ESP_LOGD(HTTP_TAG, "Connected to %s:%s", transport->host, transport->port);
+  return ESP_OK;
+}
+
+static int raw_send(http_transport_t *transport, const char *data,
+                    size_t len) {
+  if (transport->ssl != NULL) {
+    return SSL_write(transport->ssl, data, len);
+  }
+  return send(transport->fd, data, len, MSG_NOSIGNAL);
+}
+
+// Receive from the connection, 0 once it is closed and -1 on error
+static int raw_recv(http_transport_t *transport, void *data, size_t len) {
+  if (transport->ssl != NULL) {
+    int n = SSL_read(transport->ssl, data, len);
+    if (n > 0) {
+      return n;
+    }
+    return SSL_get_error(transport->ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+  }
+  ssize_t n = recv(transport->fd, data, len, 0);
+  return n < 0 ? -1 : (int)n;
+}
+
+// Receive into the buffer if it is empty
+static int fill(http_transport_t *transport) {
+  if (transport->recv_pos < transport->recv_len) {
+    return transport->recv_len - transport->recv_pos;
+  }
+  int n = raw_recv(transport, transport->recv, sizeof(transport->recv));
+  transport->recv_pos = 0;
+  transport->recv_len = n > 0 ? n : 0;
+  return n;
+}
+
+// Read the body or the headers, from the buffer first
+static int buffered_recv(http_transport_t *transport, void *data,
+                         size_t len) {
+  if (transport->recv_pos == transport->recv_len && len >= RECV_BUFFSIZE) {
+    return raw_recv(transport, data, len);
+  }
+  int n = fill(transport);
+  if (n <= 0) {
+    return n;
+  }
+  if ((size_t)n > len) {
+    n = len;
+  }
+  memcpy(data, &transport->recv[transport->recv_pos], n);
+  transport->recv_pos += n;
+  return n;
+}
+
+// Read a CRLF terminated line, without the CRLF
+static esp_err_t read_line(http_transport_t *transport, char *line,
+                           size_t size) {
+  size_t len = 0;
+  while (1) {
+    if (fill(transport) <= 0) {
+      return ESP_FAIL;
+    }
+    char c = transport->recv[transport->recv_pos++];
+    if (c == '\n') {
+      if (len > 0 && line[len - 1] == '\r') {
+        len--;
+      }
+      line[len] = '\0';
+      return ESP_OK;
+    }
+    if (len + 1 >= size) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    line[len++] = c;
+  }
+}
+
+// Find a header of the response, returns its value or NULL
+static const char *find_header(const http_transport_t *transport,
+                               const char *name, size_t *value_len) {
+  size_t name_len = strlen(name);
+  const char *line = transport->headers;
+
+  while (*line != '\0') {
+    size_t line_len = strcspn(line, "\n");
+    if (line_len > name_len && line[name_len] == ':' &&
+        strncasecmp(line, name, name_len) == 0) {
+      const char *value = &line[name_len + 1];
+      while (*value == ' ' || *value == '\t') {
+        value++;
+      }
+      *value_len = &line[line_len] - value;
+      return value;
+    }
+    line += line_len + (line[line_len] == '\n');
+  }
+  return NULL;
+}
+
+static bool header_contains(const http_transport_t *transport,
+                            const char *name, const char *token) {
+  size_t len;
+  const char *value = find_header(transport, name, &len);
+  if (value == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i + strlen(token) <= len; ++i) {
+    if (strncasecmp(&value[i], token, strlen(token)) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Read the status line and the headers of the response
+static esp_err_t read_response_head(http_transport_t *transport,
+                                    int *status) {
+  char line[512];
+  esp_err_t err = read_line(transport, line, sizeof(line));
+  if (err != ESP_OK) {
+    return err;
+  }
+  if (sscanf(line, "HTTP/1.%*d %d", status) != 1) {
+    ESP_LOGE(HTTP_TAG, "Invalid status line: %s", line);
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+
+  size_t len = 0;
+  transport->headers[0] = '\0';
+  while ((err = read_line(transport, line, sizeof(line))) == ESP_OK &&
+         line[0] != '\0') {
+    size_t line_len = strlen(line);
+    if (len + line_len + 2 > sizeof(transport->headers)) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(&transport->headers[len], line, line_len);
+    len += line_len;
+    transport->headers[len++] = '\n';
+    transport->headers[len] = '\0';
+  }
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  size_t value_len;
+  const char *content_length =
+      find_header(transport, "Content-Length", &value_len);
+  transport->chunked =
+      header_contains(transport, "Transfer-Encoding", "chunked");
+  transport->chunk_left = -1;
+  transport->content_length =
+      content_length != NULL ? strtoll(content_length, NULL, 10) : -1;
+  if (*status == 204 || *status == 304 || (*status >= 100 && *status < 200)) {
+    transport->content_length = 0;
+    transport->chunked = false;
+  }
+  transport->received = 0;
+  transport->complete = transport->content_length == 0;
+  transport->reusable = transport->config.keep_alive &&
+                        !header_contains(transport, "Connection", "close") &&
+                        (transport->content_length >= 0 || transport->chunked);
+  return ESP_OK;
+}
+
+// Send a request, with a body if `body` is not NULL
+static esp_err_t send_request(http_transport_t *transport, const char *method,
+                              const char *path, const char *const *headers,
+                              size_t header_count, const char *body,
+                              size_t body_len) {
+  char request[REQUEST_MAX_LEN];
+  int len = snprintf(request, sizeof(request),
+                     "%s %s HTTP/1.1\r\nHost: %s:%s\r\n"
+                     "User-Agent: esp32-ota-host\r\nConnection: %s\r\n",
+                     method, path, transport->host, transport->port,
+                     transport->config.keep_alive ? "keep-alive" : "close");
+  for (size_t i = 0; i < header_count && len < (int)sizeof(request); ++i) {
+    len += snprintf(&request[len], sizeof(request) - len, "%s: %s\r\n",
+                    headers[i * 2], headers[i * 2 + 1]);
+  }
+  if (body != NULL && len < (int)sizeof(request)) {
+    len += snprintf(&request[len], sizeof(request) - len,
+                    "Content-Length: %zu\r\n", body_len);
+  }
+  if (len < (int)sizeof(request)) {
+    len += snprintf(&request[len], sizeof(request) - len, "\r\n");
+  }
+  if (len >= (int)sizeof(request)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (raw_send(transport, request, len) != len) {
+    return ESP_FAIL;
+  }
+  if (body != NULL && raw_send(transport, body, body_len) != (int)body_len) {
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t http_request(http_transport_t *transport, const char *method,
+                              const char *url, const char *const *headers,
+                              size_t header_count, const char *body,
+                              size_t body_len, int *status) {
+  char host[HOST_MAX_LEN];
+  char port[PORT_MAX_LEN];
+  const char *path;
+  bool https;
+
+  if (parse_url(url, &https, host, port, &path) != ESP_OK) {
+    ESP_LOGE(HTTP_TAG, "Invalid URL: %s", url);
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (https && transport->tls == NULL) {
+    ESP_LOGE(HTTP_TAG, "No CA certificate to connect to %s", url);
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  // Keep the connection and the TLS session only for the same server
+  bool same_server = https == transport->https &&
+                     strcmp(host, transport->host) == 0 &&
+                     strcmp(port, transport->port) == 0;
+  if (!same_server) {
+    forget_session(transport);
+  }
+  if (transport->fd >= 0 && (!transport->reusable || !same_server)) {
+    disconnect(transport);
+  }
+  transport->https = https;
+  strcpy(transport->host, host);
+  strcpy(transport->port, port);
+
+  // A kept connection may have been closed by the server in the meantime,
+  // the request is then sent again on a new one
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    bool reused = transport->fd >= 0;
+    esp_err_t err = reused ? ESP_OK : connect_to(transport);
+    if (err != ESP_OK) {
+      return err;
+    }
+
+    transport->stats.requests++;
+    err = send_request(transport, method, path, headers, header_count, body,
+                       body_len);
+    if (err == ESP_OK) {
+      err = read_response_head(transport, status);
+    }
+    if (err == ESP_OK) {
+      return ESP_OK;
+    }
+    disconnect(transport);
+    if (!reused) {
+      return err;
+    }
+  }
+  return ESP_FAIL;
+}
+
+static esp_err_t http_open(void *ctx, const char *url,
+                           const char *const *headers, size_t header_count,
+                           int *status) {
+  return http_request(ctx, "GET", url, headers, header_count, NULL, 0, status);
+}
+
+static esp_err_t http_post(void *ctx, const char *url,
+                           const char *content_type, const char *body,
+                           size_t len, int *status) {
+  const char *headers[] = {"Content-Type", content_type};
+  return http_request(ctx, "POST", url, headers, 1, body, len, status);
+}
+
+static esp_err_t http_get_header(void *ctx, const char *name, char *value,
+                                 size_t len) {
+  http_transport_t *transport = ctx;
+  size_t value_len;
+  const char *found = find_header(transport, name, &value_len);
+
+  if (found == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (value_len >= len) {
+    value_len = len - 1;
+  }
+  memcpy(value, found, value_len);
+  value[value_len] = '\0';
+  return ESP_OK;
+}
+
+// Read the size line of the next chunk, 0 for the last chunk
+static esp_err_t next_chunk(http_transport_t *transport) {
+  char line[64];
+
+  // The data of the previous chunk ends with CRLF
+  if (transport->chunk_left == 0 &&
+      read_line(transport, line, sizeof(line)) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  if (read_line(transport, line, sizeof(line)) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  transport->chunk_left = strtoll(line, NULL, 16);
+  if (transport->chunk_left == 0) {
+    // Skip the trailers
+    do {
+      if (read_line(transport, line, sizeof(line)) != ESP_OK) {
+        return ESP_FAIL;
+      }
+    } while (line[0] != '\0');
+    transport->complete = true;
+  }
+  return ESP_OK;
+}
+
+static int http_read(void *ctx, char *data, size_t len) {
+  http_transport_t *transport = ctx;
+
+  if (transport->complete || transport->fd < 0) {
+    return 0;
+  }
+
+  if (transport->config.fail_at > 0 && !transport->failed) {
+    if (transport->body_total >= transport->config.fail_at) {
+      ESP_LOGW(HTTP_TAG, "Injected network failure after %" PRIu64 " bytes",
+               transport->body_total);
+      transport->failed = true;
+      disconnect(transport);
+      return -1;
+    }
+    if (len > transport->config.fail_at - transport->body_total) {
+      len = transport->config.fail_at - transport->body_total;
+    }
+  }
+
+  if (transport->chunked) {
+    if (transport->chunk_left <= 0) {
+      if (next_chunk(transport) != ESP_OK) {
+        disconnect(transport);
+        return -1;
+      }
+      if (transport->complete) {
+        return 0;
+      }
+    }
+    if ((int64_t)len > transport->chunk_left) {
+      len = transport->chunk_left;
+    }
+  } else if (transport->content_length >= 0 &&
+             (int64_t)len > transport->content_length - transport->received) {
+    len = transport->content_length - transport->received;
+  }
+
+  int n = buffered_recv(transport, data, len);
+  if (n < 0) {
+    ESP_LOGE(HTTP_TAG, "Receive failed (%s)", strerror(errno));
+    disconnect(transport);
+    return -1;
+  } else if (n == 0) {
+    // The body of a response without length ends with the connection
+    transport->complete =
+        transport->content_length < 0 && !transport->chunked;
+    ESP_LOGI(HTTP_TAG, "Connection closed");
+    disconnect(transport);
+    return 0;
+  }
+
+  if (transport->config.corrupt_at > 0 && !transport->corrupted &&
+      transport->body_total + n > transport->config.corrupt_at) {
+    data[transport->config.corrupt_at - transport->body_total] ^= 0x10;
+    transport->corrupted = true;
+    ESP_LOGW(HTTP_TAG, "Injected corruption of body byte %" PRIu64,
+             transport->config.corrupt_at);
+  }
+  transport->received += n;
+  transport->body_total += n;
+  if (transport->chunked) {
+    transport->chunk_left -= n;
+  } else if (transport->received == transport->content_length) {
+    transport->complete = true;
+  }
+  return n;
+}
+
+static bool http_is_complete(void *ctx) {
+  http_transport_t *transport = ctx;
+  return transport->complete;
+}
+
+static void http_close(void *ctx) {
+  http_transport_t *transport = ctx;
+
+  // Only a connection at the end of a response can carry the next one
+  if (!transport->complete || !transport->reusable) {
+    disconnect(transport);
+  }
+}
+
+static void http_get_stats(void *ctx, ota_transport_stats_t *stats) {
+  http_transport_t *transport = ctx;
+  *stats = transport->stats;
+}
+
+static void http_set_timeout(void *ctx, uint32_t timeout_ms) {
+  http_transport_t *transport = ctx;
+
+  transport->timeout_ms = timeout_ms;
+  if (transport->fd >= 0) {
+    apply_timeout(transport);
+  }
+}
+
+const ota_transport_t http_transport = {
+    .open = http_open,
+    .get_header = http_get_header,
+    .read = http_read,
+    .is_complete = http_is_complete,
+    .close = http_close,
+    .get_stats = http_get_stats,
+    .set_timeout = http_set_timeout,
+    .post = http_post,
+};
+
+void *http_transport_create(const http_transport_config_t *config) {
+  http_transport_t *transport = calloc(1, sizeof(*transport));
+  if (transport == NULL) {
+    return NULL;
+  }
+  transport->config = *config;
+  transport->fd = -1;
+
+  if (config->ca_cert != NULL) {
+    transport->tls = SSL_CTX_new(TLS_client_method());
+    if (transport->tls == NULL ||
+        SSL_CTX_load_verify_locations(transport->tls, config->ca_cert, NULL) !=
+            1) {
+      ESP_LOGE(HTTP_TAG, "Failed to load the CA certificate %s",
+               config->ca_cert);
+      http_transport_destroy(transport);
+      return NULL;
+    }
+    // Like skip_cert_common_name_check on the device, the certificate is
+    // verified but not the host name
+    SSL_CTX_set_verify(transport->tls, SSL_VERIFY_PEER, NULL);
+    // Sessions are kept by the transport (see new_session()), as the device
+    // keeps them in its long-lived HTTP client
+    SSL_CTX_set_session_cache_mode(transport->tls,
+                                   SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(transport->tls, new_session);
+  }
+  return transport;
+}
+
+void http_transport_destroy(void *ctx) {
+  http_transport_t *transport = ctx;
+  disconnect(transport);
+  forget_session(transport);
+  SSL_CTX_free(transport->tls);
+  free(transport);
+}
+
+void http_transport_disconnect(void *ctx) { disconnect(ctx); }
+
+void http_transport_restart(void *ctx) {
+  disconnect(ctx);
+  forget_session(ctx);
+}
@@ -0,0 +1,689 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host.h"
+#include "ota_engine.h"
+#include "sdkconfig.h"
+#include "window.h"
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_MANIFEST_URL                                                   \
+  "http://127.0.0.1:8070/manifest/esp32_secure_ota.bin"
+#define DEFAULT_IMAGE_URL "http://127.0.0.1:8070/esp32_secure_ota.bin"
+#define DEFAULT_PARTITION_SIZE (4 * 1024 * 1024)
+
+static const char *HOST_TAG = "HOST";
+
+static const char *const MODE_NAMES[] = {
+    [DOWNLOAD_IMAGE] = "image",
+    [DOWNLOAD_COMPRESSED] = "compressed",
+    [DOWNLOAD_DELTA] = "delta",
+};
+
+static const char *const RESULT_NAMES[] = {
+    [OTA_UPDATED] = "updated",
+    [OTA_UP_TO_DATE] = "up-to-date",
+    [OTA_FAILED] = "failed",
+};
+
+static const char *const SLEEP_NAMES[] = {
+    [WINDOW_STAY_AWAKE] = "awake",
+    [WINDOW_LIGHT_SLEEP] = "light",
+    [WINDOW_DEEP_SLEEP] = "deep",
+};
+
+static const char *const FAILURE_NAMES[] = {
+    [OTA_FAILURE_NONE] = "none",
+    [OTA_FAILURE_NETWORK] = "network",
+    [OTA_FAILURE_SERVER] = "server",
+    [OTA_FAILURE_REJECTED] = "rejected",
+    [OTA_FAILURE_DEVICE] = "device",
+};
+
+// Download throughput in bytes/s
+static int64_t throughput(const pipeline_result_t *pipeline) {
+  return pipeline->total_us > 0
+             ? (int64_t)pipeline->bytes * 1000000 / pipeline->total_us
+             : 0;
+}
+
+typedef struct {
+  const char *state_dir;
+  const char *manifest_url;
+  const char *image_url;
+  const char *install;
+  const char *signing_key; // PEM file of the manifest signing key
+  const char *device_id;
+  const char *channel;
+  const char *report_url;
+  bool rollback;
+  bool json;
+  bool poll;
+  int attempts;
+  int retry_delay_ms;
+  int retry_max_ms;
+  int poll_interval_ms;
+  int long_poll_s;
+  bool windows; // Sleep between update windows, on the simulated clock
+  window_config_t window;
+  uint64_t missed_windows; // Bit N - 1 set: window N does not reach the AP
+  http_transport_config_t http;
+  file_flash_config_t flash;
+} options_t;
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options] STATE_DIR\n"
+          "\n"
+          "Run the OTA engine against simulated flash partitions stored in\n"
+          "STATE_DIR (ota_0.bin, ota_1.bin, otadata.bin and nvs/).\n"
+          "\n"
+          "  --manifest-url URL     firmware manifest (default " DEFAULT_MANIFEST_URL
+          ")\n"
+          "  --image-url URL        firmware image (default " DEFAULT_IMAGE_URL
+          ")\n"
+          "  --ca-cert FILE         CA certificate of the server, for https\n"
+          "  --signing-key FILE     public key the manifests are signed with,\n"
+          "                         with OTA_VERIFY_SIGNATURE\n"
+          "  --device-id ID         ID sent for staged rollouts\n"
+          "  --channel NAME         get images of the release channel NAME\n"
+          "                         from the catalog at --manifest-url\n"
+          "  --report-url URL       POST a summary of every check to URL\n"
+          "  --install FILE         flash FILE as the running firmware first\n"
+          "  --rollback             roll back the running firmware first, as a\n"
+          "                         failed diagnostic does\n"
+          "  --partition-size N     size of the OTA partitions in bytes\n"
+          "  --attempts N           update checks before giving up (default 1)\n"
+          "  --poll                 keep checking while up to date, as the\n"
+          "                         device does, until --attempts checks\n"
+          "  --retry-delay MS       first delay after a failed check (default 0)\n"
+          "  --retry-max MS         longest delay after failed checks\n"
+          "  --poll-interval MS     delay between checks while up to date\n"
+          "                         (default 0), the server hints replace them\n"
+          "  --long-poll SECS       ask the server to hold every check up to\n"
+          "                         SECS until there is a new image\n"
+          "  --sleep light|deep     turn the radio off and sleep between update\n"
+          "                         windows, as a battery powered device does,\n"
+          "                         on a simulated clock (waits take no time)\n"
+          "  --window-period MS     windows open on this period (default 0,\n"
+          "                         whenever a check is due)\n"
+          "  --window-min-sleep MS  shorter waits stay in the window, awake\n"
+          "  --miss-window N        window N (from 1, up to 64) does not reach\n"
+          "                         the AP and is given up, can be repeated\n"
+          "  --timeout MS           receive timeout (default 5000)\n"
+          "  --no-keep-alive        open a new connection for every request\n"
+          "  --no-tls-resume        do a full TLS handshake on every connection\n"
+          "  --flash-speed KBPS     throttle flash writes to KBPS KB/s\n"
+          "  --json                 print the measurements of every update\n"
+          "                         check as a JSON object on one line\n"
+          "\n"
+          "Failure scenarios, offsets in bytes:\n"
+          "  --net-fail-at N        drop the connection after N body bytes\n"
+          "  --corrupt-at N         flip a bit of body byte N, as a link\n"
+          "                         corrupting data would\n"
+          "  --flash-fail-at N      fail the flash write reaching offset N\n"
+          "  --power-cut-at N       exit at offset N of the update partition,\n"
+          "                         without any cleanup\n"
+          "\n"
+          "  -v, --verbose          debug logs\n"
+          "  -q, --quiet            error logs only\n",
+          program);
+}
+
+static uint32_t parse_size(const char *arg) {
+  char *end;
+  unsigned long long value = strtoull(arg, &end, 0);
+  if (*end == 'k' || *end == 'K') {
+    value *= 1024;
+  } else if (*end == 'm' || *end == 'M') {
+    value *= 1024 * 1024;
+  }
+  return value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+}
+
+static bool parse_options(int argc, char **argv, options_t *options) {
+  enum {
+    OPT_MANIFEST_URL = 256,
+    OPT_IMAGE_URL,
+    OPT_CA_CERT,
+    OPT_SIGNING_KEY,
+    OPT_DEVICE_ID,
+    OPT_CHANNEL,
+    OPT_REPORT_URL,
+    OPT_INSTALL,
+    OPT_ROLLBACK,
+    OPT_PARTITION_SIZE,
+    OPT_ATTEMPTS,
+    OPT_POLL,
+    OPT_RETRY_DELAY,
+    OPT_RETRY_MAX,
+    OPT_POLL_INTERVAL,
+    OPT_LONG_POLL,
+    OPT_SLEEP,
+    OPT_WINDOW_PERIOD,
+    OPT_WINDOW_MIN_SLEEP,
+    OPT_MISS_WINDOW,
+    OPT_TIMEOUT,
+    OPT_NO_KEEP_ALIVE,
+    OPT_NO_TLS_RESUME,
+    OPT_FLASH_SPEED,
+    OPT_JSON,
+    OPT_NET_FAIL_AT,
+    OPT_CORRUPT_AT,
+    OPT_FLASH_FAIL_AT,
+    OPT_POWER_CUT_AT,
+  };
+  static const struct option long_options[] = {
+      {"manifest-url", required_argument, NULL, OPT_MANIFEST_URL},
+      {"image-url", required_argument, NULL, OPT_IMAGE_URL},
+      {"ca-cert", required_argument, NULL, OPT_CA_CERT},
+      {"signing-key", required_argument, NULL, OPT_SIGNING_KEY},
+      {"device-id", required_argument, NULL, OPT_DEVICE_ID},
+      {"channel", required_argument, NULL, OPT_CHANNEL},
+      {"report-url", required_argument, NULL, OPT_REPORT_URL},
+      {"install", required_argument, NULL, OPT_INSTALL},
+      {"rollback", no_argument, NULL, OPT_ROLLBACK},
+      {"partition-size", required_argument, NULL, OPT_PARTITION_SIZE},
+      {"attempts", required_argument, NULL, OPT_ATTEMPTS},
+      {"poll", no_argument, NULL, OPT_POLL},
+      {"retry-delay", required_argument, NULL, OPT_RETRY_DELAY},
+      {"retry-max", required_argument, NULL, OPT_RETRY_MAX},
+      {"poll-interval", required_argument, NULL, OPT_POLL_INTERVAL},
+      {"long-poll", required_argument, NULL, OPT_LONG_POLL},
+      {"sleep", required_argument, NULL, OPT_SLEEP},
+      {"window-period", required_argument, NULL, OPT_WINDOW_PERIOD},
+      {"window-min-sleep", required_argument, NULL, OPT_WINDOW_MIN_SLEEP},
+      {"miss-window", required_argument, NULL, OPT_MISS_WINDOW},
+      {"timeout", required_argument, NULL, OPT_TIMEOUT},
+      {"no-keep-alive", no_argument, NULL, OPT_NO_KEEP_ALIVE},
+      {"no-tls-resume", no_argument, NULL, OPT_NO_TLS_RESUME},
+      {"flash-speed", required_argument, NULL, OPT_FLASH_SPEED},
+      {"json", no_argument, NULL, OPT_JSON},
+      {"net-fail-at", required_argument, NULL, OPT_NET_FAIL_AT},
+      {"corrupt-at", required_argument, NULL, OPT_CORRUPT_AT},
+      {"flash-fail-at", required_argument, NULL, OPT_FLASH_FAIL_AT},
+      {"power-cut-at", required_argument, NULL, OPT_POWER_CUT_AT},
+      {"verbose", no_argument, NULL, 'v'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  *options = (options_t){
+      .manifest_url = DEFAULT_MANIFEST_URL,
+      .image_url = DEFAULT_IMAGE_URL,
+      .attempts = 1,
+      .http =
+          {
+              .timeout_ms = 5000,
+              .keep_alive = true,
+              .tls_resume = true,
+          },
+      .flash =
+          {
+              .partition_size = DEFAULT_PARTITION_SIZE,
+          },
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "vqh", long_options, NULL)) != -1) {
+    switch (opt) {
+    case OPT_MANIFEST_URL:
+      options->manifest_url = optarg;
+      break;
+    case OPT_IMAGE_URL:
+      options->image_url = optarg;
+      break;
+    case OPT_CA_CERT:
+      options->http.ca_cert = optarg;
+      break;
+    case OPT_SIGNING_KEY:
+      options->signing_key = optarg;
+      break;
+    case OPT_DEVICE_ID:
+      options->device_id = optarg;
+      break;
+    case OPT_CHANNEL:
+      options->channel = optarg;
+      break;
+    case OPT_REPORT_URL:
+      options->report_url = optarg;
+      break;
+    case OPT_INSTALL:
+      options->install = optarg;
+      break;
+    case OPT_ROLLBACK:
+      options->rollback = true;
+      break;
+    case OPT_PARTITION_SIZE:
+      options->flash.partition_size = parse_size(optarg);
+      break;
+    case OPT_ATTEMPTS:
+      options->attempts = atoi(optarg);
+      break;
+    case OPT_POLL:
+      options->poll = true;
+      break;
+    case OPT_RETRY_DELAY:
+      options->retry_delay_ms = atoi(optarg);
+      break;
+    case OPT_RETRY_MAX:
+      options->retry_max_ms = atoi(optarg);
+      break;
+    case OPT_POLL_INTERVAL:
+      options->poll_interval_ms = atoi(optarg);
+      break;
+    case OPT_LONG_POLL:
+      options->long_poll_s = atoi(optarg);
+      break;
+    case OPT_SLEEP:
+      if (strcmp(optarg, "light") == 0) {
+        options->window.sleep = WINDOW_LIGHT_SLEEP;
+      } else if (strcmp(optarg, "deep") == 0) {
+        options->window.sleep = WINDOW_DEEP_SLEEP;
+      } else {
+        return false;
+      }
+      options->windows = true;
+      break;
+    case OPT_WINDOW_PERIOD:
+      options->window.period_ms = parse_size(optarg);
+      break;
+    case OPT_WINDOW_MIN_SLEEP:
+      options->window.min_sleep_ms = parse_size(optarg);
+      break;
+    case OPT_MISS_WINDOW: {
+      int window = atoi(optarg);
+      if (window < 1 || window > 64) {
+        return false;
+      }
+      options->missed_windows |= 1ull << (window - 1);
+      break;
+    }
+    case OPT_TIMEOUT:
+      options->http.timeout_ms = atoi(optarg);
+      break;
+    case OPT_NO_KEEP_ALIVE:
+      options->http.keep_alive = false;
+      break;
+    case OPT_NO_TLS_RESUME:
+      options->http.tls_resume = false;
+      break;
+    case OPT_FLASH_SPEED:
+      options->flash.write_kbps = parse_size(optarg);
+      break;
+    case OPT_JSON:
+      options->json = true;
+      break;
+    case OPT_NET_FAIL_AT:
+      options->http.fail_at = parse_size(optarg);
+      break;
+    case OPT_CORRUPT_AT:
+      options->http.corrupt_at = parse_size(optarg);
+      break;
+    case OPT_FLASH_FAIL_AT:
+      options->flash.fail_at = parse_size(optarg);
+      break;
+    case OPT_POWER_CUT_AT:
+      options->flash.power_cut_at = parse_size(optarg);
+      break;
+    case 'v':
+      esp_log_level = ESP_LOG_DEBUG;
+      break;
+    case 'q':
+      esp_log_level = ESP_LOG_ERROR;
+      break;
+    default:
+      return false;
+    }
+  }
+
+  if (optind != argc - 1 || options->attempts < 1 ||
+      options->flash.partition_size % 4096 != 0) {
+    return false;
+  }
+  options->state_dir = argv[optind];
+  options->flash.dir = options->state_dir;
+  return true;
+}
+
+// Print the fields of the update windows of a JSON report, after the wait of
+// `window_ms` until the next one was planned
+static void report_window_json(const window_state_t *window,
+                               uint32_t window_ms, window_sleep_t sleep) {
+  printf(",\"window_ms\":%" PRIu32 ",\"sleep\":\"%s\",\"windows\":%" PRIu32
+         ",\"missed_windows\":%" PRIu32 ",\"radio_us\":%" PRId64
+         ",\"asleep_us\":%" PRId64 ",\"window_offset_ms\":%" PRIu32
+         ",\"next_window_ms\":%" PRId64,
+         window_ms, SLEEP_NAMES[sleep], window->windows, window->missed,
+         window->radio_us, window->asleep_us, window->offset_ms,
+         window->next_us / 1000);
+}
+
+// Print the measurements of an update check on stdout, as a single JSON
+// object for the benchmarks (see ota_https_server/src/bin/ota_bench.rs)
+static void report_json(int attempt, ota_result_t result,
+                        const ota_stats_t *stats, int64_t wall_us,
+                        const window_state_t *window, uint32_t window_ms,
+                        window_sleep_t sleep) {
+  const pipeline_result_t *pipeline = &stats->pipeline;
+  const ota_transport_stats_t *http = &stats->transport;
+
+  printf("{\"attempt\":%d,\"result\":\"%s\",\"mode\":\"%s\","
+         "\"wall_us\":%" PRId64 ",\"manifest_us\":%" PRId64
+         ",\"download_us\":%" PRId64 ",\"ttfb_us\":%" PRId64
+         ",\"finish_us\":%" PRId64
+         ",\"bytes\":%" PRIu32 ",\"image_len\":%" PRIu32
+         ",\"resume_offset\":%" PRIu32 ",\"bad_blocks\":%" PRIu32
+         ",\"failure\":\"%s\""
+         ",\"retry_after_s\":%" PRIu32 ",\"max_age_s\":%" PRIu32
+         ",\"next_check_ms\":%" PRIu32 ",\"long_polled\":%s"
+         ",\"transfer_us\":%" PRId64
+         ",\"throughput_bps\":%" PRId64 ",\"network_us\":%" PRId64
+         ",\"network_wait_us\":%" PRId64 ",\"flash_us\":%" PRId64
+         ",\"requests\":%" PRIu32 ",\"connections\":%" PRIu32
+         ",\"resumed\":%" PRIu32 ",\"connect_us\":%" PRId64
+         ",\"handshake_us\":%" PRId64 ",\"peak_heap\":%zu"
+         ",\"pipeline_buffer_size\":%d,\"pipeline_buffers\":%d",
+         attempt, RESULT_NAMES[result],
+         pipeline->bytes > 0 ? MODE_NAMES[stats->mode] : "none", wall_us,
+         stats->manifest_us, stats->download_us, stats->ttfb_us,
+         stats->finish_us, pipeline->bytes, stats->image_len,
+         stats->resume_offset, stats->bad_blocks,
+         FAILURE_NAMES[stats->failure], stats->retry_after_s,
+         stats->max_age_s, stats->next_check_ms,
+         stats->long_polled ? "true" : "false", pipeline->total_us,
+         throughput(pipeline), pipeline->network_us, pipeline->network_wait_us,
+         pipeline->flash_us, http->requests, http->connections, http->resumed,
+         http->connect_us, http->handshake_us, heap_peak(),
+         CONFIG_OTA_PIPELINE_BUFFER_SIZE * 1024, CONFIG_OTA_PIPELINE_BUFFERS);
+  if (window != NULL) {
+    report_window_json(window, window_ms, sleep);
+  }
+  printf("}\n");
+  fflush(stdout);
+}
+
+// Print the measurements of an update check on stdout. `window` is NULL
+// unless the checks run in update windows, then the wait until the next check
+// is `window_ms`, spent as `sleep` says.
+static void report(int attempt, ota_result_t result, const ota_stats_t *stats,
+                   int64_t wall_us, const window_state_t *window,
+                   uint32_t window_ms, window_sleep_t sleep, bool json) {
+  const pipeline_result_t *pipeline = &stats->pipeline;
+  const ota_transport_stats_t *http = &stats->transport;
+
+  if (json) {
+    report_json(attempt, result, stats, wall_us, window, window_ms, sleep);
+    return;
+  }
+
+  if (result == OTA_FAILED) {
+    printf("attempt %d: %s (%s)\n", attempt, RESULT_NAMES[result],
+           FAILURE_NAMES[stats->failure]);
+  } else {
+    printf("attempt %d: %s\n", attempt, RESULT_NAMES[result]);
+  }
+  printf("  wall time      %" PRId64 " ms (manifest %" PRId64
+         " ms, download %" PRId64 " ms)\n",
+         wall_us / 1000, stats->manifest_us / 1000, stats->download_us / 1000);
+  if (pipeline->bytes > 0) {
+    printf("  downloaded     %" PRIu32 " bytes (%s), %" PRId64
+           " bytes/s, first byte after %" PRId64 " ms\n",
+           pipeline->bytes, MODE_NAMES[stats->mode], throughput(pipeline),
+           stats->ttfb_us / 1000);
+    printf("  image          %" PRIu32 " bytes written, resumed at %" PRIu32
+           ", %" PRIu32 " corrupted blocks downloaded again\n",
+           stats->image_len, stats->resume_offset, stats->bad_blocks);
+    printf("  pipeline       network %" PRId64 " ms (waited %" PRId64
+           " ms), flash %" PRId64 " ms, validation %" PRId64 " ms\n",
+           pipeline->network_us / 1000, pipeline->network_wait_us / 1000,
+           pipeline->flash_us / 1000, stats->finish_us / 1000);
+  }
+  printf("  connections    %" PRIu32 " for %" PRIu32
+         " requests (connect %" PRId64 " ms, TLS %" PRId64 " ms, %" PRIu32
+         " sessions resumed)\n",
+         http->connections, http->requests, http->connect_us / 1000,
+         http->handshake_us / 1000, http->resumed);
+  printf("  next check     in %" PRIu32 " ms", stats->next_check_ms);
+  if (stats->long_polled) {
+    printf(" (long polled for %" PRId64 " ms)", stats->manifest_us / 1000);
+  } else if (stats->retry_after_s > 0) {
+    printf(" (Retry-After %" PRIu32 " s)", stats->retry_after_s);
+  } else if (stats->max_age_s > 0) {
+    printf(" (max-age %" PRIu32 " s)", stats->max_age_s);
+  }
+  printf("\n");
+  if (window != NULL) {
+    printf("  next window    in %" PRIu32 " ms (%s)\n", window_ms,
+           sleep == WINDOW_STAY_AWAKE ? "stay awake"
+                                      : sleep == WINDOW_LIGHT_SLEEP
+                                            ? "light sleep"
+                                            : "deep sleep");
+  }
+  printf("  peak heap      %zu bytes\n", heap_peak());
+  fflush(stdout);
+}
+
+// Print a window given up without reaching the AP on stdout, no update check
+// ran in it
+static void report_missed(const window_state_t *window, uint32_t window_ms,
+                          window_sleep_t sleep, bool json) {
+  if (json) {
+    printf("{\"window\":%" PRIu32 ",\"result\":\"missed\"", window->windows);
+    report_window_json(window, window_ms, sleep);
+    printf("}\n");
+  } else {
+    printf("window %" PRIu32 ": AP not reached\n", window->windows);
+    // Given up windows always sleep until the next one
+    printf("  next window    in %" PRIu32 " ms (%s sleep)\n", window_ms,
+           SLEEP_NAMES[sleep]);
+  }
+  fflush(stdout);
+}
+
+// Sleep until the next window, `wait_ms` away on the simulated clock, and
+// open it. Deep sleep restarts the device: only the flash, the NVS and the
+// window state (RTC memory) are kept, and the link to the server. Returns
+// false if the simulated device could not restart.
+static bool wake_at_window(const options_t *options,
+                           ota_engine_config_t *config, window_state_t *window,
+                           window_sleep_t sleep, uint32_t wait_ms) {
+  if (sleep == WINDOW_LIGHT_SLEEP) {
+    http_transport_disconnect(config->transport_ctx);
+  } else if (sleep == WINDOW_DEEP_SLEEP) {
+    http_transport_restart(config->transport_ctx);
+    file_flash_destroy(config->flash_ctx);
+    file_store_destroy(config->store_ctx);
+    config->store_ctx = file_store_create(options->state_dir);
+    config->flash_ctx = file_flash_create(&options->flash);
+    if (config->store_ctx == NULL || config->flash_ctx == NULL) {
+      ESP_LOGE(HOST_TAG, "Failed to restart the simulated device");
+      return false;
+    }
+    ota_engine_init(config);
+    window_init(window, &options->window);
+  }
+  host_clock_advance((int64_t)wait_ms * 1000);
+  window_open(window, esp_timer_get_time());
+  return true;
+}
+
+// Give up the windows of --miss-window, from the one open, as the device does
+// when the AP cannot be reached in time: it retries at the window of the first
+// retry delay. Returns false if the simulated device could not restart.
+static bool miss_windows(const options_t *options, ota_engine_config_t *config,
+                         window_state_t *window) {
+  while (window->windows <= 64 &&
+         (options->missed_windows & (1ull << (window->windows - 1))) != 0) {
+    window_sleep_t sleep;
+    uint32_t wait_ms =
+        window_plan(window, &options->window, esp_timer_get_time(),
+                    config->schedule.retry_min_ms, false, &sleep);
+    report_missed(window, wait_ms, sleep, options->json);
+    if (!wake_at_window(options, config, window, sleep, wait_ms)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Read a whole text file, as the device embeds it (NUL terminated).
+// Returns NULL if it cannot be read.
+static char *read_text_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+
+  char *text = NULL;
+  long len = -1;
+  if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) >= 0 &&
+      fseek(file, 0, SEEK_SET) == 0) {
+    text = malloc(len + 1);
+  }
+  if (text != NULL && fread(text, 1, len, file) != (size_t)len) {
+    free(text);
+    text = NULL;
+  }
+  if (text != NULL) {
+    text[len] = '\0';
+  }
+  fclose(file);
+  return text;
+}
+
+static uint32_t host_random(void) { return (uint32_t)rand(); }
+
+int main(int argc, char **argv) {
+  options_t options;
+
+  // Before anything allocates with OpenSSL
+  heap_init();
+  if (!parse_options(argc, argv, &options)) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  void *store = file_store_create(options.state_dir);
+  void *flash = file_flash_create(&options.flash);
+  void *transport = http_transport_create(&options.http);
+  if (store == NULL || flash == NULL || transport == NULL) {
+    ESP_LOGE(HOST_TAG, "Failed to set up the simulated device");
+    return 1;
+  }
+
+  if (options.install != NULL &&
+      file_flash_install(flash, options.install) != ESP_OK) {
+    return 1;
+  }
+  if (options.rollback && file_flash_rollback(flash) != ESP_OK) {
+    return 1;
+  }
+  char *signing_key = NULL;
+  if (options.signing_key != NULL &&
+      (signing_key = read_text_file(options.signing_key)) == NULL) {
+    ESP_LOGE(HOST_TAG, "Failed to read %s", options.signing_key);
+    return 1;
+  }
+
+  ota_engine_config_t config = {
+      .transport = &http_transport,
+      .transport_ctx = transport,
+      .flash = &file_flash,
+      .flash_ctx = flash,
+      .store = &file_store,
+      .store_ctx = store,
+      .manifest_url = options.manifest_url,
+      .image_url = options.image_url,
+      .signing_key = signing_key,
+      .device_id = options.device_id,
+      .channel = options.channel,
+      .report_url = options.report_url,
+      .schedule =
+          {
+              .poll_interval_ms = options.poll_interval_ms,
+              .retry_min_ms = options.retry_delay_ms,
+              .retry_max_ms = options.retry_max_ms,
+              .random = host_random,
+          },
+      .long_poll_s = options.long_poll_s,
+  };
+  // Devices started together must not retry together
+  srand((unsigned)time(NULL) ^ (unsigned)getpid());
+  ota_engine_init(&config);
+
+  // The RTC memory of the device, the only memory kept across deep sleep
+  window_state_t window_state = {0};
+  options.window.random = host_random;
+  if (options.windows) {
+    window_init(&window_state, &options.window);
+    window_open(&window_state, esp_timer_get_time());
+    if (!miss_windows(&options, &config, &window_state)) {
+      return 1;
+    }
+  }
+
+  ota_result_t result = OTA_FAILED;
+  ota_stats_t stats;
+  uint32_t wait_ms = 0;
+  window_sleep_t sleep = WINDOW_STAY_AWAKE;
+  for (int attempt = 1; attempt <= options.attempts; ++attempt) {
+    if (attempt > 1 && !options.windows) {
+      vTaskDelay(stats.next_check_ms / portTICK_PERIOD_MS);
+    } else if (attempt > 1) {
+      if (!wake_at_window(&options, &config, &window_state, sleep, wait_ms) ||
+          !miss_windows(&options, &config, &window_state)) {
+        return 1;
+      }
+      store = config.store_ctx;
+      flash = config.flash_ctx;
+    }
+
+    heap_reset_peak();
+    int64_t start = esp_timer_get_time();
+    result = ota_engine_run(&stats);
+    int64_t wall_us = esp_timer_get_time() - start;
+    if (options.windows && result != OTA_UPDATED) {
+      wait_ms = window_plan(&window_state, &options.window,
+                            esp_timer_get_time(), stats.next_check_ms, true,
+                            &sleep);
+    } else if (options.windows) {
+      // The device restarts into the new firmware in this window
+      wait_ms = 0;
+      sleep = WINDOW_STAY_AWAKE;
+    }
+    report(attempt, result, &stats, wall_us,
+           options.windows ? &window_state : NULL, wait_ms, sleep,
+           options.json);
+    if (result == OTA_UPDATED || (result == OTA_UP_TO_DATE && !options.poll)) {
+      break;
+    }
+  }
+
+  if (options.windows && !options.json) {
+    int64_t total_us = window_state.radio_us + window_state.asleep_us;
+    printf("windows          %" PRIu32 " (%" PRIu32 " missed), radio on %" PRId64
+           " ms, asleep %" PRId64 " ms, duty cycle %.3f%%\n",
+           window_state.windows, window_state.missed,
+           window_state.radio_us / 1000, window_state.asleep_us / 1000,
+           total_us > 0 ? 100.0 * window_state.radio_us / total_us : 100.0);
+  }
+
+  if (result == OTA_UPDATED) {
+    ESP_LOGI(HOST_TAG, "Slot %d boots next", file_flash_boot_slot(flash));
+  }
+
+  http_transport_destroy(transport);
+  file_flash_destroy(flash);
+  file_store_destroy(store);
+  free(signing_key);
+  return result == OTA_FAILED ? 1 : 0;
+}
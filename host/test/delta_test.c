@@ -0,0 +1,210 @@
+// Unit tests of the patch applier (main/delta.c) with the fixture patch made
+// by the ota_delta tool, see make_fixtures.py.
+//
+//   delta_test FIXTURES_DIR
+
+#include "delta.h"
+#include "esp_log.h"
+#include "mbedtls/sha256.h"
+#include "test_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OP_END 0
+#define OP_ADD 1
+#define OP_INSERT 2
+
+// Running image the patches are applied to
+static const uint8_t *old_image;
+static size_t old_len;
+
+static esp_err_t read_old(void *ctx, uint32_t offset, void *data,
+                          size_t len) {
+  (void)ctx;
+  // The applier checks the records before reading the old image
+  CHECK(offset <= old_len && len <= old_len - offset);
+  if (offset > old_len || len > old_len - offset) {
+    return ESP_FAIL;
+  }
+  memcpy(data, &old_image[offset], len);
+  return ESP_OK;
+}
+
+static esp_err_t write_new(void *ctx, const void *data, size_t len) {
+  test_buffer_append(ctx, data, len);
+  return ESP_OK;
+}
+
+static void sha256(const uint8_t *data, size_t len, uint8_t hash[32]) {
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, 0);
+  mbedtls_sha256_update(&ctx, data, len);
+  mbedtls_sha256_finish(&ctx, hash);
+  mbedtls_sha256_free(&ctx);
+}
+
+// Apply `patch`, fed `chunk` bytes at a time, to the image expected to be
+// rebuilt. Returns the first error of delta_feed() or delta_finish().
+static esp_err_t apply(const uint8_t *patch, size_t len, size_t chunk,
+                       const uint8_t *target, size_t target_len,
+                       test_buffer_t *out) {
+  static delta_t delta;
+  uint8_t target_sha256[32];
+
+  sha256(target, target_len, target_sha256);
+  delta_init(&delta, target_sha256, read_old, write_new, out);
+  for (size_t offset = 0; offset < len;) {
+    size_t block = len - offset < chunk ? len - offset : chunk;
+    esp_err_t err = delta_feed(&delta, &patch[offset], block);
+    if (err != ESP_OK) {
+      return err;
+    }
+    offset += block;
+  }
+  return delta_finish(&delta);
+}
+
+// Patch made of literals only: the header of `header`, then the records
+static void make_patch(const uint8_t *header, const uint8_t *records,
+                       size_t len, test_buffer_t *patch) {
+  test_bits_t bits = {0};
+  test_bits_literals(&bits, records, len);
+  test_bits_finish(&bits);
+  test_buffer_append(patch, header, DELTA_HEADER_LEN);
+  test_buffer_append(patch, bits.out.data, bits.out.len);
+  test_buffer_free(&bits.out);
+}
+
+static size_t put_record(uint8_t *data, uint8_t op, uint32_t old_offset,
+                         uint32_t len) {
+  size_t pos = 0;
+  data[pos++] = op;
+  if (op == OP_ADD) {
+    memcpy(&data[pos], &old_offset, 4); // Little endian host
+    pos += 4;
+  }
+  memcpy(&data[pos], &len, 4);
+  return pos + 4;
+}
+
+static void test_fixture_patch(const uint8_t *patch, size_t patch_len,
+                               const uint8_t *new, size_t new_len) {
+  // Whatever the download blocks, down to single bytes
+  static const size_t chunks[] = {1, 7, 112, 4096, SIZE_MAX};
+  for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+    test_buffer_t out = {0};
+    CHECK_ERR(apply(patch, patch_len, chunks[i], new, new_len, &out), ESP_OK);
+    CHECK(out.len == new_len && memcmp(out.data, new, new_len) == 0);
+    test_buffer_free(&out);
+  }
+}
+
+static void test_truncated_patch(const uint8_t *patch, size_t patch_len,
+                                 const uint8_t *new, size_t new_len) {
+  static const size_t cuts[] = {1, 16, 200};
+  for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); ++i) {
+    test_buffer_t out = {0};
+    CHECK_ERR(apply(patch, patch_len - cuts[i], 64, new, new_len, &out),
+              ESP_ERR_INVALID_SIZE);
+    test_buffer_free(&out);
+  }
+  // Only part of the header
+  test_buffer_t out = {0};
+  CHECK_ERR(apply(patch, DELTA_HEADER_LEN - 1, 64, new, new_len, &out),
+            ESP_ERR_INVALID_SIZE);
+  CHECK(out.len == 0);
+  test_buffer_free(&out);
+}
+
+static void test_wrong_base(uint8_t *old, const uint8_t *patch,
+                            size_t patch_len, const uint8_t *new,
+                            size_t new_len) {
+  test_buffer_t out = {0};
+  old[5000] ^= 1;
+  CHECK_ERR(apply(patch, patch_len, 4096, new, new_len, &out),
+            ESP_ERR_INVALID_VERSION);
+  old[5000] ^= 1;
+  CHECK(out.len == 0);
+
+  // Nor a patch rebuilding another image than the manifest says
+  CHECK_ERR(apply(patch, patch_len, 4096, old, old_len, &out),
+            ESP_ERR_INVALID_VERSION);
+  CHECK(out.len == 0);
+  test_buffer_free(&out);
+}
+
+static void test_add_out_of_bounds(const uint8_t *header, const uint8_t *new,
+                                   size_t new_len) {
+  // Past the end of the old image, then longer than what is left of it, then
+  // longer than the new image
+  const uint32_t records[][2] = {
+      {old_len + 1, 1},
+      {old_len - 8, 16},
+      {0, new_len + 1},
+  };
+  for (size_t i = 0; i < sizeof(records) / sizeof(records[0]); ++i) {
+    // With the bytes to add, so that the old image would be read
+    uint8_t data[9 + 16] = {0};
+    size_t len = put_record(data, OP_ADD, records[i][0], records[i][1]) + 16;
+    test_buffer_t patch = {0}, out = {0};
+    make_patch(header, data, len, &patch);
+    CHECK_ERR(apply(patch.data, patch.len, 4096, new, new_len, &out),
+              ESP_ERR_INVALID_SIZE);
+    CHECK(out.len == 0);
+    test_buffer_free(&patch);
+    test_buffer_free(&out);
+  }
+}
+
+static void test_data_after_end(const uint8_t *header, const uint8_t *new,
+                                size_t new_len) {
+  // The new image inserted as it is
+  size_t len = 5 + new_len + 2;
+  uint8_t *records = malloc(len);
+  size_t pos = put_record(records, OP_INSERT, 0, new_len);
+  memcpy(&records[pos], new, new_len);
+  records[pos + new_len] = OP_END;
+  records[pos + new_len + 1] = OP_END;
+
+  test_buffer_t patch = {0}, out = {0};
+  make_patch(header, records, len - 1, &patch);
+  CHECK_ERR(apply(patch.data, patch.len, 4096, new, new_len, &out), ESP_OK);
+  CHECK(out.len == new_len && memcmp(out.data, new, new_len) == 0);
+  test_buffer_free(&patch);
+  test_buffer_free(&out);
+
+  make_patch(header, records, len, &patch);
+  CHECK_ERR(apply(patch.data, patch.len, 4096, new, new_len, &out),
+            ESP_ERR_INVALID_RESPONSE);
+  test_buffer_free(&patch);
+  test_buffer_free(&out);
+  free(records);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s FIXTURES_DIR\n", argv[0]);
+    return 2;
+  }
+  // The failures are expected
+  esp_log_level = ESP_LOG_NONE;
+
+  size_t new_len, patch_len;
+  uint8_t *old = test_read_fixture(argv[1], "old.bin", &old_len);
+  uint8_t *new = test_read_fixture(argv[1], "new.bin", &new_len);
+  uint8_t *patch = test_read_fixture(argv[1], "new.bin.delta", &patch_len);
+  old_image = old;
+
+  test_fixture_patch(patch, patch_len, new, new_len);
+  test_truncated_patch(patch, patch_len, new, new_len);
+  test_wrong_base(old, patch, patch_len, new, new_len);
+  test_add_out_of_bounds(patch, new, new_len);
+  test_data_after_end(patch, new, new_len);
+
+  free(old);
+  free(new);
+  free(patch);
+  return test_result();
+}
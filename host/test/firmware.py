@@ -0,0 +1,207 @@
+"""Fixture firmware images and a minimal update server for the host tests.
+
+The images only have what the OTA engine and the simulated flash look at: the
+image header, the first segment header and the esp_app_desc_t. The rest is
+pseudo-random data, the same for every run.
+"""
+
+import hashlib
+import http.server
+import json
+import os
+import random
+import struct
+import subprocess
+import sys
+import threading
+
+ESP_IMAGE_HEADER_MAGIC = 0xE9
+ESP_APP_DESC_MAGIC_WORD = 0xABCD5432
+
+
+def image(version, size, secure_version=0, seed=0, project="esp32_secure_ota"):
+    """Build an application image of `size` bytes"""
+    rng = random.Random(seed)
+    # esp_image_header_t, one segment, chip 0 (ESP32) from revision 0
+    header = struct.pack("<BBBBIB3sHBHH4sB", ESP_IMAGE_HEADER_MAGIC, 1, 2, 0,
+                         0x40080000, 0xEE, b"", 0, 0, 0, 0xFFFF, b"", 0)
+    desc = struct.pack("<II8x32s32s16s16s32s32s", ESP_APP_DESC_MAGIC_WORD,
+                       secure_version, version.encode(), project.encode(),
+                       b"00:00:00", b"Jan  1 2025", b"v5.2",
+                       rng.randbytes(32)).ljust(256, b"\0")
+    body_len = size - len(header) - 8 - len(desc)
+    # Compressible, like real code: instructions from a small set of words
+    words = [rng.randbytes(4) for _ in range(64)]
+    body = b"".join(rng.choices(words, k=body_len // 4 + 1))[:body_len]
+    segment = struct.pack("<II", 0x3F400000, len(desc) + body_len)
+    return header + segment + desc + body
+
+
+def version(data):
+    """Version of an image, from its esp_app_desc_t"""
+    return data[48:80].split(b"\0")[0].decode()
+
+
+def secure_version(data):
+    return struct.unpack_from("<I", data, 36)[0]
+
+
+class Signer:
+    """ECDSA P-256 key signing the manifests, made with the openssl command"""
+
+    def __init__(self, dir):
+        self.key = os.path.join(dir, "signing_key.pem")
+        self.public_key = os.path.join(dir, "signing_pub.pem")
+        subprocess.run(["openssl", "genpkey", "-algorithm", "EC", "-pkeyopt",
+                        "ec_paramgen_curve:P-256", "-out", self.key],
+                       check=True, capture_output=True)
+        subprocess.run(["openssl", "pkey", "-in", self.key, "-pubout", "-out",
+                        self.public_key], check=True, capture_output=True)
+
+    def sign(self, message):
+        """Hex encoded DER signature, as in the manifests"""
+        return subprocess.run(["openssl", "dgst", "-sha256", "-sign", self.key],
+                              input=message, check=True,
+                              capture_output=True).stdout.hex()
+
+
+BLOCK_SIZE = 4096
+
+
+def blocks(data):
+    """Block list of an image, see ota_https_server/src/blocks.rs"""
+    hashes = b"".join(hashlib.sha256(data[i:i + BLOCK_SIZE]).digest()
+                      for i in range(0, len(data), BLOCK_SIZE))
+    return (b"ESPB" + struct.pack("<BBBBI", 1, 12, 0, 0, len(data)) +
+            hashlib.sha256(data).digest() + hashes)
+
+
+def manifest_message(name, data):
+    """Signed manifest fields, see ota_https_server/src/signing.rs"""
+    return "ota-manifest-v1\n{}\n{}\n{}\n{}\n{}\n".format(
+        name, version(data), secure_version(data), len(data),
+        hashlib.sha256(data).hexdigest()).encode()
+
+
+class QuietServer(http.server.ThreadingHTTPServer):
+    """Server taking the connections ota_host drops on purpose in its stride"""
+
+    def handle_error(self, request, client_address):
+        if not isinstance(sys.exc_info()[1], ConnectionError):
+            super().handle_error(request, client_address)
+
+
+class Server:
+    """Update server on 127.0.0.1 serving the files of a directory as the OTA
+    server does: /manifest/<image>, /blocks/<image> and the images with ETag
+    and Range. `requests` lists the path and body size of every response."""
+
+    def __init__(self, dir, signer=None):
+        self.dir = dir
+        self.signer = signer
+        self.requests = []
+        server = self
+
+        class Handler(http.server.BaseHTTPRequestHandler):
+            protocol_version = "HTTP/1.1"
+
+            def log_message(self, *args):
+                pass
+
+            def do_GET(self):
+                status, headers, body = server.get(self.path, self.headers)
+                server.requests.append((self.path, len(body)))
+                self.send_response(status)
+                for name, value in headers.items():
+                    self.send_header(name, value)
+                self.send_header("Content-Length", str(len(body)))
+                self.end_headers()
+                self.wfile.write(body)
+
+        self.httpd = QuietServer(("127.0.0.1", 0), Handler)
+        self.thread = threading.Thread(target=self.httpd.serve_forever,
+                                       daemon=True)
+
+    def __enter__(self):
+        self.thread.start()
+        return self
+
+    def __exit__(self, *args):
+        self.httpd.shutdown()
+        self.httpd.server_close()
+
+    def url(self, path):
+        return "http://127.0.0.1:{}/{}".format(self.httpd.server_port, path)
+
+    def read(self, name):
+        path = os.path.join(self.dir, name)
+        if os.sep in name or not os.path.isfile(path):
+            return None
+        with open(path, "rb") as file:
+            return file.read()
+
+    def manifest(self, name, data):
+        manifest = {
+            "name": name,
+            "url": "/" + name,
+            "version": version(data),
+            "project_name": "esp32_secure_ota",
+            "secure_version": secure_version(data),
+            "size": len(data),
+            "sha256": hashlib.sha256(data).hexdigest(),
+            "blocks": {
+                "url": "/blocks/" + name,
+                "size": len(blocks(data)),
+                "sha256": hashlib.sha256(blocks(data)).hexdigest(),
+            },
+        }
+        if self.signer is not None:
+            manifest["signature"] = self.signer.sign(manifest_message(name,
+                                                                      data))
+            manifest["blocks"]["signature"] = self.signer.sign(blocks(data))
+        return manifest
+
+    def get(self, path, headers):
+        if path.startswith("/manifest/"):
+            name = path[len("/manifest/"):]
+            data = self.read(name)
+            if data is None:
+                return 404, {}, b""
+            etag = '"{}"'.format(hashlib.sha256(data).hexdigest())
+            if headers.get("If-None-Match") == etag:
+                return 304, {"ETag": etag}, b""
+            body = json.dumps(self.manifest(name, data)).encode()
+            return 200, {"ETag": etag,
+                         "Content-Type": "application/json"}, body
+        if path.startswith("/blocks/"):
+            data = self.read(path[len("/blocks/"):])
+            if data is None:
+                return 404, {}, b""
+            return 200, {"Content-Type": "application/octet-stream"}, blocks(
+                data)
+
+        data = self.read(path.lstrip("/"))
+        if data is None:
+            return 404, {}, b""
+        etag = '"{}"'.format(hashlib.sha256(data).hexdigest())
+        return serve_bytes(data, etag, headers)
+
+
+def serve_bytes(data, etag, headers):
+    """Answer a GET of `data`, the part asked for by a single range request
+    as long as If-Range matches"""
+    common = {"ETag": etag, "Accept-Ranges": "bytes",
+              "Content-Type": "application/octet-stream"}
+    spec = headers.get("Range", "")
+    if_range = headers.get("If-Range")
+    if not spec.startswith("bytes=") or "," in spec or (
+            if_range is not None and if_range != etag):
+        return 200, common, data
+    start, _, end = spec[len("bytes="):].partition("-")
+    start = int(start)
+    end = min(int(end) + 1, len(data)) if end else len(data)
+    if start >= len(data):
+        return 416, {"Content-Range": "bytes */{}".format(len(data))}, b""
+    common["Content-Range"] = "bytes {}-{}/{}".format(start, end - 1,
+                                                      len(data))
+    return 206, common, data[start:end]
@@ -0,0 +1,108 @@
+// Unit tests of the heatshrink decoder (main/heatshrink.c) with the
+// compressed images of the fixtures, see make_fixtures.py.
+//
+//   heatshrink_test FIXTURES_DIR
+
+#include "esp_log.h"
+#include "heatshrink.h"
+#include "test_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IMAGE_HEADER_LEN 12
+
+static esp_err_t output(void *ctx, const void *data, size_t len) {
+  test_buffer_t *out = ctx;
+  // Nothing is output twice or past the end of the window
+  CHECK(len > 0 && len <= 1 << HEATSHRINK_MAX_WINDOW_BITS);
+  test_buffer_append(out, data, len);
+  return ESP_OK;
+}
+
+// Decompress the compressed image `image`, fed `chunk` bytes at a time.
+// Returns the first error of the decoder.
+static esp_err_t decompress(const uint8_t *image, size_t len, size_t chunk,
+                            test_buffer_t *out) {
+  static heatshrink_decoder_t decoder;
+
+  CHECK(len >= IMAGE_HEADER_LEN && memcmp(image, "ESPZ", 4) == 0);
+  esp_err_t err =
+      heatshrink_decoder_init(&decoder, image[5], image[6], output, out);
+  for (size_t offset = IMAGE_HEADER_LEN; offset < len && err == ESP_OK;) {
+    size_t block = len - offset < chunk ? len - offset : chunk;
+    err = heatshrink_decoder_feed(&decoder, &image[offset], block);
+    offset += block;
+  }
+  return err;
+}
+
+// Decompress the fixture `compressed`, expecting the fixture `name`
+static void test_fixture(const char *dir, const char *compressed,
+                         const char *name) {
+  size_t image_len, data_len;
+  uint8_t *image = test_read_fixture(dir, compressed, &image_len);
+  uint8_t *data = test_read_fixture(dir, name, &data_len);
+
+  static const size_t chunks[] = {1, 3, 512, 4096, SIZE_MAX};
+  for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+    test_buffer_t out = {0};
+    CHECK_ERR(decompress(image, image_len, chunks[i], &out), ESP_OK);
+    CHECK(out.len == data_len && memcmp(out.data, data, data_len) == 0);
+    test_buffer_free(&out);
+  }
+  free(image);
+  free(data);
+}
+
+static void test_before_start(const char *dir) {
+  size_t len;
+  uint8_t *image = test_read_fixture(dir, "before_start.hsz", &len);
+  test_buffer_t out = {0};
+  CHECK_ERR(decompress(image, len, 1, &out), ESP_ERR_INVALID_RESPONSE);
+  test_buffer_free(&out);
+  CHECK_ERR(decompress(image, len, SIZE_MAX, &out), ESP_ERR_INVALID_RESPONSE);
+  test_buffer_free(&out);
+  free(image);
+}
+
+static void test_window_sizes(void) {
+  heatshrink_decoder_t decoder;
+  CHECK_ERR(heatshrink_decoder_init(&decoder, HEATSHRINK_MAX_WINDOW_BITS + 1,
+                                    4, output, NULL),
+            ESP_ERR_INVALID_ARG);
+  CHECK_ERR(heatshrink_decoder_init(&decoder, 8, 8, output, NULL),
+            ESP_ERR_INVALID_ARG);
+
+  // The largest back-reference of a small window
+  test_buffer_t out = {0};
+  test_bits_t bits = {0};
+  test_bits_literals(&bits, "0123456789abcdef", 16);
+  test_bits_push(&bits, 0, 1);
+  test_bits_push(&bits, 15, 4);
+  test_bits_push(&bits, 7, 3);
+  test_bits_finish(&bits);
+  CHECK_ERR(heatshrink_decoder_init(&decoder, 4, 3, output, &out), ESP_OK);
+  CHECK_ERR(heatshrink_decoder_feed(&decoder, bits.out.data, bits.out.len),
+            ESP_OK);
+  CHECK(out.len == 24 && memcmp(out.data, "0123456789abcdef01234567", 24) == 0);
+  test_buffer_free(&out);
+  test_buffer_free(&bits.out);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s FIXTURES_DIR\n", argv[0]);
+    return 2;
+  }
+  // The failures are expected
+  esp_log_level = ESP_LOG_NONE;
+
+  test_fixture(argv[1], "overlap.hsz", "overlap.bin");
+  test_fixture(argv[1], "wrap.hsz", "wrap.bin");
+  // Compressed by the server
+  test_fixture(argv[1], "new.bin.hsz", "new.bin");
+  test_before_start(argv[1]);
+  test_window_sizes();
+  return test_result();
+}
@@ -0,0 +1,115 @@
+"""Write the fixture images of the unit tests to fixtures/.
+
+new.bin is old.bin rebuilt as a later release: some bytes inserted, some
+removed and a range of addresses moved. The patch between them is made by the
+server tools, with ota_https_server as working directory:
+
+    cargo run --bin ota_delta -- ../host/test/fixtures/old.bin \
+        ../host/test/fixtures/new.bin --out ../host/test/fixtures/new.bin.delta
+
+and new.bin.hsz, new.bin compressed, is checked by the server tests.
+
+The *.hsz files are compressed images (ota_https_server/src/heatshrink.rs)
+written field by field, to decompress to the matching *.bin file. The one of
+before_start.hsz refers to data before the start of the stream.
+"""
+
+import os
+import random
+import struct
+
+import firmware
+
+FIXTURES = os.path.join(os.path.dirname(os.path.abspath(__file__)), "fixtures")
+
+
+class Stream:
+    """Heatshrink stream, fields most significant bit first"""
+
+    def __init__(self, window_bits=12, lookahead_bits=6):
+        self.window_bits = window_bits
+        self.lookahead_bits = lookahead_bits
+        self.bits = []
+        self.data = bytearray()
+
+    def push(self, value, count):
+        self.bits += [(value >> i) & 1 for i in reversed(range(count))]
+
+    def literals(self, data):
+        for byte in data:
+            self.push(1, 1)
+            self.push(byte, 8)
+        self.data += data
+
+    def copy(self, distance, length):
+        """Back-reference, `length` bytes from `distance` bytes back"""
+        self.push(0, 1)
+        self.push(distance - 1, self.window_bits)
+        self.push(length - 1, self.lookahead_bits)
+        for _ in range(length):
+            self.data.append(self.data[-distance] if distance <= len(self.data)
+                             else 0)
+
+    def image(self):
+        """Compressed image header and the stream, padded with zeros"""
+        bits = self.bits + [0] * (-len(self.bits) % 8)
+        stream = bytes(int("".join(map(str, bits[i:i + 8])), 2)
+                       for i in range(0, len(bits), 8))
+        return b"ESPZ" + struct.pack("<BBBBI", 1, self.window_bits,
+                                     self.lookahead_bits, 0,
+                                     len(self.data)) + stream
+
+
+def streams():
+    rng = random.Random(3)
+
+    # Back-references reading the bytes they write
+    overlap = Stream()
+    overlap.literals(b"ab")
+    overlap.copy(2, 64)
+    overlap.literals(b"x")
+    overlap.copy(1, 10)
+
+    # Back-references across the end of the 4096 bytes window, and reaching
+    # back as far as the window goes
+    wrap = Stream()
+    wrap.literals(rng.randbytes(4090))
+    wrap.copy(100, 64)
+    wrap.copy(4096, 64)
+    wrap.literals(rng.randbytes(4000))
+    wrap.copy(4096, 3)
+    wrap.copy(1, 64)
+    wrap.copy(3000, 33)
+
+    before_start = Stream()
+    before_start.literals(b"abc")
+    before_start.copy(4, 1)
+
+    return {"overlap": overlap, "wrap": wrap, "before_start": before_start}
+
+
+def main():
+    old = firmware.image("1.0", 20000, seed=1)
+    rng = random.Random(2)
+    new = bytearray(old)
+    # Version, then the relocated addresses of a moved function
+    new[48:80] = b"1.1".ljust(32, b"\0")
+    for offset in range(12000, 12400, 4):
+        address, = struct.unpack_from("<I", new, offset)
+        struct.pack_into("<I", new, offset, (address + 0x40) & 0xFFFFFFFF)
+    new[15000:15500] = b""
+    new[8000:8000] = rng.randbytes(300)
+
+    files = {"old.bin": old, "new.bin": bytes(new)}
+    for name, stream in streams().items():
+        files[name + ".hsz"] = stream.image()
+        if name != "before_start":
+            files[name + ".bin"] = bytes(stream.data)
+
+    for name, data in files.items():
+        with open(os.path.join(FIXTURES, name), "wb") as file:
+            file.write(data)
+
+
+if __name__ == "__main__":
+    main()
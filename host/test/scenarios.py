@@ -0,0 +1,302 @@
+"""Failure scenarios of the host build, run by CTest (see CMakeLists.txt).
+
+Every scenario installs a fixture image as the running firmware of a fresh
+simulated device, serves a newer one and runs ota_host against it with --json,
+checking the result of every update check and where the downloads resumed.
+
+    python3 scenarios.py OTA_HOST SCENARIO [--resume] [--blocks] [--signed]
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+import firmware
+
+# Offsets of the failures, none of them on a checkpoint
+IMAGE_SIZE = 300000
+FAIL_AT = 150000
+POWER_CUT_AT = 200000
+# CONFIG_OTA_RESUME_CHECKPOINT_INTERVAL of include/sdkconfig.h, in bytes
+CHECKPOINT_INTERVAL = 64 * 1024
+# Checkpoints saved after a failure are at the start of a flash sector
+SECTOR_SIZE = 4096
+# Update windows of the low-power scenarios, on the simulated clock of ota_host
+WINDOW_PERIOD_MS = 600000
+RETRY_DELAY_MS = 60000
+POLL_INTERVAL_MS = 3600000
+# Real time the simulated device may take on its own in a window or to wake up
+WINDOW_SLACK_US = 1000000
+
+
+class Device:
+    """Simulated device running old.bin, checking for new.bin on `server`"""
+
+    def __init__(self, args, dir, server, name="state"):
+        self.args = args
+        self.state_dir = os.path.join(dir, name)
+        os.mkdir(self.state_dir)
+        self.options = [
+            "--json", "--quiet",
+            "--manifest-url", server.url("manifest/new.bin"),
+            "--image-url", server.url("new.bin"),
+            "--install", os.path.join(server.dir, "old.bin"),
+        ]
+        if server.signer is not None:
+            self.options += ["--signing-key", server.signer.public_key]
+        self.server = server
+
+    def run(self, *options, status=None):
+        """Run ota_host, returns the result of every update check"""
+        process = subprocess.run([self.args.ota_host, *self.options, *options,
+                                  self.state_dir], capture_output=True,
+                                 text=True, timeout=60)
+        sys.stderr.write(process.stderr)
+        expected = (0, 1) if status is None else (status,)
+        check(process.returncode in expected,
+              "ota_host exited with {}".format(process.returncode))
+        # The simulated flash keeps the running firmware: only the first run
+        # installs it
+        if "--install" in self.options:
+            i = self.options.index("--install")
+            del self.options[i:i + 2]
+        return [json.loads(line) for line in process.stdout.splitlines()]
+
+
+def check(condition, message):
+    if not condition:
+        raise AssertionError(message)
+
+
+def check_result(report, result, failure="none"):
+    check(report["result"] == result and report["failure"] == failure,
+          "attempt {}: expected {} ({}), got {} ({})".format(
+              report["attempt"], result, failure, report["result"],
+              report["failure"]))
+
+
+def check_resumed(args, report, at, interval):
+    """The download of `report` resumed from the last checkpoint before `at`,
+    saved every `interval` bytes, or started over without OTA_RESUME"""
+    offset = report["resume_offset"]
+    if not args.resume:
+        check(offset == 0, "resumed at {} without OTA_RESUME".format(offset))
+        return
+    check(offset > at - interval - SECTOR_SIZE and offset <= at,
+          "resumed at {}, the failure was at {}".format(offset, at))
+    check(offset % SECTOR_SIZE == 0,
+          "resumed at {}, not a sector boundary".format(offset))
+    check(report["bytes"] == IMAGE_SIZE - offset,
+          "downloaded {} bytes resuming at {}".format(report["bytes"], offset))
+
+
+def check_updated(report):
+    check_result(report, "updated")
+    check(report["image_len"] == IMAGE_SIZE,
+          "wrote {} bytes".format(report["image_len"]))
+
+
+def update(args, device):
+    [report] = device.run()
+    check_updated(report)
+    check(report["resume_offset"] == 0 and report["bytes"] == IMAGE_SIZE,
+          "downloaded {} bytes from {}".format(report["bytes"],
+                                               report["resume_offset"]))
+
+
+def net_fail(args, device):
+    first, second = device.run("--net-fail-at", str(FAIL_AT), "--attempts",
+                               "2")
+    check_result(first, "failed", "network")
+    check_updated(second)
+    check_resumed(args, second, FAIL_AT, SECTOR_SIZE)
+
+
+def flash_fail(args, device):
+    first, second = device.run("--flash-fail-at", str(FAIL_AT), "--attempts",
+                               "2")
+    check_result(first, "failed", "device")
+    check_updated(second)
+    if args.blocks:
+        # The blocks written before the failure match the block list
+        check_resumed(args, second, FAIL_AT, SECTOR_SIZE)
+        return
+    # What the failed write left in flash is unknown: the download starts over
+    check(second["resume_offset"] == 0 and second["bytes"] == IMAGE_SIZE,
+          "resumed at {} after a flash failure".format(
+              second["resume_offset"]))
+
+
+def corrupt(args, device):
+    reports = device.run("--corrupt-at", str(FAIL_AT), "--attempts", "2")
+    if not args.blocks:
+        # Only found once the image is complete, which is downloaded again
+        first, second = reports
+        check_result(first, "failed", "rejected")
+        check_updated(second)
+        check(second["resume_offset"] == 0 and second["bytes"] == IMAGE_SIZE,
+              "resumed at {} a corrupted image".format(
+                  second["resume_offset"]))
+        return
+
+    # The corrupted block is downloaded again by the same update check
+    [report] = reports
+    check_updated(report)
+    check(report["bad_blocks"] == 1,
+          "{} corrupted blocks".format(report["bad_blocks"]))
+    # The manifest and the block list came first
+    requests = device.server.requests
+    first_image = requests.index(("/new.bin", IMAGE_SIZE))
+    corrupted = FAIL_AT - sum(len for _, len in requests[:first_image])
+    block = corrupted // SECTOR_SIZE * SECTOR_SIZE
+    check(report["resume_offset"] == block,
+          "resumed at {}, byte {} of the image was corrupted".format(
+              report["resume_offset"], corrupted))
+    check(requests[first_image + 1:] == [("/new.bin", IMAGE_SIZE - block)],
+          "downloaded {} again".format(requests[first_image + 1:]))
+
+
+def power_cut(args, device):
+    # ota_host exits as the power goes, before reporting anything
+    check(device.run("--power-cut-at", str(POWER_CUT_AT), status=3) == [],
+          "reported an update check cut short")
+    [report] = device.run()
+    check_updated(report)
+    check_resumed(args, report, POWER_CUT_AT, CHECKPOINT_INTERVAL)
+
+
+def check_windows(records, retry_delay_ms):
+    """The update checks and given up windows of `records`, the JSON reports
+    of ota_host --sleep in order, each ended with a sleep until a window of
+    the device but an update, installed in its window, and the radio and
+    sleep totals add up"""
+    offset = records[0]["window_offset_ms"]
+    check(0 <= offset < WINDOW_PERIOD_MS, "window offset {}".format(offset))
+    previous = None
+    for record in records:
+        name = "window {}".format(record["windows"])
+        check(record["window_offset_ms"] == offset,
+              "{}: offset changed to {}".format(name,
+                                                record["window_offset_ms"]))
+        radio_us = record["radio_us"]
+        asleep_us = record["asleep_us"]
+        if previous is not None:
+            check(record["windows"] == previous["windows"] + 1,
+                  "{} after window {}".format(name, previous["windows"]))
+            radio_us -= previous["radio_us"]
+            asleep_us -= previous["asleep_us"]
+            slept_us = previous["window_ms"] * 1000
+            check(slept_us <= asleep_us <= slept_us + WINDOW_SLACK_US,
+                  "{}: asleep {} us, the wait was {} us".format(
+                      name, asleep_us, slept_us))
+
+        if record["result"] == "updated":
+            check(record is records[-1],
+                  "{}: checked again after an update".format(name))
+            break
+        # The radio was on during the check, or while the AP was not reached
+        spent_us = record.get("wall_us", 0)
+        check(spent_us <= radio_us <= spent_us + WINDOW_SLACK_US,
+              "{}: radio on {} us for a {} us check".format(name, radio_us,
+                                                           spent_us))
+        # The next window is the first one of the device from the time the
+        # next check is due
+        check((record["next_window_ms"] - offset) % WINDOW_PERIOD_MS == 0,
+              "{}: next window at {}, not aligned".format(
+                  name, record["next_window_ms"]))
+        due_ms = (retry_delay_ms if record["result"] == "missed"
+                  else record["next_check_ms"])
+        check(due_ms <= record["window_ms"] <= due_ms + WINDOW_PERIOD_MS,
+              "{}: next window in {} ms, the check is due in {} ms".format(
+                  name, record["window_ms"], due_ms))
+        previous = record
+
+    missed = sum(record["result"] == "missed" for record in records)
+    check(records[-1]["missed_windows"] == missed,
+          "{} windows missed, {} reported".format(
+              records[-1]["missed_windows"], missed))
+
+
+def sleep_light(args, device):
+    # The device runs the image served: every check finds it up to date, and
+    # the second window does not reach the AP
+    options = ["--sleep", "light", "--window-period", str(WINDOW_PERIOD_MS),
+               "--poll", "--poll-interval", str(POLL_INTERVAL_MS),
+               "--retry-delay", str(RETRY_DELAY_MS), "--miss-window", "2"]
+    records = device.run("--manifest-url",
+                         device.server.url("manifest/old.bin"), "--attempts",
+                         "3", *options)
+    check([record["result"] for record in records] ==
+          ["up-to-date", "missed", "up-to-date", "up-to-date"],
+          "results {}".format([record["result"] for record in records]))
+    check(all(record["sleep"] == "light" for record in records),
+          "slept {}".format([record["sleep"] for record in records]))
+    check_windows(records, RETRY_DELAY_MS)
+
+    # Another device opens its windows at its own offset
+    other = Device(args, os.path.dirname(device.state_dir), device.server,
+                   "other")
+    [record] = other.run("--manifest-url",
+                         device.server.url("manifest/old.bin"), *options)
+    check(record["window_offset_ms"] != records[0]["window_offset_ms"],
+          "two devices at the offset {}".format(record["window_offset_ms"]))
+
+
+def sleep_deep(args, device):
+    # The device restarts at every window: the download broken in the first
+    # one goes on from its checkpoint two windows later
+    records = device.run("--net-fail-at", str(FAIL_AT), "--attempts", "2",
+                         "--sleep", "deep", "--window-period",
+                         str(WINDOW_PERIOD_MS), "--retry-delay",
+                         str(RETRY_DELAY_MS), "--miss-window", "2")
+    check([record["result"] for record in records[:2]] == ["failed", "missed"],
+          "results {}".format([record["result"] for record in records]))
+    check_result(records[0], "failed", "network")
+    # The window state kept in RTC memory is reloaded by every restart
+    check_windows(records, RETRY_DELAY_MS)
+    check(all(record["sleep"] == "deep" for record in records[:2]),
+          "slept {}".format([record["sleep"] for record in records]))
+    check_updated(records[2])
+    check_resumed(args, records[2], FAIL_AT, SECTOR_SIZE)
+
+
+SCENARIOS = {
+    "update": update,
+    "net_fail": net_fail,
+    "flash_fail": flash_fail,
+    "power_cut": power_cut,
+    "corrupt": corrupt,
+    "sleep_light": sleep_light,
+    "sleep_deep": sleep_deep,
+}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("ota_host")
+    parser.add_argument("scenario", choices=SCENARIOS)
+    parser.add_argument("--resume", action="store_true",
+                        help="ota_host is built with OTA_RESUME")
+    parser.add_argument("--blocks", action="store_true",
+                        help="ota_host is built with OTA_BLOCKS")
+    parser.add_argument("--signed", action="store_true",
+                        help="ota_host is built with OTA_VERIFY_SIGNATURE")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as dir:
+        images = os.path.join(dir, "images")
+        os.mkdir(images)
+        for name, version, seed in (("old.bin", "1.0", 1),
+                                    ("new.bin", "2.0", 2)):
+            with open(os.path.join(images, name), "wb") as file:
+                file.write(firmware.image(version, IMAGE_SIZE, seed=seed))
+        signer = firmware.Signer(dir) if args.signed else None
+        with firmware.Server(images, signer) as server:
+            SCENARIOS[args.scenario](args, Device(args, dir, server))
+
+
+if __name__ == "__main__":
+    main()
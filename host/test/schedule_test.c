@@ -0,0 +1,165 @@
+// Unit tests of the update check scheduler (main/schedule.c), with a seeded
+// random source so that every run draws the same delays.
+//
+//   schedule_test
+
+#include "schedule.h"
+#include "test_util.h"
+
+#define POLL_INTERVAL_MS 3600000
+#define RETRY_MIN_MS 10000
+#define RETRY_MAX_MS 600000
+#define DRAWS 1000
+
+static uint64_t random_state;
+
+// xorshift64*, seeded by seed_random()
+static uint32_t test_random(void) {
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return (uint32_t)((random_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static void seed_random(void) { random_state = 0x5eed0f0a; }
+
+static const schedule_config_t config = {
+    .poll_interval_ms = POLL_INTERVAL_MS,
+    .retry_min_ms = RETRY_MIN_MS,
+    .retry_max_ms = RETRY_MAX_MS,
+    .random = test_random,
+};
+
+// Decorrelated jitter: from the first retry delay to three times the last
+// one, never past the longest
+static void test_backoff(void) {
+  seed_random();
+  schedule_t schedule = {0};
+  uint32_t longest_ms = 0;
+  for (uint32_t i = 1; i <= DRAWS; ++i) {
+    uint32_t last_ms =
+        schedule.backoff_ms > RETRY_MIN_MS ? schedule.backoff_ms : RETRY_MIN_MS;
+    uint32_t max_ms = last_ms * 3 < RETRY_MAX_MS ? last_ms * 3 : RETRY_MAX_MS;
+    uint32_t delay_ms = schedule_next(&schedule, &config, SCHEDULE_RETRY, 0);
+    CHECK(delay_ms >= RETRY_MIN_MS && delay_ms <= max_ms);
+    CHECK(schedule.backoff_ms == delay_ms);
+    CHECK(schedule.failures == i);
+    if (delay_ms > longest_ms) {
+      longest_ms = delay_ms;
+    }
+  }
+  // Reaches the cap
+  CHECK(longest_ms > RETRY_MAX_MS - RETRY_MAX_MS / 10);
+}
+
+// A success forgets the failures: the next one backs off from the start again
+static void test_reset(void) {
+  seed_random();
+  schedule_t schedule = {0};
+  for (int i = 0; i < 20; ++i) {
+    schedule_next(&schedule, &config, SCHEDULE_RETRY, 0);
+  }
+  CHECK(schedule.backoff_ms > RETRY_MIN_MS * 3);
+
+  uint32_t delay_ms = schedule_next(&schedule, &config, SCHEDULE_OK, 0);
+  CHECK(delay_ms >= POLL_INTERVAL_MS - POLL_INTERVAL_MS / 4 &&
+        delay_ms <= POLL_INTERVAL_MS + POLL_INTERVAL_MS / 4);
+  CHECK(schedule.backoff_ms == 0 && schedule.failures == 0);
+
+  delay_ms = schedule_next(&schedule, &config, SCHEDULE_RETRY, 0);
+  CHECK(delay_ms >= RETRY_MIN_MS && delay_ms <= RETRY_MIN_MS * 3);
+  CHECK(schedule.failures == 1);
+}
+
+// The steady interval is spread over +/- 25 %, and a refused update waits as
+// long without backing off
+static void test_spread(schedule_outcome_t outcome) {
+  seed_random();
+  schedule_t schedule = {.backoff_ms = RETRY_MIN_MS};
+  uint32_t low_ms = POLL_INTERVAL_MS - POLL_INTERVAL_MS / 4;
+  uint32_t high_ms = POLL_INTERVAL_MS + POLL_INTERVAL_MS / 4;
+  uint32_t shortest_ms = UINT32_MAX, longest_ms = 0;
+  for (int i = 0; i < DRAWS; ++i) {
+    uint32_t delay_ms = schedule_next(&schedule, &config, outcome, 0);
+    CHECK(delay_ms >= low_ms && delay_ms <= high_ms);
+    if (delay_ms < shortest_ms) {
+      shortest_ms = delay_ms;
+    }
+    if (delay_ms > longest_ms) {
+      longest_ms = delay_ms;
+    }
+  }
+  // Over the whole range
+  CHECK(shortest_ms < low_ms + POLL_INTERVAL_MS / 20);
+  CHECK(longest_ms > high_ms - POLL_INTERVAL_MS / 20);
+  if (outcome == SCHEDULE_REJECTED) {
+    CHECK(schedule.backoff_ms == RETRY_MIN_MS && schedule.failures == DRAWS);
+  } else {
+    CHECK(schedule.backoff_ms == 0 && schedule.failures == 0);
+  }
+}
+
+// Retry-After or max-age replace the computed delay, with up to half of it
+// added, but failures keep backing off behind it
+static void test_hints(void) {
+  static const uint32_t hints_ms[] = {1000, 120000, 7200000};
+  seed_random();
+  for (size_t i = 0; i < sizeof(hints_ms) / sizeof(hints_ms[0]); ++i) {
+    uint32_t hint_ms = hints_ms[i];
+    schedule_t schedule = {0};
+    uint32_t longest_ms = 0;
+    for (int j = 0; j < DRAWS; ++j) {
+      uint32_t delay_ms = schedule_next(&schedule, &config, SCHEDULE_OK,
+                                        hint_ms);
+      CHECK(delay_ms >= hint_ms && delay_ms <= hint_ms + hint_ms / 2);
+      if (delay_ms > longest_ms) {
+        longest_ms = delay_ms;
+      }
+
+      delay_ms = schedule_next(&schedule, &config, SCHEDULE_RETRY, hint_ms);
+      CHECK(delay_ms >= hint_ms && delay_ms <= hint_ms + hint_ms / 2);
+      CHECK(schedule.backoff_ms >= RETRY_MIN_MS &&
+            schedule.backoff_ms <= RETRY_MIN_MS * 3);
+      CHECK(schedule.failures == 1);
+    }
+    // Devices told the same delay still drift apart
+    CHECK(longest_ms > hint_ms + hint_ms / 2 - hint_ms / 20);
+  }
+}
+
+// The first check after a restart is spread over the last backoff, or over
+// the first retry delay after a success
+static void test_first(void) {
+  static const schedule_t schedules[] = {
+      {.backoff_ms = 0, .failures = 0},
+      {.backoff_ms = 300000, .failures = 5},
+  };
+  seed_random();
+  for (size_t i = 0; i < sizeof(schedules) / sizeof(schedules[0]); ++i) {
+    uint32_t window_ms =
+        schedules[i].backoff_ms > 0 ? schedules[i].backoff_ms : RETRY_MIN_MS;
+    uint32_t shortest_ms = UINT32_MAX, longest_ms = 0;
+    for (int j = 0; j < DRAWS; ++j) {
+      uint32_t delay_ms = schedule_first(&schedules[i], &config);
+      CHECK(delay_ms <= window_ms);
+      if (delay_ms < shortest_ms) {
+        shortest_ms = delay_ms;
+      }
+      if (delay_ms > longest_ms) {
+        longest_ms = delay_ms;
+      }
+    }
+    CHECK(shortest_ms < window_ms / 20);
+    CHECK(longest_ms > window_ms - window_ms / 20);
+  }
+}
+
+int main(void) {
+  test_backoff();
+  test_reset();
+  test_spread(SCHEDULE_OK);
+  test_spread(SCHEDULE_REJECTED);
+  test_hints();
+  test_first();
+  return test_result();
+}
@@ -0,0 +1,92 @@
+#include "test_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures;
+
+void test_check(int passed, const char *condition, const char *file,
+                int line) {
+  if (!passed) {
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, condition);
+    failures++;
+  }
+}
+
+void test_check_err(esp_err_t err, esp_err_t expected, const char *file,
+                    int line) {
+  if (err != expected) {
+    fprintf(stderr, "%s:%d: got %s, expected %s\n", file, line,
+            esp_err_to_name(err), esp_err_to_name(expected));
+    failures++;
+  }
+}
+
+int test_result(void) {
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
+
+uint8_t *test_read_fixture(const char *dir, const char *name, size_t *len) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+  FILE *file = fopen(path, "rb");
+  uint8_t *data = NULL;
+  long size = -1;
+  if (file != NULL && fseek(file, 0, SEEK_END) == 0 &&
+      (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+    data = malloc(size > 0 ? size : 1);
+  }
+  if (data == NULL || fread(data, 1, size, file) != (size_t)size) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    exit(1);
+  }
+  fclose(file);
+  *len = size;
+  return data;
+}
+
+void test_buffer_append(test_buffer_t *buffer, const void *data, size_t len) {
+  if (buffer->len + len > buffer->capacity) {
+    buffer->capacity = (buffer->len + len) * 2;
+    buffer->data = realloc(buffer->data, buffer->capacity);
+    if (buffer->data == NULL) {
+      abort();
+    }
+  }
+  memcpy(&buffer->data[buffer->len], data, len);
+  buffer->len += len;
+}
+
+void test_buffer_free(test_buffer_t *buffer) {
+  free(buffer->data);
+  memset(buffer, 0, sizeof(*buffer));
+}
+
+void test_bits_push(test_bits_t *bits, uint32_t value, uint8_t count) {
+  while (count-- > 0) {
+    bits->current = (bits->current << 1) | ((value >> count) & 1);
+    if (++bits->count == 8) {
+      test_buffer_append(&bits->out, &bits->current, 1);
+      bits->current = 0;
+      bits->count = 0;
+    }
+  }
+}
+
+void test_bits_literals(test_bits_t *bits, const void *data, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    test_bits_push(bits, 1, 1);
+    test_bits_push(bits, ((const uint8_t *)data)[i], 8);
+  }
+}
+
+void test_bits_finish(test_bits_t *bits) {
+  if (bits->count > 0) {
+    test_bits_push(bits, 0, 8 - bits->count);
+  }
+}
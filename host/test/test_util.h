@@ -0,0 +1,52 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+// Helpers of the unit tests of the device code, see CMakeLists.txt
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Count a failed check, printing where it failed
+#define CHECK(condition)                                                       \
+  test_check((condition), #condition, __FILE__, __LINE__)
+
+// Check that `err` is `expected`
+#define CHECK_ERR(err, expected)                                               \
+  test_check_err((err), (expected), __FILE__, __LINE__)
+
+void test_check(int passed, const char *condition, const char *file,
+                int line);
+void test_check_err(esp_err_t err, esp_err_t expected, const char *file,
+                    int line);
+
+// Exit status of the test program: 0 if every check passed
+int test_result(void);
+
+// Read a whole fixture file of `dir`, exits if it cannot be read
+uint8_t *test_read_fixture(const char *dir, const char *name, size_t *len);
+
+// Growing buffer, for the output of the decoders
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t capacity;
+} test_buffer_t;
+
+void test_buffer_append(test_buffer_t *buffer, const void *data, size_t len);
+void test_buffer_free(test_buffer_t *buffer);
+
+// Writer of heatshrink streams, bits most significant first
+typedef struct {
+  test_buffer_t out;
+  uint8_t current;
+  uint8_t count;
+} test_bits_t;
+
+void test_bits_push(test_bits_t *bits, uint32_t value, uint8_t count);
+// Every byte of `data` as a literal
+void test_bits_literals(test_bits_t *bits, const void *data, size_t len);
+// Pad the last byte with zeros
+void test_bits_finish(test_bits_t *bits);
+
+#endif
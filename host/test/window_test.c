@@ -0,0 +1,156 @@
+// Unit tests of the low-power update windows (main/window.c), on a clock of
+// their own.
+//
+//   window_test
+
+#include "test_util.h"
+#include "window.h"
+#include <string.h>
+
+#define PERIOD_MS 600000
+#define MIN_SLEEP_MS 30000
+#define OFFSET_MS 123456
+
+static uint32_t random_value;
+
+static uint32_t test_random(void) { return random_value; }
+
+static const window_config_t config = {
+    .sleep = WINDOW_DEEP_SLEEP,
+    .period_ms = PERIOD_MS,
+    .connect_ms = 10000,
+    .min_sleep_ms = MIN_SLEEP_MS,
+    .random = test_random,
+};
+
+static int64_t ms(int64_t value) { return value * 1000; }
+
+// A fresh device at OFFSET_MS, its first window opened at `now_us`
+static void start(window_state_t *state, int64_t now_us) {
+  memset(state, 0xa5, sizeof(*state));
+  random_value = PERIOD_MS * 3 + OFFSET_MS;
+  CHECK(!window_init(state, &config));
+  CHECK(state->offset_ms == OFFSET_MS);
+  CHECK(state->windows == 0 && state->missed == 0);
+  CHECK(state->radio_us == 0 && state->asleep_us == 0);
+  window_open(state, now_us);
+}
+
+// The state kept across a deep sleep is reused as long as it fits the
+// configuration, the device woke up for a window
+static void test_init(void) {
+  window_state_t state;
+  start(&state, 0);
+  window_sleep_t sleep;
+  window_plan(&state, &config, ms(1000), PERIOD_MS, true, &sleep);
+
+  window_state_t kept = state;
+  random_value = 0;
+  CHECK(window_init(&state, &config));
+  CHECK(memcmp(&state, &kept, sizeof(state)) == 0);
+
+  // Its offset does not fit a shorter period
+  window_config_t shorter = config;
+  shorter.period_ms = OFFSET_MS;
+  CHECK(!window_init(&state, &shorter));
+  CHECK(state.offset_ms == 0 && state.windows == 0 && !state.asleep);
+
+  // Any offset fits checks without a period
+  window_config_t no_period = config;
+  no_period.period_ms = 0;
+  state = kept;
+  CHECK(window_init(&state, &no_period));
+  CHECK(state.offset_ms == OFFSET_MS);
+}
+
+// Checks run in the first window of the device from their due time
+static void test_alignment(void) {
+  static const struct {
+    int64_t now_ms;
+    uint32_t delay_ms;
+    int64_t window_ms;
+  } cases[] = {
+      // Due before the first window
+      {0, 60000, OFFSET_MS},
+      // Due right at a window
+      {0, OFFSET_MS, OFFSET_MS},
+      {1000, OFFSET_MS - 1000 + PERIOD_MS, OFFSET_MS + PERIOD_MS},
+      // Due just after one
+      {0, OFFSET_MS + 1, OFFSET_MS + PERIOD_MS},
+      {5 * PERIOD_MS, 3600000, 11 * PERIOD_MS + OFFSET_MS},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+    window_state_t state;
+    start(&state, ms(cases[i].now_ms));
+    window_sleep_t sleep = WINDOW_STAY_AWAKE;
+    uint32_t wait_ms = window_plan(&state, &config, ms(cases[i].now_ms),
+                                   cases[i].delay_ms, true, &sleep);
+    CHECK(sleep == WINDOW_DEEP_SLEEP);
+    CHECK(state.next_us == ms(cases[i].window_ms));
+    CHECK(wait_ms == cases[i].window_ms - cases[i].now_ms);
+  }
+
+  // Without a period, whenever the check is due
+  window_config_t no_period = config;
+  no_period.period_ms = 0;
+  window_state_t state;
+  start(&state, 0);
+  window_sleep_t sleep;
+  CHECK(window_plan(&state, &no_period, ms(1000), 45000, true, &sleep) ==
+        45000);
+  CHECK(state.next_us == ms(46000));
+}
+
+// A retry due soon stays in the window, unless the AP was not reached
+static void test_stay_awake(void) {
+  window_state_t state;
+  start(&state, 0);
+  window_sleep_t sleep;
+  CHECK(window_plan(&state, &config, ms(2000), MIN_SLEEP_MS - 1, true,
+                    &sleep) == MIN_SLEEP_MS - 1);
+  CHECK(sleep == WINDOW_STAY_AWAKE);
+  CHECK(state.radio_on && !state.asleep && state.radio_us == 0);
+
+  CHECK(window_plan(&state, &config, ms(2000), MIN_SLEEP_MS - 1, false,
+                    &sleep) == OFFSET_MS - 2000);
+  CHECK(sleep == WINDOW_DEEP_SLEEP);
+  CHECK(!state.radio_on && state.asleep && state.missed == 1);
+}
+
+// The radio and sleep times add up over windows, given up ones included
+static void test_totals(void) {
+  window_state_t state;
+  start(&state, ms(100));
+  window_sleep_t sleep;
+  uint32_t wait_ms = window_plan(&state, &config, ms(2100), 60000, true,
+                                 &sleep);
+  CHECK(state.radio_us == ms(2000) && state.asleep_us == 0);
+
+  // Not reached in the second window
+  int64_t now_us = ms(2100) + ms(wait_ms);
+  window_open(&state, now_us);
+  CHECK(state.asleep_us == ms(wait_ms) && state.windows == 2);
+  // Opening twice counts once
+  window_open(&state, now_us + ms(500));
+  CHECK(state.windows == 2);
+  wait_ms = window_plan(&state, &config, now_us + ms(10000), 60000, false,
+                        &sleep);
+  CHECK(state.radio_us == ms(12000) && state.missed == 1);
+  CHECK(state.next_us == ms(OFFSET_MS + PERIOD_MS));
+
+  window_open(&state, state.next_us);
+  window_plan(&state, &config, state.next_us + ms(3000), 60000, true, &sleep);
+  CHECK(state.windows == 3 && state.missed == 1);
+  CHECK(state.radio_us == ms(15000));
+  // Until the third window, the radio was on for 12 s and the device asleep
+  // the rest of the time
+  CHECK(state.asleep_us == ms(OFFSET_MS + PERIOD_MS - 100 - 12000));
+}
+
+int main(void) {
+  test_init();
+  test_alignment();
+  test_stay_awake();
+  test_totals();
+  return test_result();
+}
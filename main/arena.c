@@ -0,0 +1,86 @@
+#include "arena.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+#include <stdatomic.h>
+#include <string.h>
+#ifdef CONFIG_OTA_ARENA
+#include "multi_heap.h"
+#endif
+
+// Same capabilities as the default mbedTLS allocator
+#define HEAP_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+
+#ifdef CONFIG_OTA_ARENA
+static uint8_t memory[CONFIG_OTA_ARENA_SIZE * 1024] __attribute__((aligned(8)));
+static multi_heap_handle_t heap = NULL;
+// The Wi-Fi and update tasks both use mbedTLS
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+static atomic_uint fallbacks;
+
+void arena_init(void) {
+#ifdef CONFIG_OTA_ARENA
+  if (heap == NULL) {
+    heap = multi_heap_register(memory, sizeof(memory));
+    multi_heap_set_lock(heap, &lock);
+  }
+#endif
+}
+
+void *arena_malloc(size_t size) {
+#ifdef CONFIG_OTA_ARENA
+  if (heap != NULL) {
+    void *ptr = multi_heap_malloc(heap, size);
+    if (ptr != NULL) {
+      return ptr;
+    }
+    atomic_fetch_add(&fallbacks, 1);
+  }
+#endif
+  return heap_caps_malloc(size, HEAP_CAPS);
+}
+
+void *arena_calloc(size_t count, size_t size) {
+  size_t len;
+  if (__builtin_mul_overflow(count, size, &len)) {
+    return NULL;
+  }
+  void *ptr = arena_malloc(len);
+  if (ptr != NULL) {
+    memset(ptr, 0, len);
+  }
+  return ptr;
+}
+
+void arena_free(void *ptr) {
+#ifdef CONFIG_OTA_ARENA
+  if ((uint8_t *)ptr >= memory && (uint8_t *)ptr < memory + sizeof(memory)) {
+    multi_heap_free(heap, ptr);
+    return;
+  }
+#endif
+  heap_caps_free(ptr);
+}
+
+void arena_get_stats(arena_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->fallbacks = atomic_load(&fallbacks);
+#ifdef CONFIG_OTA_ARENA
+  if (heap != NULL) {
+    stats->size = sizeof(memory);
+    stats->used = sizeof(memory) - multi_heap_free_size(heap);
+    stats->peak = sizeof(memory) - multi_heap_minimum_free_size(heap);
+  }
+#endif
+}
+
+#ifdef CONFIG_MBEDTLS_CUSTOM_MEM_ALLOC
+// mbedTLS allocates through these with CONFIG_MBEDTLS_CUSTOM_MEM_ALLOC
+void *esp_mbedtls_mem_calloc(size_t count, size_t size) {
+  return arena_calloc(count, size);
+}
+
+void esp_mbedtls_mem_free(void *ptr) { arena_free(ptr); }
+#endif
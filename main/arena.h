@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory region reserved at build time (CONFIG_OTA_ARENA_SIZE KB) for the
+// allocations of the update client: mbedTLS (with
+// CONFIG_MBEDTLS_CUSTOM_MEM_ALLOC) and the cJSON manifests. The TLS buffers
+// come and go with every connection; from a region of their own they cannot
+// fragment the heap the application shares, however long the device polls.
+// Allocations that do not fit, or all of them without CONFIG_OTA_ARENA, go to
+// the heap.
+
+typedef struct {
+  size_t size;        // Bytes reserved, 0 without CONFIG_OTA_ARENA
+  size_t used;        // Bytes allocated now, block headers included
+  size_t peak;        // Most bytes allocated at once since the start
+  uint32_t fallbacks; // Allocations that did not fit and went to the heap
+} arena_stats_t;
+
+// Set up the region, before anything allocates from it
+void arena_init(void);
+
+void *arena_malloc(size_t size);
+void *arena_calloc(size_t count, size_t size);
+// Free memory from arena_malloc() or arena_calloc(), wherever it came from
+void arena_free(void *ptr);
+
+void arena_get_stats(arena_stats_t *stats);
+
+#endif
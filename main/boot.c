@@ -0,0 +1,71 @@
+#include "boot.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/event_groups.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+
+static const char *BOOT_TAG = "BOOT";
+
+static const char *const PHASE_NAMES[BOOT_PHASE_COUNT] = {
+    [BOOT_STORAGE] = "storage",   [BOOT_APPLICATION] = "application",
+    [BOOT_DIGESTS] = "digests",   [BOOT_WIFI] = "wifi",
+    [BOOT_VALIDATED] = "validated",
+};
+
+static EventGroupHandle_t phases_done = NULL;
+static int64_t start_us;
+static _Atomic int64_t done_us[BOOT_PHASE_COUNT];
+static atomic_flag ready_logged = ATOMIC_FLAG_INIT;
+
+void boot_init(void) {
+  start_us = esp_timer_get_time();
+  phases_done = xEventGroupCreate();
+  // esp_timer starts with the application, the bootloader is not counted
+  ESP_LOGI(BOOT_TAG, "app_main() entered at %" PRId64 " ms", start_us / 1000);
+}
+
+void boot_done(boot_phase_t phase) {
+  int64_t now = esp_timer_get_time();
+  int64_t not_done = 0;
+  if (!atomic_compare_exchange_strong(&done_us[phase], &not_done, now)) {
+    return;
+  }
+  ESP_LOGI(BOOT_TAG, "%s done at %" PRId64 " ms", PHASE_NAMES[phase],
+           now / 1000);
+
+  EventBits_t bits = xEventGroupSetBits(phases_done, BOOT_PHASE_BIT(phase));
+  if ((bits & BOOT_READY) == BOOT_READY &&
+      !atomic_flag_test_and_set(&ready_logged)) {
+    ESP_LOGI(BOOT_TAG,
+             "Ready in %" PRId64 " ms (application %" PRId64
+             " ms, wifi %" PRId64 " ms, validated %" PRId64 " ms)",
+             boot_ready_us() / 1000,
+             (done_us[BOOT_APPLICATION] - start_us) / 1000,
+             (done_us[BOOT_WIFI] - start_us) / 1000,
+             (done_us[BOOT_VALIDATED] - start_us) / 1000);
+  }
+}
+
+bool boot_wait(uint32_t phases, TickType_t timeout) {
+  EventBits_t bits =
+      xEventGroupWaitBits(phases_done, phases, pdFALSE, pdTRUE, timeout);
+  return (bits & phases) == phases;
+}
+
+int64_t boot_time_us(boot_phase_t phase) { return done_us[phase]; }
+
+int64_t boot_start_us(void) { return start_us; }
+
+int64_t boot_ready_us(void) {
+  int64_t ready = 0;
+  for (int phase = 0; phase < BOOT_PHASE_COUNT; ++phase) {
+    if (BOOT_PHASE_BIT(phase) & BOOT_READY) {
+      if (done_us[phase] == 0) {
+        return 0;
+      }
+      ready = done_us[phase] > ready ? done_us[phase] : ready;
+    }
+  }
+  return ready - start_us;
+}
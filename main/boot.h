@@ -0,0 +1,45 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include "freertos/FreeRTOS.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Phases of the startup. They run at the same time, each task waits only for
+// the phases it depends on.
+typedef enum {
+  BOOT_STORAGE,     // NVS initialized
+  BOOT_APPLICATION, // Application task running
+  BOOT_DIGESTS,     // Boot digests hashed (or loaded) and logged
+  BOOT_WIFI,        // Station associated, with an address
+  BOOT_VALIDATED,   // Running firmware valid, a new one passed its checks
+  BOOT_PHASE_COUNT,
+} boot_phase_t;
+
+#define BOOT_PHASE_BIT(phase) (1u << (phase))
+// The device serves its application and can be updated
+#define BOOT_READY                                                             \
+  (BOOT_PHASE_BIT(BOOT_APPLICATION) | BOOT_PHASE_BIT(BOOT_WIFI) |              \
+   BOOT_PHASE_BIT(BOOT_VALIDATED))
+
+// Start timing the phases, first thing in app_main()
+void boot_init(void);
+
+// Record the end of a phase, and log the time to ready once reached. Only the
+// first call for each phase counts.
+void boot_done(boot_phase_t phase);
+
+// Wait for all the phases of a mask of BOOT_PHASE_BIT()s, at most timeout
+// ticks. Returns true if they are all done.
+bool boot_wait(uint32_t phases, TickType_t timeout);
+
+// Time of the end of a phase since esp_timer started, 0 until it is done
+int64_t boot_time_us(boot_phase_t phase);
+
+// Time app_main() was entered, since esp_timer started
+int64_t boot_start_us(void);
+
+// Time from app_main() to BOOT_READY, 0 until then
+int64_t boot_ready_us(void);
+
+#endif
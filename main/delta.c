@@ -0,0 +1,244 @@
+#include "delta.h"
+#include "esp_log.h"
+#include "mbedtls/sha256.h"
+#include <inttypes.h>
+#include <string.h>
+
+#define DELTA_MAGIC "ESPD"
+#define DELTA_FORMAT_VERSION 1
+
+#define OP_END 0
+#define OP_ADD 1
+#define OP_INSERT 2
+
+static const char *DELTA_TAG = "DELTA";
+
+enum {
+  STATE_OP,         // Record type
+  STATE_OLD_OFFSET, // Old image offset of an ADD record
+  STATE_LENGTH,     // Length of the record data
+  STATE_DATA,       // Record data
+  STATE_END,        // END record found, nothing else is expected
+};
+
+static uint32_t get_u32(const uint8_t *data) {
+  return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+void delta_init(delta_t *delta, const uint8_t target_sha256[32],
+                delta_read_cb_t read_old, delta_write_cb_t write, void *ctx) {
+  memset(delta, 0, sizeof(*delta));
+  memcpy(delta->target_sha256, target_sha256, sizeof(delta->target_sha256));
+  delta->state = STATE_OP;
+  delta->read_old = read_old;
+  delta->write = write;
+  delta->ctx = ctx;
+}
+
+// Check that the old image is the one the patch was made against
+static esp_err_t check_base(delta_t *delta) {
+  mbedtls_sha256_context sha256;
+  uint8_t hash[32];
+  esp_err_t err = ESP_OK;
+
+  mbedtls_sha256_init(&sha256);
+  mbedtls_sha256_starts(&sha256, 0);
+  for (uint32_t offset = 0; offset < delta->header.base_size;
+       offset += DELTA_BUFFSIZE) {
+    size_t len = delta->header.base_size - offset;
+    if (len > DELTA_BUFFSIZE) {
+      len = DELTA_BUFFSIZE;
+    }
+    err = delta->read_old(delta->ctx, offset, delta->buffer, len);
+    if (err != ESP_OK) {
+      break;
+    }
+    mbedtls_sha256_update(&sha256, delta->buffer, len);
+  }
+  mbedtls_sha256_finish(&sha256, hash);
+  mbedtls_sha256_free(&sha256);
+
+  if (err != ESP_OK) {
+    ESP_LOGE(DELTA_TAG, "Failed to read the old image (%s)",
+             esp_err_to_name(err));
+    return err;
+  }
+  if (memcmp(hash, delta->header.base_sha256, sizeof(hash)) != 0) {
+    ESP_LOGE(DELTA_TAG, "Patch was not made against the running firmware");
+    return ESP_ERR_INVALID_VERSION;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t parse_header(delta_t *delta) {
+  const uint8_t *data = delta->header_data;
+
+  if (memcmp(data, DELTA_MAGIC, 4) != 0 || data[4] != DELTA_FORMAT_VERSION) {
+    ESP_LOGE(DELTA_TAG, "Not a patch or unsupported format version");
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+
+  delta->header.base_size = get_u32(&data[8]);
+  delta->header.target_size = get_u32(&data[12]);
+  memcpy(delta->header.base_sha256, &data[16], 32);
+  memcpy(delta->header.target_sha256, &data[48], 32);
+  memcpy(delta->header.base_elf_sha256, &data[80], 32);
+
+  if (memcmp(delta->header.target_sha256, delta->target_sha256, 32) != 0) {
+    ESP_LOGE(DELTA_TAG, "Patch does not rebuild the expected image");
+    return ESP_ERR_INVALID_VERSION;
+  }
+
+  esp_err_t err = check_base(delta);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  ESP_LOGI(DELTA_TAG, "Applying patch from %" PRIu32 " to %" PRIu32 " bytes",
+           delta->header.base_size, delta->header.target_size);
+  return ESP_OK;
+}
+
+// Output the next `len` bytes of record data
+static esp_err_t apply_data(delta_t *delta, const uint8_t *data, size_t len) {
+  if (delta->op == OP_INSERT) {
+    delta->written += len;
+    return delta->write(delta->ctx, data, len);
+  }
+
+  while (len > 0) {
+    size_t chunk = len > DELTA_BUFFSIZE ? DELTA_BUFFSIZE : len;
+    esp_err_t err =
+        delta->read_old(delta->ctx, delta->old_offset, delta->buffer, chunk);
+    if (err != ESP_OK) {
+      return err;
+    }
+    for (size_t i = 0; i < chunk; ++i) {
+      delta->buffer[i] += data[i];
+    }
+    err = delta->write(delta->ctx, delta->buffer, chunk);
+    if (err != ESP_OK) {
+      return err;
+    }
+    delta->old_offset += chunk;
+    delta->written += chunk;
+    data += chunk;
+    len -= chunk;
+  }
+  return ESP_OK;
+}
+
+// Check the bounds of a record once its fields are known
+static esp_err_t start_record(delta_t *delta) {
+  if (delta->remaining > delta->header.target_size - delta->written ||
+      (delta->op == OP_ADD &&
+       (delta->old_offset > delta->header.base_size ||
+        delta->remaining > delta->header.base_size - delta->old_offset))) {
+    ESP_LOGE(DELTA_TAG, "Record out of the image bounds");
+    return ESP_ERR_INVALID_SIZE;
+  }
+  delta->state = STATE_DATA;
+  return ESP_OK;
+}
+
+// Output callback of the decompressor: parse the records
+static esp_err_t apply_records(void *ctx, const void *output, size_t len) {
+  delta_t *delta = ctx;
+  const uint8_t *data = output;
+  esp_err_t err = ESP_OK;
+
+  while (len > 0 && err == ESP_OK) {
+    switch (delta->state) {
+    case STATE_OP:
+      delta->op = *data++;
+      len--;
+      delta->field_len = 0;
+      if (delta->op == OP_END) {
+        delta->state = STATE_END;
+      } else if (delta->op == OP_ADD) {
+        delta->state = STATE_OLD_OFFSET;
+      } else if (delta->op == OP_INSERT) {
+        delta->state = STATE_LENGTH;
+      } else {
+        ESP_LOGE(DELTA_TAG, "Unknown record type %u", delta->op);
+        err = ESP_ERR_INVALID_RESPONSE;
+      }
+      break;
+    case STATE_OLD_OFFSET:
+    case STATE_LENGTH:
+      delta->field[delta->field_len++] = *data++;
+      len--;
+      if (delta->field_len < sizeof(delta->field)) {
+        break;
+      }
+      delta->field_len = 0;
+      if (delta->state == STATE_OLD_OFFSET) {
+        delta->old_offset = get_u32(delta->field);
+        delta->state = STATE_LENGTH;
+      } else {
+        delta->remaining = get_u32(delta->field);
+        err = start_record(delta);
+      }
+      break;
+    case STATE_DATA: {
+      size_t chunk = len < delta->remaining ? len : delta->remaining;
+      err = apply_data(delta, data, chunk);
+      data += chunk;
+      len -= chunk;
+      delta->remaining -= chunk;
+      break;
+    }
+    default:
+      ESP_LOGE(DELTA_TAG, "Data after the end of the patch");
+      err = ESP_ERR_INVALID_RESPONSE;
+      break;
+    }
+
+    if (delta->state == STATE_DATA && delta->remaining == 0) {
+      delta->state = STATE_OP;
+    }
+  }
+  return err;
+}
+
+esp_err_t delta_feed(delta_t *delta, const uint8_t *data, size_t len) {
+  if (delta->header_len < DELTA_HEADER_LEN) {
+    size_t chunk = DELTA_HEADER_LEN - delta->header_len;
+    if (chunk > len) {
+      chunk = len;
+    }
+    memcpy(&delta->header_data[delta->header_len], data, chunk);
+    delta->header_len += chunk;
+    data += chunk;
+    len -= chunk;
+    if (delta->header_len < DELTA_HEADER_LEN) {
+      return ESP_OK;
+    }
+
+    esp_err_t err = parse_header(delta);
+    if (err == ESP_OK) {
+      err = heatshrink_decoder_init(&delta->decoder, delta->header_data[5],
+                                    delta->header_data[6], apply_records,
+                                    delta);
+    }
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+
+  if (len == 0) {
+    return ESP_OK;
+  }
+  return heatshrink_decoder_feed(&delta->decoder, data, len);
+}
+
+esp_err_t delta_finish(delta_t *delta) {
+  if (delta->header_len < DELTA_HEADER_LEN || delta->state != STATE_END ||
+      delta->written != delta->header.target_size) {
+    ESP_LOGE(DELTA_TAG, "Patch is incomplete (%" PRIu32 " of %" PRIu32
+                        " bytes rebuilt)",
+             delta->written, delta->header.target_size);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return ESP_OK;
+}
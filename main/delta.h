@@ -0,0 +1,62 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "esp_err.h"
+#include "heatshrink.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of the patch header, see ota_https_server/src/delta.rs for the format
+#define DELTA_HEADER_LEN 112
+// Size of the buffer the old image is read into
+#define DELTA_BUFFSIZE 512
+
+// Read `len` bytes of the old image at `offset`
+typedef esp_err_t (*delta_read_cb_t)(void *ctx, uint32_t offset, void *data,
+                                     size_t len);
+// Called with the rebuilt new image, from start to end
+typedef esp_err_t (*delta_write_cb_t)(void *ctx, const void *data, size_t len);
+
+typedef struct {
+  uint32_t base_size;
+  uint32_t target_size;
+  uint8_t base_sha256[32];
+  uint8_t target_sha256[32];
+  uint8_t base_elf_sha256[32];
+} delta_header_t;
+
+// Streaming patch applier, the patch is fed as it is downloaded
+typedef struct {
+  delta_header_t header;
+  uint8_t header_data[DELTA_HEADER_LEN];
+  size_t header_len;
+  uint8_t target_sha256[32]; // Image the patch is expected to rebuild
+  heatshrink_decoder_t decoder;
+  uint8_t state;       // Part of the record being read
+  uint8_t op;          // Type of the record being read
+  uint8_t field[4];    // Bytes of the integer field being read
+  uint8_t field_len;   // Number of bytes of the field read so far
+  uint32_t old_offset; // Next byte of the old image used by an ADD record
+  uint32_t remaining;  // Bytes of the record data still to read
+  uint32_t written;    // Bytes of the new image rebuilt so far
+  uint8_t buffer[DELTA_BUFFSIZE];
+  delta_read_cb_t read_old;
+  delta_write_cb_t write;
+  void *ctx;
+} delta_t;
+
+// Prepare to apply a patch expected to rebuild the image with the given hash
+void delta_init(delta_t *delta, const uint8_t target_sha256[32],
+                delta_read_cb_t read_old, delta_write_cb_t write, void *ctx);
+
+// Apply the next block of the patch.
+// Once the header is complete, checks that the patch rebuilds the expected
+// image from the old image (by hashing it), and fails with
+// ESP_ERR_INVALID_VERSION if it does not.
+esp_err_t delta_feed(delta_t *delta, const uint8_t *data, size_t len);
+
+// Check that the patch was complete and rebuilt the whole image
+esp_err_t delta_finish(delta_t *delta);
+
+#endif
@@ -0,0 +1,157 @@
+#include "health.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#define HEALTH_TASK_STACK_SIZE 4096 // Name resolution included
+#define HEALTH_TASK_PRIORITY 5
+#define CHECK_POLL_MS 10
+
+typedef struct {
+  const char *name;
+  health_check_fn_t check;
+  void *ctx;
+} health_check_t;
+
+// Outcome of a check, sent by its task
+typedef struct {
+  uint8_t index;
+  esp_err_t err;
+  int64_t duration_us;
+} health_result_t;
+
+static const char *HEALTH_TAG = "HEALTH";
+
+static health_check_t checks[HEALTH_CHECKS_MAX];
+static size_t check_count;
+
+// Created once, the tasks of a run that timed out may still report into it
+static QueueHandle_t results = NULL;
+static int64_t deadline_us;
+
+static atomic_uint heartbeats;
+// Checks of the current run that have not returned yet
+static atomic_uint running;
+
+esp_err_t health_register(const char *name, health_check_fn_t check,
+                          void *ctx) {
+  if (check_count == HEALTH_CHECKS_MAX) {
+    ESP_LOGE(HEALTH_TAG, "Too many health checks, %s not added", name);
+    return ESP_ERR_NO_MEM;
+  }
+  checks[check_count++] = (health_check_t){
+      .name = name,
+      .check = check,
+      .ctx = ctx,
+  };
+  return ESP_OK;
+}
+
+static void check_task(void *pvParameter) {
+  health_result_t result = {.index = (uint8_t)(uintptr_t)pvParameter};
+  const health_check_t *check = &checks[result.index];
+  int64_t start = esp_timer_get_time();
+  int64_t left_us = deadline_us - start;
+
+  result.err = left_us > 0 ? check->check(check->ctx, left_us / 1000)
+                           : ESP_ERR_TIMEOUT;
+  result.duration_us = esp_timer_get_time() - start;
+  atomic_fetch_sub(&running, 1);
+  xQueueSend(results, &result, portMAX_DELAY);
+  vTaskDelete(NULL);
+}
+
+bool health_run(uint32_t deadline_ms) {
+  if (results == NULL) {
+    results = xQueueCreate(HEALTH_CHECKS_MAX, sizeof(health_result_t));
+    if (results == NULL) {
+      ESP_LOGE(HEALTH_TAG, "Failed to create the result queue");
+      return false;
+    }
+  }
+  int64_t start = esp_timer_get_time();
+  deadline_us = start + (int64_t)deadline_ms * 1000;
+
+  bool passed[HEALTH_CHECKS_MAX] = {false};
+  size_t started = 0;
+  // All counted before the first task starts, for health_check_heap()
+  atomic_store(&running, check_count);
+  for (size_t i = 0; i < check_count; ++i) {
+    if (xTaskCreate(&check_task, checks[i].name, HEALTH_TASK_STACK_SIZE,
+                    (void *)(uintptr_t)i, HEALTH_TASK_PRIORITY,
+                    NULL) != pdPASS) {
+      ESP_LOGE(HEALTH_TAG, "Failed to start the %s check", checks[i].name);
+      atomic_fetch_sub(&running, check_count - i);
+      return false;
+    }
+    started++;
+  }
+
+  size_t pass_count = 0;
+  while (pass_count < started) {
+    int64_t left_us = deadline_us - esp_timer_get_time();
+    health_result_t result;
+    if (left_us <= 0 ||
+        xQueueReceive(results, &result, pdMS_TO_TICKS(left_us / 1000) + 1) !=
+            pdTRUE) {
+      for (size_t i = 0; i < started; ++i) {
+        if (!passed[i]) {
+          ESP_LOGE(HEALTH_TAG, "Health check %s did not finish in %" PRIu32
+                               " ms", checks[i].name, deadline_ms);
+        }
+      }
+      return false;
+    }
+
+    const char *name = checks[result.index].name;
+    if (result.err != ESP_OK) {
+      ESP_LOGE(HEALTH_TAG, "Health check %s failed after %" PRId64 " ms (%s)",
+               name, result.duration_us / 1000, esp_err_to_name(result.err));
+      return false;
+    }
+    ESP_LOGI(HEALTH_TAG, "Health check %s passed in %" PRId64 " ms", name,
+             result.duration_us / 1000);
+    passed[result.index] = true;
+    pass_count++;
+  }
+  ESP_LOGI(HEALTH_TAG, "All %u health checks passed in %" PRId64 " ms",
+           (unsigned)pass_count, (esp_timer_get_time() - start) / 1000);
+  return true;
+}
+
+void health_heartbeat(void) { atomic_fetch_add(&heartbeats, 1); }
+
+// ---- Checks -----------------------------------------------------------------
+
+esp_err_t health_check_heartbeat(void *ctx, uint32_t timeout_ms) {
+  int64_t end = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+  while (atomic_load(&heartbeats) == 0) {
+    if (esp_timer_get_time() >= end) {
+      return ESP_ERR_TIMEOUT;
+    }
+    vTaskDelay(pdMS_TO_TICKS(CHECK_POLL_MS));
+  }
+  return ESP_OK;
+}
+
+esp_err_t health_check_heap(void *ctx, uint32_t timeout_ms) {
+  uint32_t min_free = *(const uint32_t *)ctx;
+  // The Wi-Fi association and the TLS handshake of the other checks use the
+  // most heap: read its low-water mark once they returned, this one aside
+  int64_t end = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+  while (atomic_load(&running) > 1 && esp_timer_get_time() < end) {
+    vTaskDelay(pdMS_TO_TICKS(CHECK_POLL_MS));
+  }
+  size_t lowest = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  if (lowest < min_free) {
+    ESP_LOGE(HEALTH_TAG, "Free heap went down to %u bytes, below %" PRIu32,
+             (unsigned)lowest, min_free);
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
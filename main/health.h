@@ -0,0 +1,42 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Health checks deciding whether a new firmware is kept on its first boot.
+// Each registered check runs in a task of its own, all at the same time, so
+// the firmware is kept as soon as the slowest one passes, and rolled back as
+// soon as one fails.
+
+#define HEALTH_CHECKS_MAX 8
+
+// Check the health of one part of the firmware, within timeout_ms.
+// Returns ESP_OK if it is healthy, ESP_ERR_TIMEOUT if it could not tell in
+// time, or any other error if it is not healthy.
+typedef esp_err_t (*health_check_fn_t)(void *ctx, uint32_t timeout_ms);
+
+// Add a check to the next health_run(). The name is kept, not copied.
+esp_err_t health_register(const char *name, health_check_fn_t check,
+                          void *ctx);
+
+// Run all the registered checks and wait for them, at most deadline_ms.
+// Returns true if all of them passed, false as soon as one failed, or at the
+// deadline when some could not tell.
+bool health_run(uint32_t deadline_ms);
+
+// Called regularly by the application task, to show that it is running
+void health_heartbeat(void);
+
+// ---- Checks -----------------------------------------------------------------
+
+// Passes once the application called health_heartbeat()
+esp_err_t health_check_heartbeat(void *ctx, uint32_t timeout_ms);
+
+// Passes if the free heap never went below the number of bytes ctx points to
+// (uint32_t) since the start, read once the other checks of the run returned
+// or at timeout_ms
+esp_err_t health_check_heap(void *ctx, uint32_t timeout_ms);
+
+#endif
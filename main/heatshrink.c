@@ -0,0 +1,125 @@
+#include "heatshrink.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *HEATSHRINK_TAG = "HEATSHRINK";
+
+enum {
+  STATE_TAG,      // Literal or back-reference bit
+  STATE_LITERAL,  // Literal byte
+  STATE_DISTANCE, // Back-reference distance
+  STATE_COUNT,    // Back-reference length
+};
+
+esp_err_t heatshrink_decoder_init(heatshrink_decoder_t *decoder,
+                                  uint8_t window_bits, uint8_t lookahead_bits,
+                                  heatshrink_output_cb_t output, void *ctx) {
+  if (window_bits < 4 || window_bits > HEATSHRINK_MAX_WINDOW_BITS ||
+      lookahead_bits < 3 || lookahead_bits >= window_bits) {
+    ESP_LOGE(HEATSHRINK_TAG, "Unsupported window %u or lookahead %u",
+             window_bits, lookahead_bits);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  memset(decoder, 0, sizeof(*decoder));
+  decoder->window_bits = window_bits;
+  decoder->lookahead_bits = lookahead_bits;
+  decoder->state = STATE_TAG;
+  decoder->output = output;
+  decoder->ctx = ctx;
+  return ESP_OK;
+}
+
+// Pass the decompressed data from the last flushed position up to `end` to
+// the output callback
+static esp_err_t flush(heatshrink_decoder_t *decoder, uint32_t end) {
+  esp_err_t err = ESP_OK;
+
+  if (end > decoder->flushed) {
+    err = decoder->output(decoder->ctx, &decoder->window[decoder->flushed],
+                          end - decoder->flushed);
+  }
+  decoder->flushed = decoder->head;
+  return err;
+}
+
+static esp_err_t put_byte(heatshrink_decoder_t *decoder, uint8_t byte) {
+  uint16_t mask = (1 << decoder->window_bits) - 1;
+
+  decoder->window[decoder->head] = byte;
+  decoder->head = (decoder->head + 1) & mask;
+  decoder->total++;
+
+  // Flush before the oldest data in the window gets overwritten
+  if (decoder->head == 0) {
+    return flush(decoder, 1 << decoder->window_bits);
+  }
+  return ESP_OK;
+}
+
+// Consume one bit of the stream
+static esp_err_t push_bit(heatshrink_decoder_t *decoder, uint8_t bit) {
+  uint8_t field_bits;
+
+  if (decoder->state == STATE_TAG) {
+    decoder->state = bit ? STATE_LITERAL : STATE_DISTANCE;
+    decoder->value = 0;
+    decoder->value_bits = 0;
+    return ESP_OK;
+  }
+
+  decoder->value = (decoder->value << 1) | bit;
+  decoder->value_bits++;
+
+  switch (decoder->state) {
+  case STATE_LITERAL:
+    field_bits = 8;
+    break;
+  case STATE_DISTANCE:
+    field_bits = decoder->window_bits;
+    break;
+  default:
+    field_bits = decoder->lookahead_bits;
+    break;
+  }
+  if (decoder->value_bits < field_bits) {
+    return ESP_OK;
+  }
+
+  esp_err_t err = ESP_OK;
+  if (decoder->state == STATE_LITERAL) {
+    err = put_byte(decoder, decoder->value);
+    decoder->state = STATE_TAG;
+  } else if (decoder->state == STATE_DISTANCE) {
+    decoder->distance = decoder->value + 1;
+    if (decoder->distance > decoder->total) {
+      ESP_LOGE(HEATSHRINK_TAG, "Back-reference before the start of the data");
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+    decoder->state = STATE_COUNT;
+    decoder->value = 0;
+    decoder->value_bits = 0;
+  } else {
+    uint16_t mask = (1 << decoder->window_bits) - 1;
+    for (uint32_t count = decoder->value + 1; count > 0 && err == ESP_OK;
+         --count) {
+      err = put_byte(decoder, decoder->window[(decoder->head -
+                                               decoder->distance) & mask]);
+    }
+    decoder->state = STATE_TAG;
+  }
+  return err;
+}
+
+esp_err_t heatshrink_decoder_feed(heatshrink_decoder_t *decoder,
+                                  const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    for (int bit = 7; bit >= 0; --bit) {
+      esp_err_t err = push_bit(decoder, (data[i] >> bit) & 1);
+      if (err != ESP_OK) {
+        return err;
+      }
+    }
+  }
+  return flush(decoder, decoder->head);
+}
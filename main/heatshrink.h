@@ -0,0 +1,45 @@
+#ifndef HEATSHRINK_H
+#define HEATSHRINK_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest supported window (log2), sets the size of the decoder window
+#define HEATSHRINK_MAX_WINDOW_BITS 12
+
+// Called with every block of decompressed data
+typedef esp_err_t (*heatshrink_output_cb_t)(void *ctx, const void *data,
+                                            size_t len);
+
+// Streaming decoder for the heatshrink LZSS format.
+// The window doubles as output buffer, so decompressing takes no memory other
+// than this structure.
+typedef struct {
+  uint8_t window[1 << HEATSHRINK_MAX_WINDOW_BITS];
+  uint8_t window_bits;
+  uint8_t lookahead_bits;
+  uint16_t head;       // Next position written in the window
+  uint16_t flushed;    // First position not passed to the output callback
+  uint32_t total;      // Bytes decompressed so far
+  uint8_t state;       // Field being read
+  uint32_t value;      // Bits of the field read so far
+  uint8_t value_bits;  // Number of bits of the field read so far
+  uint16_t distance;   // Distance of the back-reference being read
+  heatshrink_output_cb_t output;
+  void *ctx;
+} heatshrink_decoder_t;
+
+// Prepare the decoder for a new stream.
+// Returns ESP_ERR_INVALID_ARG if the window or lookahead size is unsupported.
+esp_err_t heatshrink_decoder_init(heatshrink_decoder_t *decoder,
+                                  uint8_t window_bits, uint8_t lookahead_bits,
+                                  heatshrink_output_cb_t output, void *ctx);
+
+// Decompress a block of the stream, passing all the decompressed data to the
+// output callback before returning
+esp_err_t heatshrink_decoder_feed(heatshrink_decoder_t *decoder,
+                                  const uint8_t *data, size_t len);
+
+#endif
@@ -5,19 +5,30 @@
 #include "freertos/task.h"
 #include "nvs.h"
 #include "nvs_flash.h"
+#include "sdkconfig.h"
 #include <string.h>
 
+#include "arena.h"
+#include "boot.h"
+#include "health.h"
 #include "ota.h"
 #include "wifi.h"
 
+#define BOOT_DIGESTS_STACK_SIZE 4096
+
 static const char *APP_TAG = "APP";
 
+// Lowest free heap a new firmware may have reached during its checks
+static const uint32_t health_min_free_heap = CONFIG_OTA_HEALTH_MIN_FREE_HEAP;
+
 // Main application to run alongside ota update
 static void application(void *pvParameter) {
   const esp_partition_t *running = esp_ota_get_running_partition();
   esp_app_desc_t running_app_info;
 
+  boot_done(BOOT_APPLICATION);
   while (1) {
+    health_heartbeat();
     if (esp_ota_get_partition_description(running, &running_app_info) ==
         ESP_OK) {
       ESP_LOGI(APP_TAG, "Hello, from firmware version: %s!",
@@ -29,7 +40,27 @@ static void application(void *pvParameter) {
   }
 }
 
+// Boot digests are only logged, nothing waits for them: hash them on the other
+// core while this one runs the Wi-Fi and the health checks
+static void boot_digests(void *pvParameter) {
+  log_boot_digests();
+  boot_done(BOOT_DIGESTS);
+  vTaskDelete(NULL);
+}
+
+// Health check: the station is associated and has an address
+static esp_err_t check_wifi(void *ctx, uint32_t timeout_ms) {
+  return wait_wifi(pdMS_TO_TICKS(timeout_ms)) == WIFI_SUCCESS ? ESP_OK
+                                                               : ESP_ERR_TIMEOUT;
+}
+
+// Start the phases of the boot at the same time, each task waits for the ones
+// it needs (see boot.h)
 void app_main(void) {
+  boot_init();
+  // Before the Wi-Fi connection, which already uses mbedTLS
+  arena_init();
+
   // ---- Storage setup ------------------------------------------------
   esp_err_t res = nvs_flash_init();
   if (res == ESP_ERR_NVS_NO_FREE_PAGES ||
@@ -38,24 +69,28 @@ void app_main(void) {
     res = nvs_flash_init();
   }
   ESP_ERROR_CHECK(res);
+  boot_done(BOOT_STORAGE);
   // ---- Storage setup ------------------------------------------------
 
-  diagnose_new_firmware();
-
   // ---- Wifi setup ---------------------------------------------------
-  esp_err_t status = WIFI_FAILURE;
-
-  // Connect to AP
-  status = connect_wifi();
-  if (WIFI_SUCCESS != status) {
-    ESP_LOGE(WIFI_TAG, "Failed to associate to AP, dying...");
-    return;
-  }
+  // Connects in the background, BOOT_WIFI is done with the first address
+  start_wifi();
   // ---- Wifi setup ---------------------------------------------------
 
-  xTaskCreate(&download_new_firmware, "download_new_firmware", 8192, NULL, 5,
-              NULL);
+  xTaskCreatePinnedToCore(&boot_digests, "boot_digests", BOOT_DIGESTS_STACK_SIZE,
+                          NULL, 5, NULL, portNUM_PROCESSORS - 1);
+  // The application runs during the health checks of a new firmware, they
+  // take as long as the slowest of them
   xTaskCreate(&application, "application", 4096, NULL, 5, NULL);
+  // Waits for the connection and the validation of the running firmware
+  xTaskCreate(&download_new_firmware, "download_new_firmware",
+              CONFIG_OTA_TASK_STACK_SIZE, NULL, 5, NULL);
+
+  health_register("wifi", check_wifi, NULL);
+  health_register("heartbeat", health_check_heartbeat, NULL);
+  health_register("heap", health_check_heap, (void *)&health_min_free_heap);
+  diagnose_new_firmware();
+  boot_done(BOOT_VALIDATED);
 
   while (1) {
     vTaskDelay(10000 / portTICK_PERIOD_MS);
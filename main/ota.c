@@ -1,357 +1,929 @@
+#include "ota.h"
+#include "arena.h"
+#include "boot.h"
+#include "cJSON.h"
 #include "errno.h"
-#include "esp_app_format.h"
+#include "esp_app_desc.h"
 #include "esp_flash_partitions.h"
+#include "esp_heap_caps.h"
 #include "esp_http_client.h"
 #include "esp_log.h"
+#include "esp_mac.h"
 #include "esp_ota_ops.h"
 #include "esp_partition.h"
+#include "esp_pm.h"
+#include "esp_random.h"
+#include "esp_sleep.h"
 #include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "health.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#include "nvs.h"
+#include "ota_engine.h"
+#include "pipeline.h"
 #include "sdkconfig.h"
+#include "wifi.h"
+#include "window.h"
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <unistd.h>
 
-#define BUFFSIZE 1024
 #define HASH_LEN 32 /* SHA-256 digest length */
+#define HEADER_VALUE_MAX_LEN 72
+#define HEADER_NAME_MAX_LEN 32
+#define REQUEST_HEADERS_MAX 4
+#define SERVER_CHECK_RETRY_MS 250
+
+#define OTA_NVS_NAMESPACE "ota"
+#define BOOT_DIGESTS_KEY "boot_digests"
+
+// Response headers the engine asks for, esp_http_client only passes them to
+// the event handler
+static const char *const KEPT_HEADERS[] = {"ETag", "Retry-After",
+                                           "Cache-Control",
+                                           "Preference-Applied"};
+#define KEPT_HEADER_COUNT (sizeof(KEPT_HEADERS) / sizeof(KEPT_HEADERS[0]))
+
+// HTTP client kept from one request (and one poll) to the next, so that the
+// connection to the server is reused while it stays open, and the TLS session
+// is resumed when it has to be opened again
+typedef struct {
+  esp_http_client_handle_t client;
+  bool https;          // Scheme the client was created for
+  bool connected;      // The connection was kept after the last response
+  uint32_t timeout_ms; // Receive timeout, CONFIG_OTA_RECV_TIMEOUT if 0
+  // Headers of the last request, removed before the next one
+  char request_headers[REQUEST_HEADERS_MAX][HEADER_NAME_MAX_LEN];
+  size_t request_header_count;
+
+  // ---- Response ---------------------------------------------------------
+  char headers[KEPT_HEADER_COUNT][HEADER_VALUE_MAX_LEN];
+  int status;
+  bool connection_close; // The server closes the connection after it
+
+  int64_t open_start; // Start of the request being sent
+  ota_transport_stats_t stats;
+} http_transport_t;
+
+// SHA-256 digests of the bootloader and of the running firmware, kept in NVS
+// with the builds they were computed for. Hashing either means verifying the
+// whole image, while their descriptions are read in a few bytes.
+typedef struct {
+  // ---- Builds, compared to find out if the digests are still valid --------
+  esp_bootloader_desc_t bootloader_desc;
+  uint32_t app_address; // Running partition
+  uint8_t app_elf_sha256[HASH_LEN];
+  // ---- Digests ------------------------------------------------------------
+  uint8_t bootloader_sha256[HASH_LEN];
+  uint8_t app_sha256[HASH_LEN];
+} boot_digests_t;
+
+// Update being written to the next OTA partition
+typedef struct {
+  const esp_partition_t *partition;
+  esp_ota_handle_t handle; // Set by esp_ota_begin(), freed by esp_ota_end()
+} partition_flash_t;
 
 static const char *OTA_TAG = "OTA";
 
-// OTA data write buffer to write to the flash
-static char ota_write_data[BUFFSIZE + 1] = {0};
+// Phases of this boot, sent with the first update report
+static ota_boot_stats_t boot_stats;
+
 extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
 extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
+#ifdef CONFIG_OTA_VERIFY_SIGNATURE
+extern const uint8_t
+    signing_key_pem_start[] asm("_binary_signing_pub_pem_start");
+#endif
 
-static void print_sha256(const uint8_t *image_hash, const char *label) {
-  char hash_print[HASH_LEN * 2 + 1];
-  hash_print[HASH_LEN * 2] = 0;
-  for (int i = 0; i < HASH_LEN; ++i) {
-    sprintf(&hash_print[i * 2], "%02x", image_hash[i]);
+// ---- HTTP transport ---------------------------------------------------------
+
+// Collect the kept response headers into the transport set as the client user
+// data, and count the connections it opens
+static esp_err_t http_event_handler(esp_http_client_event_t *evt) {
+  http_transport_t *transport = evt->user_data;
+
+  if (evt->event_id == HTTP_EVENT_ON_CONNECTED) {
+    // TLS handshake included, esp_http_client does not tell them apart
+    transport->stats.connections++;
+    transport->stats.connect_us += esp_timer_get_time() - transport->open_start;
+  } else if (evt->event_id == HTTP_EVENT_ON_HEADER) {
+    for (size_t i = 0; i < KEPT_HEADER_COUNT; ++i) {
+      if (strcasecmp(evt->header_key, KEPT_HEADERS[i]) == 0) {
+        strlcpy(transport->headers[i], evt->header_value,
+                HEADER_VALUE_MAX_LEN);
+      }
+    }
+    if (strcasecmp(evt->header_key, "Connection") == 0 &&
+        strcasecmp(evt->header_value, "close") == 0) {
+      transport->connection_close = true;
+    }
   }
-  ESP_LOGI(OTA_TAG, "%s: %s", label, hash_print);
+  return ESP_OK;
 }
 
-static void http_cleanup(esp_http_client_handle_t client) {
-  esp_http_client_close(client);
-  esp_http_client_cleanup(client);
+// Create the client, or point it to another URL
+static esp_err_t http_set_url(http_transport_t *transport, const char *url) {
+  bool https = strncmp(url, "https://", 8) == 0;
+
+  // The client keeps the transport (TCP or TLS) it was created for
+  if (transport->client != NULL && https != transport->https) {
+    esp_http_client_cleanup(transport->client);
+    transport->client = NULL;
+  }
+
+  if (transport->client != NULL) {
+    // Also closes the connection if the URL is on another server
+    return esp_http_client_set_url(transport->client, url);
+  }
+
+  esp_http_client_config_t config = {
+      .url = url,
+      .cert_pem = (char *)server_cert_pem_start,
+      .skip_cert_common_name_check = true,
+      .timeout_ms = CONFIG_OTA_RECV_TIMEOUT,
+      .keep_alive_enable = true,
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+      // Keep the TLS session for the next connection of this client
+      .save_client_session = true,
+#endif
+      .event_handler = http_event_handler,
+      .user_data = transport,
+  };
+  transport->client = esp_http_client_init(&config);
+  if (transport->client == NULL) {
+    ESP_LOGE(OTA_TAG, "Failed to initialise HTTP connection with: %s", url);
+    return ESP_FAIL;
+  }
+  transport->https = https;
+  transport->connected = false;
+  transport->request_header_count = 0;
+  return ESP_OK;
 }
 
-// Check if the new app image is valid and works as expected
-// For testing, the app is always considered valid
-static bool diagnostic(void) {
-  bool diagnostic_is_ok = true;
-  ESP_LOGI(OTA_TAG, "Running diagnostics ...");
-  vTaskDelay(5000 / portTICK_PERIOD_MS);
-  return diagnostic_is_ok;
+// Replace the headers of the last request
+static void http_set_headers(http_transport_t *transport,
+                             const char *const *headers, size_t header_count) {
+  for (size_t i = 0; i < transport->request_header_count; ++i) {
+    esp_http_client_delete_header(transport->client,
+                                  transport->request_headers[i]);
+  }
+  for (size_t i = 0; i < header_count; ++i) {
+    esp_http_client_set_header(transport->client, headers[i * 2],
+                               headers[i * 2 + 1]);
+    strlcpy(transport->request_headers[i], headers[i * 2],
+            HEADER_NAME_MAX_LEN);
+  }
+  transport->request_header_count = header_count;
 }
 
-// Task to download new firmware from HTTP server
-// Runs every CONFIG_OTA_RETRY_INTERVAL seconds
-void download_new_firmware(void *pvParameter) {
-  const int retry_delay_ms = CONFIG_OTA_RETRY_INTERVAL * 1000;
-  ESP_LOGI(OTA_TAG, "Starting new firmware download task");
-  while (1) {
-    esp_err_t err;
+// Send a request, with a body if `body` is not NULL, and read the response
+// headers
+static esp_err_t http_request(http_transport_t *transport,
+                              esp_http_client_method_t method, const char *url,
+                              const char *const *headers, size_t header_count,
+                              const char *body, size_t body_len, int *status) {
+  if (header_count > REQUEST_HEADERS_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  esp_err_t err = http_set_url(transport, url);
+  if (err != ESP_OK) {
+    return err;
+  }
+  http_set_headers(transport, headers, header_count);
+  esp_http_client_set_method(transport->client, method);
+  esp_http_client_set_timeout_ms(transport->client,
+                                 transport->timeout_ms > 0
+                                     ? transport->timeout_ms
+                                     : CONFIG_OTA_RECV_TIMEOUT);
+
+  // A kept connection may have been closed by the server (or lost with the
+  // wifi) since the last request, the request is then sent again on a new one
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    uint32_t connections = transport->stats.connections;
+    memset(transport->headers, 0, sizeof(transport->headers));
+    transport->connection_close = false;
+    transport->open_start = esp_timer_get_time();
+    transport->stats.requests++;
+
+    err = esp_http_client_open(transport->client, body != NULL ? body_len : 0);
+    if (err == ESP_OK && body != NULL &&
+        esp_http_client_write(transport->client, body, body_len) !=
+            (int)body_len) {
+      err = ESP_FAIL;
+    }
+    if (err == ESP_OK && esp_http_client_fetch_headers(transport->client) < 0) {
+      err = ESP_FAIL;
+    }
+    bool reused =
+        transport->connected && transport->stats.connections == connections;
+    transport->connected = false;
+    if (err == ESP_OK) {
+      transport->status = esp_http_client_get_status_code(transport->client);
+      *status = transport->status;
+      return ESP_OK;
+    }
 
-    // Handle set by esp_ota_begin(), must be freed via esp_ota_end()
-    esp_ota_handle_t update_handle = 0;
-    const esp_partition_t *update_partition = NULL;
+    esp_http_client_close(transport->client);
+    if (!reused) {
+      break;
+    }
+    ESP_LOGW(OTA_TAG, "Kept connection lost, reconnecting");
+  }
+  return err;
+}
 
-    ESP_LOGI(OTA_TAG, "Attempting to download new firmware...");
+static esp_err_t http_open(void *ctx, const char *url,
+                           const char *const *headers, size_t header_count,
+                           int *status) {
+  return http_request(ctx, HTTP_METHOD_GET, url, headers, header_count, NULL,
+                      0, status);
+}
+
+static esp_err_t http_post(void *ctx, const char *url,
+                           const char *content_type, const char *body,
+                           size_t len, int *status) {
+  const char *headers[] = {"Content-Type", content_type};
+  return http_request(ctx, HTTP_METHOD_POST, url, headers, 1, body, len,
+                      status);
+}
+
+static esp_err_t http_get_header(void *ctx, const char *name, char *value,
+                                 size_t len) {
+  http_transport_t *transport = ctx;
 
-    // ---- Check current partition --------------------------------------
-    const esp_partition_t *configured = esp_ota_get_boot_partition();
-    const esp_partition_t *running = esp_ota_get_running_partition();
-
-    if (configured != running) {
-      ESP_LOGW(OTA_TAG,
-               "Configured OTA boot partition at offset 0x%08" PRIx32
-               ", but running from offset 0x%08" PRIx32,
-               configured->address, running->address);
-      ESP_LOGW(OTA_TAG,
-               "(This can happen if either the OTA boot data or preferred "
-               "boot image become corrupted somehow.)");
+  for (size_t i = 0; i < KEPT_HEADER_COUNT; ++i) {
+    if (strcasecmp(name, KEPT_HEADERS[i]) == 0 &&
+        transport->headers[i][0] != '\0') {
+      strlcpy(value, transport->headers[i], len);
+      return ESP_OK;
     }
-    ESP_LOGI(OTA_TAG,
-             "Running partition type %d subtype %d (offset 0x%08" PRIx32 ")",
-             running->type, running->subtype, running->address);
-    // ---- Check current partition --------------------------------------
-
-    // ---- Connect to HTTP server ---------------------------------------
-    esp_http_client_config_t config = {
-        .url = CONFIG_FIRMWARE_UPG_URL,
-        .cert_pem = (char *)server_cert_pem_start,
-        .skip_cert_common_name_check = true,
-        .timeout_ms = CONFIG_OTA_RECV_TIMEOUT,
-        .keep_alive_enable = true,
-    };
-
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    if (client == NULL) {
-      ESP_LOGE(OTA_TAG,
-               "Failed to initialise HTTP connection with the "
-               "firmware upgrade server at: %s",
-               CONFIG_FIRMWARE_UPG_URL);
-      ESP_LOGE(OTA_TAG, "Retrying in %ds...", CONFIG_OTA_RETRY_INTERVAL);
-
-      vTaskDelay(retry_delay_ms / portTICK_PERIOD_MS);
-      continue;
+  }
+  return ESP_ERR_NOT_FOUND;
+}
+
+static int http_read(void *ctx, char *data, size_t len) {
+  http_transport_t *transport = ctx;
+
+  while (1) {
+    int data_read = esp_http_client_read(transport->client, data, len);
+    if (data_read < 0) {
+      ESP_LOGE(OTA_TAG, "Error: SSL data read error");
+      return -1;
+    } else if (data_read > 0) {
+      return data_read;
     }
-    err = esp_http_client_open(client, 0);
-    if (err != ESP_OK) {
-      ESP_LOGE(OTA_TAG,
-               "Failed to open HTTP connection with the firmware upgrade "
-               "server (%s): %s",
-               CONFIG_FIRMWARE_UPG_URL,
-               esp_err_to_name(err));
-      ESP_LOGE(OTA_TAG, "Retrying in %ds...", CONFIG_OTA_RETRY_INTERVAL);
-      esp_http_client_cleanup(client);
+    if (errno == ECONNRESET || errno == ENOTCONN) {
+      ESP_LOGE(OTA_TAG, "Connection closed, errno = %d", errno);
+      return 0;
+    }
+    if (esp_http_client_is_complete_data_received(transport->client) == true) {
+      ESP_LOGI(OTA_TAG, "Connection closed");
+      return 0;
+    }
+  }
+}
 
-      vTaskDelay(retry_delay_ms / portTICK_PERIOD_MS);
-      continue;
+static bool http_is_complete(void *ctx) {
+  http_transport_t *transport = ctx;
+  return esp_http_client_is_complete_data_received(transport->client);
+}
+
+static void http_close(void *ctx) {
+  http_transport_t *transport = ctx;
+
+  // Only a connection at the end of a response can carry the next one, the
+  // client and its TLS session are kept either way
+  bool complete = transport->status == 304 ||
+                  esp_http_client_is_complete_data_received(transport->client);
+  if (!complete || transport->connection_close) {
+    esp_http_client_close(transport->client);
+  } else {
+    transport->connected = true;
+  }
+}
+
+static void http_get_stats(void *ctx, ota_transport_stats_t *stats) {
+  http_transport_t *transport = ctx;
+  *stats = transport->stats;
+}
+
+static void http_set_timeout(void *ctx, uint32_t timeout_ms) {
+  http_transport_t *transport = ctx;
+
+  transport->timeout_ms = timeout_ms;
+  if (transport->client != NULL) {
+    esp_http_client_set_timeout_ms(transport->client,
+                                   timeout_ms > 0 ? timeout_ms
+                                                  : CONFIG_OTA_RECV_TIMEOUT);
+  }
+}
+
+static const ota_transport_t http_transport = {
+    .open = http_open,
+    .get_header = http_get_header,
+    .read = http_read,
+    .is_complete = http_is_complete,
+    .close = http_close,
+    .get_stats = http_get_stats,
+    .set_timeout = http_set_timeout,
+    .post = http_post,
+};
+
+// ---- OTA partitions ---------------------------------------------------------
+
+static esp_err_t partition_update_partition(void *ctx, uint32_t *address,
+                                            uint32_t *size) {
+  partition_flash_t *flash = ctx;
+
+  // ---- Check current partition --------------------------------------
+  const esp_partition_t *configured = esp_ota_get_boot_partition();
+  const esp_partition_t *running = esp_ota_get_running_partition();
+
+  if (configured != running) {
+    ESP_LOGW(OTA_TAG,
+             "Configured OTA boot partition at offset 0x%08" PRIx32
+             ", but running from offset 0x%08" PRIx32,
+             configured->address, running->address);
+    ESP_LOGW(OTA_TAG,
+             "(This can happen if either the OTA boot data or preferred "
+             "boot image become corrupted somehow.)");
+  }
+  ESP_LOGI(OTA_TAG,
+           "Running partition type %d subtype %d (offset 0x%08" PRIx32 ")",
+           running->type, running->subtype, running->address);
+  // ---- Check current partition --------------------------------------
+
+  flash->partition = esp_ota_get_next_update_partition(NULL);
+  if (flash->partition == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  ESP_LOGI(OTA_TAG, "Update partition subtype %d at offset 0x%" PRIx32,
+           flash->partition->subtype, flash->partition->address);
+  *address = flash->partition->address;
+  *size = flash->partition->size;
+  return ESP_OK;
+}
+
+static esp_err_t partition_begin(void *ctx, uint32_t offset) {
+  partition_flash_t *flash = ctx;
+  esp_err_t err;
+
+  if (offset == 0) {
+    err = esp_ota_begin(flash->partition, OTA_WITH_SEQUENTIAL_WRITES,
+                        &flash->handle);
+    if (err != ESP_OK) {
+      ESP_LOGE(OTA_TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
+      return err;
     }
-    esp_http_client_fetch_headers(client);
-    // ---- Connect to HTTP server ---------------------------------------
-
-    update_partition = esp_ota_get_next_update_partition(NULL);
-    assert(update_partition != NULL);
-
-    // Handle recieved packet
-    int binary_file_length = 0;
-    bool image_header_was_checked = false;
-
-    bool ota_in_progress = false;      // Track if esp_ota_begin has been called
-    bool ota_error = false;            // If a retry is needed
-    bool ota_wait_new_version = false; // If OTA succeded but no update needed
-    while (1) {
-      int data_read = esp_http_client_read(client, ota_write_data, BUFFSIZE);
-      if (data_read < 0) {
-        ESP_LOGE(OTA_TAG, "Error: SSL data read error");
-
-        ota_error = true;
-        break;
-      } else if (data_read == 0) {
-        if (errno == ECONNRESET || errno == ENOTCONN) {
-          ESP_LOGE(OTA_TAG, "Connection closed, errno = %d", errno);
-          break;
-        }
-        if (esp_http_client_is_complete_data_received(client) == true) {
-          ESP_LOGI(OTA_TAG, "Connection closed");
-          break;
-        }
-      } else if (data_read > 0) {
-        if (image_header_was_checked == false) {
-          esp_app_desc_t new_app_info;
-
-          if (data_read <= sizeof(esp_image_header_t) +
-                               sizeof(esp_image_segment_header_t) +
-                               sizeof(esp_app_desc_t)) {
-            ESP_LOGE(OTA_TAG, "received package is not fit len");
-
-            ota_error = true;
-            break;
-          }
-
-          if (data_read > sizeof(esp_image_header_t) +
-                              sizeof(esp_image_segment_header_t) +
-                              sizeof(esp_app_desc_t)) {
-
-            // ---- Version check ---------------------------------------------
-            // Get new firmware info
-            memcpy(&new_app_info,
-                   &ota_write_data[sizeof(esp_image_header_t) +
-                                   sizeof(esp_image_segment_header_t)],
-                   sizeof(esp_app_desc_t));
-            ESP_LOGI(OTA_TAG, "New firmware version: %s", new_app_info.version);
-
-            esp_app_desc_t running_app_info;
-            if (esp_ota_get_partition_description(running, &running_app_info) ==
-                ESP_OK) {
-              ESP_LOGI(OTA_TAG, "Running firmware version: %s",
-                       running_app_info.version);
-            }
-
-            // Get last invalid firmware info
-            const esp_partition_t *last_invalid_app =
-                esp_ota_get_last_invalid_partition();
-            esp_app_desc_t invalid_app_info;
-            if (esp_ota_get_partition_description(
-                    last_invalid_app, &invalid_app_info) == ESP_OK) {
-              ESP_LOGI(OTA_TAG, "Last invalid firmware version: %s",
-                       invalid_app_info.version);
-            }
-
-            // Check current firmware version with last invalid firmware version
-            if (last_invalid_app != NULL) {
-              if (memcmp(invalid_app_info.version, new_app_info.version,
-                         sizeof(new_app_info.version)) == 0) {
-                ESP_LOGW(OTA_TAG,
-                         "New version is the same as an invalid version.");
-                ESP_LOGW(OTA_TAG,
-                         "Previously, there was an attempt to launch the "
-                         "firmware with %s version, but it failed.",
-                         invalid_app_info.version);
-                ESP_LOGW(OTA_TAG, "The firmware has been rolled back to the "
-                                  "previous version.");
-
-                ota_error = true;
-                break;
-              }
-            }
-
-#ifndef CONFIG_SKIP_VERSION_CHECK
-            // Check new firmware version
-            if (memcmp(new_app_info.version, running_app_info.version,
-                       sizeof(new_app_info.version)) == 0) {
-              ESP_LOGW(OTA_TAG, "Current running version is the same as a new. "
-                                "The update will not be made.");
-              ota_wait_new_version = true;
-              break;
-            }
-#endif
-            // ---- Version check ----------------------------------------------
-
-            image_header_was_checked = true;
-
-            // ---- Begin OTA segment write to partition -----------------------
-            ESP_LOGI(OTA_TAG,
-                     "Writing to partition subtype %d at offset 0x%" PRIx32,
-                     update_partition->subtype, update_partition->address);
-
-            err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES,
-                                &update_handle);
-            if (err != ESP_OK) {
-              ESP_LOGE(OTA_TAG, "esp_ota_begin failed (%s)",
-                       esp_err_to_name(err));
-
-              ota_error = true;
-              break;
-            }
-            ota_in_progress = true;
-            ESP_LOGI(OTA_TAG, "esp_ota_begin succeeded");
-            ESP_LOGI(OTA_TAG, "Updating firmware...");
-            // ---- Begin OTA segment write to partition -----------------------
-          }
-        }
-
-        // --- Write new firmware segment to partition ------------------------
-        err = esp_ota_write(update_handle, (const void *)ota_write_data,
-                            data_read);
-        if (err != ESP_OK) {
-          http_cleanup(client);
-
-          ota_error = true;
-          break;
-        }
-
-        binary_file_length += data_read;
-        ESP_LOGD(OTA_TAG, "Written image length %d", binary_file_length);
-        // --- Write new firmware segment to partition -----------------------
-      }
+    ESP_LOGI(OTA_TAG, "esp_ota_begin succeeded");
+  } else {
+    err = esp_ota_resume(flash->partition, OTA_WITH_SEQUENTIAL_WRITES, offset,
+                         &flash->handle);
+    if (err != ESP_OK) {
+      ESP_LOGE(OTA_TAG, "esp_ota_resume failed (%s)", esp_err_to_name(err));
+      return err;
     }
+    ESP_LOGI(OTA_TAG, "esp_ota_resume succeeded");
+  }
+  return ESP_OK;
+}
 
-    // If error occured retry
-    if (ota_error) {
-      ESP_LOGE(OTA_TAG, "An error occurred during OTA. Retrying in %ds...",
-               CONFIG_OTA_RETRY_INTERVAL);
-      http_cleanup(client);
-      if (ota_in_progress) {
-        esp_ota_abort(update_handle);
-      }
-      vTaskDelay(retry_delay_ms / portTICK_PERIOD_MS);
-      continue;
-    } else if (ota_wait_new_version) {
-      ESP_LOGI(OTA_TAG, "No new firmware version available. Retrying in %ds...",
-               CONFIG_OTA_RETRY_INTERVAL);
+static esp_err_t partition_write(void *ctx, const void *data, size_t len) {
+  partition_flash_t *flash = ctx;
 
-      http_cleanup(client);
+  esp_err_t err = esp_ota_write(flash->handle, data, len);
+  if (err != ESP_OK) {
+    ESP_LOGE(OTA_TAG, "esp_ota_write failed (%s)", esp_err_to_name(err));
+  }
+  return err;
+}
 
-      vTaskDelay(retry_delay_ms / portTICK_PERIOD_MS);
-      continue;
+static void partition_abort(void *ctx) {
+  partition_flash_t *flash = ctx;
+  esp_ota_abort(flash->handle);
+}
+
+static esp_err_t partition_finish(void *ctx) {
+  partition_flash_t *flash = ctx;
+
+  esp_err_t err = esp_ota_end(flash->handle);
+  if (err != ESP_OK) {
+    if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+      ESP_LOGE(OTA_TAG, "Image validation failed, image is corrupted");
+    } else {
+      ESP_LOGE(OTA_TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
     }
+    return err;
+  }
 
-    // --- Check written firmware -----------------------------------------
-    ESP_LOGI(OTA_TAG, "Total Write binary data length: %d", binary_file_length);
+  err = esp_ota_set_boot_partition(flash->partition);
+  if (err != ESP_OK) {
+    ESP_LOGE(OTA_TAG, "esp_ota_set_boot_partition failed (%s)!",
+             esp_err_to_name(err));
+  }
+  return err;
+}
 
-    if (esp_http_client_is_complete_data_received(client) != true) {
-      ESP_LOGE(OTA_TAG, "Error in receiving complete file. Retrying in %ds...",
-               CONFIG_OTA_RETRY_INTERVAL);
-      http_cleanup(client);
+static esp_err_t partition_read_running(void *ctx, uint32_t offset,
+                                        void *data, size_t len) {
+  return esp_partition_read(esp_ota_get_running_partition(), offset, data,
+                            len);
+}
 
-      if (ota_in_progress) {
-        esp_ota_abort(update_handle);
-      }
+static esp_err_t partition_read_update(void *ctx, uint32_t offset, void *data,
+                                       size_t len) {
+  partition_flash_t *flash = ctx;
+  return esp_partition_read(flash->partition, offset, data, len);
+}
 
-      vTaskDelay(retry_delay_ms / portTICK_PERIOD_MS);
-      continue;
+static esp_err_t partition_running_desc(void *ctx, esp_app_desc_t *desc) {
+  return esp_ota_get_partition_description(esp_ota_get_running_partition(),
+                                           desc);
+}
+
+static esp_err_t partition_invalid_desc(void *ctx, esp_app_desc_t *desc) {
+  const esp_partition_t *last_invalid_app =
+      esp_ota_get_last_invalid_partition();
+  if (last_invalid_app == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  return esp_ota_get_partition_description(last_invalid_app, desc);
+}
+
+static const ota_flash_t partition_flash = {
+    .update_partition = partition_update_partition,
+    .begin = partition_begin,
+    .write = partition_write,
+    .abort = partition_abort,
+    .finish = partition_finish,
+    .read_running = partition_read_running,
+    .read_update = partition_read_update,
+    .running_desc = partition_running_desc,
+    .invalid_desc = partition_invalid_desc,
+};
+
+// ---- NVS store --------------------------------------------------------------
+
+static esp_err_t nvs_store_load(void *ctx, const char *key, void *data,
+                                size_t *len) {
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs);
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = nvs_get_blob(nvs, key, data, len);
+  nvs_close(nvs);
+  return err == ESP_ERR_NVS_NOT_FOUND ? ESP_ERR_NOT_FOUND : err;
+}
+
+static esp_err_t nvs_store_save(void *ctx, const char *key, const void *data,
+                                size_t len) {
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err == ESP_OK) {
+    err = nvs_set_blob(nvs, key, data, len);
+    if (err == ESP_OK) {
+      err = nvs_commit(nvs);
     }
+    nvs_close(nvs);
+  }
+  return err;
+}
 
-    err = esp_ota_end(update_handle);
-    if (err != ESP_OK) {
-      if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-        ESP_LOGE(
-            OTA_TAG,
-            "Image validation failed, image is corrupted. Retrying in %ds...",
-            CONFIG_OTA_RETRY_INTERVAL);
-      } else {
-        ESP_LOGE(OTA_TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
-        ESP_LOGE(OTA_TAG, "Retrying in %ds...", CONFIG_OTA_RETRY_INTERVAL);
+static void nvs_store_erase(void *ctx, const char *key) {
+  nvs_handle_t nvs;
+  if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+    nvs_erase_key(nvs, key);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+  }
+}
+
+static const ota_store_t nvs_store = {
+    .load = nvs_store_load,
+    .save = nvs_store_save,
+    .erase = nvs_store_erase,
+};
+
+// -----------------------------------------------------------------------------
+
+// ---- Health checks ----------------------------------------------------------
+
+#ifdef CONFIG_OTA_HEALTH_CHECK_SERVER
+// Open a TCP connection to host:port within timeout_ms
+static esp_err_t connect_server(const char *host, const char *port,
+                                uint32_t timeout_ms) {
+  const struct addrinfo hints = {
+      .ai_family = AF_INET,
+      .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo *addresses = NULL;
+  if (getaddrinfo(host, port, &hints, &addresses) != 0 || addresses == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  esp_err_t err = ESP_FAIL;
+  int sock = socket(addresses->ai_family, addresses->ai_socktype, 0);
+  if (sock >= 0) {
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(sock, addresses->ai_addr, addresses->ai_addrlen) == 0) {
+      err = ESP_OK;
+    } else if (errno == EINPROGRESS) {
+      fd_set writable;
+      FD_ZERO(&writable);
+      FD_SET(sock, &writable);
+      struct timeval timeout = {
+          .tv_sec = timeout_ms / 1000,
+          .tv_usec = (timeout_ms % 1000) * 1000,
+      };
+      int sock_err = 0;
+      socklen_t len = sizeof(sock_err);
+      if (select(sock + 1, NULL, &writable, NULL, &timeout) <= 0) {
+        err = ESP_ERR_TIMEOUT;
+      } else if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &sock_err, &len) ==
+                     0 &&
+                 sock_err == 0) {
+        err = ESP_OK;
       }
+    }
+    close(sock);
+  }
+  freeaddrinfo(addresses);
+  return err;
+}
 
-      http_cleanup(client);
-      vTaskDelay(retry_delay_ms / portTICK_PERIOD_MS);
-      continue;
+// Health check: the update server can be reached, so that the new firmware
+// can be replaced. Retried until the deadline, the network may still be
+// coming up.
+static esp_err_t check_server(void *ctx, uint32_t timeout_ms) {
+  // Host and port of the manifest URL
+  const char *url = ctx;
+  const char *host = strstr(url, "://");
+  host = host != NULL ? host + 3 : url;
+  size_t host_len = strcspn(host, ":/");
+  char name[64];
+  char port[6];
+  if (host_len == 0 || host_len >= sizeof(name)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  memcpy(name, host, host_len);
+  name[host_len] = '\0';
+  if (host[host_len] == ':') {
+    size_t port_len = strcspn(host + host_len + 1, "/");
+    if (port_len == 0 || port_len >= sizeof(port)) {
+      return ESP_ERR_INVALID_ARG;
     }
+    memcpy(port, host + host_len + 1, port_len);
+    port[port_len] = '\0';
+  } else {
+    strlcpy(port, strncmp(url, "https://", 8) == 0 ? "443" : "80",
+            sizeof(port));
+  }
 
-    err = esp_ota_set_boot_partition(update_partition);
-    if (err != ESP_OK) {
-      ESP_LOGE(OTA_TAG, "esp_ota_set_boot_partition failed (%s)!",
-               esp_err_to_name(err));
-      ESP_LOGE(OTA_TAG, "Retrying in %ds...", CONFIG_OTA_RETRY_INTERVAL);
-      http_cleanup(client);
-      vTaskDelay(retry_delay_ms / portTICK_PERIOD_MS);
+  int64_t end = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+  esp_err_t err = ESP_ERR_TIMEOUT;
+  for (int64_t left_ms = timeout_ms; left_ms > 0;
+       left_ms = (end - esp_timer_get_time()) / 1000) {
+    err = connect_server(name, port, left_ms);
+    if (err == ESP_OK) {
+      return ESP_OK;
+    }
+    vTaskDelay(pdMS_TO_TICKS(SERVER_CHECK_RETRY_MS));
+  }
+  ESP_LOGW(OTA_TAG, "Update server %s:%s not reached (%s)", name, port,
+           esp_err_to_name(err));
+  return ESP_ERR_TIMEOUT;
+}
+#endif
+
+// Check if the new app image is valid and works as expected: run the health
+// checks registered by the application, and the update server check
+static bool diagnostic(void) {
+  ESP_LOGI(OTA_TAG, "Running diagnostics ...");
+#ifdef CONFIG_OTA_HEALTH_CHECK_SERVER
+  health_register("server", check_server, CONFIG_FIRMWARE_MANIFEST_URL);
+#endif
+  return health_run(CONFIG_OTA_HEALTH_TIMEOUT * 1000);
+}
+
+// Log the memory the update client used so far, to size CONFIG_OTA_ARENA_SIZE
+// and the task stacks
+static void log_memory_usage(void) {
+  arena_stats_t arena;
+  arena_get_stats(&arena);
+  ESP_LOGI(OTA_TAG,
+           "Arena: %u of %u bytes used, peak %u, %" PRIu32
+           " allocations did not fit",
+           (unsigned)arena.used, (unsigned)arena.size, (unsigned)arena.peak,
+           arena.fallbacks);
+  ESP_LOGI(OTA_TAG, "Heap: %u bytes free, lowest %u, largest block %u",
+           (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+           (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+           (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  ESP_LOGI(OTA_TAG,
+           "Stack never used: %u of %u bytes (update task), %" PRIu32
+           " of %u bytes (flash task)",
+           (unsigned)uxTaskGetStackHighWaterMark(NULL),
+           CONFIG_OTA_TASK_STACK_SIZE, pipeline_stack_free(),
+           CONFIG_OTA_FLASH_TASK_STACK_SIZE);
+}
+
+#ifdef CONFIG_OTA_LOW_POWER
+// ---- Update windows ---------------------------------------------------------
+
+static const window_config_t window_config = {
+#ifdef CONFIG_OTA_POWER_DEEP_SLEEP
+    .sleep = WINDOW_DEEP_SLEEP,
+#else
+    .sleep = WINDOW_LIGHT_SLEEP,
+#endif
+    .period_ms = CONFIG_OTA_WINDOW_PERIOD * 1000,
+    .connect_ms = CONFIG_OTA_WINDOW_CONNECT_TIMEOUT * 1000,
+    .min_sleep_ms = CONFIG_OTA_WINDOW_MIN_SLEEP * 1000,
+    .random = esp_random,
+};
+
+// Kept across deep sleep, reset on power on
+static RTC_DATA_ATTR window_state_t window_state;
+
+// Clock of the windows: the system time, which the RTC timer keeps counting
+// during deep sleep while esp_timer restarts from 0
+static int64_t window_clock_us(void) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+#ifdef CONFIG_OTA_POWER_LIGHT_SLEEP
+// Let the CPU light sleep whenever every task waits, with the radio off
+// between windows nothing wakes it but the timers
+static void enable_light_sleep(void) {
+  esp_pm_config_t pm_config = {
+      .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+      .min_freq_mhz = CONFIG_XTAL_FREQ,
+      .light_sleep_enable = true,
+  };
+  esp_err_t err = esp_pm_configure(&pm_config);
+  if (err != ESP_OK) {
+    ESP_LOGW(OTA_TAG, "Failed to enable light sleep (%s)",
+             esp_err_to_name(err));
+  }
+}
+#endif
+
+// Turn the radio off until the next window, `wait_ms` from now. Deep sleep
+// does not return, the device restarts at the window.
+static void sleep_until_window(http_transport_t *transport,
+                               window_sleep_t sleep, uint32_t wait_ms) {
+  ESP_LOGI(OTA_TAG,
+           "Next update window in %" PRIu32 " s, %s sleep. %" PRIu32
+           " windows so far (%" PRIu32 " missed), radio on %" PRId64
+           " s, asleep %" PRId64 " s",
+           wait_ms / 1000, sleep == WINDOW_DEEP_SLEEP ? "deep" : "light",
+           window_state.windows, window_state.missed,
+           window_state.radio_us / 1000000, window_state.asleep_us / 1000000);
+  // The kept connection does not survive the radio, the TLS session does
+  if (transport->client != NULL) {
+    esp_http_client_close(transport->client);
+    transport->connected = false;
+  }
+  stop_wifi();
+
+  if (sleep == WINDOW_DEEP_SLEEP) {
+    esp_deep_sleep((uint64_t)wait_ms * 1000);
+  }
+  vTaskDelay(pdMS_TO_TICKS(wait_ms));
+  window_open(&window_state, window_clock_us());
+  resume_wifi();
+}
+#endif
+
+// Task to download new firmware from HTTP server
+// Runs every CONFIG_OTA_POLL_INTERVAL seconds while up to date, backs off from
+// CONFIG_OTA_RETRY_INTERVAL seconds on errors, or when the server asks to
+void download_new_firmware(void *pvParameter) {
+  static http_transport_t transport;
+  static partition_flash_t flash;
+  // Wi-Fi MAC address, identifying the device for staged rollouts
+  static char device_id[13];
+  uint8_t mac[6];
+  ESP_ERROR_CHECK(esp_read_mac(mac, ESP_MAC_WIFI_STA));
+  snprintf(device_id, sizeof(device_id), "%02x%02x%02x%02x%02x%02x", mac[0],
+           mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+  const ota_engine_config_t config = {
+      .transport = &http_transport,
+      .transport_ctx = &transport,
+      .flash = &partition_flash,
+      .flash_ctx = &flash,
+      .store = &nvs_store,
+      .store_ctx = NULL,
+      .manifest_url = CONFIG_FIRMWARE_MANIFEST_URL,
+      .image_url = CONFIG_FIRMWARE_UPG_URL,
+#ifdef CONFIG_OTA_VERIFY_SIGNATURE
+      .signing_key = (const char *)signing_key_pem_start,
+#endif
+      .device_id = device_id,
+#ifdef CONFIG_OTA_CATALOG
+      .channel = CONFIG_OTA_CHANNEL,
+#endif
+      .schedule =
+          {
+              .poll_interval_ms = CONFIG_OTA_POLL_INTERVAL * 1000,
+              .retry_min_ms = CONFIG_OTA_RETRY_INTERVAL * 1000,
+              .retry_max_ms = CONFIG_OTA_RETRY_MAX_INTERVAL * 1000,
+              .random = esp_random,
+          },
+#ifndef CONFIG_OTA_LOW_POWER
+      // A held request would keep the radio on
+      .long_poll_s = CONFIG_OTA_LONG_POLL_WAIT,
+#endif
+      .report_url =
+          CONFIG_OTA_REPORT_URL[0] != '\0' ? CONFIG_OTA_REPORT_URL : NULL,
+      .boot = &boot_stats,
+  };
+
+#ifdef CONFIG_OTA_LOW_POWER
+#ifdef CONFIG_OTA_POWER_LIGHT_SLEEP
+  enable_light_sleep();
+#endif
+  // Woken up for a window, the check that was due is due now
+  bool window_woke = window_init(&window_state, &window_config) &&
+                     esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER;
+  window_open(&window_state, window_clock_us());
+  // The AP may be out of reach, it is only waited for the window
+  boot_wait(BOOT_READY & ~BOOT_PHASE_BIT(BOOT_WIFI), portMAX_DELAY);
+#else
+  // Nothing to update before the network is up and the running firmware is
+  // known to be valid
+  boot_wait(BOOT_READY, portMAX_DELAY);
+#endif
+  boot_stats.startup_us = boot_start_us();
+  boot_stats.ready_us = boot_ready_us();
+
+  ESP_LOGI(OTA_TAG, "Starting new firmware download task");
+  // The manifests are parsed in the arena too
+  cJSON_Hooks hooks = {.malloc_fn = arena_malloc, .free_fn = arena_free};
+  cJSON_InitHooks(&hooks);
+  ota_engine_init(&config);
+  // Devices restarted together (after a power cut) spread their first checks
+  uint32_t delay_ms = ota_engine_first_check_ms();
+#ifdef CONFIG_OTA_LOW_POWER
+  if (window_woke) {
+    delay_ms = 0;
+  }
+#endif
+  ESP_LOGI(OTA_TAG, "First update check in %" PRIu32 " ms", delay_ms);
+  vTaskDelay(delay_ms / portTICK_PERIOD_MS);
+  while (1) {
+#ifdef CONFIG_OTA_LOW_POWER
+    if (wait_wifi(pdMS_TO_TICKS(window_config.connect_ms)) != WIFI_SUCCESS) {
+      ESP_LOGW(OTA_TAG, "AP not reached, update window given up");
+      window_sleep_t sleep;
+      uint32_t wait_ms =
+          window_plan(&window_state, &window_config, window_clock_us(),
+                      config.schedule.retry_min_ms, false, &sleep);
+      sleep_until_window(&transport, sleep, wait_ms);
+      continue;
+    }
+#else
+    if (!wifi_connected()) {
+      ESP_LOGI(OTA_TAG, "Waiting for the Wi-Fi connection...");
+      wait_wifi(portMAX_DELAY);
+    }
+#endif
+    ESP_LOGI(OTA_TAG, "Attempting to download new firmware...");
+    wifi_clear_lost();
+    ota_stats_t stats;
+    ota_result_t result = ota_engine_run(&stats);
+    ESP_LOGI(OTA_TAG,
+             "%" PRIu32 " requests, %" PRIu32 " new connections (%" PRId64
+             " ms connecting)",
+             stats.transport.requests, stats.transport.connections,
+             stats.transport.connect_us / 1000);
+    log_memory_usage();
+    if (result == OTA_UPDATED) {
+      break;
+    }
+#ifdef CONFIG_OTA_LOW_POWER
+    window_sleep_t sleep;
+    uint32_t wait_ms =
+        window_plan(&window_state, &window_config, window_clock_us(),
+                    stats.next_check_ms, true, &sleep);
+    if (sleep != WINDOW_STAY_AWAKE) {
+      sleep_until_window(&transport, sleep, wait_ms);
       continue;
     }
-    // --- Check written firmware -----------------------------------------
+#endif
+    // A transfer broken by the loss of the Wi-Fi connection is paused: it
+    // goes on as soon as the connection is back (from the checkpoint, with
+    // CONFIG_OTA_RESUME), instead of after the retry delay
+    if (result == OTA_FAILED && stats.failure == OTA_FAILURE_NETWORK &&
+        wifi_lost()) {
+      ESP_LOGI(OTA_TAG, "Wi-Fi connection lost, update paused");
+      wait_wifi(portMAX_DELAY);
+      ESP_LOGI(OTA_TAG, "Wi-Fi connection back, resuming the update");
+      continue;
+    }
+
+    ESP_LOGI(OTA_TAG, "Retrying in %" PRIu32 "s...",
+             stats.next_check_ms / 1000);
+    vTaskDelay(stats.next_check_ms / portTICK_PERIOD_MS);
+  }
 
-    // Apply the update
-    ESP_LOGI(OTA_TAG, "Prepare to restart system!");
-    http_cleanup(client);
+  // Apply the update
+  ESP_LOGI(OTA_TAG, "Prepare to restart system!");
 
-    ESP_LOGI(OTA_TAG, "Waiting for network stack to clean up...");
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
+  ESP_LOGI(OTA_TAG, "Waiting for network stack to clean up...");
+  vTaskDelay(2000 / portTICK_PERIOD_MS);
+
+  esp_restart();
+}
 
-    esp_restart();
+// Get the digests of the bootloader and of the running firmware, computed once
+// per build and then loaded from NVS
+static void get_boot_digests(boot_digests_t *digests) {
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  memset(digests, 0, sizeof(*digests));
+  digests->app_address = running->address;
+  memcpy(digests->app_elf_sha256, esp_app_get_description()->app_elf_sha256,
+         HASH_LEN);
+  // Bootloaders built before ESP-IDF 5.2 have no description to compare
+  bool cacheable = esp_ota_get_bootloader_description(
+                       NULL, &digests->bootloader_desc) == ESP_OK;
+
+  boot_digests_t stored;
+  size_t len = sizeof(stored);
+  if (cacheable &&
+      nvs_store_load(NULL, BOOT_DIGESTS_KEY, &stored, &len) == ESP_OK &&
+      len == sizeof(stored) &&
+      memcmp(&stored, digests, offsetof(boot_digests_t, bootloader_sha256)) ==
+          0) {
+    memcpy(digests, &stored, sizeof(stored));
     return;
   }
+
+  int64_t start = esp_timer_get_time();
+  esp_partition_t partition = {
+      .address = ESP_BOOTLOADER_OFFSET,
+      .size = ESP_PARTITION_TABLE_OFFSET,
+      .type = ESP_PARTITION_TYPE_APP,
+  };
+  esp_partition_get_sha256(&partition, digests->bootloader_sha256);
+  esp_partition_get_sha256(running, digests->app_sha256);
+  boot_stats.digests_us = esp_timer_get_time() - start;
+  ESP_LOGI(OTA_TAG, "Hashed the bootloader and the firmware in %" PRId64 " ms",
+           boot_stats.digests_us / 1000);
+
+  if (cacheable) {
+    esp_err_t err =
+        nvs_store_save(NULL, BOOT_DIGESTS_KEY, digests, sizeof(*digests));
+    if (err != ESP_OK) {
+      ESP_LOGW(OTA_TAG, "Failed to store the boot digests (%s)",
+               esp_err_to_name(err));
+    }
+  }
 }
 
-void diagnose_new_firmware() {
+void log_boot_digests(void) {
   uint8_t sha_256[HASH_LEN] = {0};
-  esp_partition_t partition = {0};
 
-  // Get sha256 digest for the partition table
-  partition.address = ESP_PARTITION_TABLE_OFFSET;
-  partition.size = ESP_PARTITION_TABLE_MAX_LEN;
-  partition.type = ESP_PARTITION_TYPE_DATA;
+  // Get sha256 digest for the partition table, at most 3 KB it is hashed on
+  // every boot
+  esp_partition_t partition = {
+      .address = ESP_PARTITION_TABLE_OFFSET,
+      .size = ESP_PARTITION_TABLE_MAX_LEN,
+      .type = ESP_PARTITION_TYPE_DATA,
+  };
   esp_partition_get_sha256(&partition, sha_256);
   print_sha256(sha_256, "SHA-256 for the partition table: ");
 
-  // Get sha256 digest for bootloader
-  partition.address = ESP_BOOTLOADER_OFFSET;
-  partition.size = ESP_PARTITION_TABLE_OFFSET;
-  partition.type = ESP_PARTITION_TYPE_APP;
-  esp_partition_get_sha256(&partition, sha_256);
-  print_sha256(sha_256, "SHA-256 for bootloader: ");
-
-  // Get sha256 digest for running partition
-  esp_partition_get_sha256(esp_ota_get_running_partition(), sha_256);
-  print_sha256(sha_256, "SHA-256 for current firmware: ");
+  // Get sha256 digest for bootloader and running partition
+  boot_digests_t digests;
+  get_boot_digests(&digests);
+  print_sha256(digests.bootloader_sha256, "SHA-256 for bootloader: ");
+  print_sha256(digests.app_sha256, "SHA-256 for current firmware: ");
+}
 
+void diagnose_new_firmware() {
   const esp_partition_t *running = esp_ota_get_running_partition();
   esp_ota_img_states_t ota_state;
 
   // Check validity of new app image on first boot
   if (esp_ota_get_state_partition(running, &ota_state) == ESP_OK) {
     if (ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
+      int64_t start = esp_timer_get_time();
       bool diagnostic_is_ok = diagnostic();
+      boot_stats.diagnostic_us = esp_timer_get_time() - start;
+      boot_stats.new_firmware = true;
       if (diagnostic_is_ok) {
         ESP_LOGI(
             OTA_TAG,
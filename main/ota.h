@@ -5,9 +5,15 @@
 // server
 void download_new_firmware(void *pvParameter);
 
-// Check if the new firmware works as expected on first boot.
-// If yes, mark app as valid to avoid rollback.
-// If not, rollback to previous version.
+// Log the SHA-256 digests of the partition table, the bootloader and the
+// running firmware
+void log_boot_digests(void);
+
+// Check if the new firmware works as expected on first boot, with the health
+// checks registered so far (see health.h) and a check of the update server.
+// If they all pass, mark app as valid to avoid rollback.
+// If one fails, or they do not all pass in CONFIG_OTA_HEALTH_TIMEOUT seconds,
+// rollback to previous version.
 void diagnose_new_firmware();
 
 #endif
@@ -0,0 +1,1864 @@
+#include "ota_engine.h"
+#include "cJSON.h"
+#include "delta.h"
+#include "esp_app_format.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "heatshrink.h"
+#include "mbedtls/sha256.h"
+#include "sdkconfig.h"
+#ifdef CONFIG_OTA_VERIFY_SIGNATURE
+#include "mbedtls/pk.h"
+#endif
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_LEN 32 /* SHA-256 digest length */
+#define MANIFEST_MAX_LEN 1280
+#define REPORT_MAX_LEN 768
+#define SIGNATURE_MAX_LEN 72 /* DER encoded ECDSA P-256 signature */
+#define ETAG_MAX_LEN 72 /* Quoted SHA-256 hex digest with some margin */
+#define URL_MAX_LEN 192
+#define NAME_MAX_LEN 64
+// First line of the signed manifest fields, see ota_https_server/src/signing.rs
+#define MANIFEST_SIGNATURE_CONTEXT "ota-manifest-v1"
+// Manifest URL with the target of the running firmware in its query string
+#define CATALOG_URL_MAX_LEN (URL_MAX_LEN + 160)
+
+// Start of the image checked before anything is written to the partition
+#define IMAGE_HEADER_LEN                                                       \
+  (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) +          \
+   sizeof(esp_app_desc_t))
+
+// Header of compressed images, see ota_https_server/src/heatshrink.rs
+#define COMPRESSED_MAGIC "ESPZ"
+#define COMPRESSED_FORMAT_VERSION 1
+#define COMPRESSED_HEADER_LEN 12
+
+// Header of block lists, see ota_https_server/src/blocks.rs. Blocks are flash
+// sectors, checked at the checkpoints of the download.
+#define BLOCKS_MAGIC "ESPB"
+#define BLOCKS_FORMAT_VERSION 1
+#define BLOCKS_HEADER_LEN 44
+#define BLOCK_BITS 12
+#define BLOCK_SIZE (1u << BLOCK_BITS)
+
+#define HTTP_STATUS_OK 200
+#define HTTP_STATUS_NO_CONTENT 204
+#define HTTP_STATUS_PARTIAL_CONTENT 206
+#define HTTP_STATUS_NOT_MODIFIED 304
+#define HTTP_STATUS_TOO_MANY_REQUESTS 429
+#define HTTP_STATUS_SERVICE_UNAVAILABLE 503
+
+#define OTA_STORE_ETAG_KEY "last_etag"
+#define OTA_STORE_CHECKPOINT_KEY "checkpoint"
+#define OTA_STORE_SCHEDULE_KEY "schedule"
+
+// Downloads are only resumed from flash sector boundaries, where every byte
+// before the offset is known to be written to the partition
+#define CHECKPOINT_ALIGN 4096
+
+// The response to a long poll is waited for this much longer than the server
+// was asked to wait
+#define LONG_POLL_MARGIN_S 10
+// Longest delay before the next long poll, so that a server answering at once
+// does not get a request loop
+#define LONG_POLL_GAP_MS 1000
+
+// Firmware image description published by the server
+typedef struct {
+  char name[NAME_MAX_LEN]; // File name of the image on the server
+  char version[32]; // Same layout as esp_app_desc_t.version
+  uint32_t secure_version;
+  uint32_t size;
+  uint8_t sha256[HASH_LEN];
+  // Signature of the name, versions, size and hash, see verify_manifest()
+  uint8_t signature[SIGNATURE_MAX_LEN];
+  size_t signature_len;                 // 0 if the manifest is not signed
+  char etag[ETAG_MAX_LEN];
+  bool not_modified; // The server answered 304, the fields above are unset
+  bool not_offered;  // The server answered 204, this device has to wait
+  char image_url[URL_MAX_LEN]; // Image, the configured URL if not sent
+  char compressed_url[URL_MAX_LEN]; // Compressed image, if offered
+  uint32_t compressed_size;
+  char delta_url[URL_MAX_LEN]; // Patch from the running firmware, if offered
+  uint32_t delta_size;
+  char blocks_url[URL_MAX_LEN]; // Block list of the image, if offered
+  uint32_t blocks_size;
+  uint8_t blocks_sha256[HASH_LEN];
+  uint8_t blocks_signature[SIGNATURE_MAX_LEN]; // Signature of blocks_sha256
+  size_t blocks_signature_len;
+} ota_manifest_t;
+
+// Progress of an image download, used to resume it after an interruption
+typedef struct {
+  char etag[ETAG_MAX_LEN];        // Image being downloaded
+  uint32_t partition_address;     // Update partition the image is written to
+  uint32_t offset;                // Bytes of the image written to the partition
+  mbedtls_sha256_context sha256;  // Hash of the first offset bytes
+} ota_checkpoint_t;
+
+// Image being written to the update partition, fed either with the
+// downloaded image or with the output of a decoder
+typedef struct {
+  uint32_t partition_address;    // Update partition the image is written to
+  const ota_manifest_t *manifest;
+  download_mode_t mode;          // What is downloaded to rebuild the image
+  bool in_progress;              // Track if the flash write has begun
+  bool wait_new_version;         // The image turned out to be already running
+  uint32_t length;               // Bytes of the image written to the partition
+  mbedtls_sha256_context sha256; // Hash of the bytes written
+  char header[IMAGE_HEADER_LEN]; // Start of the image, until it is checked
+  size_t header_len;
+} ota_image_t;
+
+// Compressed image being decompressed
+typedef struct {
+  uint8_t header[COMPRESSED_HEADER_LEN];
+  size_t header_len;
+  heatshrink_decoder_t decoder;
+} ota_compressed_t;
+
+// Result of comparing an available firmware version with the installed ones
+typedef enum {
+  VERSION_NEW,     // The version can be installed
+  VERSION_RUNNING, // The version is already running
+  VERSION_INVALID, // The version was already installed and rolled back
+} version_status_t;
+
+static const char *OTA_TAG = "OTA";
+
+// Platform the engine runs on
+static ota_engine_config_t platform;
+
+// Manifest URL asking the catalog of the server for the running target
+static char catalog_url[CATALOG_URL_MAX_LEN];
+
+// The boot phases were sent with a report
+static bool boot_reported;
+
+// ETag of the last image that was installed or found not worth installing
+static char last_etag[ETAG_MAX_LEN] = {0};
+
+#ifdef CONFIG_OTA_VERIFY_SIGNATURE
+// Public key verifying the manifests, parsed once
+static mbedtls_pk_context signing_key;
+static bool signing_key_loaded;
+#endif
+
+// Backoff state of the update checks, and the last one stored
+static schedule_t schedule;
+static schedule_t saved_schedule;
+
+// Last sector aligned progress of the current download
+static ota_checkpoint_t checkpoint;
+// Offset of the last checkpoint stored
+static uint32_t saved_checkpoint_offset;
+
+#if defined(CONFIG_OTA_DELTA) || defined(CONFIG_OTA_COMPRESSED)
+// Patch or compressed image being decoded, too large for the task stack.
+// Only one download runs at a time, so they share the memory.
+static union {
+  delta_t delta;
+  ota_compressed_t compressed;
+} decoder;
+// ETag of the last image a patch or compressed image failed to rebuild, it is
+// downloaded as is
+static char fallback_etag[ETAG_MAX_LEN] = {0};
+#endif
+
+#ifdef CONFIG_OTA_BLOCKS
+// Block list of the image being downloaded. It is kept until the download
+// is over, the retries of a corrupted block check against it again.
+static struct {
+  uint8_t *list;                 // Header then hashes, NULL without a list
+  char etag[ETAG_MAX_LEN];       // Image the list is of
+  uint32_t image_size;
+  mbedtls_sha256_context sha256; // Hash of the block being written
+} blocks;
+#endif
+
+void print_sha256(const uint8_t *image_hash, const char *label) {
+  char hash_print[HASH_LEN * 2 + 1];
+  hash_print[HASH_LEN * 2] = 0;
+  for (int i = 0; i < HASH_LEN; ++i) {
+    sprintf(&hash_print[i * 2], "%02x", image_hash[i]);
+  }
+  ESP_LOGI(OTA_TAG, "%s: %s", label, hash_print);
+}
+
+// Load the last seen image ETag from the store
+static void load_last_etag(void) {
+  size_t len = sizeof(last_etag) - 1;
+
+  memset(last_etag, 0, sizeof(last_etag));
+  if (platform.store->load(platform.store_ctx, OTA_STORE_ETAG_KEY, last_etag,
+                           &len) != ESP_OK) {
+    last_etag[0] = '\0';
+  }
+}
+
+// Store the last seen image ETag, so it survives reboots
+static void save_last_etag(const char *etag) {
+  if (etag[0] == '\0' || strcmp(etag, last_etag) == 0) {
+    return;
+  }
+
+  esp_err_t err = platform.store->save(platform.store_ctx, OTA_STORE_ETAG_KEY,
+                                       etag, strlen(etag));
+  if (err != ESP_OK) {
+    ESP_LOGW(OTA_TAG, "Failed to store the image ETag (%s)",
+             esp_err_to_name(err));
+    return;
+  }
+  strlcpy(last_etag, etag, sizeof(last_etag));
+}
+
+// Load the checkpoint of an interrupted download from the store
+static bool load_checkpoint(void) {
+  bool found = false;
+#ifdef CONFIG_OTA_RESUME
+  static ota_checkpoint_t stored;
+  size_t len = sizeof(stored);
+
+  // A checkpoint written by a different firmware build has a different size
+  if (platform.store->load(platform.store_ctx, OTA_STORE_CHECKPOINT_KEY,
+                           &stored, &len) == ESP_OK &&
+      len == sizeof(stored)) {
+    mbedtls_sha256_free(&checkpoint.sha256);
+    memcpy(&checkpoint, &stored, sizeof(checkpoint));
+    saved_checkpoint_offset = checkpoint.offset;
+    found = true;
+  }
+#endif
+  return found;
+}
+
+// Store the last sector aligned progress of the current download
+static void save_checkpoint(void) {
+  if (checkpoint.offset == 0 || checkpoint.offset == saved_checkpoint_offset) {
+    return;
+  }
+
+  esp_err_t err =
+      platform.store->save(platform.store_ctx, OTA_STORE_CHECKPOINT_KEY,
+                           &checkpoint, sizeof(checkpoint));
+  if (err != ESP_OK) {
+    ESP_LOGW(OTA_TAG, "Failed to store the download checkpoint (%s)",
+             esp_err_to_name(err));
+    return;
+  }
+  saved_checkpoint_offset = checkpoint.offset;
+  ESP_LOGD(OTA_TAG, "Download checkpoint stored at %" PRIu32,
+           checkpoint.offset);
+}
+
+// Forget the current download, the next one starts from the beginning.
+// Without CONFIG_OTA_RESUME no checkpoint is ever taken, so this and
+// save_checkpoint() have nothing to do.
+static void clear_checkpoint(void) {
+  if (saved_checkpoint_offset != 0) {
+    platform.store->erase(platform.store_ctx, OTA_STORE_CHECKPOINT_KEY);
+  }
+  mbedtls_sha256_free(&checkpoint.sha256);
+  memset(&checkpoint, 0, sizeof(checkpoint));
+  saved_checkpoint_offset = 0;
+}
+
+// Load the backoff state of the update checks from the store
+static void load_schedule(void) {
+  size_t len = sizeof(schedule);
+
+  if (platform.store->load(platform.store_ctx, OTA_STORE_SCHEDULE_KEY,
+                           &schedule, &len) != ESP_OK ||
+      len != sizeof(schedule)) {
+    memset(&schedule, 0, sizeof(schedule));
+  }
+  saved_schedule = schedule;
+}
+
+// Store the backoff state of the update checks if it changed, so that a
+// restart keeps the device where it was in its backoff. Up to date devices
+// keep the same state and write nothing.
+static void save_schedule(void) {
+  if (memcmp(&schedule, &saved_schedule, sizeof(schedule)) == 0) {
+    return;
+  }
+
+  esp_err_t err = platform.store->save(platform.store_ctx,
+                                       OTA_STORE_SCHEDULE_KEY, &schedule,
+                                       sizeof(schedule));
+  if (err != ESP_OK) {
+    ESP_LOGW(OTA_TAG, "Failed to store the update schedule (%s)",
+             esp_err_to_name(err));
+    return;
+  }
+  saved_schedule = schedule;
+}
+
+#ifdef CONFIG_OTA_BLOCKS
+// Start hashing a block, the image is written from a block boundary
+static void begin_block(void) {
+  if (blocks.list != NULL) {
+    mbedtls_sha256_starts(&blocks.sha256, 0);
+  }
+}
+
+// Hash bytes of the block being written, ending at `offset` of the image, and
+// check the block against its hash in the list once it is complete. Returns
+// ESP_ERR_INVALID_CRC if it does not match.
+static esp_err_t check_block(uint32_t offset, const char *data, size_t len) {
+  if (blocks.list == NULL) {
+    return ESP_OK;
+  }
+  mbedtls_sha256_update(&blocks.sha256, (const unsigned char *)data, len);
+  if (offset % BLOCK_SIZE != 0 && offset != blocks.image_size) {
+    return ESP_OK;
+  }
+
+  uint32_t index = (offset - 1) / BLOCK_SIZE;
+  uint8_t hash[HASH_LEN];
+  mbedtls_sha256_finish(&blocks.sha256, hash);
+  mbedtls_sha256_starts(&blocks.sha256, 0);
+  if (memcmp(hash, &blocks.list[BLOCKS_HEADER_LEN + index * HASH_LEN],
+             HASH_LEN) != 0) {
+    ESP_LOGW(OTA_TAG, "Block %" PRIu32 " (offset %" PRIu32 ") is corrupted",
+             index, index * BLOCK_SIZE);
+    return ESP_ERR_INVALID_CRC;
+  }
+  return ESP_OK;
+}
+#endif
+
+// Hash and write image data to the update partition.
+// When resuming is enabled, the progress is checkpointed at every flash
+// sector boundary and stored every CONFIG_OTA_RESUME_CHECKPOINT_INTERVAL KB.
+// With a block list every block is checked before its checkpoint, so that the
+// progress kept never includes a corrupted block.
+static esp_err_t write_image_data(mbedtls_sha256_context *sha256,
+                                  uint32_t *offset, const char *data,
+                                  size_t len) {
+  while (len > 0) {
+    size_t chunk_len = len;
+#ifdef CONFIG_OTA_RESUME
+    size_t to_boundary = CHECKPOINT_ALIGN - (*offset % CHECKPOINT_ALIGN);
+    if (chunk_len > to_boundary) {
+      chunk_len = to_boundary;
+    }
+#endif
+
+    esp_err_t err = platform.flash->write(platform.flash_ctx, data, chunk_len);
+    if (err != ESP_OK) {
+      return err;
+    }
+    mbedtls_sha256_update(sha256, (const unsigned char *)data, chunk_len);
+    *offset += chunk_len;
+    data += chunk_len;
+    len -= chunk_len;
+
+#ifdef CONFIG_OTA_BLOCKS
+    err = check_block(*offset, data - chunk_len, chunk_len);
+    if (err != ESP_OK) {
+      return err;
+    }
+#endif
+#ifdef CONFIG_OTA_RESUME
+    if (*offset % CHECKPOINT_ALIGN == 0) {
+      // Cloning also moves a hardware accelerated hash state into the context
+      mbedtls_sha256_clone(&checkpoint.sha256, sha256);
+      checkpoint.offset = *offset;
+      if (checkpoint.offset - saved_checkpoint_offset >=
+          CONFIG_OTA_RESUME_CHECKPOINT_INTERVAL * 1024) {
+        save_checkpoint();
+      }
+    }
+#endif
+  }
+  return ESP_OK;
+}
+
+// Compare the version of an available firmware with the running firmware and
+// with the last firmware that was rolled back
+static version_status_t check_new_version(const char *new_version) {
+  esp_app_desc_t running_app_info = {0};
+  if (platform.flash->running_desc(platform.flash_ctx, &running_app_info) ==
+      ESP_OK) {
+    ESP_LOGI(OTA_TAG, "Running firmware version: %s",
+             running_app_info.version);
+  }
+
+  // Get last invalid firmware info
+  esp_app_desc_t invalid_app_info;
+  if (platform.flash->invalid_desc(platform.flash_ctx, &invalid_app_info) ==
+      ESP_OK) {
+    ESP_LOGI(OTA_TAG, "Last invalid firmware version: %s",
+             invalid_app_info.version);
+
+    // Check current firmware version with last invalid firmware version
+    if (memcmp(invalid_app_info.version, new_version,
+               sizeof(invalid_app_info.version)) == 0) {
+      ESP_LOGW(OTA_TAG, "New version is the same as an invalid version.");
+      ESP_LOGW(OTA_TAG,
+               "Previously, there was an attempt to launch the "
+               "firmware with %s version, but it failed.",
+               invalid_app_info.version);
+      ESP_LOGW(OTA_TAG, "The firmware has been rolled back to the "
+                        "previous version.");
+      return VERSION_INVALID;
+    }
+  }
+
+#ifndef CONFIG_SKIP_VERSION_CHECK
+  // Check new firmware version
+  if (memcmp(new_version, running_app_info.version,
+             sizeof(running_app_info.version)) == 0) {
+    ESP_LOGW(OTA_TAG, "Current running version is the same as a new. "
+                      "The update will not be made.");
+    return VERSION_RUNNING;
+  }
+#endif
+
+  return VERSION_NEW;
+}
+
+// Check the version of the image from its header, then start writing it to
+// the update partition
+static esp_err_t image_begin(ota_image_t *image) {
+  esp_app_desc_t new_app_info;
+
+  // ---- Version check ---------------------------------------------
+  // Get new firmware info
+  memcpy(&new_app_info,
+         &image->header[sizeof(esp_image_header_t) +
+                        sizeof(esp_image_segment_header_t)],
+         sizeof(esp_app_desc_t));
+  ESP_LOGI(OTA_TAG, "New firmware version: %s", new_app_info.version);
+
+  // Another image cannot match the manifest hash, there is no need to write
+  // it to find out
+  if (memcmp(new_app_info.version, image->manifest->version,
+             sizeof(new_app_info.version)) != 0) {
+    ESP_LOGE(OTA_TAG, "Image version does not match the manifest");
+    return ESP_ERR_INVALID_VERSION;
+  }
+
+  version_status_t version_status = check_new_version(new_app_info.version);
+  if (version_status == VERSION_RUNNING) {
+    image->wait_new_version = true;
+  }
+  if (version_status != VERSION_NEW) {
+    return ESP_ERR_INVALID_VERSION;
+  }
+  // ---- Version check ----------------------------------------------
+
+  // ---- Begin OTA segment write to partition -----------------------
+  ESP_LOGI(OTA_TAG, "Writing to the update partition at offset 0x%" PRIx32,
+           image->partition_address);
+
+  esp_err_t err = platform.flash->begin(platform.flash_ctx, 0);
+  if (err != ESP_OK) {
+    return err;
+  }
+  image->in_progress = true;
+  ESP_LOGI(OTA_TAG, "Updating firmware...");
+  // ---- Begin OTA segment write to partition -----------------------
+
+  // Start tracking the progress of the new download
+  clear_checkpoint();
+  strlcpy(checkpoint.etag, image->manifest->etag, sizeof(checkpoint.etag));
+  checkpoint.partition_address = image->partition_address;
+  mbedtls_sha256_init(&checkpoint.sha256);
+  return ESP_OK;
+}
+
+static esp_err_t image_append(ota_image_t *image, const char *data,
+                              size_t len) {
+  if (image->length + len > image->manifest->size) {
+    ESP_LOGE(OTA_TAG, "Image is larger than advertised by the manifest");
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return write_image_data(&image->sha256, &image->length, data, len);
+}
+
+// Write the next bytes of the image.
+// Nothing is written until the image header is complete and its version
+// checked, if the version is not to be installed ESP_ERR_INVALID_VERSION is
+// returned.
+static esp_err_t image_write(void *ctx, const void *data, size_t len) {
+  ota_image_t *image = ctx;
+  const char *bytes = data;
+
+  if (!image->in_progress) {
+    size_t chunk = IMAGE_HEADER_LEN - image->header_len;
+    if (chunk > len) {
+      chunk = len;
+    }
+    memcpy(&image->header[image->header_len], bytes, chunk);
+    image->header_len += chunk;
+    bytes += chunk;
+    len -= chunk;
+    if (image->header_len < IMAGE_HEADER_LEN) {
+      return ESP_OK;
+    }
+
+    esp_err_t err = image_begin(image);
+    if (err == ESP_OK) {
+      err = image_append(image, image->header, IMAGE_HEADER_LEN);
+    }
+    if (err != ESP_OK || len == 0) {
+      return err;
+    }
+  }
+
+  return image_append(image, bytes, len);
+}
+
+#ifdef CONFIG_OTA_DELTA
+// Read the running firmware, which patches are applied to
+static esp_err_t read_running_image(void *ctx, uint32_t offset, void *data,
+                                    size_t len) {
+  return platform.flash->read_running(platform.flash_ctx, offset, data, len);
+}
+#endif
+
+#ifdef CONFIG_OTA_COMPRESSED
+// Decompress the next bytes of a compressed image into the image
+static esp_err_t compressed_feed(ota_compressed_t *compressed,
+                                 ota_image_t *image, const char *data,
+                                 size_t len) {
+  if (compressed->header_len < COMPRESSED_HEADER_LEN) {
+    size_t chunk = COMPRESSED_HEADER_LEN - compressed->header_len;
+    if (chunk > len) {
+      chunk = len;
+    }
+    memcpy(&compressed->header[compressed->header_len], data, chunk);
+    compressed->header_len += chunk;
+    data += chunk;
+    len -= chunk;
+    if (compressed->header_len < COMPRESSED_HEADER_LEN) {
+      return ESP_OK;
+    }
+
+    const uint8_t *header = compressed->header;
+    uint32_t size = header[8] | header[9] << 8 | header[10] << 16 |
+                    (uint32_t)header[11] << 24;
+    if (memcmp(header, COMPRESSED_MAGIC, 4) != 0 ||
+        header[4] != COMPRESSED_FORMAT_VERSION ||
+        size != image->manifest->size) {
+      ESP_LOGE(OTA_TAG, "Not a compressed image of the expected size");
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    esp_err_t err = heatshrink_decoder_init(&compressed->decoder, header[5],
+                                            header[6], image_write, image);
+    if (err != ESP_OK || len == 0) {
+      return err;
+    }
+  }
+
+  return heatshrink_decoder_feed(&compressed->decoder, (const uint8_t *)data,
+                                 len);
+}
+#endif
+
+// Choose the smallest download that rebuilds the image.
+// Patches and compressed images are neither used to resume an interrupted
+// download nor for an image they already failed to rebuild.
+static download_mode_t choose_download(const ota_manifest_t *manifest,
+                                       uint32_t resume_offset) {
+#if defined(CONFIG_OTA_DELTA) || defined(CONFIG_OTA_COMPRESSED)
+  if (resume_offset > 0 || manifest->etag[0] == '\0' ||
+      strcmp(manifest->etag, fallback_etag) == 0) {
+    return DOWNLOAD_IMAGE;
+  }
+#endif
+#ifdef CONFIG_OTA_DELTA
+  if (manifest->delta_url[0] != '\0') {
+    return DOWNLOAD_DELTA;
+  }
+#endif
+#ifdef CONFIG_OTA_COMPRESSED
+  if (manifest->compressed_url[0] != '\0') {
+    return DOWNLOAD_COMPRESSED;
+  }
+#endif
+  return DOWNLOAD_IMAGE;
+}
+
+// Prepare the decoder rebuilding the image from the download
+static void begin_decoding(download_mode_t mode, ota_image_t *image) {
+#ifdef CONFIG_OTA_DELTA
+  if (mode == DOWNLOAD_DELTA) {
+    delta_init(&decoder.delta, image->manifest->sha256, read_running_image,
+               image_write, image);
+  }
+#endif
+#ifdef CONFIG_OTA_COMPRESSED
+  if (mode == DOWNLOAD_COMPRESSED) {
+    memset(&decoder.compressed, 0, sizeof(decoder.compressed));
+  }
+#endif
+}
+
+// Pass downloaded data to the decoder or directly to the image, called from
+// the flash task of the download pipeline
+static esp_err_t process_download(void *ctx, const char *data, size_t len) {
+  ota_image_t *image = ctx;
+
+#ifdef CONFIG_OTA_DELTA
+  if (image->mode == DOWNLOAD_DELTA) {
+    return delta_feed(&decoder.delta, (const uint8_t *)data, len);
+  }
+#endif
+#ifdef CONFIG_OTA_COMPRESSED
+  if (image->mode == DOWNLOAD_COMPRESSED) {
+    return compressed_feed(&decoder.compressed, image, data, len);
+  }
+#endif
+  return image_write(image, data, len);
+}
+
+// Check that the whole download was decoded
+static esp_err_t finish_decoding(download_mode_t mode) {
+#ifdef CONFIG_OTA_DELTA
+  if (mode == DOWNLOAD_DELTA) {
+    return delta_finish(&decoder.delta);
+  }
+#endif
+  return ESP_OK;
+}
+
+// Download the image as is the next times, the download failed to rebuild it
+static void fall_back_to_image(download_mode_t mode,
+                               const ota_manifest_t *manifest) {
+#if defined(CONFIG_OTA_DELTA) || defined(CONFIG_OTA_COMPRESSED)
+  if (mode != DOWNLOAD_IMAGE) {
+    ESP_LOGW(OTA_TAG, "Failed to rebuild the image, the next attempt "
+                      "downloads it as is");
+    strlcpy(fallback_etag, manifest->etag, sizeof(fallback_etag));
+  }
+#endif
+}
+
+// Classify an error writing the download. The image is refused if its header
+// or size is wrong, a patch or compressed image that failed is retried as the
+// image itself.
+static ota_failure_t consume_failure(download_mode_t mode, esp_err_t err) {
+  if (mode != DOWNLOAD_IMAGE) {
+    return OTA_FAILURE_SERVER;
+  } else if (err == ESP_ERR_INVALID_VERSION || err == ESP_ERR_INVALID_SIZE) {
+    return OTA_FAILURE_REJECTED;
+  }
+  return OTA_FAILURE_DEVICE;
+}
+
+// Parse `len` hex encoded bytes
+static esp_err_t parse_hex(const char *hex, uint8_t *data, size_t len) {
+  if (strlen(hex) != len * 2) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  for (size_t i = 0; i < len * 2; ++i) {
+    char c = hex[i];
+    uint8_t nibble;
+    if (c >= '0' && c <= '9') {
+      nibble = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      nibble = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      nibble = c - 'A' + 10;
+    } else {
+      return ESP_ERR_INVALID_ARG;
+    }
+    data[i / 2] = (i % 2 == 0) ? nibble << 4 : data[i / 2] | nibble;
+  }
+  return ESP_OK;
+}
+
+// Get the delay the server asked for in the Retry-After header of the
+// response, in seconds. Dates are not supported, the device clock may not be
+// set.
+static uint32_t get_retry_after(void) {
+  char value[16] = {0};
+  if (platform.transport->get_header(platform.transport_ctx, "Retry-After",
+                                     value, sizeof(value)) != ESP_OK) {
+    return 0;
+  }
+  char *end;
+  unsigned long seconds = strtoul(value, &end, 10);
+  return end != value && *end == '\0' ? (uint32_t)seconds : 0;
+}
+
+// Get the max-age directive of the Cache-Control header of the response, in
+// seconds: how long the server wants the answer to stand before the next poll
+static uint32_t get_max_age(void) {
+  char value[64] = {0};
+  if (platform.transport->get_header(platform.transport_ctx, "Cache-Control",
+                                     value, sizeof(value)) != ESP_OK) {
+    return 0;
+  }
+  const char *max_age = strstr(value, "max-age=");
+  return max_age != NULL
+             ? (uint32_t)strtoul(max_age + strlen("max-age="), NULL, 10)
+             : 0;
+}
+
+// Build the URL of an absolute path on the firmware upgrade server
+static esp_err_t server_url(const char *path, char *url, size_t len) {
+  const char *base = platform.image_url;
+  const char *host = strstr(base, "://");
+  host = host != NULL ? host + 3 : base;
+  size_t origin_len = (host - base) + strcspn(host, "/");
+
+  if (path[0] != '/') {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (origin_len + strlen(path) + 1 > len) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(url, base, origin_len);
+  strcpy(&url[origin_len], path);
+  return ESP_OK;
+}
+
+// Parse an optional alternative download of the image in the manifest, the
+// URL is left empty if there is none
+static void parse_variant(const cJSON *json, const char *name,
+                          char url[URL_MAX_LEN], uint32_t *size) {
+  const cJSON *variant = cJSON_GetObjectItemCaseSensitive(json, name);
+  const cJSON *variant_url = cJSON_GetObjectItemCaseSensitive(variant, "url");
+  const cJSON *variant_size =
+      cJSON_GetObjectItemCaseSensitive(variant, "size");
+
+  if (cJSON_IsString(variant_url) && cJSON_IsNumber(variant_size) &&
+      variant_size->valuedouble >= 0 &&
+      server_url(variant_url->valuestring, url, URL_MAX_LEN) == ESP_OK) {
+    *size = (uint32_t)variant_size->valuedouble;
+  } else {
+    url[0] = '\0';
+  }
+}
+
+#ifdef CONFIG_OTA_BLOCKS
+// Parse the block list of the image in the manifest, the URL is left empty if
+// there is none
+static void parse_blocks(const cJSON *json, ota_manifest_t *manifest) {
+  const cJSON *blocks = cJSON_GetObjectItemCaseSensitive(json, "blocks");
+  const cJSON *sha256 = cJSON_GetObjectItemCaseSensitive(blocks, "sha256");
+  const cJSON *signature =
+      cJSON_GetObjectItemCaseSensitive(blocks, "signature");
+
+  parse_variant(json, "blocks", manifest->blocks_url, &manifest->blocks_size);
+  if (!cJSON_IsString(sha256) ||
+      parse_hex(sha256->valuestring, manifest->blocks_sha256, HASH_LEN) !=
+          ESP_OK) {
+    manifest->blocks_url[0] = '\0';
+    return;
+  }
+  // Only sent when the server has a signing key or a signature file
+  if (cJSON_IsString(signature)) {
+    size_t signature_len = strlen(signature->valuestring) / 2;
+    if (signature_len <= SIGNATURE_MAX_LEN &&
+        parse_hex(signature->valuestring, manifest->blocks_signature,
+                  signature_len) == ESP_OK) {
+      manifest->blocks_signature_len = signature_len;
+    }
+  }
+}
+#endif
+
+// Parse the JSON manifest published by the server
+static esp_err_t parse_manifest(const char *data, size_t len,
+                                ota_manifest_t *manifest) {
+  cJSON *json = cJSON_ParseWithLength(data, len);
+  if (json == NULL) {
+    ESP_LOGE(OTA_TAG, "Failed to parse the firmware manifest");
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+
+  esp_err_t err = ESP_OK;
+  const cJSON *name = cJSON_GetObjectItemCaseSensitive(json, "name");
+  const cJSON *version = cJSON_GetObjectItemCaseSensitive(json, "version");
+  const cJSON *secure_version =
+      cJSON_GetObjectItemCaseSensitive(json, "secure_version");
+  const cJSON *size = cJSON_GetObjectItemCaseSensitive(json, "size");
+  const cJSON *sha256 = cJSON_GetObjectItemCaseSensitive(json, "sha256");
+  if (!cJSON_IsString(version) || !cJSON_IsNumber(size) ||
+      size->valuedouble < 0 || !cJSON_IsString(sha256)) {
+    ESP_LOGE(OTA_TAG, "Firmware manifest is missing the version, size or hash");
+    err = ESP_ERR_INVALID_RESPONSE;
+  } else if (parse_hex(sha256->valuestring, manifest->sha256, HASH_LEN) !=
+             ESP_OK) {
+    ESP_LOGE(OTA_TAG, "Firmware manifest has an invalid hash");
+    err = ESP_ERR_INVALID_RESPONSE;
+  } else {
+    // Pad with zeros like esp_app_desc_t.version so they can be compared
+    memset(manifest->version, 0, sizeof(manifest->version));
+    memcpy(manifest->version, version->valuestring,
+           strnlen(version->valuestring, sizeof(manifest->version)));
+    manifest->size = (uint32_t)size->valuedouble;
+  }
+  if (cJSON_IsString(name) &&
+      strlen(name->valuestring) < sizeof(manifest->name)) {
+    strcpy(manifest->name, name->valuestring);
+  } else {
+    manifest->name[0] = '\0';
+  }
+  manifest->secure_version =
+      cJSON_IsNumber(secure_version) && secure_version->valuedouble > 0
+          ? (uint32_t)secure_version->valuedouble
+          : 0;
+
+  // Only sent when the server has a signing key
+  const cJSON *signature = cJSON_GetObjectItemCaseSensitive(json, "signature");
+  if (err == ESP_OK && cJSON_IsString(signature)) {
+    size_t signature_len = strlen(signature->valuestring) / 2;
+    if (signature_len > SIGNATURE_MAX_LEN ||
+        parse_hex(signature->valuestring, manifest->signature,
+                  signature_len) != ESP_OK) {
+      ESP_LOGE(OTA_TAG, "Firmware manifest has an invalid signature");
+      err = ESP_ERR_INVALID_RESPONSE;
+    } else {
+      manifest->signature_len = signature_len;
+    }
+  }
+
+  // The image depends on the device with a catalog, older servers do not say
+  const cJSON *url = cJSON_GetObjectItemCaseSensitive(json, "url");
+  if (!cJSON_IsString(url) ||
+      server_url(url->valuestring, manifest->image_url, URL_MAX_LEN) !=
+          ESP_OK) {
+    manifest->image_url[0] = '\0';
+  }
+
+  if (err == ESP_OK) {
+    parse_variant(json, "compressed", manifest->compressed_url,
+                  &manifest->compressed_size);
+    // Only sent when the server has a patch from the running firmware
+    parse_variant(json, "delta", manifest->delta_url, &manifest->delta_size);
+#ifdef CONFIG_OTA_BLOCKS
+    parse_blocks(json, manifest);
+#endif
+  }
+
+  cJSON_Delete(json);
+  return err;
+}
+
+// Download the manifest of the firmware image from the server.
+// The request is conditional on the last seen image ETag, if the image did not
+// change the server answers with 304 and manifest->not_modified is set.
+static esp_err_t fetch_manifest(ota_manifest_t *manifest, ota_stats_t *stats) {
+  static char manifest_data[MANIFEST_MAX_LEN + 1] = {0};
+  const ota_transport_t *transport = platform.transport;
+  void *ctx = platform.transport_ctx;
+  const char *headers[8];
+  size_t header_count = 0;
+
+  memset(manifest, 0, sizeof(*manifest));
+  if (last_etag[0] != '\0') {
+    headers[header_count++] = "If-None-Match";
+    headers[header_count++] = last_etag;
+  }
+  // Without an ETag there is nothing to wait for, the manifest comes at once
+  char prefer[24];
+  bool long_poll = platform.long_poll_s > 0 && last_etag[0] != '\0' &&
+                   transport->set_timeout != NULL;
+  if (long_poll) {
+    snprintf(prefer, sizeof(prefer), "wait=%" PRIu32, platform.long_poll_s);
+    headers[header_count++] = "Prefer";
+    headers[header_count++] = prefer;
+    transport->set_timeout(ctx,
+                           (platform.long_poll_s + LONG_POLL_MARGIN_S) * 1000);
+  }
+  if (platform.device_id != NULL) {
+    headers[header_count++] = "X-Device-Id";
+    headers[header_count++] = platform.device_id;
+  }
+#ifdef CONFIG_OTA_DELTA
+  // Lets the server offer a patch from the running firmware
+  char elf_sha256[HASH_LEN * 2 + 1] = {0};
+  esp_app_desc_t running_app_info;
+  if (platform.flash->running_desc(platform.flash_ctx, &running_app_info) ==
+      ESP_OK) {
+    for (int i = 0; i < HASH_LEN; ++i) {
+      sprintf(&elf_sha256[i * 2], "%02x", running_app_info.app_elf_sha256[i]);
+    }
+    headers[header_count++] = "X-App-Elf-Sha256";
+    headers[header_count++] = elf_sha256;
+  }
+#endif
+
+  int status;
+  esp_err_t err = transport->open(ctx, platform.manifest_url, headers,
+                                  header_count / 2, &status);
+  if (long_poll) {
+    transport->set_timeout(ctx, 0);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(OTA_TAG, "Failed to open HTTP connection with %s: %s",
+             platform.manifest_url, esp_err_to_name(err));
+    stats->failure = OTA_FAILURE_NETWORK;
+    return err;
+  }
+
+  stats->max_age_s = get_max_age();
+  if (long_poll) {
+    char applied[16];
+    stats->long_polled =
+        transport->get_header(ctx, "Preference-Applied", applied,
+                              sizeof(applied)) == ESP_OK;
+  }
+  if (status == HTTP_STATUS_NOT_MODIFIED) {
+    transport->close(ctx);
+    manifest->not_modified = true;
+    return ESP_OK;
+  } else if (status == HTTP_STATUS_NO_CONTENT) {
+    // Staged rollout the device is not part of yet
+    stats->retry_after_s = get_retry_after();
+    transport->close(ctx);
+    manifest->not_offered = true;
+    return ESP_OK;
+  } else if (status != HTTP_STATUS_OK) {
+    ESP_LOGE(OTA_TAG, "Unexpected HTTP status %d for the firmware manifest",
+             status);
+    if (status == HTTP_STATUS_TOO_MANY_REQUESTS ||
+        status == HTTP_STATUS_SERVICE_UNAVAILABLE) {
+      stats->retry_after_s = get_retry_after();
+    }
+    transport->close(ctx);
+    stats->failure = OTA_FAILURE_SERVER;
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  if (transport->get_header(ctx, "ETag", manifest->etag,
+                            sizeof(manifest->etag)) != ESP_OK) {
+    manifest->etag[0] = '\0';
+  }
+
+  int manifest_len = 0;
+  while (manifest_len < MANIFEST_MAX_LEN) {
+    int data_read = transport->read(ctx, manifest_data + manifest_len,
+                                    MANIFEST_MAX_LEN - manifest_len);
+    if (data_read < 0) {
+      transport->close(ctx);
+      stats->failure = OTA_FAILURE_NETWORK;
+      return ESP_FAIL;
+    } else if (data_read == 0) {
+      break;
+    }
+    manifest_len += data_read;
+  }
+
+  if (!transport->is_complete(ctx)) {
+    ESP_LOGE(OTA_TAG, "Firmware manifest is incomplete or larger than %d bytes",
+             MANIFEST_MAX_LEN);
+    transport->close(ctx);
+    stats->failure = OTA_FAILURE_NETWORK;
+    return ESP_ERR_INVALID_SIZE;
+  }
+  transport->close(ctx);
+
+  manifest_data[manifest_len] = '\0';
+  err = parse_manifest(manifest_data, manifest_len, manifest);
+  if (err != ESP_OK) {
+    stats->failure = OTA_FAILURE_SERVER;
+  }
+  return err;
+}
+
+#ifdef CONFIG_OTA_VERIFY_SIGNATURE
+// Hash the manifest fields the server signs, one per line:
+//   ota-manifest-v1
+//   <name>
+//   <version>
+//   <secure_version>
+//   <size>
+//   <sha256 in lowercase hex>
+static esp_err_t hash_signed_fields(const ota_manifest_t *manifest,
+                                    uint8_t digest[HASH_LEN]) {
+  size_t version_len = strnlen(manifest->version, sizeof(manifest->version));
+  // A field holding a line break could pass for other fields
+  if (manifest->name[0] == '\0' || strchr(manifest->name, '\n') != NULL ||
+      memchr(manifest->version, '\n', version_len) != NULL) {
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+
+  char numbers[24];
+  int numbers_len = snprintf(numbers, sizeof(numbers), "%" PRIu32 "\n%" PRIu32,
+                             manifest->secure_version, manifest->size);
+  char sha256[HASH_LEN * 2 + 1];
+  for (int i = 0; i < HASH_LEN; i++) {
+    snprintf(&sha256[i * 2], 3, "%02x", manifest->sha256[i]);
+  }
+
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, 0);
+  mbedtls_sha256_update(&ctx,
+                        (const unsigned char *)MANIFEST_SIGNATURE_CONTEXT "\n",
+                        strlen(MANIFEST_SIGNATURE_CONTEXT) + 1);
+  mbedtls_sha256_update(&ctx, (const unsigned char *)manifest->name,
+                        strlen(manifest->name));
+  mbedtls_sha256_update(&ctx, (const unsigned char *)"\n", 1);
+  mbedtls_sha256_update(&ctx, (const unsigned char *)manifest->version,
+                        version_len);
+  mbedtls_sha256_update(&ctx, (const unsigned char *)"\n", 1);
+  mbedtls_sha256_update(&ctx, (const unsigned char *)numbers, numbers_len);
+  mbedtls_sha256_update(&ctx, (const unsigned char *)"\n", 1);
+  mbedtls_sha256_update(&ctx, (const unsigned char *)sha256, HASH_LEN * 2);
+  mbedtls_sha256_update(&ctx, (const unsigned char *)"\n", 1);
+  mbedtls_sha256_finish(&ctx, digest);
+  mbedtls_sha256_free(&ctx);
+  return ESP_OK;
+}
+#endif
+
+// Check that the manifest was signed by the update server before anything is
+// downloaded. The signature covers the name, version, secure version, size and
+// SHA-256 of the image, and every byte written is hashed against the SHA-256,
+// so what the manifest says about the image is authenticated. Patches and
+// compressed images only have to rebuild it.
+// It does not prove the manifest is current: any manifest the server ever
+// signed verifies, which check_secure_version() limits to the images that
+// anti-rollback would accept anyway.
+static esp_err_t verify_manifest(const ota_manifest_t *manifest) {
+#ifdef CONFIG_OTA_VERIFY_SIGNATURE
+  if (!signing_key_loaded) {
+    ESP_LOGE(OTA_TAG, "No key to verify the firmware manifest with");
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (manifest->signature_len == 0) {
+    ESP_LOGE(OTA_TAG, "Firmware manifest is not signed");
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+
+  uint8_t digest[HASH_LEN];
+  if (hash_signed_fields(manifest, digest) != ESP_OK) {
+    ESP_LOGE(OTA_TAG, "Firmware manifest has an invalid name or version");
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  int ret = mbedtls_pk_verify(&signing_key, MBEDTLS_MD_SHA256, digest,
+                              HASH_LEN, manifest->signature,
+                              manifest->signature_len);
+  if (ret != 0) {
+    ESP_LOGE(OTA_TAG, "Firmware manifest signature is invalid (-0x%04x)",
+             (unsigned int)-ret);
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  ESP_LOGI(OTA_TAG, "Firmware manifest signature verified");
+#endif
+  return ESP_OK;
+}
+
+// Refuse an image with a lower secure version than the running firmware, as
+// the bootloader would with anti-rollback. An older manifest replayed by the
+// server, a mirror or a man in the middle is still validly signed.
+static esp_err_t check_secure_version(const ota_manifest_t *manifest) {
+  esp_app_desc_t running;
+  if (platform.flash->running_desc(platform.flash_ctx, &running) != ESP_OK) {
+    return ESP_OK;
+  }
+  if (manifest->secure_version < running.secure_version) {
+    ESP_LOGE(OTA_TAG,
+             "Firmware secure version %" PRIu32
+             " is lower than the running one (%" PRIu32 ")",
+             manifest->secure_version, running.secure_version);
+    return ESP_ERR_INVALID_VERSION;
+  }
+  return ESP_OK;
+}
+
+// Find out if an interrupted download of the image can be resumed.
+// Returns the offset to resume from, or 0 to start from the beginning.
+static uint32_t check_interrupted_download(const ota_manifest_t *manifest,
+                                           uint32_t partition_address) {
+  if (!load_checkpoint()) {
+    return 0;
+  }
+
+  // Only resume the same image into the same partition
+  if (manifest->etag[0] != '\0' &&
+      strcmp(checkpoint.etag, manifest->etag) == 0 &&
+      checkpoint.partition_address == partition_address &&
+      checkpoint.offset % CHECKPOINT_ALIGN == 0 &&
+      checkpoint.offset < manifest->size) {
+    ESP_LOGI(OTA_TAG,
+             "Resuming interrupted download at %" PRIu32 "/%" PRIu32 " bytes",
+             checkpoint.offset, manifest->size);
+    return checkpoint.offset;
+  }
+  ESP_LOGI(OTA_TAG, "Discarding the checkpoint of a different image");
+  clear_checkpoint();
+  return 0;
+}
+
+#ifdef CONFIG_OTA_BLOCKS
+// Forget the block list of the last download
+static void release_blocks(void) {
+  if (blocks.list != NULL) {
+    free(blocks.list);
+    mbedtls_sha256_free(&blocks.sha256);
+  }
+  memset(&blocks, 0, sizeof(blocks));
+}
+
+// Check a downloaded block list: it must be the one of the manifest, and
+// describe the image of the manifest in blocks of the size checked here
+static esp_err_t check_blocks(const ota_manifest_t *manifest,
+                              const uint8_t *list) {
+  uint8_t hash[HASH_LEN];
+  mbedtls_sha256_context sha256;
+  mbedtls_sha256_init(&sha256);
+  mbedtls_sha256_starts(&sha256, 0);
+  mbedtls_sha256_update(&sha256, list, manifest->blocks_size);
+  mbedtls_sha256_finish(&sha256, hash);
+  mbedtls_sha256_free(&sha256);
+
+  uint32_t size = list[8] | list[9] << 8 | list[10] << 16 |
+                  (uint32_t)list[11] << 24;
+  if (memcmp(hash, manifest->blocks_sha256, HASH_LEN) != 0 ||
+      memcmp(list, BLOCKS_MAGIC, 4) != 0 ||
+      list[4] != BLOCKS_FORMAT_VERSION || list[5] != BLOCK_BITS ||
+      size != manifest->size ||
+      memcmp(&list[12], manifest->sha256, HASH_LEN) != 0) {
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  return ESP_OK;
+}
+
+// Download the block list of the image, unless it is the one of the last
+// attempt. Without a usable list the image is only checked once complete.
+static esp_err_t load_blocks(const ota_manifest_t *manifest) {
+  const ota_transport_t *transport = platform.transport;
+  void *ctx = platform.transport_ctx;
+
+  if (blocks.list != NULL && strcmp(blocks.etag, manifest->etag) == 0) {
+    return ESP_OK;
+  }
+  release_blocks();
+  uint32_t count = (manifest->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (manifest->blocks_url[0] == '\0' || manifest->etag[0] == '\0' ||
+      manifest->blocks_size != BLOCKS_HEADER_LEN + count * HASH_LEN) {
+    return ESP_ERR_NOT_FOUND;
+  }
+#ifdef CONFIG_OTA_VERIFY_SIGNATURE
+  // The manifest signature only covers the image
+  if (manifest->blocks_signature_len == 0 ||
+      mbedtls_pk_verify(&signing_key, MBEDTLS_MD_SHA256,
+                        manifest->blocks_sha256, HASH_LEN,
+                        manifest->blocks_signature,
+                        manifest->blocks_signature_len) != 0) {
+    ESP_LOGW(OTA_TAG, "Block list is not signed, blocks are not checked");
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+#endif
+
+  uint8_t *list = malloc(manifest->blocks_size);
+  if (list == NULL) {
+    ESP_LOGW(OTA_TAG, "No memory for the block list, blocks are not checked");
+    return ESP_ERR_NO_MEM;
+  }
+  int status;
+  esp_err_t err =
+      transport->open(ctx, manifest->blocks_url, NULL, 0, &status);
+  if (err == ESP_OK) {
+    uint32_t len = 0;
+    int data_read;
+    while (len < manifest->blocks_size &&
+           (data_read = transport->read(ctx, (char *)&list[len],
+                                        manifest->blocks_size - len)) > 0) {
+      len += data_read;
+    }
+    if (status != HTTP_STATUS_OK || len != manifest->blocks_size ||
+        !transport->is_complete(ctx) || check_blocks(manifest, list) != ESP_OK) {
+      err = ESP_ERR_INVALID_RESPONSE;
+    }
+    transport->close(ctx);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGW(OTA_TAG, "Failed to get the block list (%s), blocks are not "
+                      "checked", esp_err_to_name(err));
+    free(list);
+    return err;
+  }
+
+  blocks.list = list;
+  strlcpy(blocks.etag, manifest->etag, sizeof(blocks.etag));
+  blocks.image_size = manifest->size;
+  mbedtls_sha256_init(&blocks.sha256);
+  ESP_LOGI(OTA_TAG, "Checking the image in %" PRIu32 " blocks", count);
+  return ESP_OK;
+}
+
+// Keep the blocks of the image an interrupted attempt already wrote to the
+// update partition, past the checkpoint if there is one: the blocks from
+// `offset` that match the list are skipped, as from a checkpoint. Returns the
+// offset to download from. The last block is always downloaded, the image is
+// then completed as usual.
+static uint32_t keep_written_blocks(const ota_manifest_t *manifest,
+                                    uint32_t partition_address,
+                                    uint32_t offset) {
+  uint32_t last = (manifest->size - 1) / BLOCK_SIZE * BLOCK_SIZE;
+  if (platform.flash->read_update == NULL || offset >= last) {
+    return offset;
+  }
+  uint8_t *block = malloc(BLOCK_SIZE);
+  if (block == NULL) {
+    return offset;
+  }
+
+  mbedtls_sha256_context image_sha256, block_sha256;
+  mbedtls_sha256_init(&image_sha256);
+  mbedtls_sha256_init(&block_sha256);
+  if (offset > 0) {
+    mbedtls_sha256_clone(&image_sha256, &checkpoint.sha256);
+  } else {
+    mbedtls_sha256_starts(&image_sha256, 0);
+  }
+
+  uint32_t kept = offset;
+  uint8_t hash[HASH_LEN];
+  while (kept < last &&
+         platform.flash->read_update(platform.flash_ctx, kept, block,
+                                     BLOCK_SIZE) == ESP_OK) {
+    mbedtls_sha256_starts(&block_sha256, 0);
+    mbedtls_sha256_update(&block_sha256, block, BLOCK_SIZE);
+    mbedtls_sha256_finish(&block_sha256, hash);
+    if (memcmp(hash, &blocks.list[BLOCKS_HEADER_LEN + kept / BLOCK_SIZE *
+                                                          HASH_LEN],
+               HASH_LEN) != 0) {
+      break;
+    }
+    mbedtls_sha256_update(&image_sha256, block, BLOCK_SIZE);
+    kept += BLOCK_SIZE;
+  }
+  free(block);
+  mbedtls_sha256_free(&block_sha256);
+
+  if (kept > offset) {
+    ESP_LOGI(OTA_TAG,
+             "Keeping %" PRIu32 " bytes already written to the update "
+             "partition",
+             kept);
+    if (offset == 0) {
+      clear_checkpoint();
+      strlcpy(checkpoint.etag, manifest->etag, sizeof(checkpoint.etag));
+      checkpoint.partition_address = partition_address;
+      mbedtls_sha256_init(&checkpoint.sha256);
+    }
+    mbedtls_sha256_clone(&checkpoint.sha256, &image_sha256);
+    checkpoint.offset = kept;
+  }
+  mbedtls_sha256_free(&image_sha256);
+  return kept;
+}
+#endif
+
+// Download the image described by the manifest, or rebuild it from a patch or
+// compressed image, and write it to the update partition
+static ota_result_t download_image(const ota_manifest_t *manifest,
+                                   uint32_t partition_address,
+                                   ota_stats_t *stats) {
+  const ota_transport_t *transport = platform.transport;
+  void *ctx = platform.transport_ctx;
+  esp_err_t err;
+
+  // ---- Check interrupted download -----------------------------------
+  uint32_t resume_offset =
+      check_interrupted_download(manifest, partition_address);
+  // ---- Check interrupted download -----------------------------------
+
+  // ---- Choose download -----------------------------------------------
+  download_mode_t mode = choose_download(manifest, resume_offset);
+  const char *url = manifest->image_url[0] != '\0' ? manifest->image_url
+                                                  : platform.image_url;
+  if (mode == DOWNLOAD_DELTA) {
+    url = manifest->delta_url;
+    ESP_LOGI(OTA_TAG,
+             "Downloading a %" PRIu32 " bytes patch instead of the %" PRIu32
+             " bytes image",
+             manifest->delta_size, manifest->size);
+  } else if (mode == DOWNLOAD_COMPRESSED) {
+    url = manifest->compressed_url;
+    ESP_LOGI(OTA_TAG,
+             "Downloading the %" PRIu32 " bytes compressed image instead of "
+             "the %" PRIu32 " bytes image",
+             manifest->compressed_size, manifest->size);
+  }
+  stats->mode = mode;
+  // ---- Choose download -----------------------------------------------
+
+#ifdef CONFIG_OTA_BLOCKS
+  // ---- Check blocks --------------------------------------------------
+  if (mode == DOWNLOAD_IMAGE && load_blocks(manifest) == ESP_OK) {
+    resume_offset =
+        keep_written_blocks(manifest, partition_address, resume_offset);
+  }
+  // ---- Check blocks --------------------------------------------------
+#endif
+
+  // ---- Connect to HTTP server ---------------------------------------
+  const char *headers[4];
+  size_t header_count = 0;
+  char range[32];
+  if (resume_offset > 0) {
+    // If the image changed the server ignores the range and sends it all
+    snprintf(range, sizeof(range), "bytes=%" PRIu32 "-", resume_offset);
+    headers[header_count++] = "Range";
+    headers[header_count++] = range;
+    headers[header_count++] = "If-Range";
+    headers[header_count++] = manifest->etag;
+  }
+
+  int status;
+  int64_t request_start = esp_timer_get_time();
+  err = transport->open(ctx, url, headers, header_count / 2, &status);
+  int64_t request_us = esp_timer_get_time() - request_start;
+  if (err != ESP_OK) {
+    ESP_LOGE(OTA_TAG,
+             "Failed to open HTTP connection with the firmware upgrade "
+             "server (%s): %s",
+             url, esp_err_to_name(err));
+    stats->failure = OTA_FAILURE_NETWORK;
+    return OTA_FAILED;
+  }
+
+  if (status == HTTP_STATUS_OK && resume_offset > 0) {
+    ESP_LOGW(OTA_TAG, "Server sent the whole image, restarting download");
+    clear_checkpoint();
+    resume_offset = 0;
+  } else if (status != HTTP_STATUS_OK &&
+             !(status == HTTP_STATUS_PARTIAL_CONTENT && resume_offset > 0)) {
+    ESP_LOGE(OTA_TAG, "Unexpected HTTP status %d", status);
+    // The server is busy, the next attempt comes when it asked for
+    if (status == HTTP_STATUS_TOO_MANY_REQUESTS ||
+        status == HTTP_STATUS_SERVICE_UNAVAILABLE) {
+      stats->retry_after_s = get_retry_after();
+    }
+    transport->close(ctx);
+    stats->failure = OTA_FAILURE_SERVER;
+    return OTA_FAILED;
+  }
+  // ---- Connect to HTTP server ---------------------------------------
+
+  // Handle recieved packet
+  ota_image_t image = {
+      .partition_address = partition_address,
+      .manifest = manifest,
+      .mode = mode,
+  };
+  mbedtls_sha256_init(&image.sha256);
+  mbedtls_sha256_starts(&image.sha256, 0);
+
+  bool ota_error = false;            // If a retry is needed
+  bool ota_wait_new_version = false; // If OTA succeded but no update needed
+  bool ota_resumable = manifest->etag[0] != '\0'; // If progress can be kept
+
+  // A decoded download rebuilds the image, which is checked and written as
+  // usual
+  begin_decoding(mode, &image);
+
+  // ---- Check image ---------------------------------------------------
+  // An image that changed since the manifest was fetched cannot match its
+  // hash, so it is not downloaded at all. Partial content must also be from
+  // the image already written, never mix the bytes of two images.
+  if (mode == DOWNLOAD_IMAGE && manifest->etag[0] != '\0') {
+    char image_etag[ETAG_MAX_LEN] = {0};
+    transport->get_header(ctx, "ETag", image_etag, sizeof(image_etag));
+    if (strcmp(image_etag, manifest->etag) != 0 &&
+        (image_etag[0] != '\0' || resume_offset > 0)) {
+      ESP_LOGE(OTA_TAG, "%s",
+               resume_offset > 0
+                   ? "Partial content is from a different image"
+                   : "Image changed since the manifest was fetched");
+      stats->failure = OTA_FAILURE_SERVER;
+      ota_error = true;
+    }
+  }
+  // ---- Check image ---------------------------------------------------
+
+  // ---- Resume OTA segment write to partition ------------------------
+  if (!ota_error && resume_offset > 0) {
+    err = platform.flash->begin(platform.flash_ctx, resume_offset);
+    if (err != ESP_OK) {
+      clear_checkpoint();
+      stats->failure = OTA_FAILURE_DEVICE;
+      ota_error = true;
+    } else {
+      mbedtls_sha256_clone(&image.sha256, &checkpoint.sha256);
+      image.length = resume_offset;
+      // The header was checked when the download was started
+      image.in_progress = true;
+      stats->resume_offset = resume_offset;
+      ESP_LOGI(OTA_TAG, "Updating firmware...");
+    }
+  }
+  // ---- Resume OTA segment write to partition ------------------------
+
+  // --- Write new firmware segment to partition ------------------------
+  // Network reads and flash writes overlap, each on its own task
+  if (!ota_error) {
+#ifdef CONFIG_OTA_BLOCKS
+    begin_block();
+#endif
+    pipeline_run(transport->read, ctx, process_download, &image,
+                 &stats->pipeline);
+    stats->ttfb_us = request_us + stats->pipeline.first_byte_us;
+
+    if (image.wait_new_version) {
+      ota_wait_new_version = true;
+    } else if (stats->pipeline.consume_err == ESP_ERR_INVALID_CRC) {
+      // Corrupted on the way, the blocks before it are kept
+      stats->failure = OTA_FAILURE_NETWORK;
+      stats->bad_blocks++;
+      ota_error = true;
+    } else if (stats->pipeline.consume_err != ESP_OK) {
+      stats->failure = consume_failure(mode, stats->pipeline.consume_err);
+      fall_back_to_image(mode, manifest);
+      ota_resumable = false;
+      ota_error = true;
+    } else if (stats->pipeline.network_err != ESP_OK) {
+      stats->failure = OTA_FAILURE_NETWORK;
+      ota_error = true;
+    }
+    ESP_LOGD(OTA_TAG, "Written image length %" PRIu32, image.length);
+  }
+  stats->image_len = image.length;
+  // --- Write new firmware segment to partition -----------------------
+
+  // Everything was received, check that it was completely decoded
+  bool complete = transport->is_complete(ctx);
+  transport->close(ctx);
+  if (!ota_error && !ota_wait_new_version && complete &&
+      finish_decoding(mode) != ESP_OK) {
+    // The whole image is downloaded next time
+    stats->failure = OTA_FAILURE_SERVER;
+    fall_back_to_image(mode, manifest);
+    ota_resumable = false;
+    ota_error = true;
+  }
+
+  // Keep the progress of an interrupted download to resume it later, the
+  // image can be resumed even if it was being decoded
+  bool ota_incomplete = !ota_wait_new_version &&
+                        (ota_error || !complete ||
+                         image.length != manifest->size);
+  if (ota_incomplete && image.in_progress) {
+    if (ota_resumable) {
+      save_checkpoint();
+    } else {
+      clear_checkpoint();
+    }
+    platform.flash->abort(platform.flash_ctx);
+  }
+
+  uint8_t image_hash[HASH_LEN];
+  mbedtls_sha256_finish(&image.sha256, image_hash);
+  mbedtls_sha256_free(&image.sha256);
+
+  if (ota_error) {
+    ESP_LOGE(OTA_TAG, "An error occurred during OTA");
+    return OTA_FAILED;
+  } else if (ota_wait_new_version) {
+    ESP_LOGI(OTA_TAG, "No new firmware version available");
+    return OTA_UP_TO_DATE;
+  }
+
+  // --- Check written firmware -----------------------------------------
+  ESP_LOGI(OTA_TAG, "Total Write binary data length: %" PRIu32, image.length);
+
+  if (ota_incomplete) {
+    ESP_LOGE(OTA_TAG, "Error in receiving complete file");
+    stats->failure = OTA_FAILURE_NETWORK;
+    return OTA_FAILED;
+  }
+
+  // The image is complete, its progress is no longer needed
+  clear_checkpoint();
+
+  if (memcmp(image_hash, manifest->sha256, HASH_LEN) != 0) {
+    print_sha256(image_hash, "SHA-256 of the downloaded image");
+    ESP_LOGE(OTA_TAG, "Image hash does not match the manifest");
+    // A patch or compressed image that rebuilt the wrong image is retried as
+    // the image itself, the image would be the same again
+    stats->failure =
+        mode == DOWNLOAD_IMAGE ? OTA_FAILURE_REJECTED : OTA_FAILURE_SERVER;
+    fall_back_to_image(mode, manifest);
+    platform.flash->abort(platform.flash_ctx);
+    return OTA_FAILED;
+  }
+
+  int64_t finish_start = esp_timer_get_time();
+  err = platform.flash->finish(platform.flash_ctx);
+  stats->finish_us = esp_timer_get_time() - finish_start;
+  if (err != ESP_OK) {
+    stats->failure = OTA_FAILURE_DEVICE;
+    return OTA_FAILED;
+  }
+  // --- Check written firmware -----------------------------------------
+
+  // The installed image does not need to be downloaded again
+  save_last_etag(manifest->etag);
+  return OTA_UPDATED;
+}
+
+// Append a parameter to the query string of a URL, percent-encoding its value
+static esp_err_t append_query(char *url, size_t len, const char *name,
+                              const char *value) {
+  size_t pos = strlen(url);
+  int written = snprintf(&url[pos], len - pos, "%c%s=",
+                         strchr(url, '?') != NULL ? '&' : '?', name);
+  if (written < 0 || (size_t)written >= len - pos) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  pos += written;
+
+  for (const char *c = value; *c != '\0'; c++) {
+    bool unreserved = isalnum((unsigned char)*c) || strchr("-._~", *c) != NULL;
+    if (pos + (unreserved ? 1 : 3) >= len) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    if (unreserved) {
+      url[pos++] = *c;
+    } else {
+      pos += sprintf(&url[pos], "%%%02X", (unsigned char)*c);
+    }
+  }
+  url[pos] = '\0';
+  return ESP_OK;
+}
+
+// Build the manifest URL asking the catalog of the server for the image of
+// the running firmware target in a release channel. The chip and its minimum
+// revision come from the image header, they are not in esp_app_desc_t.
+static esp_err_t build_catalog_url(const char *channel, char *url,
+                                   size_t len) {
+  esp_app_desc_t desc;
+  esp_image_header_t header;
+  esp_err_t err = platform.flash->running_desc(platform.flash_ctx, &desc);
+  if (err == ESP_OK) {
+    err = platform.flash->read_running(platform.flash_ctx, 0, &header,
+                                       sizeof(header));
+  }
+  if (err != ESP_OK) {
+    return err;
+  }
+  if (strlen(platform.manifest_url) >= len) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  char project[sizeof(desc.project_name) + 1] = {0};
+  memcpy(project, desc.project_name, sizeof(desc.project_name));
+  char chip[8], min_rev[8], secure_version[12];
+  snprintf(chip, sizeof(chip), "%u", (unsigned)header.chip_id);
+  snprintf(min_rev, sizeof(min_rev), "%u", (unsigned)header.min_chip_rev_full);
+  snprintf(secure_version, sizeof(secure_version), "%" PRIu32,
+           desc.secure_version);
+
+  strcpy(url, platform.manifest_url);
+  err = append_query(url, len, "project", project);
+  if (err == ESP_OK) {
+    err = append_query(url, len, "chip", chip);
+  }
+  if (err == ESP_OK) {
+    err = append_query(url, len, "min_rev", min_rev);
+  }
+  if (err == ESP_OK) {
+    err = append_query(url, len, "channel", channel);
+  }
+  if (err == ESP_OK) {
+    err = append_query(url, len, "secure_version", secure_version);
+  }
+  return err;
+}
+
+void ota_engine_init(const ota_engine_config_t *config) {
+  platform = *config;
+  load_last_etag();
+  load_schedule();
+
+  if (platform.channel != NULL) {
+    esp_err_t err =
+        build_catalog_url(platform.channel, catalog_url, sizeof(catalog_url));
+    if (err == ESP_OK) {
+      platform.manifest_url = catalog_url;
+      ESP_LOGI(OTA_TAG, "Manifest URL: %s", catalog_url);
+    } else {
+      ESP_LOGE(OTA_TAG, "Failed to build the catalog manifest URL (%s)",
+               esp_err_to_name(err));
+    }
+  }
+
+#ifdef CONFIG_OTA_VERIFY_SIGNATURE
+  mbedtls_pk_free(&signing_key);
+  mbedtls_pk_init(&signing_key);
+  // The PEM length includes its terminating NUL
+  signing_key_loaded =
+      platform.signing_key != NULL &&
+      mbedtls_pk_parse_public_key(
+          &signing_key, (const unsigned char *)platform.signing_key,
+          strlen(platform.signing_key) + 1) == 0;
+  if (!signing_key_loaded) {
+    ESP_LOGE(OTA_TAG, "Invalid manifest signing key, updates are refused");
+  }
+#endif
+}
+
+// Check for a new firmware and install it if there is one
+static ota_result_t check_for_update(ota_stats_t *stats) {
+  uint32_t partition_address, partition_size;
+  esp_err_t err = platform.flash->update_partition(
+      platform.flash_ctx, &partition_address, &partition_size);
+  if (err != ESP_OK) {
+    ESP_LOGE(OTA_TAG, "No update partition (%s)", esp_err_to_name(err));
+    stats->failure = OTA_FAILURE_DEVICE;
+    return OTA_FAILED;
+  }
+
+  // ---- Check manifest -----------------------------------------------
+  // Only the small manifest is downloaded until a new version is available
+  ota_manifest_t manifest;
+  int64_t start = esp_timer_get_time();
+  err = fetch_manifest(&manifest, stats);
+  stats->manifest_us = esp_timer_get_time() - start;
+  if (err != ESP_OK) {
+    ESP_LOGE(OTA_TAG, "Failed to get the firmware manifest");
+    return OTA_FAILED;
+  }
+
+  if (manifest.not_modified) {
+    ESP_LOGI(OTA_TAG, "Firmware image not modified");
+    return OTA_UP_TO_DATE;
+  } else if (manifest.not_offered) {
+    ESP_LOGI(OTA_TAG, "New firmware not offered to this device yet");
+    return OTA_UP_TO_DATE;
+  }
+  // Nothing in the manifest is trusted before its signature is checked
+  if (verify_manifest(&manifest) != ESP_OK ||
+      check_secure_version(&manifest) != ESP_OK) {
+    stats->failure = OTA_FAILURE_REJECTED;
+    return OTA_FAILED;
+  }
+  ESP_LOGI(OTA_TAG, "Available firmware version: %.*s",
+           (int)sizeof(manifest.version), manifest.version);
+
+  if (check_new_version(manifest.version) != VERSION_NEW) {
+    ESP_LOGI(OTA_TAG, "No new firmware version available");
+
+    // Let the server answer 304 until the image changes
+    save_last_etag(manifest.etag);
+    return OTA_UP_TO_DATE;
+  }
+
+  if (manifest.size > partition_size) {
+    ESP_LOGE(OTA_TAG,
+             "Firmware image (%" PRIu32 " bytes) does not fit in the update "
+             "partition (%" PRIu32 " bytes)",
+             manifest.size, partition_size);
+    stats->failure = OTA_FAILURE_REJECTED;
+    return OTA_FAILED;
+  }
+  // ---- Check manifest -----------------------------------------------
+
+  start = esp_timer_get_time();
+  ota_result_t result = download_image(&manifest, partition_address, stats);
+#ifdef CONFIG_OTA_BLOCKS
+  // A corrupted block is downloaded again at once, resuming from its start
+  uint32_t bad_blocks = 0;
+  while (result == OTA_FAILED && stats->bad_blocks > bad_blocks &&
+         stats->bad_blocks <= CONFIG_OTA_BLOCK_RETRIES) {
+    bad_blocks = stats->bad_blocks;
+    stats->failure = OTA_FAILURE_NONE;
+    ESP_LOGW(OTA_TAG, "Downloading the image again from the corrupted block");
+    result = download_image(&manifest, partition_address, stats);
+  }
+  release_blocks();
+#endif
+  stats->download_us = esp_timer_get_time() - start;
+  return result;
+}
+
+// Schedule the next update check. The server hints replace the computed
+// delay: Retry-After always, the manifest max-age while there is nothing to
+// install.
+static uint32_t schedule_next_check(ota_result_t result,
+                                    const ota_stats_t *stats) {
+  static const schedule_outcome_t OUTCOMES[] = {
+      [OTA_FAILURE_NONE] = SCHEDULE_OK,
+      [OTA_FAILURE_NETWORK] = SCHEDULE_RETRY,
+      [OTA_FAILURE_SERVER] = SCHEDULE_RETRY,
+      [OTA_FAILURE_REJECTED] = SCHEDULE_REJECTED,
+      [OTA_FAILURE_DEVICE] = SCHEDULE_RETRY,
+  };
+  // A failure nothing classified is retried
+  schedule_outcome_t outcome =
+      result == OTA_FAILED && stats->failure == OTA_FAILURE_NONE
+          ? SCHEDULE_RETRY
+          : OUTCOMES[stats->failure];
+
+  uint32_t hint_s = stats->retry_after_s;
+  if (hint_s == 0 && result == OTA_UP_TO_DATE) {
+    hint_s = stats->max_age_s;
+  }
+  uint32_t delay_ms = schedule_next(&schedule, &platform.schedule, outcome,
+                                    hint_s * 1000);
+  save_schedule();
+  // The server held the request until there was something new or its wait
+  // ended, the next one waits again right away
+  if (stats->long_polled && result == OTA_UP_TO_DATE) {
+    delay_ms = platform.schedule.random() % LONG_POLL_GAP_MS;
+  }
+  if (schedule.failures > 0) {
+    ESP_LOGI(OTA_TAG, "%" PRIu32 " failed update checks in a row",
+             schedule.failures);
+  }
+  return delay_ms;
+}
+
+static void get_transport_stats(ota_transport_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (platform.transport->get_stats != NULL) {
+    platform.transport->get_stats(platform.transport_ctx, stats);
+  }
+}
+
+static void add_ms(cJSON *report, const char *name, int64_t us) {
+  cJSON_AddNumberToObject(report, name, (double)(us / 1000));
+}
+
+// Build the summary of an update check sent to the server, NULL if out of
+// memory
+static cJSON *build_report(ota_result_t result, const ota_stats_t *stats) {
+  static const char *const RESULTS[] = {
+      [OTA_UPDATED] = "updated",
+      [OTA_UP_TO_DATE] = "up_to_date",
+      [OTA_FAILED] = "failed",
+  };
+  static const char *const FAILURES[] = {
+      [OTA_FAILURE_NONE] = "none",       [OTA_FAILURE_NETWORK] = "network",
+      [OTA_FAILURE_SERVER] = "server",   [OTA_FAILURE_REJECTED] = "rejected",
+      [OTA_FAILURE_DEVICE] = "device",
+  };
+  static const char *const MODES[] = {
+      [DOWNLOAD_IMAGE] = "image",
+      [DOWNLOAD_COMPRESSED] = "compressed",
+      [DOWNLOAD_DELTA] = "delta",
+  };
+  cJSON *report = cJSON_CreateObject();
+  if (report == NULL) {
+    return NULL;
+  }
+
+  esp_app_desc_t running;
+  if (platform.device_id != NULL) {
+    cJSON_AddStringToObject(report, "device_id", platform.device_id);
+  }
+  if (platform.flash->running_desc(platform.flash_ctx, &running) == ESP_OK) {
+    char version[sizeof(running.version) + 1] = {0};
+    memcpy(version, running.version, sizeof(running.version));
+    cJSON_AddStringToObject(report, "version", version);
+  }
+  cJSON_AddStringToObject(report, "result", RESULTS[result]);
+  cJSON_AddStringToObject(report, "failure", FAILURES[stats->failure]);
+
+  // ---- Phases, in milliseconds ---------------------------------------
+  add_ms(report, "manifest_ms", stats->manifest_us);
+  add_ms(report, "connect_ms", stats->transport.connect_us);
+  add_ms(report, "handshake_ms", stats->transport.handshake_us);
+  cJSON_AddNumberToObject(report, "requests", stats->transport.requests);
+  cJSON_AddNumberToObject(report, "connections",
+                          stats->transport.connections);
+  if (stats->pipeline.bytes > 0) {
+    cJSON_AddStringToObject(report, "mode", MODES[stats->mode]);
+    add_ms(report, "ttfb_ms", stats->ttfb_us);
+    add_ms(report, "download_ms", stats->download_us);
+    add_ms(report, "network_ms", stats->pipeline.network_us);
+    add_ms(report, "flash_ms", stats->pipeline.flash_us);
+    add_ms(report, "finish_ms", stats->finish_us);
+    cJSON_AddNumberToObject(report, "bytes", stats->pipeline.bytes);
+    cJSON_AddNumberToObject(report, "resume_offset", stats->resume_offset);
+    if (stats->bad_blocks > 0) {
+      cJSON_AddNumberToObject(report, "bad_blocks", stats->bad_blocks);
+    }
+  }
+  cJSON_AddNumberToObject(report, "next_check_ms", stats->next_check_ms);
+
+  if (platform.boot != NULL && !boot_reported) {
+    cJSON *boot = cJSON_AddObjectToObject(report, "boot");
+    add_ms(boot, "startup_ms", platform.boot->startup_us);
+    add_ms(boot, "ready_ms", platform.boot->ready_us);
+    add_ms(boot, "digests_ms", platform.boot->digests_us);
+    add_ms(boot, "diagnostic_ms", platform.boot->diagnostic_us);
+    cJSON_AddBoolToObject(boot, "new_firmware", platform.boot->new_firmware);
+  }
+  return report;
+}
+
+// Send the summary of an update check to the server. Telemetry is best
+// effort: a report that cannot be sent is dropped.
+static void send_report(ota_result_t result, const ota_stats_t *stats) {
+  static char report_data[REPORT_MAX_LEN];
+  const ota_transport_t *transport = platform.transport;
+  void *ctx = platform.transport_ctx;
+
+  if (platform.report_url == NULL || transport->post == NULL) {
+    return;
+  }
+  cJSON *report = build_report(result, stats);
+  bool printed = report != NULL &&
+                 cJSON_PrintPreallocated(report, report_data,
+                                         sizeof(report_data), false);
+  cJSON_Delete(report);
+  if (!printed) {
+    ESP_LOGW(OTA_TAG, "Failed to build the update report");
+    return;
+  }
+
+  int status = 0;
+  esp_err_t err = transport->post(ctx, platform.report_url, "application/json",
+                                  report_data, strlen(report_data), &status);
+  if (err == ESP_OK) {
+    // Drain the response so the connection can be reused
+    char discard[64];
+    while (transport->read(ctx, discard, sizeof(discard)) > 0) {
+    }
+    transport->close(ctx);
+  }
+  if (err != ESP_OK || status < 200 || status >= 300) {
+    ESP_LOGW(OTA_TAG, "Failed to send the update report (%s, status %d)",
+             esp_err_to_name(err), status);
+    return;
+  }
+  boot_reported = true;
+}
+
+ota_result_t ota_engine_run(ota_stats_t *stats) {
+  ota_stats_t unused;
+  if (stats == NULL) {
+    stats = &unused;
+  }
+  memset(stats, 0, sizeof(*stats));
+
+  ota_transport_stats_t before, after;
+  get_transport_stats(&before);
+  ota_result_t result = check_for_update(stats);
+  get_transport_stats(&after);
+
+  stats->transport = (ota_transport_stats_t){
+      .requests = after.requests - before.requests,
+      .connections = after.connections - before.connections,
+      .resumed = after.resumed - before.resumed,
+      .connect_us = after.connect_us - before.connect_us,
+      .handshake_us = after.handshake_us - before.handshake_us,
+  };
+  stats->next_check_ms = schedule_next_check(result, stats);
+  // Not counted in the transport stats of the check
+  send_report(result, stats);
+  return result;
+}
+
+uint32_t ota_engine_first_check_ms(void) {
+  return schedule_first(&schedule, &platform.schedule);
+}
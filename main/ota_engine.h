@@ -0,0 +1,184 @@
+#ifndef OTA_ENGINE_H
+#define OTA_ENGINE_H
+
+#include "esp_app_desc.h"
+#include "esp_err.h"
+#include "pipeline.h"
+#include "schedule.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The engine polls the manifest, then downloads, verifies and writes a new
+// image. It only talks to the platform through the interfaces below, so it runs
+// both on the device (ota.c) and on a Linux host against simulated flash
+// (host/).
+
+// Connections made by a transport. Transports that cannot tell the TLS
+// handshake apart from connecting leave `resumed` and `handshake_us` at 0.
+typedef struct {
+  uint32_t requests;    // Requests sent
+  uint32_t connections; // Connections opened, the other requests reused one
+  uint32_t resumed;     // Connections resuming a previous TLS session
+  int64_t connect_us;   // Time spent connecting, TLS handshakes included
+  int64_t handshake_us; // Time spent in TLS handshakes
+} ota_transport_stats_t;
+
+// HTTP client used for the manifest and image requests
+typedef struct {
+  // Send a GET request with extra headers (`header_count` name/value pairs)
+  // and read the response headers
+  esp_err_t (*open)(void *ctx, const char *url, const char *const *headers,
+                    size_t header_count, int *status);
+  // Copy a response header, ESP_ERR_NOT_FOUND if the server did not send it
+  esp_err_t (*get_header)(void *ctx, const char *name, char *value,
+                          size_t len);
+  // Read the response body. Returns the number of bytes read, 0 once the
+  // body is complete or the connection was closed, or -1 on error.
+  int (*read)(void *ctx, char *data, size_t len);
+  // Check that the whole response body was received
+  bool (*is_complete)(void *ctx);
+  // End the request. The connection may be kept for the next one.
+  void (*close)(void *ctx);
+  // Get the connections made since the transport was created, may be NULL
+  void (*get_stats)(void *ctx, ota_transport_stats_t *stats);
+  // Wait up to `timeout_ms` for the responses from now on, 0 restores the
+  // default timeout. May be NULL, long polls are then not waited for.
+  void (*set_timeout)(void *ctx, uint32_t timeout_ms);
+  // Send a POST request with a `content_type` body and read the response
+  // headers, the response is then read and closed as with open(). May be
+  // NULL, reports are then not sent.
+  esp_err_t (*post)(void *ctx, const char *url, const char *content_type,
+                    const char *body, size_t len, int *status);
+} ota_transport_t;
+
+// Flash holding the running firmware and the partition updates are written to
+typedef struct {
+  // Get the partition the next update is written to
+  esp_err_t (*update_partition)(void *ctx, uint32_t *address, uint32_t *size);
+  // Start writing the update partition, from `offset` to continue an
+  // interrupted write (erasing as it goes)
+  esp_err_t (*begin)(void *ctx, uint32_t offset);
+  esp_err_t (*write)(void *ctx, const void *data, size_t len);
+  // Give up the update being written
+  void (*abort)(void *ctx);
+  // Validate the written update and boot it on the next restart
+  esp_err_t (*finish)(void *ctx);
+  // Read the running firmware
+  esp_err_t (*read_running)(void *ctx, uint32_t offset, void *data,
+                            size_t len);
+  // Read the update partition, may be NULL. Lets a download keep the blocks
+  // an interrupted attempt already wrote.
+  esp_err_t (*read_update)(void *ctx, uint32_t offset, void *data,
+                           size_t len);
+  // Get the description of the running firmware
+  esp_err_t (*running_desc)(void *ctx, esp_app_desc_t *desc);
+  // Get the description of the last firmware that was rolled back,
+  // ESP_ERR_NOT_FOUND if there is none
+  esp_err_t (*invalid_desc)(void *ctx, esp_app_desc_t *desc);
+} ota_flash_t;
+
+// Storage surviving restarts
+typedef struct {
+  // Load a value, `len` is the buffer size on input and the value size on
+  // output. Returns ESP_ERR_NOT_FOUND if there is no such value.
+  esp_err_t (*load)(void *ctx, const char *key, void *data, size_t *len);
+  esp_err_t (*save)(void *ctx, const char *key, const void *data, size_t len);
+  void (*erase)(void *ctx, const char *key);
+} ota_store_t;
+
+// Phases of the last boot, measured by the platform
+typedef struct {
+  int64_t startup_us;    // Application start until app_main()
+  int64_t ready_us;      // app_main() until connected and validated
+  int64_t digests_us;    // Hashing the boot digests, 0 if they were cached
+  int64_t diagnostic_us; // Diagnostic of a new firmware
+  bool new_firmware;     // First boot of an update, diagnosed
+} ota_boot_stats_t;
+
+typedef struct {
+  const ota_transport_t *transport;
+  void *transport_ctx;
+  const ota_flash_t *flash;
+  void *flash_ctx;
+  const ota_store_t *store;
+  void *store_ctx;
+  const char *manifest_url;
+  const char *image_url; // Also the origin of the patch and compressed URLs
+  // PEM public key the manifests are signed with, used with
+  // CONFIG_OTA_VERIFY_SIGNATURE
+  const char *signing_key;
+  // Sent with the manifest requests for staged rollouts, may be NULL
+  const char *device_id;
+  // Delays between update checks, the backoff state is kept in the store
+  schedule_config_t schedule;
+  // Ask the server to hold the manifest request up to this long until there
+  // is a new image, 0 to poll
+  uint32_t long_poll_s;
+  // Release channel to get images from. The target of the running firmware
+  // (project, chip, chip revision, secure version) and the channel are sent
+  // in the query string of manifest_url, for the catalog of the server to
+  // pick the image. NULL to request manifest_url as is.
+  const char *channel;
+  // A summary of every update check is POSTed there, may be NULL
+  const char *report_url;
+  // Sent with the first report, may be NULL
+  const ota_boot_stats_t *boot;
+} ota_engine_config_t;
+
+// Outcome of an update check
+typedef enum {
+  OTA_UPDATED,    // A new image was written, restart to boot it
+  OTA_UP_TO_DATE, // There is nothing to install
+  OTA_FAILED,     // The update check or download failed, retry later
+} ota_result_t;
+
+// What is downloaded to rebuild the image
+typedef enum {
+  DOWNLOAD_IMAGE,      // The image itself
+  DOWNLOAD_COMPRESSED, // The heatshrink compressed image
+  DOWNLOAD_DELTA,      // A patch from the running firmware
+} download_mode_t;
+
+// Why an update check failed
+typedef enum {
+  OTA_FAILURE_NONE,
+  OTA_FAILURE_NETWORK,  // The server could not be reached or the transfer broke
+  OTA_FAILURE_SERVER,   // The server answered with an error or unusable data
+  OTA_FAILURE_REJECTED, // The manifest or the image did not verify
+  OTA_FAILURE_DEVICE,   // The update partition could not be written
+} ota_failure_t;
+
+// Measurements of an update check
+typedef struct {
+  int64_t manifest_us;             // Manifest request
+  int64_t download_us;             // Image request, download and verification
+  int64_t ttfb_us;                 // Image request until its first body byte
+  int64_t finish_us;               // Validation of the written image
+  download_mode_t mode;            // What was downloaded
+  uint32_t resume_offset;          // Bytes kept from an interrupted download
+  uint32_t bad_blocks;             // Corrupted blocks downloaded again
+  uint32_t image_len;              // Image bytes written
+  ota_failure_t failure;           // Why the check failed
+  uint32_t retry_after_s;          // Retry-After of the server, 0 if none
+  uint32_t max_age_s;              // Manifest max-age of the server, 0 if none
+  uint32_t next_check_ms;          // Delay until the next update check
+  bool long_polled;                // The server held the manifest request
+  pipeline_result_t pipeline;      // Download, zero if nothing was downloaded
+  ota_transport_stats_t transport; // Connections of this update check
+} ota_stats_t;
+
+// Set the platform the engine runs on and load its persisted state
+void ota_engine_init(const ota_engine_config_t *config);
+
+// Check for a new firmware and install it if there is one.
+// `stats` may be NULL.
+ota_result_t ota_engine_run(ota_stats_t *stats);
+
+// Get the delay before the first update check after a restart
+uint32_t ota_engine_first_check_ms(void);
+
+// Log a SHA-256 digest in hex
+void print_sha256(const uint8_t *image_hash, const char *label);
+
+#endif
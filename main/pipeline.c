@@ -0,0 +1,176 @@
+#include "pipeline.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <inttypes.h>
+#include <string.h>
+
+#define PIPELINE_BUFFSIZE (CONFIG_OTA_PIPELINE_BUFFER_SIZE * 1024)
+#define PIPELINE_TASK_PRIORITY 5
+
+// Filled buffer passed to the flash task, a zero length marks the end of the
+// download
+typedef struct {
+  uint8_t index;
+  size_t len;
+} pipeline_item_t;
+
+static const char *PIPELINE_TAG = "PIPELINE";
+
+static uint8_t buffers[CONFIG_OTA_PIPELINE_BUFFERS][PIPELINE_BUFFSIZE];
+
+static QueueHandle_t free_queue = NULL; // Indexes of the buffers to fill
+static QueueHandle_t full_queue = NULL; // Buffers to pass to the consumer
+static SemaphoreHandle_t done = NULL;   // Given when the end marker is reached
+static TaskHandle_t flash_task_handle = NULL;
+
+// Consumer of the current download, set before the first buffer is queued
+static pipeline_consume_cb_t consume_cb;
+static void *consume_cb_ctx;
+static volatile esp_err_t consume_err;
+static int64_t flash_us;
+
+// Flash task: pass the filled buffers to the consumer and hand them back.
+// After a consumer error the remaining buffers are only handed back.
+static void flash_task(void *pvParameter) {
+  pipeline_item_t item;
+
+  while (1) {
+    xQueueReceive(full_queue, &item, portMAX_DELAY);
+    if (item.len == 0) {
+      xSemaphoreGive(done);
+      continue;
+    }
+
+    if (consume_err == ESP_OK) {
+      int64_t start = esp_timer_get_time();
+      esp_err_t err =
+          consume_cb(consume_cb_ctx, (const char *)buffers[item.index], item.len);
+      flash_us += esp_timer_get_time() - start;
+      if (err != ESP_OK) {
+        consume_err = err;
+      }
+    }
+    xQueueSend(free_queue, &item.index, portMAX_DELAY);
+  }
+}
+
+static esp_err_t pipeline_init(void) {
+  if (done != NULL) {
+    return ESP_OK;
+  }
+
+  free_queue = xQueueCreate(CONFIG_OTA_PIPELINE_BUFFERS, sizeof(uint8_t));
+  // One more slot for the end marker
+  full_queue =
+      xQueueCreate(CONFIG_OTA_PIPELINE_BUFFERS + 1, sizeof(pipeline_item_t));
+  SemaphoreHandle_t semaphore = xSemaphoreCreateBinary();
+  if (free_queue == NULL || full_queue == NULL || semaphore == NULL) {
+    ESP_LOGE(PIPELINE_TAG, "Failed to create the download queues");
+    return ESP_ERR_NO_MEM;
+  }
+
+  for (uint8_t i = 0; i < CONFIG_OTA_PIPELINE_BUFFERS; ++i) {
+    xQueueSend(free_queue, &i, 0);
+  }
+  if (xTaskCreate(&flash_task, "ota_flash", CONFIG_OTA_FLASH_TASK_STACK_SIZE,
+                  NULL, PIPELINE_TASK_PRIORITY, &flash_task_handle) != pdPASS) {
+    ESP_LOGE(PIPELINE_TAG, "Failed to create the flash task");
+    return ESP_ERR_NO_MEM;
+  }
+  done = semaphore;
+  return ESP_OK;
+}
+
+// Fill a buffer from the download started at `start`.
+// Returns false once the download is over, after an error or at its end.
+static bool fill_buffer(pipeline_read_cb_t read, void *read_ctx,
+                        uint8_t *buffer, size_t *len, int64_t start,
+                        pipeline_result_t *result) {
+  *len = 0;
+  while (*len < PIPELINE_BUFFSIZE) {
+    int data_read =
+        read(read_ctx, (char *)&buffer[*len], PIPELINE_BUFFSIZE - *len);
+    if (data_read < 0) {
+      result->network_err = ESP_FAIL;
+      return false;
+    } else if (data_read == 0) {
+      return false;
+    }
+    if (result->bytes == 0 && *len == 0) {
+      result->first_byte_us = esp_timer_get_time() - start;
+    }
+    *len += data_read;
+  }
+  return true;
+}
+
+void pipeline_run(pipeline_read_cb_t read, void *read_ctx,
+                  pipeline_consume_cb_t consume, void *consume_ctx,
+                  pipeline_result_t *result) {
+  memset(result, 0, sizeof(*result));
+  result->consume_err = pipeline_init();
+  if (result->consume_err != ESP_OK) {
+    return;
+  }
+
+  consume_cb = consume;
+  consume_cb_ctx = consume_ctx;
+  consume_err = ESP_OK;
+  flash_us = 0;
+
+  int64_t start = esp_timer_get_time();
+  bool receiving = true;
+  while (receiving && consume_err == ESP_OK) {
+    pipeline_item_t item = {0};
+
+    // Backpressure: wait for the flash task to free a buffer
+    int64_t wait_start = esp_timer_get_time();
+    xQueueReceive(free_queue, &item.index, portMAX_DELAY);
+    int64_t read_start = esp_timer_get_time();
+    result->network_wait_us += read_start - wait_start;
+
+    receiving = fill_buffer(read, read_ctx, buffers[item.index], &item.len,
+                            start, result);
+    result->network_us += esp_timer_get_time() - read_start;
+    result->bytes += item.len;
+
+    if (item.len > 0) {
+      xQueueSend(full_queue, &item, portMAX_DELAY);
+    } else {
+      xQueueSend(free_queue, &item.index, portMAX_DELAY);
+    }
+  }
+
+  // Wait for the flash task to finish with the data already received
+  pipeline_item_t end = {0};
+  xQueueSend(full_queue, &end, portMAX_DELAY);
+  xSemaphoreTake(done, portMAX_DELAY);
+
+  result->consume_err = consume_err;
+  result->flash_us = flash_us;
+  result->total_us = esp_timer_get_time() - start;
+
+  ESP_LOGI(PIPELINE_TAG,
+           "Received %" PRIu32 " bytes in %" PRId64 " ms (%" PRId64
+           " KB/s): network %" PRId64 " ms (waited %" PRId64
+           " ms for flash), flash %" PRId64 " ms (waited %" PRId64
+           " ms for network)",
+           result->bytes, result->total_us / 1000,
+           result->total_us > 0
+               ? (int64_t)result->bytes * 1000 / result->total_us
+               : 0,
+           result->network_us / 1000, result->network_wait_us / 1000,
+           result->flash_us / 1000,
+           (result->total_us - result->flash_us) / 1000);
+}
+
+uint32_t pipeline_stack_free(void) {
+  return flash_task_handle != NULL
+             ? uxTaskGetStackHighWaterMark(flash_task_handle)
+             : 0;
+}
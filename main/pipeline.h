@@ -0,0 +1,40 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Read the next bytes of the download. Returns the number of bytes read, 0 at
+// the end of the download or -1 on error.
+typedef int (*pipeline_read_cb_t)(void *ctx, char *data, size_t len);
+
+// Called from the flash task with every block of downloaded data, in order
+typedef esp_err_t (*pipeline_consume_cb_t)(void *ctx, const char *data,
+                                           size_t len);
+
+// Outcome and timing of a pipelined download
+typedef struct {
+  esp_err_t network_err; // ESP_FAIL if reading from the connection failed
+  esp_err_t consume_err; // First error returned by the consumer
+  uint32_t bytes;        // Bytes received
+  int64_t total_us;      // Wall time of the whole download
+  int64_t first_byte_us; // Time until the first bytes were received
+  int64_t network_us;    // Time spent receiving
+  int64_t network_wait_us; // Time the network task waited for a free buffer
+  int64_t flash_us;        // Time spent in the consumer
+} pipeline_result_t;
+
+// Read a download into a ring of CONFIG_OTA_PIPELINE_BUFFERS buffers, while a
+// separate flash task passes the filled buffers to the consumer.
+// The download stops at the first network or consumer error, after the data
+// already received has been consumed (unless the consumer failed).
+void pipeline_run(pipeline_read_cb_t read, void *read_ctx,
+                  pipeline_consume_cb_t consume, void *consume_ctx,
+                  pipeline_result_t *result);
+
+// Get the least free stack the flash task had so far, in bytes, 0 before the
+// first download
+uint32_t pipeline_stack_free(void);
+
+#endif
@@ -0,0 +1,65 @@
+#include "schedule.h"
+
+// Random delay from `min_ms` to `max_ms` included
+static uint32_t random_between(const schedule_config_t *config, uint32_t min_ms,
+                               uint32_t max_ms) {
+  if (max_ms <= min_ms) {
+    return min_ms;
+  }
+  uint64_t range = (uint64_t)max_ms - min_ms + 1;
+  return min_ms + (uint32_t)(config->random() % range);
+}
+
+// Spread a delay over +/- 25 %, so that devices polling at the same interval
+// drift apart
+static uint32_t spread(const schedule_config_t *config, uint32_t delay_ms) {
+  return random_between(config, delay_ms - delay_ms / 4,
+                        delay_ms + delay_ms / 4);
+}
+
+uint32_t schedule_next(schedule_t *schedule, const schedule_config_t *config,
+                       schedule_outcome_t outcome, uint32_t hint_ms) {
+  uint32_t delay_ms;
+
+  switch (outcome) {
+  case SCHEDULE_RETRY: {
+    // Decorrelated jitter: anywhere from the first delay to three times the
+    // last one, capped
+    uint32_t last_ms = schedule->backoff_ms > config->retry_min_ms
+                           ? schedule->backoff_ms
+                           : config->retry_min_ms;
+    uint64_t max_ms = (uint64_t)last_ms * 3;
+    if (max_ms > config->retry_max_ms) {
+      max_ms = config->retry_max_ms;
+    }
+    delay_ms = random_between(config, config->retry_min_ms, (uint32_t)max_ms);
+    schedule->backoff_ms = delay_ms;
+    schedule->failures++;
+    break;
+  }
+  case SCHEDULE_REJECTED:
+    // The same update would be refused again, wait for the server to publish
+    // a new one
+    delay_ms = spread(config, config->poll_interval_ms);
+    schedule->failures++;
+    break;
+  case SCHEDULE_OK:
+  default:
+    delay_ms = spread(config, config->poll_interval_ms);
+    schedule->backoff_ms = 0;
+    schedule->failures = 0;
+    break;
+  }
+
+  if (hint_ms > 0) {
+    delay_ms = hint_ms + random_between(config, 0, hint_ms / 2);
+  }
+  return delay_ms;
+}
+
+uint32_t schedule_first(const schedule_t *schedule,
+                        const schedule_config_t *config) {
+  uint32_t window_ms =
+      schedule->backoff_ms > 0 ? schedule->backoff_ms : config->retry_min_ms;
+  return random_between(config, 0, window_ms);
+}
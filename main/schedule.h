@@ -0,0 +1,45 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h>
+
+// Delays between update checks. A fleet that polls on a fixed period stays in
+// step: after an outage or a power cut every device comes back at the same
+// time and hits a server that may just be recovering. Failures back off with
+// decorrelated jitter, up to date devices wait a long steady interval, and the
+// server can ask for a delay of its own.
+
+typedef struct {
+  uint32_t poll_interval_ms; // After an update check found nothing new
+  uint32_t retry_min_ms;     // First delay after a failure
+  uint32_t retry_max_ms;     // Longest delay after consecutive failures
+  // Random numbers for the jitter, esp_random() on the device
+  uint32_t (*random)(void);
+} schedule_config_t;
+
+// What an update check ended with, as far as the next one is concerned
+typedef enum {
+  SCHEDULE_OK,       // Up to date, or the check went through
+  SCHEDULE_RETRY,    // The server could not be reached or failed, back off
+  SCHEDULE_REJECTED, // The update was refused, retrying soon will not help
+} schedule_outcome_t;
+
+// State kept across checks, and across restarts in the store of the engine
+typedef struct {
+  uint32_t backoff_ms; // Last delay after a failure, 0 after a success
+  uint32_t failures;   // Consecutive failed checks
+} schedule_t;
+
+// Get the delay until the next check and update `schedule`. `hint_ms` is the
+// delay the server asked for, 0 if none; it replaces the computed delay, with
+// jitter, but failures still back off behind it.
+uint32_t schedule_next(schedule_t *schedule, const schedule_config_t *config,
+                       schedule_outcome_t outcome, uint32_t hint_ms);
+
+// Get the delay before the first check after a restart. It is spread over the
+// last backoff (or over the first retry delay after a success), so that devices
+// restarted together do not all check at once.
+uint32_t schedule_first(const schedule_t *schedule,
+                        const schedule_config_t *config);
+
+#endif
@@ -1,19 +1,24 @@
 #include "wifi.h"
+#include "boot.h"
 #include "esp_event.h"
 #include "esp_event_base.h"
 #include "esp_log.h"
 #include "esp_netif.h"
 #include "esp_netif_ip_addr.h"
 #include "esp_netif_types.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "esp_wifi_default.h"
 #include "esp_wifi_types_generic.h"
 #include "freertos/event_groups.h"
 #include "freertos/projdefs.h"
 #include "freertos/task.h"
+#include "nvs.h"
 #include "portmacro.h"
+#include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/param.h>
 
 // ---- Wifi menuconfig ------------------------------------
 #if CONFIG_ESP_WIFI_AUTH_OPEN
@@ -47,20 +52,152 @@
 #endif
 // -----------------------------------------------------------------
 
+#define WIFI_NVS_NAMESPACE "wifi"
+#define AP_CACHE_KEY "ap"
+// First delay between connection retries after the immediate one, doubled up
+// to CONFIG_ESP_WIFI_RETRY_INTERVAL seconds
+#define RETRY_MIN_MS 1000
+
+// Access point of the last connection, kept in NVS so that the next connection
+// (after a disconnect or a restart) goes straight to it instead of scanning
+// all the channels
+typedef struct {
+  char ssid[33]; // Configured SSID it was found for
+  uint8_t bssid[6];
+  uint8_t channel;
+} ap_cache_t;
+
+typedef enum {
+  WIFI_STATE_CONNECTING,   // First connection since the start
+  WIFI_STATE_CONNECTED,    // Associated and got an address
+  WIFI_STATE_RECONNECTING, // Disconnected, retrying on the retry timer
+} wifi_state_t;
+
 // Event status
 static EventGroupHandle_t wifi_event_group;
 
+// ---- Connection state, only used from the default event loop ----------------
+static wifi_state_t state = WIFI_STATE_CONNECTING;
+static wifi_config_t wifi_config = {
+    .sta = {.ssid = CONFIG_ESP_WIFI_SSID,
+            .password = CONFIG_ESP_WIFI_PASSWORD,
+            .threshold.authmode = ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD,
+            .sae_pwe_h2e = ESP_WIFI_SAE_MODE,
+            .sae_h2e_identifier = EXAMPLE_H2E_IDENTIFIER,
+            .pmf_cfg = {
+                .capable = true,
+                .required = false,
+            }}};
+static ap_cache_t ap_cache;
+static bool ap_known;           // ap_cache holds an AP
+static bool ap_cached;          // wifi_config targets it
+static uint32_t retries;        // Connection attempts failed in a row
+static uint32_t retry_delay_ms; // Delay before the last retry
+static esp_timer_handle_t retry_timer;
+
+// ---- AP cache ---------------------------------------------------------------
+
+static bool load_ap_cache(ap_cache_t *cache) {
+  nvs_handle_t nvs;
+  if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+    return false;
+  }
+  size_t len = sizeof(*cache);
+  esp_err_t err = nvs_get_blob(nvs, AP_CACHE_KEY, cache, &len);
+  nvs_close(nvs);
+  return err == ESP_OK && len == sizeof(*cache) &&
+         strncmp(cache->ssid, CONFIG_ESP_WIFI_SSID, sizeof(cache->ssid)) == 0;
+}
+
+static void save_ap_cache(const ap_cache_t *cache) {
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err == ESP_OK) {
+    err = nvs_set_blob(nvs, AP_CACHE_KEY, cache, sizeof(*cache));
+    if (err == ESP_OK) {
+      err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGW(WIFI_TAG, "Failed to store the AP (%s)", esp_err_to_name(err));
+  }
+}
+
+// Target the cached AP, or scan for the SSID again
+static void use_ap_cache(bool use) {
+  ap_cached = use;
+  wifi_config.sta.bssid_set = use;
+  if (use) {
+    memcpy(wifi_config.sta.bssid, ap_cache.bssid, sizeof(ap_cache.bssid));
+  }
+  wifi_config.sta.channel = use ? ap_cache.channel : 0;
+  esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+}
+
+// ---- Reconnection -----------------------------------------------------------
+
+static void retry_connect(void *arg) { esp_wifi_connect(); }
+
+// The first retry is immediate, the connection was usually only lost for a
+// moment, then the delay doubles. Never blocks the event loop.
+static void schedule_retry(uint8_t reason) {
+  if (retries == 0) {
+    retry_delay_ms = 0;
+  } else if (retry_delay_ms < RETRY_MIN_MS) {
+    retry_delay_ms = RETRY_MIN_MS;
+  } else {
+    retry_delay_ms = MIN(retry_delay_ms * 2,
+                         CONFIG_ESP_WIFI_RETRY_INTERVAL * 1000);
+  }
+  retries++;
+  ESP_LOGI(WIFI_TAG, "Disconnected (reason %u), reconnecting to AP in %" PRIu32
+                     " ms", reason, retry_delay_ms);
+  esp_timer_start_once(retry_timer, (uint64_t)retry_delay_ms * 1000);
+}
+
 /* Wifi Handlers */
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
   if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-    ESP_LOGI(WIFI_TAG, "Connecting to AP");
+    ESP_LOGI(WIFI_TAG, "Connecting to AP%s", ap_cached ? " (cached)" : "");
+    state = WIFI_STATE_CONNECTING;
+    retries = 0;
     esp_wifi_connect();
+  } else if (event_base == WIFI_EVENT &&
+             event_id == WIFI_EVENT_STA_CONNECTED) {
+    // Only stored, the config cannot change while connected
+    wifi_event_sta_connected_t *event = event_data;
+    if (!ap_known || event->channel != ap_cache.channel ||
+        memcmp(event->bssid, ap_cache.bssid, sizeof(ap_cache.bssid)) != 0) {
+      memset(&ap_cache, 0, sizeof(ap_cache));
+      strlcpy(ap_cache.ssid, CONFIG_ESP_WIFI_SSID, sizeof(ap_cache.ssid));
+      memcpy(ap_cache.bssid, event->bssid, sizeof(ap_cache.bssid));
+      ap_cache.channel = event->channel;
+      ap_known = true;
+      ap_cached = false;
+      save_ap_cache(&ap_cache);
+    }
   } else if (event_base == WIFI_EVENT &&
              event_id == WIFI_EVENT_STA_DISCONNECTED) {
-    ESP_LOGI(WIFI_TAG, "Disconnected, reconnecting to AP");
-    esp_wifi_connect();
-    vTaskDelay(CONFIG_ESP_WIFI_RETRY_INTERVAL * 1000 / portTICK_PERIOD_MS);
+    wifi_event_sta_disconnected_t *event = event_data;
+    bool was_connected = state == WIFI_STATE_CONNECTED;
+    xEventGroupClearBits(wifi_event_group, WIFI_SUCCESS);
+    if (xEventGroupGetBits(wifi_event_group) & WIFI_STOPPED) {
+      // Turned off on purpose, nothing to retry
+      state = WIFI_STATE_CONNECTING;
+      return;
+    }
+    xEventGroupSetBits(wifi_event_group, WIFI_LOST);
+    state = WIFI_STATE_RECONNECTING;
+    if (was_connected && ap_known && !ap_cached) {
+      use_ap_cache(true);
+    } else if (!was_connected && ap_cached && retries > 0) {
+      // The AP may have moved to another channel, or been replaced
+      ESP_LOGI(WIFI_TAG, "Cached AP not found, scanning");
+      use_ap_cache(false);
+    }
+    schedule_retry(event->reason);
   }
 }
 
@@ -70,13 +207,16 @@ static void ip_event_handler(void *arg, esp_event_base_t event_base,
     ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
     ESP_LOGI(WIFI_TAG, "Station IP: " IPSTR, IP2STR(&event->ip_info.ip));
 
+    state = WIFI_STATE_CONNECTED;
+    retries = 0;
     xEventGroupSetBits(wifi_event_group, WIFI_SUCCESS);
+    // Registered before esp_wifi_start(), so that the first address is never
+    // missed however fast it comes (cached AP, restored DHCP lease)
+    boot_done(BOOT_WIFI);
   }
 }
 
-esp_err_t connect_wifi() {
-  int status = WIFI_FAILURE;
-
+void start_wifi() {
   /* Initialize wifi */
   // Setup TCP/IP stack
   ESP_ERROR_CHECK(esp_netif_init());
@@ -95,6 +235,12 @@ esp_err_t connect_wifi() {
   // Save the output of an event
   wifi_event_group = xEventGroupCreate();
 
+  const esp_timer_create_args_t timer_args = {
+      .callback = retry_connect,
+      .name = "wifi_retry",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &retry_timer));
+
   esp_event_handler_instance_t wifi_event_instance;
   esp_event_handler_instance_t got_ip_event_instance;
 
@@ -108,47 +254,59 @@ esp_err_t connect_wifi() {
       IP_EVENT, IP_EVENT_STA_GOT_IP, &ip_event_handler, NULL,
       &got_ip_event_instance));
 
-  /* Wifi config */
-  wifi_config_t wifi_config = {
-      .sta = {.ssid = CONFIG_ESP_WIFI_SSID,
-              .password = CONFIG_ESP_WIFI_PASSWORD,
-              .threshold.authmode = ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD,
-              .sae_pwe_h2e = ESP_WIFI_SAE_MODE,
-              .sae_h2e_identifier = EXAMPLE_H2E_IDENTIFIER,
-              .pmf_cfg = {
-                  .capable = true,
-                  .required = false,
-              }}};
-
   // Set wifi controller to be a station
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
 
-  // Apply config
-  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+  // Apply config, straight to the AP of the last connection if known
+  ap_known = load_ap_cache(&ap_cache);
+  if (ap_known) {
+    use_ap_cache(true);
+  } else {
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+  }
 
   // Start driver
   ESP_ERROR_CHECK(esp_wifi_start());
 
   ESP_LOGI(WIFI_TAG, "WIFI station initialization complete");
 
-  /* Wait for connection */
-  // Wait until success or failure status is recieved
-  EventBits_t bits =
-      xEventGroupWaitBits(wifi_event_group, WIFI_SUCCESS | WIFI_FAILURE,
-                          pdFALSE, pdFALSE, portMAX_DELAY);
-
-  if (bits & WIFI_SUCCESS) {
-    ESP_LOGI(WIFI_TAG, "Connected to AP");
-    status = WIFI_SUCCESS;
-  } else if (bits & WIFI_FAILURE) {
-    ESP_LOGE(WIFI_TAG, "Failed to connect to AP");
-    status = WIFI_FAILURE;
-  } else {
-    ESP_LOGE(WIFI_TAG, "Unexpected event");
-    status = WIFI_FAILURE;
+  // Keep the event handlers active for future disconnects
+}
+
+void stop_wifi(void) {
+  // Before the disconnection it causes
+  xEventGroupSetBits(wifi_event_group, WIFI_STOPPED);
+  esp_timer_stop(retry_timer);
+  esp_err_t err = esp_wifi_stop();
+  if (err != ESP_OK) {
+    ESP_LOGW(WIFI_TAG, "Failed to stop the radio (%s)", esp_err_to_name(err));
   }
+  xEventGroupClearBits(wifi_event_group, WIFI_SUCCESS);
+}
 
-  // Keep the event handlers active for future disconnects
+void resume_wifi(void) {
+  xEventGroupClearBits(wifi_event_group, WIFI_STOPPED);
+  // Connects on WIFI_EVENT_STA_START
+  esp_err_t err = esp_wifi_start();
+  if (err != ESP_OK) {
+    ESP_LOGW(WIFI_TAG, "Failed to start the radio (%s)", esp_err_to_name(err));
+  }
+}
+
+esp_err_t wait_wifi(TickType_t timeout) {
+  /* Wait for connection */
+  EventBits_t bits = xEventGroupWaitBits(wifi_event_group, WIFI_SUCCESS,
+                                         pdFALSE, pdFALSE, timeout);
+
+  return (bits & WIFI_SUCCESS) ? WIFI_SUCCESS : WIFI_FAILURE;
+}
+
+bool wifi_connected(void) {
+  return (xEventGroupGetBits(wifi_event_group) & WIFI_SUCCESS) != 0;
+}
+
+void wifi_clear_lost(void) { xEventGroupClearBits(wifi_event_group, WIFI_LOST); }
 
-  return status;
+bool wifi_lost(void) {
+  return (xEventGroupGetBits(wifi_event_group) & WIFI_LOST) != 0;
 }
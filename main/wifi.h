@@ -2,14 +2,39 @@
 #define WIFI_H
 
 #include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include <stdbool.h>
 
 #define WIFI_SUCCESS BIT0
 #define WIFI_FAILURE BIT1
+#define WIFI_LOST BIT2 // Disconnected since wifi_clear_lost()
+#define WIFI_STOPPED BIT3 // Radio turned off by stop_wifi()
 
 static const char *WIFI_TAG = "WIFI";
 
-// Connects to wifi access point with defined SSID and password in menuconfig
+// Starts connecting to wifi access point with defined SSID and password in
+// menuconfig, without waiting for the connection. The connection is restored
+// in the background whenever it is lost.
+void start_wifi();
+
+// Turn the radio off, e.g. to sleep between update windows. The connection is
+// not restored until resume_wifi().
+void stop_wifi(void);
+
+// Turn the radio back on and connect, straight to the AP of the last
+// connection
+void resume_wifi(void);
+
+// Waits at most timeout ticks until connected
 // Returns WIFI_SUCCESS or WIFI_FAILURE
-esp_err_t connect_wifi();
+esp_err_t wait_wifi(TickType_t timeout);
+
+// Whether connected right now
+bool wifi_connected(void);
+
+// Start watching for the loss of the connection, wifi_lost() tells whether it
+// was lost since
+void wifi_clear_lost(void);
+bool wifi_lost(void);
 
 #endif
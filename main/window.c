@@ -0,0 +1,70 @@
+#include "window.h"
+#include <string.h>
+
+#define WINDOW_MAGIC 0x4f54414cu // "OTAL"
+
+bool window_init(window_state_t *state, const window_config_t *config) {
+  if (state->magic == WINDOW_MAGIC &&
+      (config->period_ms == 0 || state->offset_ms < config->period_ms)) {
+    return state->asleep;
+  }
+
+  memset(state, 0, sizeof(*state));
+  state->magic = WINDOW_MAGIC;
+  state->offset_ms = config->period_ms > 0 && config->random != NULL
+                         ? config->random() % config->period_ms
+                         : 0;
+  return false;
+}
+
+void window_open(window_state_t *state, int64_t now_us) {
+  if (state->radio_on) {
+    return;
+  }
+  if (state->asleep) {
+    state->asleep_us += now_us - state->since_us;
+    state->asleep = false;
+  }
+  state->radio_on = true;
+  state->since_us = now_us;
+  state->windows++;
+}
+
+uint32_t window_plan(window_state_t *state, const window_config_t *config,
+                     int64_t now_us, uint32_t delay_ms, bool connected,
+                     window_sleep_t *sleep) {
+  // A retry due soon stays in the window, waking up and associating again
+  // would cost more than staying on
+  if (connected && delay_ms < config->min_sleep_ms) {
+    *sleep = WINDOW_STAY_AWAKE;
+    state->next_us = now_us + (int64_t)delay_ms * 1000;
+    return delay_ms;
+  }
+
+  // Otherwise the check runs in the first window of the device from its due
+  // time
+  int64_t window_us = now_us + (int64_t)delay_ms * 1000;
+  if (config->period_ms > 0) {
+    int64_t period_us = (int64_t)config->period_ms * 1000;
+    int64_t offset_us = (int64_t)state->offset_ms * 1000;
+    if (window_us <= offset_us) {
+      window_us = offset_us;
+    } else {
+      int64_t periods = (window_us - offset_us + period_us - 1) / period_us;
+      window_us = offset_us + periods * period_us;
+    }
+  }
+  state->next_us = window_us;
+
+  if (state->radio_on) {
+    state->radio_us += now_us - state->since_us;
+    state->radio_on = false;
+  }
+  if (!connected) {
+    state->missed++;
+  }
+  state->asleep = true;
+  state->since_us = now_us;
+  *sleep = config->sleep;
+  return (uint32_t)((window_us - now_us) / 1000);
+}
@@ -0,0 +1,64 @@
+#ifndef WINDOW_H
+#define WINDOW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Low-power update checks. A battery powered device cannot keep its radio
+// associated between checks: it turns it on for a window, associates with the
+// cached AP, runs the checks that are due and sleeps until the next window.
+// Windows open on a fixed period, each device at its own offset in it, so that
+// the checks due within a period share one wake-up and the fleet does not wake
+// in step.
+
+// How the device waits for the next window
+typedef enum {
+  WINDOW_STAY_AWAKE, // Radio on, the wait is too short to sleep
+  WINDOW_LIGHT_SLEEP, // Radio off, light sleep: RAM is kept and the other
+                      // tasks still run when their timers wake the CPU
+  WINDOW_DEEP_SLEEP,  // Radio off, deep sleep: only the RTC memory is kept and
+                      // the device restarts at the next window
+} window_sleep_t;
+
+typedef struct {
+  window_sleep_t sleep; // Light or deep sleep between windows
+  uint32_t period_ms;   // Windows open on this period, 0 when a check is due
+  uint32_t connect_ms;  // Longest association before giving up the window
+  uint32_t min_sleep_ms; // Shorter waits are spent awake in the same window
+  // Random numbers for the offset of the device, esp_random() on the device
+  uint32_t (*random)(void);
+} window_config_t;
+
+// Kept in RTC memory, across deep sleep
+typedef struct {
+  uint32_t magic;      // WINDOW_MAGIC once initialized
+  uint32_t offset_ms;  // Offset of the windows of this device in the period
+  int64_t next_us;     // Clock time of the next window
+  bool radio_on;       // In a window
+  bool asleep;         // Between windows, the device slept
+  int64_t since_us;    // Clock time the radio was turned on or the device
+                       // went to sleep
+  // ---- Totals since the state was initialized ---------------------------
+  uint32_t windows; // Windows opened
+  uint32_t missed;  // Windows given up, the AP was not reached
+  int64_t radio_us; // Time the radio was on
+  int64_t asleep_us; // Time spent asleep
+} window_state_t;
+
+// Check the state kept across a restart, and initialize it if it does not
+// hold any. Returns true if the device woke from a window sleep: the check
+// that was due is due now.
+bool window_init(window_state_t *state, const window_config_t *config);
+
+// Record the radio being turned on at `now_us`, at the start of a window
+void window_open(window_state_t *state, int64_t now_us);
+
+// Plan the wait after the checks of a window, until the window of the next
+// check due in `delay_ms`. Returns the wait and sets how to wait; if the
+// device sleeps, the radio is recorded as turned off (with `connected`
+// telling whether the window reached the AP).
+uint32_t window_plan(window_state_t *state, const window_config_t *config,
+                     int64_t now_us, uint32_t delay_ms, bool connected,
+                     window_sleep_t *sleep);
+
+#endif
@@ -0,0 +1,144 @@
+use axum::body::Body;
+use bytes::Bytes;
+use futures_util::stream;
+use std::convert::Infallible;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+use tokio::sync::{OwnedSemaphorePermit, Semaphore};
+
+/// Bytes handed to the connection at once by a limited download. The download
+/// slot is released once the last chunk is handed over.
+const CHUNK_LEN: usize = 16 * 1024;
+
+/// Downloads since the server started, for the metrics
+#[derive(Default)]
+pub struct DownloadStats {
+    /// Downloads whose body is being sent
+    pub active: AtomicU64,
+    pub admitted: AtomicU64,
+    /// Downloads turned away with `503 Service Unavailable`
+    pub turned_away: AtomicU64,
+    /// Body bytes handed to the connections
+    pub bytes: AtomicU64,
+}
+
+/// Limits on the downloads served at the same time and on their speed, so that
+/// a fleet fetching a new build at once does not saturate the uplink
+pub struct Admission {
+    /// Download slots, unlimited if None
+    downloads: Option<Arc<Semaphore>>,
+    /// Speed of every download in bytes per second, unlimited if None
+    rate: Option<u64>,
+    /// Sent to the devices that are turned away
+    retry_after: Duration,
+    stats: Arc<DownloadStats>,
+}
+
+impl Admission {
+    /// `max_downloads` and `rate_kbps` are unlimited when 0
+    pub fn new(max_downloads: usize, rate_kbps: u64, retry_after: Duration) -> Admission {
+        Admission {
+            downloads: (max_downloads > 0).then(|| Arc::new(Semaphore::new(max_downloads))),
+            rate: (rate_kbps > 0).then_some(rate_kbps * 1024),
+            retry_after,
+            stats: Arc::default(),
+        }
+    }
+
+    /// Admit a download, `None` if too many are in progress
+    pub fn admit(&self) -> Option<Ticket> {
+        let permit = match &self.downloads {
+            Some(downloads) => match downloads.clone().try_acquire_owned() {
+                Ok(permit) => Some(permit),
+                Err(_) => {
+                    self.stats.turned_away.fetch_add(1, Ordering::Relaxed);
+                    return None;
+                }
+            },
+            None => None,
+        };
+        self.stats.admitted.fetch_add(1, Ordering::Relaxed);
+        Some(Ticket {
+            permit,
+            rate: self.rate,
+            stats: self.stats.clone(),
+        })
+    }
+
+    pub fn stats(&self) -> &DownloadStats {
+        &self.stats
+    }
+
+    /// Value of the `Retry-After` header sent to the devices turned away
+    pub fn retry_after(&self) -> String {
+        self.retry_after.as_secs().to_string()
+    }
+}
+
+/// An admitted download, holding its slot until its body is sent or the
+/// client goes away
+pub struct Ticket {
+    permit: Option<OwnedSemaphorePermit>,
+    rate: Option<u64>,
+    stats: Arc<DownloadStats>,
+}
+
+/// Counts a download as active until its body is sent or dropped
+struct Active(Arc<DownloadStats>);
+
+impl Active {
+    fn new(stats: Arc<DownloadStats>) -> Active {
+        stats.active.fetch_add(1, Ordering::Relaxed);
+        Active(stats)
+    }
+}
+
+impl Drop for Active {
+    fn drop(&mut self) {
+        self.0.active.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+/// Progress of a download
+struct Transfer {
+    data: Bytes,
+    rate: Option<u64>,
+    start: Instant,
+    sent: u64,
+    /// Download slot, held until the body is sent
+    permit: Option<OwnedSemaphorePermit>,
+    active: Active,
+}
+
+impl Ticket {
+    /// Create the body sending `data`, paced to the download rate.
+    /// The chunks share the bytes of `data`, nothing is copied. Without
+    /// limits the data is handed over at once.
+    pub fn body(self, data: Bytes) -> Body {
+        let transfer = Transfer {
+            data,
+            rate: self.rate,
+            start: Instant::now(),
+            sent: 0,
+            active: Active::new(self.stats),
+            permit: self.permit,
+        };
+        let limited = transfer.permit.is_some() || transfer.rate.is_some();
+        Body::from_stream(stream::unfold(transfer, move |mut transfer| async move {
+            if transfer.data.is_empty() {
+                return None;
+            }
+            if let Some(rate) = transfer.rate {
+                let due = transfer.start + Duration::from_secs_f64(transfer.sent as f64 / rate as f64);
+                tokio::time::sleep_until(due.into()).await;
+            }
+
+            let len = if limited { CHUNK_LEN } else { transfer.data.len() };
+            let chunk = transfer.data.split_to(len.min(transfer.data.len()));
+            transfer.sent += chunk.len() as u64;
+            transfer.active.0.bytes.fetch_add(chunk.len() as u64, Ordering::Relaxed);
+            Some((Ok::<_, Infallible>(chunk), transfer))
+        }))
+    }
+}
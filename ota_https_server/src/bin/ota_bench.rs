@@ -0,0 +1,341 @@
+//! Benchmark the OTA client against this server over loopback.
+//!
+//! The update is run with the host build of the OTA engine (`host/`, built
+//! with `-DOTA_BENCH=ON`) for every combination of pipeline buffer size,
+//! HTTP or HTTPS, keep-alive, compressed or raw download and image size.
+//! Every run installs the same base firmware in a fresh state directory and
+//! updates it to a generated image, and its measurements are written as one
+//! JSON object per line. The medians of the repeated runs are summarised on
+//! stderr.
+
+use clap::Parser;
+use serde_json::{Map, Value, json};
+use sha2::{Digest, Sha256};
+use std::io::Write;
+use std::net::{Ipv4Addr, SocketAddr, TcpStream};
+use std::path::{Path, PathBuf};
+use std::process::{Child, Command, Stdio};
+use std::time::{Duration, Instant};
+
+/// Offset of `esp_app_desc_t` in an image (image and segment headers)
+const APP_DESC_OFFSET: usize = 24 + 8;
+const ESP_APP_DESC_MAGIC_WORD: u32 = 0xABCD5432;
+/// Size of the OTA partitions of the 4 MB flash layout
+const PARTITION_SIZE: usize = 4 * 1024 * 1024;
+
+// --- CLI Args ---
+#[derive(Parser, Debug)]
+#[clap(author, version, about, long_about = None)]
+struct Args {
+    /// Build directory of the host client, holding `ota_host_<size>k` and
+    /// `ota_host_<size>k_raw`
+    #[clap(long, default_value = "../host/build")]
+    client_dir: PathBuf,
+
+    /// Pipeline buffer sizes in KB, each one must have been built
+    #[clap(long, value_delimiter = ',', default_value = "1,2,4,8,16")]
+    buffer_sizes: Vec<u32>,
+
+    /// Image sizes, with an optional K or M suffix
+    #[clap(long, value_delimiter = ',', default_value = "256K,512K,1M,2M,4M",
+           value_parser = parse_size)]
+    sizes: Vec<usize>,
+
+    /// Certificate directory (`ca_cert.pem` and `ca_key.pem`) to also run
+    /// the benchmarks over HTTPS
+    #[clap(short, long)]
+    cert_dir: Option<PathBuf>,
+
+    /// Runs of every combination
+    #[clap(short, long, default_value_t = 3)]
+    repeat: usize,
+
+    /// Throttle the simulated flash to this many KB/s (not throttled by
+    /// default, to measure the network side)
+    #[clap(long)]
+    flash_speed: Option<u32>,
+
+    /// Port of the HTTP server, the HTTPS server uses the next one
+    #[clap(short, long, default_value_t = 8170)]
+    port: u16,
+
+    /// Directory for the generated images and the simulated devices
+    #[clap(long, default_value = "target/ota_bench")]
+    work_dir: PathBuf,
+
+    /// Output file of the measurements, stdout by default
+    #[clap(short, long)]
+    out: Option<PathBuf>,
+}
+
+fn parse_size(arg: &str) -> Result<usize, String> {
+    let (number, unit) = match arg.char_indices().find(|(_, c)| !c.is_ascii_digit()) {
+        Some((i, _)) => arg.split_at(i),
+        None => (arg, ""),
+    };
+    let number: usize = number.parse().map_err(|_| format!("invalid size {:?}", arg))?;
+    match unit.to_ascii_uppercase().as_str() {
+        "" => Ok(number),
+        "K" => Ok(number * 1024),
+        "M" => Ok(number * 1024 * 1024),
+        _ => Err(format!("invalid size {:?}", arg)),
+    }
+}
+
+/// Small deterministic generator, so that every run benchmarks the same images
+struct XorShift(u64);
+
+impl XorShift {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+
+    fn below(&mut self, n: usize) -> usize {
+        (self.next() % n as u64) as usize
+    }
+}
+
+/// Generate an application image of `size` bytes with the given version.
+///
+/// The body mixes random bytes with copies of earlier data, so that it
+/// compresses about as well as real firmware.
+fn generate_image(size: usize, version: &str, seed: u64) -> Vec<u8> {
+    let mut rng = XorShift(seed | 1);
+    let mut image = vec![0; size];
+
+    // esp_image_header_t with one segment, then esp_image_segment_header_t
+    image[0] = 0xE9;
+    image[1] = 1;
+    image[28..32].copy_from_slice(&(size as u32 - APP_DESC_OFFSET as u32).to_le_bytes());
+
+    // esp_app_desc_t
+    let desc = &mut image[APP_DESC_OFFSET..APP_DESC_OFFSET + 256];
+    desc[0..4].copy_from_slice(&ESP_APP_DESC_MAGIC_WORD.to_le_bytes());
+    desc[16..16 + version.len()].copy_from_slice(version.as_bytes());
+    desc[48..57].copy_from_slice(b"ota_bench");
+    desc[144..176].copy_from_slice(&Sha256::digest(version.as_bytes()));
+
+    let mut offset = APP_DESC_OFFSET + 256;
+    while offset < size {
+        let len = (4 + rng.below(60)).min(size - offset);
+        if rng.below(5) < 3 && offset > 4096 {
+            let from = offset - 1 - rng.below(4096);
+            for i in 0..len {
+                image[offset + i] = image[from + i];
+            }
+        } else {
+            for byte in &mut image[offset..offset + len] {
+                *byte = rng.next() as u8;
+            }
+        }
+        offset += len;
+    }
+    image
+}
+
+/// Server process, stopped when dropped
+struct Server(Child);
+
+impl Server {
+    fn start(dir: &Path, port: u16, cert_dir: Option<&Path>) -> anyhow::Result<Server> {
+        // The server is built next to this tool
+        let exe = std::env::current_exe()?.with_file_name("ota_https_server");
+        let mut command = Command::new(&exe);
+        command
+            .arg("--dir")
+            .arg(dir)
+            .args(["--ip", "127.0.0.1", "--port", &port.to_string()])
+            .env("RUST_LOG", "warn")
+            .stdout(Stdio::null());
+        if let Some(cert_dir) = cert_dir {
+            command.arg("--cert-dir").arg(cert_dir);
+        }
+        let server = Server(
+            command
+                .spawn()
+                .map_err(|e| anyhow::anyhow!("Failed to start {:?}: {}", exe, e))?,
+        );
+
+        // The images are inspected and compressed before the server listens
+        let addr = SocketAddr::from((Ipv4Addr::LOCALHOST, port));
+        let start = Instant::now();
+        while TcpStream::connect_timeout(&addr, Duration::from_millis(100)).is_err() {
+            if start.elapsed() > Duration::from_secs(120) {
+                anyhow::bail!("Server on port {} did not start", port);
+            }
+            std::thread::sleep(Duration::from_millis(100));
+        }
+        Ok(server)
+    }
+}
+
+impl Drop for Server {
+    fn drop(&mut self) {
+        let _ = self.0.kill();
+        let _ = self.0.wait();
+    }
+}
+
+/// One combination of the benchmark parameters
+struct Config {
+    buffer_kb: u32,
+    scheme: &'static str,
+    keep_alive: bool,
+    compressed: bool,
+    image_size: usize,
+}
+
+impl Config {
+    fn client(&self, client_dir: &Path) -> PathBuf {
+        let raw = if self.compressed { "" } else { "_raw" };
+        client_dir.join(format!("ota_host_{}k{}", self.buffer_kb, raw))
+    }
+}
+
+/// Update a fresh simulated device once and return the client measurements
+fn run(args: &Args, config: &Config, base: &Path, image: &str) -> anyhow::Result<Map<String, Value>> {
+    let state = args.work_dir.join("state");
+    let _ = std::fs::remove_dir_all(&state);
+    std::fs::create_dir_all(&state)?;
+
+    let port = if config.scheme == "https" { args.port + 1 } else { args.port };
+    let origin = format!("{}://127.0.0.1:{}", config.scheme, port);
+    let client = config.client(&args.client_dir);
+    let mut command = Command::new(&client);
+    command
+        .args(["--json", "--quiet", "--partition-size", &PARTITION_SIZE.to_string()])
+        .arg("--install")
+        .arg(base)
+        .arg("--manifest-url")
+        .arg(format!("{}/manifest/{}", origin, image))
+        .arg("--image-url")
+        .arg(format!("{}/{}", origin, image));
+    if let (Some(cert_dir), "https") = (&args.cert_dir, config.scheme) {
+        command.arg("--ca-cert").arg(cert_dir.join("ca_cert.pem"));
+    }
+    if !config.keep_alive {
+        command.arg("--no-keep-alive");
+    }
+    if let Some(flash_speed) = args.flash_speed {
+        command.args(["--flash-speed", &flash_speed.to_string()]);
+    }
+    command.arg(&state);
+
+    let output = command
+        .output()
+        .map_err(|e| anyhow::anyhow!("Failed to run {:?}: {}", client, e))?;
+    let stdout = String::from_utf8_lossy(&output.stdout);
+    let Some(line) = stdout.lines().last() else {
+        anyhow::bail!("{:?} failed: {}", client, String::from_utf8_lossy(&output.stderr));
+    };
+    let Value::Object(measurements) = serde_json::from_str(line)? else {
+        anyhow::bail!("Unexpected output from {:?}: {}", client, line);
+    };
+    if measurements.get("result") != Some(&json!("updated")) {
+        anyhow::bail!("Update failed: {}", line);
+    }
+    Ok(measurements)
+}
+
+fn median(values: &mut [i64]) -> i64 {
+    values.sort_unstable();
+    values[values.len() / 2]
+}
+
+fn main() -> anyhow::Result<()> {
+    let args = Args::parse();
+    if args.repeat == 0 {
+        anyhow::bail!("--repeat must be at least 1");
+    }
+    if args.sizes.iter().any(|&size| size < 4096 || size > PARTITION_SIZE) {
+        anyhow::bail!("Image sizes must be between 4K and 4M");
+    }
+
+    // Generate the images, every size is served as its own firmware
+    let firmware_dir = args.work_dir.join("firmware");
+    let _ = std::fs::remove_dir_all(&firmware_dir);
+    std::fs::create_dir_all(&firmware_dir)?;
+    let base = args.work_dir.join("base.bin");
+    std::fs::write(&base, generate_image(256 * 1024, "bench-0", 1))?;
+    for &size in &args.sizes {
+        let image = generate_image(size, "bench-1", size as u64);
+        std::fs::write(firmware_dir.join(format!("bench_{}k.bin", size / 1024)), image)?;
+    }
+
+    let mut schemes = vec!["http"];
+    let _http = Server::start(&firmware_dir, args.port, None)?;
+    let _https = match &args.cert_dir {
+        Some(cert_dir) => {
+            schemes.push("https");
+            Some(Server::start(&firmware_dir, args.port + 1, Some(cert_dir))?)
+        }
+        None => {
+            eprintln!("No --cert-dir, skipping the HTTPS benchmarks");
+            None
+        }
+    };
+
+    let mut out: Box<dyn Write> = match &args.out {
+        Some(path) => Box::new(std::fs::File::create(path)?),
+        None => Box::new(std::io::stdout()),
+    };
+
+    let mut results: Vec<(Config, Vec<Map<String, Value>>)> = Vec::new();
+    for &buffer_kb in &args.buffer_sizes {
+        for &compressed in &[true, false] {
+            for &scheme in &schemes {
+                for &keep_alive in &[true, false] {
+                    for &image_size in &args.sizes {
+                        let config = Config { buffer_kb, scheme, keep_alive, compressed, image_size };
+                        let image = format!("bench_{}k.bin", image_size / 1024);
+                        let mut runs = Vec::new();
+                        for repeat in 0..args.repeat {
+                            let mut record = json!({
+                                "buffer_kb": buffer_kb,
+                                "scheme": scheme,
+                                "keep_alive": keep_alive,
+                                "compressed": compressed,
+                                "image_size": image_size,
+                                "repeat": repeat,
+                            });
+                            let measurements = run(&args, &config, &base, &image)?;
+                            record.as_object_mut().unwrap().extend(measurements.clone());
+                            writeln!(out, "{}", record)?;
+                            runs.push(measurements);
+                        }
+                        results.push((config, runs));
+                    }
+                }
+            }
+        }
+    }
+    out.flush()?;
+
+    eprintln!(
+        "{:>6} {:>5} {:>4} {:>4} {:>6} | {:>9} {:>9} {:>10} {:>9} {:>9}",
+        "buffer", "proto", "keep", "comp", "size", "wall ms", "ttfb ms", "KB/s", "tls ms", "heap KB"
+    );
+    for (config, runs) in &results {
+        let metric = |name: &str| {
+            let mut values: Vec<i64> = runs.iter().map(|run| run[name].as_i64().unwrap_or(0)).collect();
+            median(&mut values)
+        };
+        eprintln!(
+            "{:>5}K {:>5} {:>4} {:>4} {:>5}K | {:>9.1} {:>9.2} {:>10} {:>9.2} {:>9}",
+            config.buffer_kb,
+            config.scheme,
+            if config.keep_alive { "yes" } else { "no" },
+            if config.compressed { "yes" } else { "no" },
+            config.image_size / 1024,
+            metric("wall_us") as f64 / 1000.0,
+            metric("ttfb_us") as f64 / 1000.0,
+            metric("throughput_bps") / 1024,
+            metric("handshake_us") as f64 / 1000.0,
+            metric("peak_heap") / 1024,
+        );
+    }
+    Ok(())
+}
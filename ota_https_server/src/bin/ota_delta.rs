@@ -0,0 +1,74 @@
+//! Create a delta patch updating devices running one firmware image to
+//! another, to be served from the `deltas` subdirectory of the firmware
+//! directory.
+
+use clap::Parser;
+use ota_https_server::delta;
+use ota_https_server::firmware::{AppDesc, DELTA_DIR};
+use std::path::PathBuf;
+
+// --- CLI Args ---
+#[derive(Parser, Debug)]
+#[clap(author, version, about, long_about = None)]
+struct Args {
+    /// Firmware image running on the devices
+    old: PathBuf,
+
+    /// New firmware image, as served to the devices
+    new: PathBuf,
+
+    /// Output file, by default the patch is written to the `deltas`
+    /// subdirectory next to the new image
+    #[clap(short, long)]
+    out: Option<PathBuf>,
+}
+
+fn main() -> anyhow::Result<()> {
+    let args = Args::parse();
+
+    let old = std::fs::read(&args.old)
+        .map_err(|e| anyhow::anyhow!("Failed to read {:?}: {}", args.old, e))?;
+    let new = std::fs::read(&args.new)
+        .map_err(|e| anyhow::anyhow!("Failed to read {:?}: {}", args.new, e))?;
+
+    let patch = delta::create(&old, &new)?;
+
+    let out = match args.out {
+        Some(out) => out,
+        None => {
+            // Name the patch after the new image and the old build
+            let base_desc = AppDesc::parse(&old)
+                .ok_or_else(|| anyhow::anyhow!("{:?} is not a firmware image", args.old))?;
+            let new_name = args
+                .new
+                .file_name()
+                .ok_or_else(|| anyhow::anyhow!("{:?} is not a file", args.new))?
+                .to_string_lossy();
+            let dir = args
+                .new
+                .parent()
+                .unwrap_or_else(|| std::path::Path::new("."))
+                .join(DELTA_DIR);
+            std::fs::create_dir_all(&dir)?;
+            dir.join(format!(
+                "{}.{}.delta",
+                new_name,
+                &base_desc.app_elf_sha256[..16]
+            ))
+        }
+    };
+
+    // Write under a temporary name, so the server never reads a partial patch
+    let tmp = out.with_extension("tmp");
+    std::fs::write(&tmp, &patch)?;
+    std::fs::rename(&tmp, &out)?;
+
+    println!(
+        "{:?}: {} bytes ({:.1}% of the {} bytes image)",
+        out,
+        patch.len(),
+        patch.len() as f64 * 100.0 / new.len() as f64,
+        new.len()
+    );
+    Ok(())
+}
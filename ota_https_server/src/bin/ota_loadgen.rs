@@ -0,0 +1,606 @@
+//! Load the server with a fleet of simulated devices over loopback.
+//!
+//! Every device runs the update loop of the original firmware task
+//! (`download_new_firmware()`): each cycle opens a new connection with a full
+//! TLS handshake, requests the image, reads the response 1 KB at a time and
+//! peeks at the version in the application descriptor of the first bytes. A
+//! device already running that version closes the connection there, the
+//! others read the whole image, "install" it and only peek from then on.
+//! Devices then wait for the retry interval and start again, until the end of
+//! the run.
+//!
+//! The run is summarised as one JSON object: cycles and their outcome,
+//! download throughput, the p50/p99 latencies of the handshake, first byte and
+//! download, and the CPU and memory used by the server process.
+
+use clap::Parser;
+use rustls::client::WebPkiServerVerifier;
+use rustls::client::danger::{HandshakeSignatureValid, ServerCertVerified, ServerCertVerifier};
+use rustls::pki_types::{CertificateDer, ServerName, UnixTime};
+use rustls::{CertificateError, ClientConfig, DigitallySignedStruct, RootCertStore, SignatureScheme};
+use serde_json::json;
+use std::fs::File;
+use std::io::{BufReader, Write};
+use std::net::{Ipv4Addr, SocketAddr, TcpStream as StdTcpStream, ToSocketAddrs};
+use std::path::{Path, PathBuf};
+use std::process::{Child, Command, Stdio};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+use tokio::net::TcpStream;
+use tokio_rustls::TlsConnector;
+
+/// Size of the reads of the device (`BUFFSIZE`)
+const READ_SIZE: usize = 1024;
+/// Offset of `esp_app_desc_t` in an image (image and segment headers)
+const APP_DESC_OFFSET: usize = 24 + 8;
+/// Offset and size of the version in `esp_app_desc_t`
+const VERSION_OFFSET: usize = 16;
+const VERSION_LEN: usize = 32;
+/// Largest response header accepted
+const MAX_HEADER_LEN: usize = 8 * 1024;
+/// Clock ticks of the CPU times of `/proc/<pid>/stat` (`USER_HZ`, fixed by
+/// the Linux ABI)
+const USER_HZ: f64 = 100.0;
+
+// --- CLI Args ---
+#[derive(Parser, Debug)]
+#[clap(author, version, about, long_about = None)]
+struct Args {
+    /// Simulated devices
+    #[clap(short = 'n', long, default_value_t = 100)]
+    devices: usize,
+
+    /// Length of the run in seconds
+    #[clap(long, default_value_t = 60)]
+    duration: u64,
+
+    /// Seconds a device waits between two update checks
+    /// (`CONFIG_OTA_RETRY_INTERVAL`)
+    #[clap(long, default_value_t = 30)]
+    interval: u64,
+
+    /// Seconds over which the devices start their first check, the retry
+    /// interval by default. 0 starts them all at once.
+    #[clap(long)]
+    ramp: Option<u64>,
+
+    /// Firmware image the devices download
+    #[clap(long, default_value = "esp32_secure_ota.bin")]
+    image: String,
+
+    /// Version the devices run when the run starts. Devices running the
+    /// version of the image only peek at it.
+    #[clap(long, default_value = "loadgen")]
+    running_version: String,
+
+    /// Do not install the downloaded image, so that every check downloads it
+    /// again (sustained downloads rather than a rollout)
+    #[clap(long)]
+    keep_version: bool,
+
+    /// Timeout of the connection, handshake and every read in milliseconds
+    /// (`CONFIG_OTA_RECV_TIMEOUT`)
+    #[clap(long, default_value_t = 5000)]
+    timeout: u64,
+
+    /// URL of a running server, e.g. `https://127.0.0.1:8070`. By default the
+    /// server built next to this tool is started on `--dir`.
+    #[clap(long)]
+    url: Option<String>,
+
+    /// Process ID of the server at `--url`, to measure its CPU and memory
+    #[clap(long, requires = "url")]
+    server_pid: Option<u32>,
+
+    /// CA certificate of an https server, `<cert-dir>/ca_cert.pem` for the
+    /// server started by this tool
+    #[clap(long)]
+    ca_cert: Option<PathBuf>,
+
+    /// Directory served by the started server
+    #[clap(short, long, default_value = "firmware", conflicts_with = "url")]
+    dir: PathBuf,
+
+    /// Certificate directory of the started server, to serve over HTTPS
+    #[clap(short, long, conflicts_with = "url")]
+    cert_dir: Option<PathBuf>,
+
+    /// Port of the started server
+    #[clap(short, long, default_value_t = 8180, conflicts_with = "url")]
+    port: u16,
+
+    /// Log filter (`RUST_LOG`) of the started server, its own default so the
+    /// cost of logging every connection is measured
+    #[clap(long, default_value = "info,tower_http=debug", conflicts_with = "url")]
+    server_log: String,
+
+    /// Output file of the summary, stdout by default
+    #[clap(short, long)]
+    out: Option<PathBuf>,
+}
+
+/// Server process, stopped when dropped
+struct Server(Child);
+
+impl Server {
+    fn start(args: &Args) -> anyhow::Result<Server> {
+        // The server is built next to this tool
+        let exe = std::env::current_exe()?.with_file_name("ota_https_server");
+        let mut command = Command::new(&exe);
+        command
+            .arg("--dir")
+            .arg(&args.dir)
+            .args(["--ip", "127.0.0.1", "--port", &args.port.to_string()])
+            .env("RUST_LOG", &args.server_log)
+            .stdout(Stdio::null())
+            .stderr(Stdio::null());
+        if let Some(cert_dir) = &args.cert_dir {
+            command.arg("--cert-dir").arg(cert_dir);
+        }
+        let server = Server(
+            command
+                .spawn()
+                .map_err(|e| anyhow::anyhow!("Failed to start {:?}: {}", exe, e))?,
+        );
+
+        // The images are inspected and compressed before the server listens
+        let addr = SocketAddr::from((Ipv4Addr::LOCALHOST, args.port));
+        let start = Instant::now();
+        while StdTcpStream::connect_timeout(&addr, Duration::from_millis(100)).is_err() {
+            if start.elapsed() > Duration::from_secs(120) {
+                anyhow::bail!("Server on port {} did not start", args.port);
+            }
+            std::thread::sleep(Duration::from_millis(100));
+        }
+        Ok(server)
+    }
+}
+
+impl Drop for Server {
+    fn drop(&mut self) {
+        let _ = self.0.kill();
+        let _ = self.0.wait();
+    }
+}
+
+/// CPU time and memory of a process, from `/proc`
+struct ProcessUsage {
+    cpu_seconds: f64,
+    rss_kb: u64,
+    peak_rss_kb: u64,
+}
+
+impl ProcessUsage {
+    fn read(pid: u32) -> anyhow::Result<ProcessUsage> {
+        let stat = std::fs::read_to_string(format!("/proc/{}/stat", pid))?;
+        // The command name may hold spaces, the fields start after it
+        let fields: Vec<&str> = stat[stat.rfind(')').unwrap_or(0) + 1..].split_whitespace().collect();
+        let ticks = |i: usize| fields.get(i).and_then(|value| value.parse::<u64>().ok()).unwrap_or(0);
+        // utime and stime, fields 14 and 15 of the whole line
+        let cpu_seconds = (ticks(11) + ticks(12)) as f64 / USER_HZ;
+
+        let status = std::fs::read_to_string(format!("/proc/{}/status", pid))?;
+        let kb = |name: &str| {
+            status
+                .lines()
+                .find_map(|line| line.strip_prefix(name)?.trim().strip_suffix("kB")?.trim().parse().ok())
+                .unwrap_or(0)
+        };
+        Ok(ProcessUsage { cpu_seconds, rss_kb: kb("VmRSS:"), peak_rss_kb: kb("VmHWM:") })
+    }
+}
+
+/// Verify the server certificate as the device does: the self-signed
+/// certificate of the server (`ca_cert.pem`) is trusted as is, and the name
+/// is not checked (`skip_cert_common_name_check`)
+#[derive(Debug)]
+struct DeviceVerifier {
+    trusted: Vec<CertificateDer<'static>>,
+    webpki: Arc<WebPkiServerVerifier>,
+}
+
+impl ServerCertVerifier for DeviceVerifier {
+    fn verify_server_cert(
+        &self,
+        end_entity: &CertificateDer<'_>,
+        intermediates: &[CertificateDer<'_>],
+        server_name: &ServerName<'_>,
+        ocsp_response: &[u8],
+        now: UnixTime,
+    ) -> Result<ServerCertVerified, rustls::Error> {
+        if self.trusted.contains(end_entity) {
+            return Ok(ServerCertVerified::assertion());
+        }
+        match self.webpki.verify_server_cert(end_entity, intermediates, server_name, ocsp_response, now) {
+            Err(rustls::Error::InvalidCertificate(
+                CertificateError::NotValidForName | CertificateError::NotValidForNameContext { .. },
+            )) => Ok(ServerCertVerified::assertion()),
+            result => result,
+        }
+    }
+
+    fn verify_tls12_signature(
+        &self,
+        message: &[u8],
+        cert: &CertificateDer<'_>,
+        dss: &DigitallySignedStruct,
+    ) -> Result<HandshakeSignatureValid, rustls::Error> {
+        self.webpki.verify_tls12_signature(message, cert, dss)
+    }
+
+    fn verify_tls13_signature(
+        &self,
+        message: &[u8],
+        cert: &CertificateDer<'_>,
+        dss: &DigitallySignedStruct,
+    ) -> Result<HandshakeSignatureValid, rustls::Error> {
+        self.webpki.verify_tls13_signature(message, cert, dss)
+    }
+
+    fn supported_verify_schemes(&self) -> Vec<SignatureScheme> {
+        self.webpki.supported_verify_schemes()
+    }
+}
+
+/// TLS client trusting the certificates of a PEM file. Sessions are not
+/// resumed, every handshake of the original firmware is a full one.
+fn tls_connector(ca_cert: &Path) -> anyhow::Result<TlsConnector> {
+    let mut reader = BufReader::new(File::open(ca_cert)?);
+    let trusted = rustls_pemfile::certs(&mut reader).collect::<Result<Vec<_>, _>>()?;
+    let mut roots = RootCertStore::empty();
+    for cert in &trusted {
+        roots.add(cert.clone())?;
+    }
+    let webpki = WebPkiServerVerifier::builder(Arc::new(roots)).build()?;
+    let mut config = ClientConfig::builder()
+        .dangerous()
+        .with_custom_certificate_verifier(Arc::new(DeviceVerifier { trusted, webpki }))
+        .with_no_client_auth();
+    config.resumption = rustls::client::Resumption::disabled();
+    Ok(TlsConnector::from(Arc::new(config)))
+}
+
+/// Where and how the devices connect
+struct Target {
+    addr: SocketAddr,
+    host: String,
+    path: String,
+    tls: Option<(TlsConnector, ServerName<'static>)>,
+    timeout: Duration,
+}
+
+impl Target {
+    fn new(url: &str, image: &str, ca_cert: Option<&Path>, timeout: Duration) -> anyhow::Result<Target> {
+        let (https, rest) = if let Some(rest) = url.strip_prefix("https://") {
+            (true, rest)
+        } else if let Some(rest) = url.strip_prefix("http://") {
+            (false, rest)
+        } else {
+            anyhow::bail!("URL {} is not http or https", url);
+        };
+        let (authority, base_path) = rest.split_once('/').unwrap_or((rest, ""));
+        let (host, port) = match authority.rsplit_once(':') {
+            Some((host, port)) => (host, port.parse()?),
+            None => (authority, if https { 443 } else { 80 }),
+        };
+        let addr = (host, port)
+            .to_socket_addrs()?
+            .next()
+            .ok_or_else(|| anyhow::anyhow!("Failed to resolve {}", host))?;
+
+        let tls = if https {
+            let Some(ca_cert) = ca_cert else {
+                anyhow::bail!("An https server needs --ca-cert");
+            };
+            Some((tls_connector(ca_cert)?, ServerName::try_from(host.to_string())?))
+        } else {
+            None
+        };
+
+        let base_path = base_path.trim_end_matches('/');
+        Ok(Target {
+            addr,
+            host: authority.to_string(),
+            path: if base_path.is_empty() { format!("/{}", image) } else { format!("/{}/{}", base_path, image) },
+            tls,
+            timeout,
+        })
+    }
+}
+
+trait Stream: AsyncRead + AsyncWrite + Unpin + Send {}
+impl<T: AsyncRead + AsyncWrite + Unpin + Send> Stream for T {}
+
+/// How an update check ended
+enum Outcome {
+    /// The image was downloaded, with its version
+    Downloaded(String),
+    /// The device already runs the version of the image
+    UpToDate,
+    /// Turned away by the admission control (`503`)
+    Busy,
+}
+
+/// Timings of an update check, from the start of the connection
+#[derive(Default)]
+struct Timings {
+    handshake: Option<Duration>,
+    first_byte: Option<Duration>,
+    /// From the request to the last byte of the image
+    download: Option<Duration>,
+    bytes: u64,
+}
+
+/// Read what arrived, at most one buffer
+async fn read(stream: &mut Box<dyn Stream>, buffer: &mut [u8], timeout: Duration) -> anyhow::Result<usize> {
+    match tokio::time::timeout(timeout, stream.read(buffer)).await {
+        Ok(Ok(0)) => anyhow::bail!("Connection closed"),
+        Ok(result) => Ok(result?),
+        Err(_) => anyhow::bail!("Read timed out"),
+    }
+}
+
+/// Run one update check of a device, as the original firmware task does
+async fn check(target: &Target, version: &str, timings: &mut Timings) -> anyhow::Result<Outcome> {
+    let timed_out = |what: &'static str| move |_| anyhow::anyhow!("{} timed out", what);
+    let start = Instant::now();
+
+    let tcp = tokio::time::timeout(target.timeout, TcpStream::connect(target.addr))
+        .await
+        .map_err(timed_out("Connection"))??;
+    tcp.set_nodelay(true)?;
+    let mut stream: Box<dyn Stream> = match &target.tls {
+        Some((connector, name)) => Box::new(
+            tokio::time::timeout(target.timeout, connector.connect(name.clone(), tcp))
+                .await
+                .map_err(timed_out("TLS handshake"))??,
+        ),
+        None => Box::new(tcp),
+    };
+    timings.handshake = Some(start.elapsed());
+
+    let request_start = Instant::now();
+    let request = format!(
+        "GET {} HTTP/1.1\r\nHost: {}\r\nUser-Agent: ESP32 HTTP Client/1.0\r\n\r\n",
+        target.path, target.host
+    );
+    stream.write_all(request.as_bytes()).await?;
+
+    // Read 1 KB at a time until the end of the header, the rest is body
+    let mut buffer = [0; READ_SIZE];
+    let mut received = Vec::with_capacity(READ_SIZE);
+    let header_len = loop {
+        let len = read(&mut stream, &mut buffer, target.timeout).await?;
+        if timings.first_byte.is_none() {
+            timings.first_byte = Some(request_start.elapsed());
+        }
+        received.extend_from_slice(&buffer[..len]);
+        if let Some(end) = received.windows(4).position(|window| window == b"\r\n\r\n") {
+            break end + 4;
+        }
+        if received.len() > MAX_HEADER_LEN {
+            anyhow::bail!("Response header too long");
+        }
+    };
+    let header = std::str::from_utf8(&received[..header_len])?;
+    let status = header.split(' ').nth(1).unwrap_or("");
+    match status {
+        "200" => {}
+        "503" => return Ok(Outcome::Busy),
+        _ => anyhow::bail!("GET {} returned {}", target.path, status),
+    }
+    let content_length: u64 = header
+        .lines()
+        .find_map(|line| {
+            let (name, value) = line.split_once(':')?;
+            name.eq_ignore_ascii_case("content-length").then(|| value.trim().parse().ok())?
+        })
+        .ok_or_else(|| anyhow::anyhow!("Response without Content-Length"))?;
+
+    // Peek at the version, the first read must hold the app descriptor
+    let mut body = received.split_off(header_len);
+    let desc_end = APP_DESC_OFFSET + VERSION_OFFSET + VERSION_LEN;
+    while body.len() < desc_end && (body.len() as u64) < content_length {
+        let len = read(&mut stream, &mut buffer, target.timeout).await?;
+        body.extend_from_slice(&buffer[..len]);
+    }
+    if body.len() < desc_end {
+        anyhow::bail!("Image too short for an app descriptor");
+    }
+    let new_version = &body[APP_DESC_OFFSET + VERSION_OFFSET..desc_end];
+    let new_version = String::from_utf8_lossy(new_version.split(|&b| b == 0).next().unwrap_or(&[])).into_owned();
+    if new_version == version {
+        return Ok(Outcome::UpToDate);
+    }
+
+    let mut bytes = body.len() as u64;
+    while bytes < content_length {
+        bytes += read(&mut stream, &mut buffer, target.timeout).await? as u64;
+    }
+    timings.download = Some(request_start.elapsed());
+    timings.bytes = bytes;
+    Ok(Outcome::Downloaded(new_version))
+}
+
+/// Measurements of the whole fleet
+#[derive(Default)]
+struct Results {
+    checks: u64,
+    downloads: u64,
+    up_to_date: u64,
+    busy: u64,
+    errors: u64,
+    /// First error messages, to tell why checks fail
+    error_samples: Vec<String>,
+    bytes: u64,
+    handshake: Vec<Duration>,
+    first_byte: Vec<Duration>,
+    download: Vec<Duration>,
+}
+
+impl Results {
+    fn record(&mut self, result: &anyhow::Result<Outcome>, timings: Timings) {
+        self.checks += 1;
+        match result {
+            Ok(Outcome::Downloaded(_)) => self.downloads += 1,
+            Ok(Outcome::UpToDate) => self.up_to_date += 1,
+            Ok(Outcome::Busy) => self.busy += 1,
+            Err(e) => {
+                self.errors += 1;
+                if self.error_samples.len() < 5 {
+                    self.error_samples.push(e.to_string());
+                }
+            }
+        }
+        self.bytes += timings.bytes;
+        self.handshake.extend(timings.handshake);
+        self.first_byte.extend(timings.first_byte);
+        self.download.extend(timings.download);
+    }
+}
+
+/// Run a device until the deadline
+async fn device(args: Arc<Args>, target: Arc<Target>, results: Arc<Mutex<Results>>, start: Duration, deadline: Instant) {
+    let interval = Duration::from_secs(args.interval);
+    let mut version = args.running_version.clone();
+    tokio::time::sleep(start).await;
+    while Instant::now() < deadline {
+        let mut timings = Timings::default();
+        let result = check(&target, &version, &mut timings).await;
+        if let (Ok(Outcome::Downloaded(new_version)), false) = (&result, args.keep_version) {
+            version = new_version.clone();
+        }
+        results.lock().unwrap().record(&result, timings);
+        tokio::time::sleep_until((Instant::now() + interval).min(deadline).into()).await;
+    }
+}
+
+/// Percentile of the durations in milliseconds
+fn percentile_ms(durations: &mut [Duration], percentile: f64) -> Option<f64> {
+    if durations.is_empty() {
+        return None;
+    }
+    durations.sort_unstable();
+    let index = ((durations.len() - 1) as f64 * percentile).round() as usize;
+    Some(durations[index].as_secs_f64() * 1000.0)
+}
+
+fn format_ms(value: Option<f64>) -> String {
+    value.map_or("-".to_string(), |ms| format!("{:.1}", ms))
+}
+
+#[tokio::main]
+async fn main() -> anyhow::Result<()> {
+    let args = Arc::new(Args::parse());
+    if args.devices == 0 || args.duration == 0 {
+        anyhow::bail!("--devices and --duration must be at least 1");
+    }
+
+    let server = match &args.url {
+        Some(_) => None,
+        None => Some(Server::start(&args)?),
+    };
+    let (url, ca_cert) = match &args.url {
+        Some(url) => (url.clone(), args.ca_cert.clone()),
+        None => {
+            let scheme = if args.cert_dir.is_some() { "https" } else { "http" };
+            let ca_cert = args.ca_cert.clone().or_else(|| Some(args.cert_dir.as_ref()?.join("ca_cert.pem")));
+            (format!("{}://127.0.0.1:{}", scheme, args.port), ca_cert)
+        }
+    };
+    let target = Arc::new(Target::new(&url, &args.image, ca_cert.as_deref(), Duration::from_millis(args.timeout))?);
+    let server_pid = server.as_ref().map(|server| server.0.id()).or(args.server_pid);
+
+    eprintln!("{} devices checking {}{} every {} s for {} s", args.devices, url, target.path, args.interval, args.duration);
+    let usage_before = server_pid.map(ProcessUsage::read).transpose()?;
+    let results = Arc::new(Mutex::new(Results::default()));
+    let ramp = Duration::from_secs(args.ramp.unwrap_or(args.interval));
+    let started = Instant::now();
+    let deadline = started + Duration::from_secs(args.duration);
+
+    let devices: Vec<_> = (0..args.devices)
+        .map(|i| {
+            let start = ramp.mul_f64(i as f64 / args.devices as f64);
+            tokio::spawn(device(args.clone(), target.clone(), results.clone(), start, deadline))
+        })
+        .collect();
+    for device in devices {
+        device.await?;
+    }
+    let elapsed = started.elapsed().as_secs_f64();
+    // A server that did not survive the run still gets its summary
+    let usage_after = server_pid.and_then(|pid| {
+        ProcessUsage::read(pid)
+            .map_err(|e| eprintln!("Failed to read the usage of the server process {}: {}", pid, e))
+            .ok()
+    });
+    drop(server);
+
+    let mut results = results.lock().unwrap();
+    let results = &mut *results;
+    let mut summary = json!({
+        "devices": args.devices,
+        "duration_s": elapsed,
+        "url": format!("{}{}", url, target.path),
+        "checks": results.checks,
+        "downloads": results.downloads,
+        "up_to_date": results.up_to_date,
+        "busy": results.busy,
+        "errors": results.errors,
+        "error_samples": results.error_samples,
+        "bytes": results.bytes,
+        "throughput_bps": (results.bytes as f64 / elapsed) as u64,
+        "checks_per_s": results.checks as f64 / elapsed,
+        "handshake_p50_ms": percentile_ms(&mut results.handshake, 0.50),
+        "handshake_p99_ms": percentile_ms(&mut results.handshake, 0.99),
+        "first_byte_p50_ms": percentile_ms(&mut results.first_byte, 0.50),
+        "first_byte_p99_ms": percentile_ms(&mut results.first_byte, 0.99),
+        "download_p50_ms": percentile_ms(&mut results.download, 0.50),
+        "download_p99_ms": percentile_ms(&mut results.download, 0.99),
+    });
+    if let (Some(before), Some(after)) = (&usage_before, &usage_after) {
+        let fields = summary.as_object_mut().unwrap();
+        fields.insert("server_cpu_percent".into(), json!((after.cpu_seconds - before.cpu_seconds) / elapsed * 100.0));
+        fields.insert("server_rss_kb".into(), json!(after.rss_kb));
+        fields.insert("server_peak_rss_kb".into(), json!(after.peak_rss_kb));
+    }
+
+    let mut out: Box<dyn Write> = match &args.out {
+        Some(path) => Box::new(File::create(path)?),
+        None => Box::new(std::io::stdout()),
+    };
+    writeln!(out, "{}", summary)?;
+    out.flush()?;
+
+    eprintln!(
+        "{} checks: {} downloads, {} up to date, {} busy, {} errors",
+        results.checks, results.downloads, results.up_to_date, results.busy, results.errors
+    );
+    for error in &results.error_samples {
+        eprintln!("  error: {}", error);
+    }
+    eprintln!("{:>10} | {:>9} {:>9}", "", "p50 ms", "p99 ms");
+    for (name, p50, p99) in [
+        ("handshake", "handshake_p50_ms", "handshake_p99_ms"),
+        ("first byte", "first_byte_p50_ms", "first_byte_p99_ms"),
+        ("download", "download_p50_ms", "download_p99_ms"),
+    ] {
+        eprintln!(
+            "{:>10} | {:>9} {:>9}",
+            name,
+            format_ms(summary[p50].as_f64()),
+            format_ms(summary[p99].as_f64())
+        );
+    }
+    eprintln!("throughput {} KB/s", summary["throughput_bps"].as_u64().unwrap_or(0) / 1024);
+    if let Some(cpu) = summary.get("server_cpu_percent") {
+        eprintln!(
+            "server: {:.0}% CPU, {} KB resident ({} KB peak)",
+            cpu.as_f64().unwrap_or(0.0),
+            summary["server_rss_kb"],
+            summary["server_peak_rss_kb"]
+        );
+    }
+    Ok(())
+}
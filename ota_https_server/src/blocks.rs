@@ -0,0 +1,83 @@
+//! Block lists of the firmware images, so that devices can check a download
+//! as it lands instead of only once it is complete.
+//!
+//! The image is split in blocks of one flash sector, the last one possibly
+//! shorter, and the list holds the SHA-256 of every block after a fixed size
+//! header. All integers are little endian.
+//!
+//! Header:
+//! - `magic`: `ESPB`
+//! - `version`, `block_bits` (log2 of the block size), two reserved bytes
+//! - `size`: u32 size of the image
+//! - `sha256`: SHA-256 of the whole image
+//!
+//! The list is signed like the image: a device trusting it can keep every
+//! block already written that still matches, and download again only the
+//! block that did not.
+
+use sha2::{Digest, Sha256};
+
+/// Blocks are flash sectors, the unit devices erase and resume writes at
+pub const BLOCK_BITS: u8 = 12;
+pub const BLOCK_SIZE: usize = 1 << BLOCK_BITS;
+
+pub const MAGIC: &[u8; 4] = b"ESPB";
+pub const FORMAT_VERSION: u8 = 1;
+pub const HEADER_LEN: usize = 44;
+
+/// Build the block list of an image
+pub fn build(image: &[u8]) -> Vec<u8> {
+    let count = image.len().div_ceil(BLOCK_SIZE);
+
+    let mut out = Vec::with_capacity(HEADER_LEN + count * 32);
+    out.extend_from_slice(MAGIC);
+    out.extend_from_slice(&[FORMAT_VERSION, BLOCK_BITS, 0, 0]);
+    out.extend_from_slice(&(image.len() as u32).to_le_bytes());
+    out.extend_from_slice(&Sha256::digest(image));
+    for block in image.chunks(BLOCK_SIZE) {
+        out.extend_from_slice(&Sha256::digest(block));
+    }
+    out
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Fixture shared with the host tests, see host/test/make_fixtures.py
+    const NEW: &[u8] = include_bytes!("../../host/test/fixtures/new.bin");
+
+    #[test]
+    fn header() {
+        let list = build(NEW);
+        assert_eq!(&list[0..4], MAGIC);
+        assert_eq!(list[4..8], [FORMAT_VERSION, BLOCK_BITS, 0, 0]);
+        assert_eq!(u32::from_le_bytes(list[8..12].try_into().unwrap()) as usize, NEW.len());
+        assert_eq!(list[12..HEADER_LEN], Sha256::digest(NEW)[..]);
+    }
+
+    #[test]
+    fn block_hashes() {
+        // The last block of the fixture is shorter than the others
+        assert_ne!(NEW.len() % BLOCK_SIZE, 0);
+        let list = build(NEW);
+        let hashes: Vec<&[u8]> = list[HEADER_LEN..].chunks(32).collect();
+        assert_eq!(hashes.len(), NEW.len().div_ceil(BLOCK_SIZE));
+        for (i, hash) in hashes.iter().enumerate() {
+            let block = &NEW[i * BLOCK_SIZE..NEW.len().min((i + 1) * BLOCK_SIZE)];
+            assert_eq!(*hash, &Sha256::digest(block)[..]);
+        }
+        let last = &NEW[NEW.len() / BLOCK_SIZE * BLOCK_SIZE..];
+        assert!(last.len() < BLOCK_SIZE);
+        assert_eq!(hashes[hashes.len() - 1], &Sha256::digest(last)[..]);
+    }
+
+    #[test]
+    fn whole_blocks() {
+        let image = &NEW[..2 * BLOCK_SIZE];
+        let list = build(image);
+        assert_eq!(list.len(), HEADER_LEN + 2 * 32);
+        assert_eq!(list[HEADER_LEN + 32..], Sha256::digest(&image[BLOCK_SIZE..])[..]);
+        assert_eq!(build(&[]).len(), HEADER_LEN);
+    }
+}
@@ -0,0 +1,240 @@
+//! Catalog of the firmware images by the devices they are built for
+use crate::firmware::Image;
+use serde::Deserialize;
+use std::collections::HashMap;
+use std::sync::Arc;
+
+/// Channel of the versions without a pre-release tag
+pub const STABLE_CHANNEL: &str = "stable";
+
+/// Devices a build is meant for, the key of the catalog
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+pub struct Target {
+    /// `project_name` of the `esp_app_desc_t`
+    pub project: String,
+    /// `chip_id` of the image header
+    pub chip: u16,
+    /// `min_chip_rev_full` of the image header, e.g. 300 for v3.0
+    pub min_rev: u16,
+    /// Release channel, see `channel()`
+    pub channel: String,
+}
+
+impl Target {
+    pub fn of(image: &Image) -> Target {
+        Target {
+            project: image.desc.project_name.clone(),
+            chip: image.chip_id,
+            min_rev: image.min_chip_rev,
+            channel: channel(&image.desc.version),
+        }
+    }
+}
+
+/// Target of the running firmware, sent by a device in the query string of
+/// the manifest request:
+/// `/manifest?project=esp32_secure_ota&chip=0&min_rev=300&channel=stable&secure_version=0`
+#[derive(Debug, Deserialize)]
+pub struct CatalogQuery {
+    pub project: String,
+    pub chip: u16,
+    pub min_rev: u16,
+    pub channel: String,
+    /// Images with a lower secure version would be refused by anti-rollback
+    #[serde(default)]
+    pub secure_version: u32,
+}
+
+impl CatalogQuery {
+    pub fn target(&self) -> Target {
+        Target {
+            project: self.project.clone(),
+            chip: self.chip,
+            min_rev: self.min_rev,
+            channel: self.channel.to_ascii_lowercase(),
+        }
+    }
+}
+
+/// Get the release channel of a version: the letters starting its pre-release
+/// tag (`beta` for `v2.1.0-beta.3`), `stable` without one. What `git describe`
+/// appends (`v2.1.0-4-gb1e2d3f`, `v2.1.0-dirty`) is not a channel.
+pub fn channel(version: &str) -> String {
+    version
+        .split_once('-')
+        .map(|(_, tag)| {
+            tag.chars()
+                .take_while(char::is_ascii_alphabetic)
+                .collect::<String>()
+                .to_ascii_lowercase()
+        })
+        .filter(|channel| !channel.is_empty() && channel != "dirty")
+        .unwrap_or_else(|| STABLE_CHANNEL.to_string())
+}
+
+/// The image offered to every target, found with a single hash lookup.
+///
+/// When several images have the same target, the catalog keeps the one with
+/// the highest secure version, then the one published last (file modification
+/// time).
+#[derive(Debug, Default)]
+pub struct Catalog {
+    latest: HashMap<Target, Arc<Image>>,
+}
+
+impl Catalog {
+    pub fn new<'a>(images: impl IntoIterator<Item = &'a Arc<Image>>) -> Catalog {
+        let mut latest: HashMap<Target, Arc<Image>> = HashMap::new();
+        for image in images {
+            latest
+                .entry(Target::of(image))
+                .and_modify(|current| {
+                    if precedence(image) > precedence(current) {
+                        *current = image.clone();
+                    }
+                })
+                .or_insert_with(|| image.clone());
+        }
+        Catalog { latest }
+    }
+
+    /// Get the image of a target
+    pub fn get(&self, target: &Target) -> Option<&Arc<Image>> {
+        self.latest.get(target)
+    }
+
+    /// Get the image of the target a device sent, if the device can install it
+    pub fn find(&self, query: &CatalogQuery) -> Option<&Arc<Image>> {
+        self.get(&query.target())
+            .filter(|image| image.desc.secure_version >= query.secure_version)
+    }
+
+    pub fn entries(&self) -> impl Iterator<Item = (&Target, &Arc<Image>)> {
+        self.latest.iter()
+    }
+}
+
+/// Order of the images of the same target, the name breaks ties so that the
+/// choice does not depend on the directory listing order
+fn precedence(image: &Image) -> (u32, Option<std::time::SystemTime>, &str) {
+    (image.desc.secure_version, image.modified(), &image.name)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::time::{Duration, SystemTime};
+
+    fn at(seconds: u64) -> Option<SystemTime> {
+        Some(SystemTime::UNIX_EPOCH + Duration::from_secs(seconds))
+    }
+
+    fn image(name: &str, version: &str, secure_version: u32, modified: Option<SystemTime>) -> Arc<Image> {
+        Arc::new(Image::test(name, "esp32_secure_ota", version, secure_version, modified))
+    }
+
+    fn query(channel: &str, secure_version: u32) -> CatalogQuery {
+        CatalogQuery {
+            project: "esp32_secure_ota".to_string(),
+            chip: 0,
+            min_rev: 300,
+            channel: channel.to_string(),
+            secure_version,
+        }
+    }
+
+    fn found<'a>(catalog: &'a Catalog, query: &CatalogQuery) -> Option<&'a str> {
+        catalog.find(query).map(|image| image.name.as_str())
+    }
+
+    #[test]
+    fn pre_release_channels() {
+        assert_eq!(channel("v2.1.0-beta.3"), "beta");
+        assert_eq!(channel("2.1.0-rc1"), "rc");
+        assert_eq!(channel("v2.1.0-Beta"), "beta");
+        assert_eq!(channel("v2.1.0-nightly-4-gb1e2d3f"), "nightly");
+    }
+
+    #[test]
+    fn stable_channel() {
+        assert_eq!(channel("v2.1.0"), STABLE_CHANNEL);
+        assert_eq!(channel("1.1"), STABLE_CHANNEL);
+        assert_eq!(channel(""), STABLE_CHANNEL);
+        // What git describe appends
+        assert_eq!(channel("v2.1.0-4-gb1e2d3f"), STABLE_CHANNEL);
+        assert_eq!(channel("v2.1.0-dirty"), STABLE_CHANNEL);
+        assert_eq!(channel("v2.1.0-4-gb1e2d3f-dirty"), STABLE_CHANNEL);
+        assert_eq!(channel("v2.1.0-"), STABLE_CHANNEL);
+    }
+
+    #[test]
+    fn channels_ignore_case() {
+        let catalog = Catalog::new(&[image("beta.bin", "v2.1.0-beta.3", 0, at(1))]);
+        assert_eq!(found(&catalog, &query("BETA", 0)), Some("beta.bin"));
+        assert_eq!(found(&catalog, &query("Beta", 0)), Some("beta.bin"));
+        assert_eq!(found(&catalog, &query(STABLE_CHANNEL, 0)), None);
+    }
+
+    #[test]
+    fn targets() {
+        let mut other_chip = Image::test("c3.bin", "esp32_secure_ota", "v2.0", 0, at(1));
+        other_chip.chip_id = 5;
+        let catalog = Catalog::new(&[
+            image("stable.bin", "v2.0", 0, at(1)),
+            image("beta.bin", "v2.1-beta.1", 0, at(1)),
+            Arc::new(other_chip),
+            Arc::new(Image::test("other.bin", "other_project", "v2.0", 0, at(1))),
+        ]);
+        assert_eq!(catalog.entries().count(), 4);
+        assert_eq!(found(&catalog, &query(STABLE_CHANNEL, 0)), Some("stable.bin"));
+        assert_eq!(found(&catalog, &query("beta", 0)), Some("beta.bin"));
+        assert_eq!(found(&catalog, &CatalogQuery { chip: 5, ..query(STABLE_CHANNEL, 0) }), Some("c3.bin"));
+        assert_eq!(found(&catalog, &CatalogQuery { min_rev: 0, ..query(STABLE_CHANNEL, 0) }), None);
+        assert_eq!(
+            found(&catalog, &CatalogQuery { project: "other_project".to_string(), ..query(STABLE_CHANNEL, 0) }),
+            Some("other.bin")
+        );
+    }
+
+    #[test]
+    fn highest_secure_version_first() {
+        // Whatever the order of the directory listing
+        let images = [image("a.bin", "v2.0", 2, at(1)), image("b.bin", "v2.1", 1, at(100))];
+        for images in [images.clone(), [images[1].clone(), images[0].clone()]] {
+            let catalog = Catalog::new(&images);
+            assert_eq!(found(&catalog, &query(STABLE_CHANNEL, 0)), Some("a.bin"));
+        }
+    }
+
+    #[test]
+    fn last_published_first() {
+        let images = [image("a.bin", "v2.0", 1, at(100)), image("b.bin", "v2.1", 1, at(1))];
+        for images in [images.clone(), [images[1].clone(), images[0].clone()]] {
+            let catalog = Catalog::new(&images);
+            assert_eq!(found(&catalog, &query(STABLE_CHANNEL, 0)), Some("a.bin"));
+        }
+        // Without a modification time
+        let images = [image("a.bin", "v2.0", 1, None), image("b.bin", "v2.1", 1, at(1))];
+        assert_eq!(found(&Catalog::new(&images), &query(STABLE_CHANNEL, 0)), Some("b.bin"));
+    }
+
+    #[test]
+    fn name_breaks_ties() {
+        let images = [image("a.bin", "v2.0", 1, at(1)), image("b.bin", "v2.0", 1, at(1))];
+        for images in [images.clone(), [images[1].clone(), images[0].clone()]] {
+            let catalog = Catalog::new(&images);
+            assert_eq!(found(&catalog, &query(STABLE_CHANNEL, 0)), Some("b.bin"));
+        }
+    }
+
+    #[test]
+    fn secure_version_filter() {
+        let catalog = Catalog::new(&[image("a.bin", "v2.0", 2, at(1))]);
+        assert_eq!(found(&catalog, &query(STABLE_CHANNEL, 0)), Some("a.bin"));
+        assert_eq!(found(&catalog, &query(STABLE_CHANNEL, 2)), Some("a.bin"));
+        // Anti-rollback would refuse it
+        assert_eq!(found(&catalog, &query(STABLE_CHANNEL, 3)), None);
+        // The image of the target is not replaced by an older one
+        assert!(catalog.get(&query(STABLE_CHANNEL, 3).target()).is_some());
+    }
+}
@@ -0,0 +1,323 @@
+//! Binary delta patches between two firmware images.
+//!
+//! A patch is a fixed size header followed by a heatshrink compressed stream
+//! of records rebuilding the new image from start to end, so that the device
+//! can apply it as it downloads it while reading the old image from its
+//! running partition. All integers are little endian.
+//!
+//! Header:
+//! - `magic`: `ESPD`
+//! - `version`, `window_bits`, `lookahead_bits`, reserved byte
+//! - `base_size`, `target_size`: u32
+//! - `base_sha256`, `target_sha256`: SHA-256 of the whole images
+//! - `base_elf_sha256`: `app_elf_sha256` of the old image, to select a patch
+//!
+//! Records:
+//! - `ADD`: u8 `1`, u32 old offset, u32 length, `length` bytes to add (mod 256)
+//!   to the bytes of the old image starting at the old offset
+//! - `INSERT`: u8 `2`, u32 length, `length` bytes to insert as they are
+//! - `END`: u8 `0`
+
+use crate::firmware::AppDesc;
+use crate::heatshrink;
+use sha2::{Digest, Sha256};
+
+pub const MAGIC: &[u8; 4] = b"ESPD";
+pub const FORMAT_VERSION: u8 = 1;
+pub const HEADER_LEN: usize = 112;
+
+const OP_END: u8 = 0;
+const OP_ADD: u8 = 1;
+const OP_INSERT: u8 = 2;
+
+/// Bytes hashed to find matches in the old image
+const KEY_LEN: usize = 8;
+const HASH_BITS: u32 = 20;
+/// Shortest exact match worth an `ADD` record
+const MIN_MATCH: usize = 16;
+/// Maximum number of candidates looked at for every position
+const MAX_CHAIN: usize = 64;
+/// How far an `ADD` record is extended past its last matching byte
+const MAX_MISMATCH_RUN: usize = 64;
+const NONE: u32 = u32::MAX;
+
+/// Parsed patch header
+#[derive(Debug, Clone)]
+pub struct Header {
+    pub base_size: u32,
+    pub target_size: u32,
+    pub base_sha256: [u8; 32],
+    pub target_sha256: [u8; 32],
+    pub base_elf_sha256: [u8; 32],
+}
+
+impl Header {
+    pub fn parse(data: &[u8]) -> Option<Header> {
+        if data.len() < HEADER_LEN || &data[0..4] != MAGIC || data[4] != FORMAT_VERSION {
+            return None;
+        }
+
+        Some(Header {
+            base_size: u32::from_le_bytes(data[8..12].try_into().ok()?),
+            target_size: u32::from_le_bytes(data[12..16].try_into().ok()?),
+            base_sha256: data[16..48].try_into().ok()?,
+            target_sha256: data[48..80].try_into().ok()?,
+            base_elf_sha256: data[80..112].try_into().ok()?,
+        })
+    }
+}
+
+enum Record {
+    Add { old_offset: usize, new_offset: usize, len: usize },
+    Insert { new_offset: usize, len: usize },
+}
+
+fn hash(data: &[u8]) -> usize {
+    let key = u64::from_le_bytes(data[..KEY_LEN].try_into().unwrap());
+    (key.wrapping_mul(0x9E3779B97F4A7C15) >> (64 - HASH_BITS)) as usize
+}
+
+/// Extend an approximate match forward, the way bsdiff does: stop where the
+/// share of matching bytes is the highest, so that small differences (e.g.
+/// relocated addresses) do not split the record.
+fn extend_match(old: &[u8], new: &[u8], old_offset: usize, new_offset: usize) -> usize {
+    let limit = (old.len() - old_offset).min(new.len() - new_offset);
+    let mut score: isize = 0;
+    let mut best_score: isize = 0;
+    let mut best_len = 0;
+
+    for i in 0..limit {
+        if old[old_offset + i] == new[new_offset + i] {
+            score += 1;
+        } else {
+            score -= 1;
+        }
+        if score > best_score {
+            best_score = score;
+            best_len = i + 1;
+        } else if i - best_len > MAX_MISMATCH_RUN {
+            break;
+        }
+    }
+    best_len
+}
+
+/// Split the new image into records copying from the old image
+fn diff(old: &[u8], new: &[u8]) -> Vec<Record> {
+    let mut head = vec![NONE; 1 << HASH_BITS];
+    let mut prev = vec![NONE; old.len()];
+    for pos in 0..old.len().saturating_sub(KEY_LEN - 1) {
+        let h = hash(&old[pos..]);
+        prev[pos] = head[h];
+        head[h] = pos as u32;
+    }
+
+    let mut records = Vec::new();
+    let mut insert_start = 0;
+    let mut pos = 0;
+
+    while pos + KEY_LEN <= new.len() {
+        // Find the longest exact match in the old image
+        let mut best_len = 0;
+        let mut best_offset = 0;
+        let mut candidate = head[hash(&new[pos..])];
+        let mut chain = 0;
+        while candidate != NONE && chain < MAX_CHAIN {
+            let start = candidate as usize;
+            let len = old[start..]
+                .iter()
+                .zip(&new[pos..])
+                .take_while(|(a, b)| a == b)
+                .count();
+            if len > best_len {
+                best_len = len;
+                best_offset = start;
+            }
+            candidate = prev[start];
+            chain += 1;
+        }
+
+        if best_len < MIN_MATCH {
+            pos += 1;
+            continue;
+        }
+
+        // Pull matching bytes back out of the pending insertion
+        let mut old_offset = best_offset;
+        let mut new_offset = pos;
+        while new_offset > insert_start && old_offset > 0 && old[old_offset - 1] == new[new_offset - 1] {
+            old_offset -= 1;
+            new_offset -= 1;
+        }
+
+        if new_offset > insert_start {
+            records.push(Record::Insert {
+                new_offset: insert_start,
+                len: new_offset - insert_start,
+            });
+        }
+
+        let len = extend_match(old, new, old_offset, new_offset);
+        records.push(Record::Add {
+            old_offset,
+            new_offset,
+            len,
+        });
+
+        pos = new_offset + len;
+        insert_start = pos;
+    }
+
+    if new.len() > insert_start {
+        records.push(Record::Insert {
+            new_offset: insert_start,
+            len: new.len() - insert_start,
+        });
+    }
+    records
+}
+
+/// Create a patch rebuilding `new` from `old`.
+/// Fails if the images are not ESP-IDF application images.
+pub fn create(old: &[u8], new: &[u8]) -> anyhow::Result<Vec<u8>> {
+    let base_desc =
+        AppDesc::parse(old).ok_or_else(|| anyhow::anyhow!("old file is not a firmware image"))?;
+    AppDesc::parse(new).ok_or_else(|| anyhow::anyhow!("new file is not a firmware image"))?;
+    let base_elf_sha256 = hex::decode(&base_desc.app_elf_sha256)?;
+
+    let mut body = Vec::with_capacity(new.len());
+    for record in diff(old, new) {
+        match record {
+            Record::Add {
+                old_offset,
+                new_offset,
+                len,
+            } => {
+                body.push(OP_ADD);
+                body.extend_from_slice(&(old_offset as u32).to_le_bytes());
+                body.extend_from_slice(&(len as u32).to_le_bytes());
+                body.extend(
+                    new[new_offset..new_offset + len]
+                        .iter()
+                        .zip(&old[old_offset..old_offset + len])
+                        .map(|(n, o)| n.wrapping_sub(*o)),
+                );
+            }
+            Record::Insert { new_offset, len } => {
+                body.push(OP_INSERT);
+                body.extend_from_slice(&(len as u32).to_le_bytes());
+                body.extend_from_slice(&new[new_offset..new_offset + len]);
+            }
+        }
+    }
+    body.push(OP_END);
+
+    let mut patch = Vec::with_capacity(HEADER_LEN + new.len() / 4);
+    patch.extend_from_slice(MAGIC);
+    patch.extend_from_slice(&[
+        FORMAT_VERSION,
+        heatshrink::WINDOW_BITS,
+        heatshrink::LOOKAHEAD_BITS,
+        0,
+    ]);
+    patch.extend_from_slice(&(old.len() as u32).to_le_bytes());
+    patch.extend_from_slice(&(new.len() as u32).to_le_bytes());
+    patch.extend_from_slice(&Sha256::digest(old));
+    patch.extend_from_slice(&Sha256::digest(new));
+    patch.extend_from_slice(&base_elf_sha256);
+    patch.extend_from_slice(&heatshrink::compress(
+        &body,
+        heatshrink::WINDOW_BITS,
+        heatshrink::LOOKAHEAD_BITS,
+    ));
+    Ok(patch)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Fixtures shared with the host tests, see host/test/make_fixtures.py
+    const OLD: &[u8] = include_bytes!("../../host/test/fixtures/old.bin");
+    const NEW: &[u8] = include_bytes!("../../host/test/fixtures/new.bin");
+    const PATCH: &[u8] = include_bytes!("../../host/test/fixtures/new.bin.delta");
+
+    fn u32_at(data: &[u8], offset: usize) -> Option<usize> {
+        Some(u32::from_le_bytes(data.get(offset..offset + 4)?.try_into().ok()?) as usize)
+    }
+
+    /// Rebuild the new image from `old` and a patch as `main/delta.c` does.
+    /// Returns `None` if the patch is invalid or does not rebuild its target.
+    fn apply(old: &[u8], patch: &[u8]) -> Option<Vec<u8>> {
+        let header = Header::parse(patch)?;
+        if Sha256::digest(old)[..] != header.base_sha256 {
+            return None;
+        }
+        let body = heatshrink::decompress(&patch[HEADER_LEN..], patch[5], patch[6])?;
+
+        let mut new = Vec::new();
+        let mut pos = 0;
+        loop {
+            let op = *body.get(pos)?;
+            pos += 1;
+            match op {
+                OP_END => break,
+                OP_ADD => {
+                    let (offset, len) = (u32_at(&body, pos)?, u32_at(&body, pos + 4)?);
+                    pos += 8;
+                    let diff = body.get(pos..pos + len)?;
+                    let base = old.get(offset..offset + len)?;
+                    new.extend(base.iter().zip(diff).map(|(o, d)| o.wrapping_add(*d)));
+                    pos += len;
+                }
+                OP_INSERT => {
+                    let len = u32_at(&body, pos)?;
+                    pos += 4;
+                    new.extend_from_slice(body.get(pos..pos + len)?);
+                    pos += len;
+                }
+                _ => return None,
+            }
+        }
+
+        (pos == body.len()
+            && new.len() == header.target_size as usize
+            && Sha256::digest(&new)[..] == header.target_sha256)
+            .then_some(new)
+    }
+
+    #[test]
+    fn patch_rebuilds_new_image() {
+        let patch = create(OLD, NEW).unwrap();
+        let header = Header::parse(&patch).unwrap();
+        assert_eq!(header.base_size as usize, OLD.len());
+        assert_eq!(header.target_size as usize, NEW.len());
+        assert_eq!(hex::encode(header.base_elf_sha256), AppDesc::parse(OLD).unwrap().app_elf_sha256);
+        assert_eq!(apply(OLD, &patch).unwrap(), NEW);
+        // Most of the new image comes from the old one
+        assert!(patch.len() < NEW.len() / 4);
+    }
+
+    #[test]
+    fn patch_between_any_images() {
+        for (old, new) in [(OLD, OLD), (NEW, OLD), (OLD, &NEW[..NEW.len() - 1])] {
+            let patch = create(old, new).unwrap();
+            assert_eq!(apply(old, &patch).unwrap(), new);
+        }
+    }
+
+    #[test]
+    fn fixture_patch_is_current() {
+        // The host tests feed this patch to the device code
+        assert_eq!(create(OLD, NEW).unwrap(), PATCH);
+        assert_eq!(apply(OLD, PATCH).unwrap(), NEW);
+    }
+
+    #[test]
+    fn patch_needs_its_base_image() {
+        let mut old = OLD.to_vec();
+        old[5000] ^= 1;
+        assert!(apply(&old, PATCH).is_none());
+        assert!(create(&OLD[1..], NEW).is_err());
+    }
+}
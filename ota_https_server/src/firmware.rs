@@ -0,0 +1,682 @@
+use crate::catalog::{Catalog, CatalogQuery};
+use crate::rollout::{ROLLOUT_SUFFIX, Rollout};
+use crate::signing::{BLOCKS_SIGNATURE_SUFFIX, ImageSigner, SIGNATURE_SUFFIX, manifest_message};
+use crate::{blocks, delta, heatshrink};
+use bytes::Bytes;
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+use std::collections::HashMap;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, RwLock};
+use std::time::SystemTime;
+use tokio::sync::watch;
+use tracing::{info, warn};
+
+/// Size of `esp_image_header_t`
+const IMAGE_HEADER_LEN: usize = 24;
+/// Size of `esp_image_segment_header_t`
+const SEGMENT_HEADER_LEN: usize = 8;
+/// Size of `esp_app_desc_t`
+const APP_DESC_LEN: usize = 256;
+/// `esp_app_desc_t` is always placed right after the first segment header
+const APP_DESC_OFFSET: usize = IMAGE_HEADER_LEN + SEGMENT_HEADER_LEN;
+
+const ESP_IMAGE_HEADER_MAGIC: u8 = 0xE9;
+const ESP_APP_DESC_MAGIC_WORD: u32 = 0xABCD5432;
+
+/// Subdirectory of the serving directory holding the delta patches
+pub const DELTA_DIR: &str = "deltas";
+/// Path prefix of the compressed images
+pub const COMPRESSED_PATH: &str = "compressed";
+/// Path prefix of the block lists of the images
+pub const BLOCKS_PATH: &str = "blocks";
+
+/// Application description embedded in every ESP-IDF image (`esp_app_desc_t`)
+#[derive(Debug, Clone, Serialize)]
+pub struct AppDesc {
+    pub version: String,
+    pub project_name: String,
+    pub secure_version: u32,
+    pub time: String,
+    pub date: String,
+    pub idf_ver: String,
+    pub app_elf_sha256: String,
+}
+
+impl AppDesc {
+    /// Parse the `esp_app_desc_t` of an application image.
+    /// Returns `None` if the data is not a valid ESP-IDF application image.
+    pub fn parse(image: &[u8]) -> Option<AppDesc> {
+        if image.len() < APP_DESC_OFFSET + APP_DESC_LEN || image[0] != ESP_IMAGE_HEADER_MAGIC {
+            return None;
+        }
+
+        let desc = &image[APP_DESC_OFFSET..APP_DESC_OFFSET + APP_DESC_LEN];
+        let magic_word = u32::from_le_bytes(desc[0..4].try_into().ok()?);
+        if magic_word != ESP_APP_DESC_MAGIC_WORD {
+            return None;
+        }
+
+        Some(AppDesc {
+            secure_version: u32::from_le_bytes(desc[4..8].try_into().ok()?),
+            version: c_string(&desc[16..48]),
+            project_name: c_string(&desc[48..80]),
+            time: c_string(&desc[80..96]),
+            date: c_string(&desc[96..112]),
+            idf_ver: c_string(&desc[112..144]),
+            app_elf_sha256: hex::encode(&desc[144..176]),
+        })
+    }
+}
+
+/// Get the `chip_id` and `min_chip_rev_full` of the header
+/// (`esp_image_header_t`) of an application image
+fn parse_chip(image: &[u8]) -> (u16, u16) {
+    (
+        u16::from_le_bytes([image[12], image[13]]),
+        u16::from_le_bytes([image[15], image[16]]),
+    )
+}
+
+/// Convert a fixed size, NUL padded C string field into a `String`
+fn c_string(field: &[u8]) -> String {
+    let len = field.iter().position(|&b| b == 0).unwrap_or(field.len());
+    String::from_utf8_lossy(&field[..len]).into_owned()
+}
+
+/// Small description of a firmware image that devices poll instead of the
+/// image itself
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct Manifest {
+    pub name: String,
+    /// Path of the image
+    pub url: String,
+    pub version: String,
+    pub project_name: String,
+    pub secure_version: u32,
+    pub size: u64,
+    pub sha256: String,
+    /// Signature of the name, version, secure version, size and hash (see
+    /// `signing::manifest_message`), if the server has a signing key or a
+    /// signature file
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub signature: Option<String>,
+    /// Compressed image, if it is smaller than the image
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub compressed: Option<ManifestVariant>,
+    /// Patch from the firmware running on the requesting device, if any
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub delta: Option<ManifestVariant>,
+    /// Hashes of the blocks of the image, see `blocks`
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub blocks: Option<ManifestBlocks>,
+}
+
+/// Alternative download of the image advertised in a manifest
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct ManifestVariant {
+    pub url: String,
+    pub size: u64,
+}
+
+/// Block list of the image advertised in a manifest
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct ManifestBlocks {
+    pub url: String,
+    pub size: u64,
+    pub sha256: String,
+    /// Signature of the block list, signed like the image
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub signature: Option<String>,
+}
+
+/// A firmware image found in the serving directory
+#[derive(Debug)]
+pub struct Image {
+    pub name: String,
+    pub size: u64,
+    pub sha256: [u8; 32],
+    /// Strong entity tag, derived from the content hash
+    pub etag: String,
+    pub desc: AppDesc,
+    /// Chip the image runs on, from its header
+    pub chip_id: u16,
+    /// Lowest chip revision the image runs on, e.g. 300 for v3.0
+    pub min_chip_rev: u16,
+    /// Hex encoded DER signature of the manifest fields, from the signature
+    /// file or the signing key of the server
+    pub signature: Option<String>,
+    /// The image itself, shared by every response sending it
+    pub data: Bytes,
+    /// Heatshrink compressed image, if it is smaller than the image
+    pub compressed: Option<Bytes>,
+    /// Entity tag of the compressed image
+    pub compressed_etag: String,
+    /// SHA-256 of every block of the image
+    pub blocks: Bytes,
+    pub blocks_sha256: [u8; 32],
+    /// Hex encoded DER signature of the block list
+    pub blocks_signature: Option<String>,
+    modified: Option<SystemTime>,
+    /// Modification times of the signature files, if there are some
+    signature_modified: Option<SystemTime>,
+    blocks_signature_modified: Option<SystemTime>,
+}
+
+impl Image {
+    /// Read and inspect the image at `path`.
+    /// Returns `Ok(None)` if the file is not an ESP-IDF application image.
+    fn load(
+        name: &str,
+        path: &Path,
+        signer: Option<&ImageSigner>,
+    ) -> anyhow::Result<Option<Image>> {
+        let modified = std::fs::metadata(path)?.modified().ok();
+        let data = std::fs::read(path)?;
+
+        let Some(desc) = AppDesc::parse(&data) else {
+            return Ok(None);
+        };
+        let (chip_id, min_chip_rev) = parse_chip(&data);
+
+        let sha256: [u8; 32] = Sha256::digest(&data).into();
+        let message = manifest_message(name, &desc.version, desc.secure_version, data.len() as u64, &sha256)?;
+        let (signature, signature_modified) = sign(&signature_path(path), signer, &message)?;
+        let compressed = heatshrink::compress_image(&data);
+        let compressed = (compressed.len() < data.len()).then(|| Bytes::from(compressed));
+        let blocks = blocks::build(&data);
+        let (blocks_signature, blocks_signature_modified) =
+            sign(&blocks_signature_path(path), signer, &blocks)?;
+
+        Ok(Some(Image {
+            name: name.to_string(),
+            size: data.len() as u64,
+            sha256,
+            etag: format!("\"{}\"", hex::encode(sha256)),
+            desc,
+            chip_id,
+            min_chip_rev,
+            signature,
+            data: Bytes::from(data),
+            compressed,
+            compressed_etag: format!("\"{}-hs\"", hex::encode(sha256)),
+            blocks_sha256: Sha256::digest(&blocks).into(),
+            blocks: Bytes::from(blocks),
+            blocks_signature,
+            modified,
+            signature_modified,
+            blocks_signature_modified,
+        }))
+    }
+
+    pub fn manifest(&self) -> Manifest {
+        Manifest {
+            name: self.name.clone(),
+            url: format!("/{}", self.name),
+            version: self.desc.version.clone(),
+            project_name: self.desc.project_name.clone(),
+            secure_version: self.desc.secure_version,
+            size: self.size,
+            sha256: hex::encode(self.sha256),
+            signature: self.signature.clone(),
+            compressed: self.compressed.as_ref().map(|compressed| ManifestVariant {
+                url: format!("/{}/{}", COMPRESSED_PATH, self.name),
+                size: compressed.len() as u64,
+            }),
+            delta: None,
+            blocks: Some(ManifestBlocks {
+                url: format!("/{}/{}", BLOCKS_PATH, self.name),
+                size: self.blocks.len() as u64,
+                sha256: hex::encode(self.blocks_sha256),
+                signature: self.blocks_signature.clone(),
+            }),
+        }
+    }
+
+    /// Strong entity tag of the block list
+    pub fn blocks_etag(&self) -> String {
+        format!("\"{}-blocks\"", hex::encode(self.sha256))
+    }
+
+    /// Modification time of the file, when the image was published
+    pub fn modified(&self) -> Option<SystemTime> {
+        self.modified
+    }
+
+    /// Image of `project` for chip 0 v3.0, without content, for the tests of
+    /// the modules choosing between images
+    #[cfg(test)]
+    pub(crate) fn test(
+        name: &str,
+        project: &str,
+        version: &str,
+        secure_version: u32,
+        modified: Option<SystemTime>,
+    ) -> Image {
+        Image {
+            name: name.to_string(),
+            size: 0,
+            sha256: [0; 32],
+            etag: String::new(),
+            desc: AppDesc {
+                version: version.to_string(),
+                project_name: project.to_string(),
+                secure_version,
+                time: String::new(),
+                date: String::new(),
+                idf_ver: String::new(),
+                app_elf_sha256: String::new(),
+            },
+            chip_id: 0,
+            min_chip_rev: 300,
+            signature: None,
+            data: Bytes::new(),
+            compressed: None,
+            compressed_etag: String::new(),
+            blocks: Bytes::new(),
+            blocks_sha256: [0; 32],
+            blocks_signature: None,
+            modified,
+            signature_modified: None,
+            blocks_signature_modified: None,
+        }
+    }
+
+    /// Check if the files on disk are still the ones this entry was built from
+    fn is_current(&self, path: &Path, metadata: &std::fs::Metadata) -> bool {
+        let modified = |path: PathBuf| std::fs::metadata(path).ok().and_then(|metadata| metadata.modified().ok());
+        metadata.len() == self.size
+            && metadata.modified().ok() == self.modified
+            && modified(signature_path(path)) == self.signature_modified
+            && modified(blocks_signature_path(path)) == self.blocks_signature_modified
+    }
+}
+
+/// Path of the signature file of the image at `path`
+pub fn signature_path(path: &Path) -> PathBuf {
+    let mut path = path.as_os_str().to_owned();
+    path.push(SIGNATURE_SUFFIX);
+    PathBuf::from(path)
+}
+
+/// Path of the signature file of the block list of the image at `path`
+pub fn blocks_signature_path(path: &Path) -> PathBuf {
+    let mut path = path.as_os_str().to_owned();
+    path.push(BLOCKS_SIGNATURE_SUFFIX);
+    PathBuf::from(path)
+}
+
+/// Get the signature of `data` from its signature file, or else from the
+/// signing key. Returns the signature and the modification time of the file.
+fn sign(
+    path: &Path,
+    signer: Option<&ImageSigner>,
+    data: &[u8],
+) -> anyhow::Result<(Option<String>, Option<SystemTime>)> {
+    Ok(match signature_file(path)? {
+        Some((signature, modified)) => (Some(signature), modified),
+        None => (signer.map(|signer| signer.sign(data)).transpose()?.map(hex::encode), None),
+    })
+}
+
+/// Read a signature file, if there is one
+fn signature_file(path: &Path) -> anyhow::Result<Option<(String, Option<SystemTime>)>> {
+    let data = match std::fs::read_to_string(path) {
+        Ok(data) => data,
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => return Ok(None),
+        Err(e) => return Err(e.into()),
+    };
+    let signature = data.trim().to_ascii_lowercase();
+    if signature.is_empty() || hex::decode(&signature).is_err() {
+        anyhow::bail!("{:?} is not a hex encoded signature", path);
+    }
+    let modified = std::fs::metadata(path)?.modified().ok();
+    Ok(Some((signature, modified)))
+}
+
+/// A delta patch found in the `deltas` subdirectory of the serving directory
+#[derive(Debug)]
+pub struct Patch {
+    pub name: String,
+    pub size: u64,
+    pub sha256: [u8; 32],
+    pub header: delta::Header,
+    /// Strong entity tag, derived from the content hash
+    pub etag: String,
+    /// The patch itself, shared by every response sending it
+    pub data: Bytes,
+    modified: Option<SystemTime>,
+}
+
+impl Patch {
+    /// Read the patch at `path`.
+    /// Returns `Ok(None)` if the file is not a patch.
+    fn load(name: &str, path: &Path) -> anyhow::Result<Option<Patch>> {
+        let modified = std::fs::metadata(path)?.modified().ok();
+        let data = std::fs::read(path)?;
+        let Some(header) = delta::Header::parse(&data) else {
+            return Ok(None);
+        };
+
+        let sha256: [u8; 32] = Sha256::digest(&data).into();
+        Ok(Some(Patch {
+            name: name.to_string(),
+            size: data.len() as u64,
+            sha256,
+            header,
+            etag: format!("\"{}\"", hex::encode(sha256)),
+            data: Bytes::from(data),
+            modified,
+        }))
+    }
+
+    pub fn manifest(&self) -> ManifestVariant {
+        ManifestVariant {
+            url: format!("/{}/{}", DELTA_DIR, self.name),
+            size: self.size,
+        }
+    }
+
+    /// Check if the file on disk is still the one this entry was built from
+    fn is_current(&self, metadata: &std::fs::Metadata) -> bool {
+        metadata.len() == self.size && metadata.modified().ok() == self.modified
+    }
+}
+
+/// Everything a server offers, for its mirrors (see `/index`)
+#[derive(Debug, Default, Serialize, Deserialize)]
+pub struct Index {
+    pub images: Vec<IndexImage>,
+    pub patches: Vec<IndexPatch>,
+}
+
+#[derive(Debug, Serialize, Deserialize)]
+pub struct IndexImage {
+    /// Manifest of the image, with its signature
+    pub manifest: Manifest,
+    /// Staged rollout of the image, offered to every device without one
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub rollout: Option<Rollout>,
+}
+
+#[derive(Debug, Serialize, Deserialize)]
+pub struct IndexPatch {
+    pub name: String,
+    pub size: u64,
+    pub sha256: String,
+}
+
+/// Immutable view of the serving directory, as loaded by the last reload.
+/// Requests keep the snapshot they started with, so a download in progress
+/// is not affected by a reload.
+#[derive(Default)]
+pub struct FirmwareSnapshot {
+    images: HashMap<String, Arc<Image>>,
+    /// Patches by file name
+    patches: HashMap<String, Arc<Patch>>,
+    /// Patches by target image SHA-256 and base `app_elf_sha256`
+    patch_index: HashMap<([u8; 32], [u8; 32]), Arc<Patch>>,
+    /// Staged rollouts by image name
+    rollouts: HashMap<String, Rollout>,
+    /// Image of every target
+    catalog: Catalog,
+}
+
+impl FirmwareSnapshot {
+    /// Get the image with the given file name
+    pub fn image(&self, name: &str) -> Option<&Arc<Image>> {
+        self.images.get(name)
+    }
+
+    /// Iterate over the images, in no particular order
+    pub fn images(&self) -> impl Iterator<Item = &Arc<Image>> {
+        self.images.values()
+    }
+
+    /// Get the image of the target a device sent
+    pub fn find(&self, query: &CatalogQuery) -> Option<&Arc<Image>> {
+        self.catalog.find(query)
+    }
+
+    /// Check if an image is offered to the device with the given ID
+    pub fn offered(&self, image: &Image, device_id: Option<&str>) -> bool {
+        self.rollouts
+            .get(&image.name)
+            .is_none_or(|rollout| rollout.includes(&image.sha256, device_id))
+    }
+
+    /// Get the patch with the given file name
+    pub fn patch_file(&self, name: &str) -> Option<&Arc<Patch>> {
+        self.patches.get(name)
+    }
+
+    /// Iterate over the patches, in no particular order
+    pub fn patches(&self) -> impl Iterator<Item = &Arc<Patch>> {
+        self.patches.values()
+    }
+
+    /// List the images, patches and rollouts, for the mirrors of the server
+    pub fn index(&self) -> Index {
+        let mut images: Vec<IndexImage> = self
+            .images
+            .values()
+            .map(|image| IndexImage {
+                manifest: image.manifest(),
+                rollout: self.rollouts.get(&image.name).cloned(),
+            })
+            .collect();
+        images.sort_by(|a, b| a.manifest.name.cmp(&b.manifest.name));
+        let mut patches: Vec<IndexPatch> = self
+            .patches
+            .values()
+            .map(|patch| IndexPatch {
+                name: patch.name.clone(),
+                size: patch.size,
+                sha256: hex::encode(patch.sha256),
+            })
+            .collect();
+        patches.sort_by(|a, b| a.name.cmp(&b.name));
+        Index { images, patches }
+    }
+
+    /// Get the patch rebuilding `image` from the firmware with the given
+    /// `app_elf_sha256`, if there is one
+    pub fn patch(&self, image: &Image, base_elf_sha256: &[u8; 32]) -> Option<&Arc<Patch>> {
+        self.patch_index.get(&(image.sha256, *base_elf_sha256))
+    }
+}
+
+/// The firmware images and patches of the serving directory, held in memory.
+///
+/// Every image is read, inspected (parsed, hashed, compressed and signed) and
+/// kept in memory once, so requests are served without touching the disk.
+/// A reload reads the directory again, only inspecting the files that changed
+/// (size or modification time), and atomically replaces the snapshot.
+/// Every reload is announced to the subscribers, the requests waiting for a
+/// new image.
+pub struct FirmwareStore {
+    dir: PathBuf,
+    signer: Option<ImageSigner>,
+    snapshot: RwLock<Arc<FirmwareSnapshot>>,
+    /// Number of reloads
+    reloads: watch::Sender<u64>,
+}
+
+impl FirmwareStore {
+    /// Create an empty store, filled by `reload()`
+    pub fn new(dir: &Path, signer: Option<ImageSigner>) -> FirmwareStore {
+        FirmwareStore {
+            dir: dir.to_path_buf(),
+            signer,
+            snapshot: RwLock::new(Arc::new(FirmwareSnapshot::default())),
+            reloads: watch::channel(0).0,
+        }
+    }
+
+    /// Serving directory
+    pub fn dir(&self) -> &Path {
+        &self.dir
+    }
+
+    /// Get the current snapshot
+    pub fn snapshot(&self) -> Arc<FirmwareSnapshot> {
+        self.snapshot.read().unwrap().clone()
+    }
+
+    /// Get notified of the next reloads. Subscribe before reading the
+    /// snapshot, so that a reload in between is not missed.
+    pub fn subscribe(&self) -> watch::Receiver<u64> {
+        self.reloads.subscribe()
+    }
+
+    /// Read the serving directory again and replace the snapshot
+    pub fn reload(&self) -> anyhow::Result<()> {
+        let current = self.snapshot();
+        let images = self.load_images(&current)?;
+        let patches = self.load_patches(&current)?;
+        let rollouts = self.load_rollouts(&images)?;
+        let catalog = Catalog::new(images.values());
+
+        for name in current.images.keys().filter(|name| !images.contains_key(*name)) {
+            info!("Removed firmware {}", name);
+        }
+        for name in current.patches.keys().filter(|name| !patches.contains_key(*name)) {
+            info!("Removed delta patch {}", name);
+        }
+        for (target, image) in catalog.entries() {
+            let unchanged = current
+                .catalog
+                .get(target)
+                .is_some_and(|current| Arc::ptr_eq(current, image));
+            if !unchanged {
+                info!(
+                    "Catalog: {} for {} on chip {} rev {}+ ({} channel)",
+                    image.name, target.project, target.chip, target.min_rev, target.channel
+                );
+            }
+        }
+
+        let patch_index = patches
+            .values()
+            .map(|patch| ((patch.header.target_sha256, patch.header.base_elf_sha256), patch.clone()))
+            .collect();
+        *self.snapshot.write().unwrap() = Arc::new(FirmwareSnapshot {
+            images,
+            patches,
+            patch_index,
+            rollouts,
+            catalog,
+        });
+        self.reloads.send_modify(|reloads| *reloads += 1);
+        Ok(())
+    }
+
+    /// Load the images of the serving directory, reusing the unchanged ones
+    fn load_images(&self, current: &FirmwareSnapshot) -> anyhow::Result<HashMap<String, Arc<Image>>> {
+        let mut images = HashMap::new();
+        for (name, path, metadata) in list_files(&self.dir)? {
+            if name.ends_with(ROLLOUT_SUFFIX) || name.ends_with(SIGNATURE_SUFFIX) {
+                continue;
+            }
+            if let Some(image) = current.images.get(&name).filter(|image| image.is_current(&path, &metadata)) {
+                images.insert(name, image.clone());
+                continue;
+            }
+
+            match Image::load(&name, &path, self.signer.as_ref()) {
+                Ok(Some(image)) => {
+                    info!(
+                        "Found firmware {} version {} ({} bytes, {} compressed)",
+                        image.name,
+                        image.desc.version,
+                        image.size,
+                        image.compressed.as_ref().map_or(image.size, |c| c.len() as u64)
+                    );
+                    images.insert(name, Arc::new(image));
+                }
+                Ok(None) => {}
+                Err(e) => warn!("Failed to inspect {:?}: {}", path, e),
+            }
+        }
+        Ok(images)
+    }
+
+    /// Load the rollout files of the images. An image with an invalid rollout
+    /// file is offered to no device, rather than to the whole fleet.
+    fn load_rollouts(&self, images: &HashMap<String, Arc<Image>>) -> anyhow::Result<HashMap<String, Rollout>> {
+        let mut rollouts = HashMap::new();
+        for (name, path, _) in list_files(&self.dir)? {
+            let Some(image) = name.strip_suffix(ROLLOUT_SUFFIX).filter(|image| images.contains_key(*image))
+            else {
+                continue;
+            };
+
+            let rollout = std::fs::read(&path)
+                .map_err(anyhow::Error::from)
+                .and_then(|data| Rollout::parse(&data))
+                .unwrap_or_else(|e| {
+                    warn!("Invalid rollout file {:?}, {} is offered to no device: {}", path, image, e);
+                    Rollout::default()
+                });
+            info!(
+                "Rollout of {}: {}% of the devices, plus {} listed devices",
+                image,
+                rollout.percent,
+                rollout.devices.len()
+            );
+            rollouts.insert(image.to_string(), rollout);
+        }
+        Ok(rollouts)
+    }
+
+    /// Load the patches of the patch directory, reusing the unchanged ones
+    fn load_patches(&self, current: &FirmwareSnapshot) -> anyhow::Result<HashMap<String, Arc<Patch>>> {
+        let mut patches = HashMap::new();
+        let dir = self.dir.join(DELTA_DIR);
+        if !dir.is_dir() {
+            return Ok(patches);
+        }
+
+        for (name, path, metadata) in list_files(&dir)? {
+            if !name.ends_with(".delta") {
+                continue;
+            }
+            if let Some(patch) = current.patches.get(&name).filter(|patch| patch.is_current(&metadata)) {
+                patches.insert(name, patch.clone());
+                continue;
+            }
+
+            match Patch::load(&name, &path) {
+                Ok(Some(patch)) => {
+                    info!("Found delta patch {} ({} bytes)", patch.name, patch.size);
+                    patches.insert(name, Arc::new(patch));
+                }
+                Ok(None) => {}
+                Err(e) => warn!("Failed to inspect {:?}: {}", path, e),
+            }
+        }
+        Ok(patches)
+    }
+}
+
+/// List the regular files of a directory with UTF-8 names, skipping hidden
+/// files (such as the temporary files of editors and copies in progress)
+fn list_files(dir: &Path) -> anyhow::Result<Vec<(String, PathBuf, std::fs::Metadata)>> {
+    let mut files = Vec::new();
+    for entry in std::fs::read_dir(dir)? {
+        let entry = entry?;
+        let Some(name) = entry.file_name().to_str().map(str::to_string) else {
+            continue;
+        };
+        if name.starts_with('.') {
+            continue;
+        }
+        // Follows symbolic links, like serving the file does
+        let path = entry.path();
+        match std::fs::metadata(&path) {
+            Ok(metadata) if metadata.is_file() => files.push((name, path, metadata)),
+            _ => {}
+        }
+    }
+    Ok(files)
+}
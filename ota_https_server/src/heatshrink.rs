@@ -0,0 +1,255 @@
+//! Encoder for the heatshrink LZSS format, which devices can decompress as a
+//! stream with a small fixed size window.
+//!
+//! The stream is a sequence of bits, most significant bit first:
+//! - `1` followed by 8 bits: literal byte
+//! - `0` followed by `window_bits` bits of `distance - 1` and `lookahead_bits`
+//!   bits of `length - 1`: copy `length` bytes starting `distance` bytes back
+//!
+//! Compressed firmware images start with a header (little endian):
+//! - `magic`: `ESPZ`
+//! - `version`, `window_bits`, `lookahead_bits`, reserved byte
+//! - `size`: u32 size of the decompressed image
+
+/// Default window size (log2), the device needs a buffer of this size
+pub const WINDOW_BITS: u8 = 12;
+/// Default maximum match length (log2)
+pub const LOOKAHEAD_BITS: u8 = 6;
+
+pub const IMAGE_MAGIC: &[u8; 4] = b"ESPZ";
+pub const IMAGE_FORMAT_VERSION: u8 = 1;
+pub const IMAGE_HEADER_LEN: usize = 12;
+
+const HASH_BITS: u32 = 16;
+/// Maximum number of candidates looked at for every position
+const MAX_CHAIN: usize = 256;
+/// No match position
+const NONE: u32 = u32::MAX;
+
+struct BitWriter {
+    out: Vec<u8>,
+    current: u8,
+    count: u8,
+}
+
+impl BitWriter {
+    fn new(capacity: usize) -> BitWriter {
+        BitWriter {
+            out: Vec::with_capacity(capacity),
+            current: 0,
+            count: 0,
+        }
+    }
+
+    fn push(&mut self, value: u32, bits: u8) {
+        for i in (0..bits).rev() {
+            self.current = (self.current << 1) | ((value >> i) & 1) as u8;
+            self.count += 1;
+            if self.count == 8 {
+                self.out.push(self.current);
+                self.current = 0;
+                self.count = 0;
+            }
+        }
+    }
+
+    fn finish(mut self) -> Vec<u8> {
+        if self.count > 0 {
+            self.out.push(self.current << (8 - self.count));
+        }
+        self.out
+    }
+}
+
+fn hash(data: &[u8]) -> usize {
+    let key = u32::from(data[0]) << 16 | u32::from(data[1]) << 8 | u32::from(data[2]);
+    (key.wrapping_mul(2654435761) >> (32 - HASH_BITS)) as usize
+}
+
+/// Add the position to the hash chains
+fn insert(data: &[u8], pos: usize, head: &mut [u32], prev: &mut [u32]) {
+    if pos + 3 <= data.len() {
+        let h = hash(&data[pos..]);
+        prev[pos] = head[h];
+        head[h] = pos as u32;
+    }
+}
+
+/// Compress `data` with the given window and lookahead sizes (log2)
+pub fn compress(data: &[u8], window_bits: u8, lookahead_bits: u8) -> Vec<u8> {
+    let window = 1usize << window_bits;
+    let max_len = 1usize << lookahead_bits;
+    // A back-reference only pays off if it is shorter than the literals
+    let min_len = (1 + window_bits as usize + lookahead_bits as usize) / 9 + 1;
+
+    let mut head = vec![NONE; 1 << HASH_BITS];
+    let mut prev = vec![NONE; data.len()];
+    let mut writer = BitWriter::new(data.len() / 2);
+
+    let mut pos = 0;
+    while pos < data.len() {
+        let mut best_len = 0;
+        let mut best_distance = 0;
+
+        if pos + 3 <= data.len() {
+            let limit = max_len.min(data.len() - pos);
+            let mut candidate = head[hash(&data[pos..])];
+            let mut chain = 0;
+
+            while candidate != NONE && chain < MAX_CHAIN {
+                let start = candidate as usize;
+                let distance = pos - start;
+                if distance > window {
+                    break;
+                }
+
+                let len = data[start..]
+                    .iter()
+                    .zip(&data[pos..pos + limit])
+                    .take_while(|(a, b)| a == b)
+                    .count();
+                if len > best_len {
+                    best_len = len;
+                    best_distance = distance;
+                    if len == limit {
+                        break;
+                    }
+                }
+
+                candidate = prev[start];
+                chain += 1;
+            }
+        }
+
+        if best_len >= min_len {
+            writer.push(0, 1);
+            writer.push((best_distance - 1) as u32, window_bits);
+            writer.push((best_len - 1) as u32, lookahead_bits);
+            for p in pos..pos + best_len {
+                insert(data, p, &mut head, &mut prev);
+            }
+            pos += best_len;
+        } else {
+            writer.push(1, 1);
+            writer.push(u32::from(data[pos]), 8);
+            insert(data, pos, &mut head, &mut prev);
+            pos += 1;
+        }
+    }
+
+    writer.finish()
+}
+
+/// Compress a firmware image with the default window and lookahead sizes,
+/// prefixed with the compressed image header
+pub fn compress_image(image: &[u8]) -> Vec<u8> {
+    let data = compress(image, WINDOW_BITS, LOOKAHEAD_BITS);
+
+    let mut out = Vec::with_capacity(IMAGE_HEADER_LEN + data.len());
+    out.extend_from_slice(IMAGE_MAGIC);
+    out.extend_from_slice(&[IMAGE_FORMAT_VERSION, WINDOW_BITS, LOOKAHEAD_BITS, 0]);
+    out.extend_from_slice(&(image.len() as u32).to_le_bytes());
+    out.extend_from_slice(&data);
+    out
+}
+
+/// Decompress a stream of `compress` the way the device does
+/// (`main/heatshrink.c`), for the tests. Bits left after the last complete
+/// field are padding. Returns `None` if a back-reference points before the
+/// start of the data.
+#[cfg(test)]
+pub(crate) fn decompress(data: &[u8], window_bits: u8, lookahead_bits: u8) -> Option<Vec<u8>> {
+    let mut out = Vec::new();
+    let mut pos = 0;
+    let mut read = |bits: u8| -> Option<usize> {
+        if pos + bits as usize > data.len() * 8 {
+            return None;
+        }
+        let mut value = 0;
+        for _ in 0..bits {
+            value = value << 1 | usize::from(data[pos / 8] >> (7 - pos % 8) & 1);
+            pos += 1;
+        }
+        Some(value)
+    };
+
+    while let Some(tag) = read(1) {
+        if tag == 1 {
+            match read(8) {
+                Some(byte) => out.push(byte as u8),
+                None => break,
+            }
+            continue;
+        }
+        let (Some(distance), Some(len)) = (read(window_bits), read(lookahead_bits)) else {
+            break;
+        };
+        let start = out.len().checked_sub(distance + 1)?;
+        // The source may overlap the bytes being written
+        for i in 0..=len {
+            out.push(out[start + i]);
+        }
+    }
+    Some(out)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Fixtures shared with the host tests, see host/test/make_fixtures.py
+    const NEW: &[u8] = include_bytes!("../../host/test/fixtures/new.bin");
+    const NEW_HSZ: &[u8] = include_bytes!("../../host/test/fixtures/new.bin.hsz");
+    const STREAMS: [(&[u8], &[u8]); 2] = [
+        (
+            include_bytes!("../../host/test/fixtures/overlap.hsz"),
+            include_bytes!("../../host/test/fixtures/overlap.bin"),
+        ),
+        (
+            include_bytes!("../../host/test/fixtures/wrap.hsz"),
+            include_bytes!("../../host/test/fixtures/wrap.bin"),
+        ),
+    ];
+    const BEFORE_START: &[u8] = include_bytes!("../../host/test/fixtures/before_start.hsz");
+
+    /// Decompress a compressed image, checking its header
+    fn decompress_image(image: &[u8]) -> Option<Vec<u8>> {
+        if image.get(..5)? != [&IMAGE_MAGIC[..], &[IMAGE_FORMAT_VERSION]].concat() {
+            return None;
+        }
+        let size = u32::from_le_bytes(image.get(8..12)?.try_into().ok()?) as usize;
+        let data = decompress(&image[IMAGE_HEADER_LEN..], image[5], image[6])?;
+        (data.len() == size).then_some(data)
+    }
+
+    #[test]
+    fn fixture_streams() {
+        for (stream, data) in STREAMS {
+            assert_eq!(decompress_image(stream).unwrap(), data);
+        }
+        assert!(decompress_image(BEFORE_START).is_none());
+    }
+
+    #[test]
+    fn compressed_image_round_trip() {
+        // The host tests decompress this image on the device code
+        assert_eq!(compress_image(NEW), NEW_HSZ);
+        assert_eq!(decompress_image(NEW_HSZ).unwrap(), NEW);
+        assert!(NEW_HSZ.len() < NEW.len() * 2 / 3);
+    }
+
+    #[test]
+    fn round_trip() {
+        let (_, wrap) = STREAMS[1];
+        let repeated = b"abc".repeat(1000);
+        let inputs: [&[u8]; 5] = [b"", b"a", &repeated, wrap, NEW];
+        for data in inputs {
+            for (window_bits, lookahead_bits) in [(WINDOW_BITS, LOOKAHEAD_BITS), (8, 4), (4, 3)] {
+                let stream = compress(data, window_bits, lookahead_bits);
+                assert_eq!(decompress(&stream, window_bits, lookahead_bits).unwrap(), data);
+            }
+        }
+        // Back-references overlapping the bytes they copy
+        assert!(compress(&repeated, WINDOW_BITS, LOOKAHEAD_BITS).len() < repeated.len() / 20);
+    }
+}
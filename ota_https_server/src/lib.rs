@@ -0,0 +1,8 @@
+//! Firmware handling shared by the server and the tools
+pub mod blocks;
+pub mod catalog;
+pub mod delta;
+pub mod firmware;
+pub mod heatshrink;
+pub mod rollout;
+pub mod signing;
@@ -1,16 +1,34 @@
+mod admission;
+mod metrics;
+mod mirror;
+mod routes;
+mod tls;
+mod upstream;
+mod watch;
+
+use admission::Admission;
 use axum::Router;
+use axum::routing::{get, post};
 use clap::Parser;
 use hyper_util::rt::{TokioExecutor, TokioIo};
 use hyper_util::server::conn::auto::Builder;
 use hyper_util::service::TowerToHyperService;
+use metrics::Fleet;
+use ota_https_server::firmware::FirmwareStore;
+use ota_https_server::signing::{ImageSigner, ImageVerifier};
+use routes::AppState;
 use rustls::pki_types::{CertificateDer, PrivateKeyDer};
 use std::fs::File;
 use std::io::BufReader;
 use std::net::{IpAddr, SocketAddr};
 use std::path::{Path, PathBuf};
 use std::sync::Arc;
+use std::time::{Duration, Instant};
+use tls::TlsStats;
 use tokio::net::TcpListener;
+use tokio::sync::Semaphore;
 use tokio_rustls::TlsAcceptor;
+use upstream::Upstream;
 use tower::Service;
 use tower_http::services::ServeDir;
 use tracing::{error, info, warn};
@@ -34,6 +52,57 @@ struct Args {
     /// Path to custom certificates save directory
     #[clap(short, long)]
     cert_dir: Option<PathBuf>,
+
+    /// PEM file of the ECDSA P-256 private key (PKCS#8) signing the manifests
+    #[clap(long)]
+    signing_key: Option<PathBuf>,
+
+    /// Connections served at the same time, others wait to be accepted.
+    /// Devices that long poll keep theirs open.
+    #[clap(long, default_value_t = 16384)]
+    max_connections: usize,
+
+    /// Image downloads served at the same time, 0 for no limit
+    #[clap(long, default_value_t = 0)]
+    max_downloads: usize,
+
+    /// Speed of every image download in KB/s, 0 for no limit
+    #[clap(long, default_value_t = 0)]
+    download_rate: u64,
+
+    /// Seconds after which devices turned away (busy server or staged
+    /// rollout) should check again
+    #[clap(long, default_value_t = 60)]
+    retry_after: u64,
+
+    /// Seconds devices wait before checking again while up to date, sent as
+    /// the max-age of the manifests. 0 leaves it to the devices.
+    #[clap(long, default_value_t = 0)]
+    poll_interval: u64,
+
+    /// Longest time in seconds a manifest request is held waiting for a new
+    /// image, for the devices that long poll. 0 answers them at once.
+    #[clap(long, default_value_t = 300)]
+    max_wait: u64,
+
+    /// URL of the server to mirror, e.g. the public one for a server on the
+    /// devices' LAN. Its images, signatures, rollouts and patches are copied
+    /// to the serving directory, the devices verify the upstream signatures.
+    #[clap(long, conflicts_with = "signing_key")]
+    upstream: Option<String>,
+
+    /// PEM file of the CA certificate of an https upstream server
+    #[clap(long, requires = "upstream")]
+    upstream_ca: Option<PathBuf>,
+
+    /// PEM file of the public key the upstream images are signed with, the
+    /// one the devices embed. Images it did not sign are not mirrored.
+    #[clap(long, requires = "upstream")]
+    upstream_key: Option<PathBuf>,
+
+    /// Seconds between two checks of the upstream server for changes
+    #[clap(long, default_value_t = 60)]
+    upstream_interval: u64,
 }
 
 /// Load public certificate from a PEM file
@@ -53,6 +122,23 @@ fn load_key(path: &Path) -> anyhow::Result<PrivateKeyDer<'static>> {
     Ok(key)
 }
 
+/// Load the manifest signing key from a PEM file
+fn load_signer(path: &Path) -> anyhow::Result<ImageSigner> {
+    match load_key(path)? {
+        PrivateKeyDer::Pkcs8(key) => ImageSigner::from_pkcs8(key.secret_pkcs8_der()),
+        _ => anyhow::bail!("{:?} is not a PKCS#8 private key", path),
+    }
+}
+
+/// Load the public key of the upstream signatures from a PEM file
+fn load_verifier(path: &Path) -> anyhow::Result<ImageVerifier> {
+    let mut reader = BufReader::new(File::open(path)?);
+    let key = rustls_pemfile::public_keys(&mut reader)
+        .next()
+        .ok_or_else(|| anyhow::anyhow!("could not find public key in file"))??;
+    ImageVerifier::from_spki(key.as_ref())
+}
+
 #[tokio::main]
 async fn main() -> anyhow::Result<()> {
     // Initialize logging
@@ -70,10 +156,65 @@ async fn main() -> anyhow::Result<()> {
     let serve_dir = std::fs::canonicalize(&args.dir)
         .map_err(|e| anyhow::anyhow!("Failed to find serving directory {:?}: {}", args.dir, e))?;
 
+    // Sign the manifests if a key is given
+    let signer = match &args.signing_key {
+        Some(path) => {
+            info!("Signing the firmware manifests with {:?}", path);
+            Some(load_signer(path)?)
+        }
+        None => None,
+    };
+
+    // Load the available firmware images, and again whenever they change
+    let store = Arc::new(FirmwareStore::new(&serve_dir, signer));
+    store.reload()?;
+    watch::spawn(store.clone())?;
+
+    // Follow the upstream server, the watcher picks up what the mirror writes
+    if let Some(url) = &args.upstream {
+        // The devices verify the signatures too, but they would only turn
+        // down what the mirror published over the images they have
+        let Some(key) = &args.upstream_key else {
+            anyhow::bail!("--upstream needs --upstream-key to verify the upstream images");
+        };
+        info!("Mirroring {}", url);
+        let upstream = Upstream::new(url, args.upstream_ca.as_deref())?;
+        let verifier = load_verifier(key)?;
+        mirror::spawn(store.clone(), upstream, verifier, Duration::from_secs(args.upstream_interval.max(1)));
+    }
+
     // --- Server Configuration ---
     // Create the Axum app and address
-    let app = Router::new().nest_service("/", ServeDir::new(&serve_dir));
+    let tls_stats = Arc::new(TlsStats::default());
+    let state = AppState {
+        store,
+        files: ServeDir::new(&serve_dir),
+        admission: Arc::new(Admission::new(
+            args.max_downloads,
+            args.download_rate,
+            Duration::from_secs(args.retry_after),
+        )),
+        poll_interval: (args.poll_interval > 0).then(|| Duration::from_secs(args.poll_interval)),
+        max_wait: (args.max_wait > 0).then(|| Duration::from_secs(args.max_wait)),
+        tls_stats: tls_stats.clone(),
+        fleet: Arc::new(Fleet::default()),
+    };
+    let app = Router::new()
+        .route("/manifest", get(routes::catalog_manifest))
+        .route("/manifest/:image", get(routes::manifest))
+        .route("/compressed/:image", get(routes::compressed))
+        .route("/blocks/:image", get(routes::blocks))
+        .route("/deltas/:patch", get(routes::patch))
+        .route("/stats/tls", get(routes::tls_stats))
+        .route("/index", get(routes::index))
+        .route("/report", post(routes::report))
+        .route("/metrics", get(routes::metrics))
+        .fallback(routes::firmware)
+        .with_state(state);
     let addr = SocketAddr::new(args.ip, args.port);
+    // Every connection runs in its own task, the limit keeps their number (and
+    // memory) bounded when the whole fleet connects at once
+    let connections = Arc::new(Semaphore::new(args.max_connections));
 
     // --- Server Mode Selection ---
     match args.cert_dir {
@@ -98,12 +239,7 @@ async fn main() -> anyhow::Result<()> {
             let certs = load_certs(&default_cert_path)?;
             let key = load_key(&default_key_path)?;
 
-            let tls_config = Arc::new(
-                rustls::ServerConfig::builder()
-                    .with_no_client_auth()
-                    .with_single_cert(certs, key)
-                    .map_err(|e| anyhow::anyhow!("Failed to create TLS config: {}", e))?,
-            );
+            let tls_config = Arc::new(tls::server_config(certs, key)?);
 
             // --- HTTPS Server Loop ---
             let tls_acceptor = TlsAcceptor::from(tls_config);
@@ -120,6 +256,9 @@ async fn main() -> anyhow::Result<()> {
             let app_service = app.into_make_service_with_connect_info::<SocketAddr>();
 
             loop {
+                // Stop accepting while at the limit, the connections wait in
+                // the listen backlog
+                let permit = connections.clone().acquire_owned().await.unwrap();
                 let (tcp_stream, peer_addr) = match listener.accept().await {
                     Ok(s) => s,
                     Err(e) => {
@@ -130,17 +269,26 @@ async fn main() -> anyhow::Result<()> {
                 info!("TCP connection accepted from: {}", peer_addr);
 
                 let tls_acceptor = tls_acceptor.clone();
+                let tls_stats = tls_stats.clone();
                 let mut app_service = app_service.clone();
 
                 tokio::spawn(async move {
+                    let _permit = permit;
                     let service_for_connection = app_service.call(peer_addr).await.unwrap();
 
                     let hyper_service = TowerToHyperService::new(service_for_connection);
 
                     // Perform TLS handshake
+                    let handshake_start = Instant::now();
                     match tls_acceptor.accept(tcp_stream).await {
                         Ok(tls_stream) => {
-                            info!("TLS handshake successful with: {}", peer_addr);
+                            let kind = tls_stream.get_ref().1.handshake_kind();
+                            let duration = handshake_start.elapsed();
+                            tls_stats.record(kind, duration);
+                            info!(
+                                "TLS handshake ({:?}) successful with {} in {:?}",
+                                kind, peer_addr, duration
+                            );
                             let io = TokioIo::new(tls_stream);
 
                             if let Err(err) = Builder::new(TokioExecutor::new())
@@ -153,6 +301,7 @@ async fn main() -> anyhow::Result<()> {
                             }
                         }
                         Err(e) => {
+                            tls_stats.record_failure();
                             warn!("TLS handshake error from {}: {}", peer_addr, e);
                         }
                     }
@@ -175,6 +324,9 @@ async fn main() -> anyhow::Result<()> {
             let app_service = app.into_make_service_with_connect_info::<SocketAddr>();
 
             loop {
+                // Stop accepting while at the limit, the connections wait in
+                // the listen backlog
+                let permit = connections.clone().acquire_owned().await.unwrap();
                 let (tcp_stream, peer_addr) = match listener.accept().await {
                     Ok(s) => s,
                     Err(e) => {
@@ -187,6 +339,7 @@ async fn main() -> anyhow::Result<()> {
                 let mut app_service = app_service.clone();
 
                 tokio::spawn(async move {
+                    let _permit = permit;
                     let service_for_connection = app_service.call(peer_addr).await.unwrap();
 
                     let hyper_service = TowerToHyperService::new(service_for_connection);
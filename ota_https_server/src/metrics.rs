@@ -0,0 +1,221 @@
+use crate::admission::DownloadStats;
+use crate::tls::{HANDSHAKE_BUCKETS_MS, HandshakeHistogram, TlsStats};
+use serde::Deserialize;
+use std::collections::{BTreeMap, HashMap};
+use std::fmt::Write;
+use std::sync::Mutex;
+use std::sync::atomic::Ordering;
+
+/// Devices whose running version is tracked, the reports of further devices
+/// are only counted
+const MAX_DEVICES: usize = 1 << 20;
+
+/// Values of the `result` and `failure` labels, anything else a device sends
+/// is counted as `other`
+const RESULTS: [&str; 3] = ["updated", "up_to_date", "failed"];
+const FAILURES: [&str; 5] = ["none", "network", "server", "rejected", "device"];
+
+/// Summary of an update check, POSTed by the devices to `/report` (see
+/// send_report() in main/ota_engine.c). Durations are in milliseconds.
+#[derive(Debug, Deserialize)]
+pub struct DeviceReport {
+    pub device_id: Option<String>,
+    /// Version of the running firmware
+    pub version: Option<String>,
+    pub result: String,
+    #[serde(default)]
+    pub failure: String,
+    /// What was downloaded, if anything
+    pub mode: Option<String>,
+    pub manifest_ms: Option<u64>,
+    pub connect_ms: Option<u64>,
+    pub handshake_ms: Option<u64>,
+    pub ttfb_ms: Option<u64>,
+    pub download_ms: Option<u64>,
+    pub network_ms: Option<u64>,
+    pub flash_ms: Option<u64>,
+    pub finish_ms: Option<u64>,
+    pub bytes: Option<u64>,
+    /// Blocks that did not match the block list and were downloaded again
+    #[serde(default)]
+    pub bad_blocks: u64,
+    /// Phases of the boot, sent once after a restart
+    pub boot: Option<BootReport>,
+}
+
+#[derive(Debug, Deserialize)]
+pub struct BootReport {
+    pub startup_ms: Option<u64>,
+    /// From `app_main()` until connected with a valid firmware
+    pub ready_ms: Option<u64>,
+    pub digests_ms: Option<u64>,
+    pub diagnostic_ms: Option<u64>,
+    #[serde(default)]
+    pub new_firmware: bool,
+}
+
+impl DeviceReport {
+    /// Durations of the phases of the update check, by phase name
+    fn phases(&self) -> impl Iterator<Item = (&'static str, u64)> {
+        [
+            ("manifest", self.manifest_ms),
+            ("connect", self.connect_ms),
+            ("handshake", self.handshake_ms),
+            ("first_byte", self.ttfb_ms),
+            ("download", self.download_ms),
+            ("network", self.network_ms),
+            ("flash", self.flash_ms),
+            ("validation", self.finish_ms),
+        ]
+        .into_iter()
+        .filter_map(|(phase, ms)| Some((phase, ms?)))
+    }
+}
+
+impl BootReport {
+    fn phases(&self) -> impl Iterator<Item = (&'static str, u64)> {
+        [
+            ("startup", self.startup_ms),
+            ("ready", self.ready_ms),
+            ("digests", self.digests_ms),
+            ("diagnostic", self.diagnostic_ms.filter(|_| self.new_firmware)),
+        ]
+        .into_iter()
+        .filter_map(|(phase, ms)| Some((phase, ms?)))
+    }
+}
+
+/// Total duration and number of the measurements of a phase
+#[derive(Default)]
+struct Summary {
+    sum_ms: u64,
+    count: u64,
+}
+
+#[derive(Default)]
+struct FleetState {
+    /// Running version of every device that sent a report
+    versions: HashMap<String, String>,
+    /// Reports by result and failure
+    reports: BTreeMap<(&'static str, &'static str), u64>,
+    phases: BTreeMap<&'static str, Summary>,
+    boot_phases: BTreeMap<&'static str, Summary>,
+    /// Bytes the devices reported downloading
+    bytes: u64,
+    bad_blocks: u64,
+}
+
+/// What the devices reported about their update checks
+#[derive(Default)]
+pub struct Fleet {
+    state: Mutex<FleetState>,
+}
+
+/// Get the label value of a field among the expected ones
+fn label(value: &str, expected: &[&'static str]) -> &'static str {
+    expected.iter().find(|&&known| known == value).copied().unwrap_or("other")
+}
+
+impl Fleet {
+    pub fn record(&self, report: &DeviceReport) {
+        let result = label(&report.result, &RESULTS);
+        let failure = label(&report.failure, &FAILURES);
+        let mut state = self.state.lock().unwrap();
+
+        *state.reports.entry((result, failure)).or_default() += 1;
+        for (phase, ms) in report.phases() {
+            let summary = state.phases.entry(phase).or_default();
+            summary.sum_ms += ms;
+            summary.count += 1;
+        }
+        for (phase, ms) in report.boot.iter().flat_map(BootReport::phases) {
+            let summary = state.boot_phases.entry(phase).or_default();
+            summary.sum_ms += ms;
+            summary.count += 1;
+        }
+        state.bytes += report.bytes.unwrap_or(0);
+        state.bad_blocks += report.bad_blocks;
+
+        if let (Some(device_id), Some(version)) = (&report.device_id, &report.version) {
+            let known = state.versions.contains_key(device_id);
+            if known || state.versions.len() < MAX_DEVICES {
+                state.versions.insert(device_id.clone(), version.clone());
+            }
+        }
+    }
+}
+
+/// Escape a label value of the Prometheus text format
+fn escape(value: &str) -> String {
+    value.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n")
+}
+
+fn write_histogram(out: &mut String, name: &str, kind: &str, histogram: &HandshakeHistogram) {
+    for (bound_ms, count) in HANDSHAKE_BUCKETS_MS.iter().zip(&histogram.cumulative) {
+        let le = *bound_ms as f64 / 1000.0;
+        let _ = writeln!(out, "{}_bucket{{kind=\"{}\",le=\"{}\"}} {}", name, kind, le, count);
+    }
+    let _ = writeln!(out, "{}_bucket{{kind=\"{}\",le=\"+Inf\"}} {}", name, kind, histogram.count);
+    let _ = writeln!(out, "{}_sum{{kind=\"{}\"}} {}", name, kind, histogram.sum_us as f64 / 1e6);
+    let _ = writeln!(out, "{}_count{{kind=\"{}\"}} {}", name, kind, histogram.count);
+}
+
+fn write_summaries(out: &mut String, name: &str, help: &str, phases: &BTreeMap<&'static str, Summary>) {
+    let _ = writeln!(out, "# HELP {} {}", name, help);
+    let _ = writeln!(out, "# TYPE {} summary", name);
+    for (phase, summary) in phases {
+        let _ = writeln!(out, "{}_sum{{phase=\"{}\"}} {}", name, phase, summary.sum_ms as f64 / 1000.0);
+        let _ = writeln!(out, "{}_count{{phase=\"{}\"}} {}", name, phase, summary.count);
+    }
+}
+
+/// Render the metrics in the Prometheus text exposition format
+pub fn render(downloads: &DownloadStats, tls: &TlsStats, fleet: &Fleet) -> String {
+    let mut out = String::new();
+
+    // ---- Server ------------------------------------------------------------
+    let _ = writeln!(out, "# HELP ota_active_downloads Image, patch and compressed image downloads in progress");
+    let _ = writeln!(out, "# TYPE ota_active_downloads gauge");
+    let _ = writeln!(out, "ota_active_downloads {}", downloads.active.load(Ordering::Relaxed));
+    let _ = writeln!(out, "# HELP ota_downloads_total Downloads admitted, and turned away with 503");
+    let _ = writeln!(out, "# TYPE ota_downloads_total counter");
+    let _ = writeln!(out, "ota_downloads_total{{admitted=\"true\"}} {}", downloads.admitted.load(Ordering::Relaxed));
+    let _ = writeln!(out, "ota_downloads_total{{admitted=\"false\"}} {}", downloads.turned_away.load(Ordering::Relaxed));
+    let _ = writeln!(out, "# HELP ota_served_bytes_total Download body bytes handed to the connections");
+    let _ = writeln!(out, "# TYPE ota_served_bytes_total counter");
+    let _ = writeln!(out, "ota_served_bytes_total {}", downloads.bytes.load(Ordering::Relaxed));
+
+    let _ = writeln!(out, "# HELP ota_tls_handshake_seconds Duration of the TLS handshakes, from the connection");
+    let _ = writeln!(out, "# TYPE ota_tls_handshake_seconds histogram");
+    write_histogram(&mut out, "ota_tls_handshake_seconds", "full", &tls.histogram(false));
+    write_histogram(&mut out, "ota_tls_handshake_seconds", "resumed", &tls.histogram(true));
+    let _ = writeln!(out, "# HELP ota_tls_handshake_failures_total Failed TLS handshakes");
+    let _ = writeln!(out, "# TYPE ota_tls_handshake_failures_total counter");
+    let _ = writeln!(out, "ota_tls_handshake_failures_total {}", tls.failed());
+
+    // ---- Devices -----------------------------------------------------------
+    let state = fleet.state.lock().unwrap();
+    let mut adoption: BTreeMap<&str, u64> = BTreeMap::new();
+    for version in state.versions.values() {
+        *adoption.entry(version).or_default() += 1;
+    }
+    let _ = writeln!(out, "# HELP ota_devices Devices by running firmware version, from their last report");
+    let _ = writeln!(out, "# TYPE ota_devices gauge");
+    for (version, devices) in adoption {
+        let _ = writeln!(out, "ota_devices{{version=\"{}\"}} {}", escape(version), devices);
+    }
+    let _ = writeln!(out, "# HELP ota_device_reports_total Update checks reported by the devices");
+    let _ = writeln!(out, "# TYPE ota_device_reports_total counter");
+    for ((result, failure), count) in &state.reports {
+        let _ = writeln!(out, "ota_device_reports_total{{result=\"{}\",failure=\"{}\"}} {}", result, failure, count);
+    }
+    write_summaries(&mut out, "ota_device_phase_seconds", "Time the devices spent in each phase of their update checks", &state.phases);
+    write_summaries(&mut out, "ota_device_boot_phase_seconds", "Time the devices spent in each phase of their boot", &state.boot_phases);
+    let _ = writeln!(out, "# HELP ota_device_downloaded_bytes_total Bytes the devices reported downloading");
+    let _ = writeln!(out, "# TYPE ota_device_downloaded_bytes_total counter");
+    let _ = writeln!(out, "ota_device_downloaded_bytes_total {}", state.bytes);
+    let _ = writeln!(out, "# HELP ota_device_bad_blocks_total Corrupted blocks the devices reported downloading again");
+    let _ = writeln!(out, "# TYPE ota_device_bad_blocks_total counter");
+    let _ = writeln!(out, "ota_device_bad_blocks_total {}", state.bad_blocks);
+    out
+}
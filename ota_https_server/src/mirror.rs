@@ -0,0 +1,188 @@
+use crate::upstream::Upstream;
+use hyper::StatusCode;
+use bytes::Bytes;
+use ota_https_server::blocks;
+use ota_https_server::firmware::{AppDesc, DELTA_DIR, FirmwareStore, Index, Manifest, blocks_signature_path, signature_path};
+use ota_https_server::rollout::ROLLOUT_SUFFIX;
+use ota_https_server::signing::{ImageVerifier, manifest_message};
+use sha2::{Digest, Sha256};
+use std::collections::HashSet;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::Duration;
+use tracing::{error, info, warn};
+
+/// Keep the serving directory a copy of the images, signatures, rollouts and
+/// patches of an upstream server, checking its index every `interval`.
+///
+/// The local devices then download from this server, on the LAN, instead of
+/// each of them from the upstream one. Images are downloaded once, and only
+/// published if they match the SHA-256 of their manifest and its signature
+/// checks with `verifier`, the key of the origin. They keep the signature of
+/// the upstream server, which the devices verify, so a mirror cannot alter
+/// them. The directory watcher reloads the store after every change.
+pub fn spawn(store: Arc<FirmwareStore>, upstream: Upstream, verifier: ImageVerifier, interval: Duration) {
+    tokio::spawn(async move {
+        loop {
+            if let Err(e) = sync(&store, &upstream, &verifier).await {
+                error!("Failed to mirror the upstream server: {}", e);
+            }
+            tokio::time::sleep(interval).await;
+        }
+    });
+}
+
+/// Copy what changed on the upstream server since the last sync
+async fn sync(store: &FirmwareStore, upstream: &Upstream, verifier: &ImageVerifier) -> anyhow::Result<()> {
+    let (status, body) = upstream.get("/index").await?;
+    if status != StatusCode::OK {
+        anyhow::bail!("GET /index returned {}", status);
+    }
+    let index: Index = serde_json::from_slice(&body)?;
+    let snapshot = store.snapshot();
+    let dir = store.dir();
+
+    let mut names = HashSet::new();
+    for entry in &index.images {
+        let manifest = &entry.manifest;
+        if !is_file_name(&manifest.name) {
+            warn!("Skipping upstream image {:?}, not a file name", manifest.name);
+            continue;
+        }
+        names.insert(manifest.name.as_str());
+        let path = dir.join(&manifest.name);
+
+        // The image first: nothing is published before it is downloaded and
+        // verified, so the store never pairs an image with the signature of
+        // another one
+        let current = snapshot
+            .image(&manifest.name)
+            .filter(|image| hex::encode(image.sha256) == manifest.sha256);
+        let (data, new) = match current {
+            Some(image) => (image.data.clone(), false),
+            None => {
+                info!("Mirroring firmware {} version {}", manifest.name, manifest.version);
+                (download(upstream, &manifest.url, manifest.size, &manifest.sha256).await?, true)
+            }
+        };
+        if let Err(e) = verify(verifier, manifest, &data) {
+            warn!("Skipping upstream image {}: {}", manifest.name, e);
+            continue;
+        }
+
+        match &manifest.signature {
+            Some(signature) => write_if_changed(&signature_path(&path), signature.as_bytes()).await?,
+            None => remove(&signature_path(&path)).await?,
+        }
+        let blocks_signature = manifest.blocks.as_ref().and_then(|blocks| blocks.signature.as_ref());
+        match blocks_signature {
+            Some(signature) => write_if_changed(&blocks_signature_path(&path), signature.as_bytes()).await?,
+            None => remove(&blocks_signature_path(&path)).await?,
+        }
+        match &entry.rollout {
+            Some(rollout) => write_if_changed(&rollout_path(&path), &serde_json::to_vec(rollout)?).await?,
+            None => remove(&rollout_path(&path)).await?,
+        }
+        if new {
+            write(&path, &data).await?;
+        }
+    }
+
+    let mut patch_names = HashSet::new();
+    for patch in &index.patches {
+        if !is_file_name(&patch.name) {
+            warn!("Skipping upstream patch {:?}, not a file name", patch.name);
+            continue;
+        }
+        patch_names.insert(patch.name.as_str());
+        let current = snapshot.patch_file(&patch.name);
+        if current.is_some_and(|current| hex::encode(current.sha256) == patch.sha256) {
+            continue;
+        }
+        info!("Mirroring delta patch {}", patch.name);
+        tokio::fs::create_dir_all(dir.join(DELTA_DIR)).await?;
+        let url = format!("/{}/{}", DELTA_DIR, patch.name);
+        let data = download(upstream, &url, patch.size, &patch.sha256).await?;
+        write(&dir.join(DELTA_DIR).join(&patch.name), &data).await?;
+    }
+
+    // What the upstream server no longer offers
+    for image in snapshot.images().filter(|image| !names.contains(image.name.as_str())) {
+        info!("Firmware {} removed upstream", image.name);
+        let path = dir.join(&image.name);
+        remove(&signature_path(&path)).await?;
+        remove(&blocks_signature_path(&path)).await?;
+        remove(&rollout_path(&path)).await?;
+        remove(&path).await?;
+    }
+    for patch in snapshot.patches().filter(|patch| !patch_names.contains(patch.name.as_str())) {
+        info!("Delta patch {} removed upstream", patch.name);
+        remove(&dir.join(DELTA_DIR).join(&patch.name)).await?;
+    }
+    Ok(())
+}
+
+/// Download a file, checking that it has the expected size and SHA-256
+async fn download(upstream: &Upstream, url: &str, size: u64, sha256: &str) -> anyhow::Result<Bytes> {
+    let (status, data) = upstream.get(url).await?;
+    if status != StatusCode::OK {
+        anyhow::bail!("GET {} returned {}", url, status);
+    }
+    if data.len() as u64 != size || hex::encode(Sha256::digest(&data)) != sha256 {
+        anyhow::bail!("{} does not match its manifest", url);
+    }
+    Ok(data)
+}
+
+/// Check the signatures of an upstream image as the devices will: the
+/// manifest signature over the fields of the image itself, and the signature
+/// of its block list, rebuilt from the image
+fn verify(verifier: &ImageVerifier, manifest: &Manifest, data: &[u8]) -> anyhow::Result<()> {
+    let desc = AppDesc::parse(data).ok_or_else(|| anyhow::anyhow!("not an application image"))?;
+    let signature = manifest.signature.as_deref().ok_or_else(|| anyhow::anyhow!("not signed"))?;
+    let sha256: [u8; 32] = Sha256::digest(data).into();
+    let message = manifest_message(&manifest.name, &desc.version, desc.secure_version, data.len() as u64, &sha256)?;
+    verifier.verify(&message, signature)?;
+
+    if let Some(signature) = manifest.blocks.as_ref().and_then(|blocks| blocks.signature.as_deref()) {
+        verifier
+            .verify(&blocks::build(data), signature)
+            .map_err(|e| anyhow::anyhow!("block list: {}", e))?;
+    }
+    Ok(())
+}
+
+/// Write a file to a hidden file first (ignored by the store), then rename it,
+/// so the store never loads it half written
+async fn write(path: &Path, data: &[u8]) -> anyhow::Result<()> {
+    let name = path.file_name().unwrap().to_string_lossy();
+    let partial = path.with_file_name(format!(".{}.part", name));
+    tokio::fs::write(&partial, data).await?;
+    tokio::fs::rename(&partial, path).await?;
+    Ok(())
+}
+
+async fn write_if_changed(path: &Path, data: &[u8]) -> anyhow::Result<()> {
+    if tokio::fs::read(path).await.is_ok_and(|current| current == data) {
+        return Ok(());
+    }
+    write(path, data).await
+}
+
+async fn remove(path: &Path) -> anyhow::Result<()> {
+    match tokio::fs::remove_file(path).await {
+        Err(e) if e.kind() != std::io::ErrorKind::NotFound => Err(e.into()),
+        _ => Ok(()),
+    }
+}
+
+fn rollout_path(image: &Path) -> PathBuf {
+    let mut path = image.as_os_str().to_owned();
+    path.push(ROLLOUT_SUFFIX);
+    PathBuf::from(path)
+}
+
+/// Check that a name sent by the upstream server stays in the directory
+fn is_file_name(name: &str) -> bool {
+    !name.is_empty() && !name.starts_with('.') && !name.contains(['/', '\\'])
+}
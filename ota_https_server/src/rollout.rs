@@ -0,0 +1,59 @@
+//! Staged rollout of the firmware images
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+use std::collections::BTreeSet;
+
+/// Suffix of the rollout file of an image, e.g. `esp32_secure_ota.bin.rollout`
+pub const ROLLOUT_SUFFIX: &str = ".rollout";
+
+/// Devices an image is offered to, read from the JSON rollout file next to
+/// the image:
+/// ```json
+/// {"percent": 10, "devices": ["246f28a1b2c4"]}
+/// ```
+/// Without a rollout file an image is offered to every device.
+#[derive(Debug, Clone, Default, Deserialize, Serialize)]
+#[serde(deny_unknown_fields)]
+pub struct Rollout {
+    /// Share of the fleet the image is offered to, from 0 to 100
+    #[serde(default)]
+    pub percent: u8,
+    /// Devices the image is always offered to, such as a canary cohort.
+    /// Ordered, so that mirrors write the same file for the same rollout.
+    #[serde(default)]
+    pub devices: BTreeSet<String>,
+}
+
+impl Rollout {
+    pub fn parse(data: &[u8]) -> anyhow::Result<Rollout> {
+        let mut rollout: Rollout = serde_json::from_slice(data)?;
+        if rollout.percent > 100 {
+            anyhow::bail!("rollout percent {} is over 100", rollout.percent);
+        }
+        rollout.devices = rollout.devices.iter().map(|id| id.to_ascii_lowercase()).collect();
+        Ok(rollout)
+    }
+
+    /// Check if the image with the given SHA-256 is offered to a device.
+    ///
+    /// Devices are spread over 100 buckets by hashing their ID with the image
+    /// hash: raising the percentage only adds devices, and every image starts
+    /// with a different share of the fleet. Devices that do not send their ID
+    /// only get images offered to the whole fleet.
+    pub fn includes(&self, image_sha256: &[u8; 32], device_id: Option<&str>) -> bool {
+        let Some(device_id) = device_id else {
+            return self.percent >= 100;
+        };
+        let device_id = device_id.to_ascii_lowercase();
+        if self.devices.contains(&device_id) {
+            return true;
+        }
+
+        let hash = Sha256::new()
+            .chain_update(image_sha256)
+            .chain_update(device_id.as_bytes())
+            .finalize();
+        let bucket = u64::from_le_bytes(hash[..8].try_into().unwrap()) % 100;
+        bucket < self.percent as u64
+    }
+}
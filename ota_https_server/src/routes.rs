@@ -0,0 +1,731 @@
+use axum::extract::{Path, Query, Request, State};
+use axum::http::{HeaderMap, HeaderValue, StatusCode, header};
+use axum::response::{IntoResponse, Json, Response};
+use crate::admission::{Admission, Ticket};
+use crate::metrics::{DeviceReport, Fleet};
+use crate::tls::TlsStats;
+use bytes::Bytes;
+use ota_https_server::catalog::CatalogQuery;
+use ota_https_server::firmware::{FirmwareSnapshot, FirmwareStore, Image, ManifestVariant};
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::time::Instant;
+use tower::ServiceExt;
+use tower_http::services::ServeDir;
+use tracing::info;
+
+/// State shared by all the request handlers
+#[derive(Clone)]
+pub struct AppState {
+    pub store: Arc<FirmwareStore>,
+    /// Other files of the serving directory
+    pub files: ServeDir,
+    pub admission: Arc<Admission>,
+    /// Sent to the devices as the `max-age` of the manifest, the delay until
+    /// their next check
+    pub poll_interval: Option<Duration>,
+    /// Longest time a manifest request is held waiting for a new image, None
+    /// if they are answered at once
+    pub max_wait: Option<Duration>,
+    pub tls_stats: Arc<TlsStats>,
+    /// What the devices reported about their update checks
+    pub fleet: Arc<Fleet>,
+}
+
+/// Check if the `If-None-Match` header of a request matches an entity tag
+fn if_none_match(headers: &HeaderMap, etag: &str) -> bool {
+    headers
+        .get_all(header::IF_NONE_MATCH)
+        .iter()
+        .filter_map(|value| value.to_str().ok())
+        .flat_map(|value| value.split(','))
+        .map(str::trim)
+        // If-None-Match uses the weak comparison
+        .any(|tag| tag == "*" || tag.strip_prefix("W/").unwrap_or(tag) == etag)
+}
+
+/// Check if a range request can be served as such. A request with an
+/// `If-Range` that does not match (strong comparison) the current entity tag
+/// must get the whole entity instead.
+/// Dates are not accepted as validators, as they cannot guarantee the parts
+/// come from the same image.
+fn if_range(headers: &HeaderMap, etag: &str) -> bool {
+    match headers.get(header::IF_RANGE) {
+        Some(value) => value.to_str().is_ok_and(|tag| tag.trim() == etag),
+        None => true,
+    }
+}
+
+/// What a `Range` header asks for
+#[derive(Debug, PartialEq)]
+enum RangeRequest {
+    /// The whole entity: no range, several ranges or an invalid header
+    Whole,
+    Part(std::ops::Range<usize>),
+    Unsatisfiable,
+}
+
+/// Parse a `Range` header asking for a single byte range of an entity of
+/// `size` bytes
+fn range(headers: &HeaderMap, size: usize) -> RangeRequest {
+    let Some(spec) = headers
+        .get(header::RANGE)
+        .and_then(|value| value.to_str().ok())
+        .and_then(|value| value.trim().strip_prefix("bytes="))
+    else {
+        return RangeRequest::Whole;
+    };
+    parse_range(spec, size)
+}
+
+fn parse_range(spec: &str, size: usize) -> RangeRequest {
+    let Some((start, end)) = spec.split_once('-').filter(|_| !spec.contains(',')) else {
+        return RangeRequest::Whole;
+    };
+    let (start, end) = (start.trim(), end.trim());
+
+    if start.is_empty() {
+        // Suffix range, the last bytes
+        return match end.parse::<usize>() {
+            Ok(0) => RangeRequest::Unsatisfiable,
+            Ok(len) => RangeRequest::Part(size.saturating_sub(len)..size),
+            Err(_) => RangeRequest::Whole,
+        };
+    }
+    let Ok(start) = start.parse::<usize>() else {
+        return RangeRequest::Whole;
+    };
+    let end = match end {
+        "" => size,
+        end => match end.parse::<usize>() {
+            Ok(last) if last >= start => last.saturating_add(1).min(size),
+            _ => return RangeRequest::Whole,
+        },
+    };
+
+    if start < size {
+        RangeRequest::Part(start..end)
+    } else {
+        RangeRequest::Unsatisfiable
+    }
+}
+
+/// Serve an entity held in memory, whole or the range asked for.
+/// The body shares the bytes of the entity, nothing is copied.
+fn serve_bytes(data: &Bytes, etag: &str, headers: &HeaderMap, ticket: Ticket) -> Response {
+    let range = if if_range(headers, etag) {
+        range(headers, data.len())
+    } else {
+        RangeRequest::Whole
+    };
+
+    let common = [
+        (header::CONTENT_TYPE, "application/octet-stream".to_string()),
+        (header::ACCEPT_RANGES, "bytes".to_string()),
+        (header::ETAG, etag.to_string()),
+    ];
+    match range {
+        RangeRequest::Whole => (
+            common,
+            [(header::CONTENT_LENGTH, data.len().to_string())],
+            ticket.body(data.clone()),
+        )
+            .into_response(),
+        RangeRequest::Part(range) => (
+            StatusCode::PARTIAL_CONTENT,
+            common,
+            [
+                (
+                    header::CONTENT_RANGE,
+                    format!("bytes {}-{}/{}", range.start, range.end - 1, data.len()),
+                ),
+                (header::CONTENT_LENGTH, range.len().to_string()),
+            ],
+            ticket.body(data.slice(range)),
+        )
+            .into_response(),
+        RangeRequest::Unsatisfiable => (
+            StatusCode::RANGE_NOT_SATISFIABLE,
+            [(header::CONTENT_RANGE, format!("bytes */{}", data.len()))],
+        )
+            .into_response(),
+    }
+}
+
+/// Answer a download request while too many downloads are in progress
+fn busy(admission: &Admission) -> Response {
+    (
+        StatusCode::SERVICE_UNAVAILABLE,
+        [(header::RETRY_AFTER, admission.retry_after())],
+    )
+        .into_response()
+}
+
+/// Header carrying the `app_elf_sha256` of the firmware running on the device,
+/// used to offer it a delta patch
+const APP_ELF_SHA256: &str = "x-app-elf-sha256";
+
+/// Header carrying the ID of the device, used for staged rollouts
+const DEVICE_ID: &str = "x-device-id";
+
+/// Get the ID of the device that sent the request, if it sent one
+fn device_id(headers: &HeaderMap) -> Option<&str> {
+    headers.get(DEVICE_ID).and_then(|value| value.to_str().ok()).map(str::trim)
+}
+
+/// Answer a device left out of the staged rollout of an image, to check again
+/// later
+fn not_offered(state: &AppState) -> Response {
+    (
+        StatusCode::NO_CONTENT,
+        [
+            (header::RETRY_AFTER, state.admission.retry_after()),
+            (header::VARY, DEVICE_ID.to_string()),
+        ],
+    )
+        .into_response()
+}
+
+/// Check if a download of `image` is held back by its staged rollout. Only a
+/// request with the ID of the device can be: one without it is served, the
+/// rollout is enforced on the manifest the device polls first.
+fn download_held_back(snapshot: &FirmwareSnapshot, image: &Image, headers: &HeaderMap) -> bool {
+    device_id(headers).is_some_and(|device_id| !snapshot.offered(image, Some(device_id)))
+}
+
+/// Header of a device willing to wait for a new image (`wait=<seconds>`,
+/// RFC 7240) rather than get `304 Not Modified` at once
+const PREFER: &str = "prefer";
+const PREFERENCE_APPLIED: &str = "preference-applied";
+
+/// Get how long the device that sent the request is willing to wait
+fn prefer_wait(headers: &HeaderMap) -> Option<Duration> {
+    headers
+        .get_all(PREFER)
+        .iter()
+        .filter_map(|value| value.to_str().ok())
+        .flat_map(|value| value.split(','))
+        .find_map(|preference| preference.trim().strip_prefix("wait=")?.trim().parse().ok())
+        .map(Duration::from_secs)
+}
+
+/// Find a patch rebuilding `image` from the firmware running on the device
+/// that sent the request
+fn find_patch(snapshot: &FirmwareSnapshot, image: &Image, headers: &HeaderMap) -> Option<ManifestVariant> {
+    let mut base_elf_sha256 = [0; 32];
+    let value = headers.get(APP_ELF_SHA256)?.to_str().ok()?;
+    hex::decode_to_slice(value.trim(), &mut base_elf_sha256).ok()?;
+    snapshot.patch(image, &base_elf_sha256).map(|patch| patch.manifest())
+}
+
+fn not_modified(etag: &str) -> Response {
+    (StatusCode::NOT_MODIFIED, [(header::ETAG, etag.to_string())]).into_response()
+}
+
+/// Image a manifest request is about
+enum ManifestRequest {
+    /// The image of that name
+    Name(String),
+    /// The image the catalog has for the target of the device
+    Catalog(CatalogQuery),
+}
+
+impl ManifestRequest {
+    fn find<'a>(&self, snapshot: &'a FirmwareSnapshot) -> Option<&'a Arc<Image>> {
+        match self {
+            ManifestRequest::Name(name) => snapshot.image(name),
+            ManifestRequest::Catalog(query) => snapshot.find(query),
+        }
+    }
+}
+
+/// Serve the manifest of a firmware image, so devices can check for a new
+/// version without downloading the image.
+/// The manifest is derived from the image, so it shares the image ETag.
+/// If the device sent the `app_elf_sha256` of its firmware and there is a
+/// patch from it, the manifest also points to the patch.
+/// Devices left out of the staged rollout of the image get `204 No Content`
+/// and a `Retry-After` to check again.
+/// With a poll interval, the manifest (or `304 Not Modified`) has it as its
+/// `max-age`, which devices wait before their next check.
+///
+/// A device sending `Prefer: wait=<seconds>` long polls: instead of `304 Not
+/// Modified` or `204 No Content`, the request is held until a reload of the
+/// store changes the answer or the wait ends. An idle device then costs an open
+/// connection and a parked task, and learns about a new image as soon as it is
+/// published.
+pub async fn manifest(
+    State(state): State<AppState>,
+    Path(name): Path<String>,
+    headers: HeaderMap,
+) -> Response {
+    serve_manifest(&state, ManifestRequest::Name(name), &headers).await
+}
+
+/// Serve the manifest of the image the catalog has for the project, chip,
+/// chip revision and channel in the query string, like `manifest()`.
+/// A device gets `204 No Content` when there is no image for its target, or
+/// when the image has a lower secure version than its firmware.
+pub async fn catalog_manifest(
+    State(state): State<AppState>,
+    Query(query): Query<CatalogQuery>,
+    headers: HeaderMap,
+) -> Response {
+    serve_manifest(&state, ManifestRequest::Catalog(query), &headers).await
+}
+
+async fn serve_manifest(state: &AppState, request: ManifestRequest, headers: &HeaderMap) -> Response {
+    // Subscribed first, a reload while the answer is computed is not missed
+    let mut reloads = state.store.subscribe();
+    let mut response = manifest_response(state, &request, headers);
+
+    let wait = state.max_wait.zip(prefer_wait(headers)).map(|(max, wait)| wait.min(max));
+    let unchanged = |response: &Response| {
+        matches!(response.status(), StatusCode::NOT_MODIFIED | StatusCode::NO_CONTENT)
+    };
+    if let Some(wait) = wait.filter(|_| unchanged(&response)) {
+        let deadline = Instant::now() + wait;
+        while unchanged(&response) {
+            match tokio::time::timeout_at(deadline, reloads.changed()).await {
+                Ok(Ok(())) => response = manifest_response(state, &request, headers),
+                _ => break,
+            }
+        }
+        let applied = format!("wait={}", wait.as_secs());
+        response.headers_mut().insert(
+            PREFERENCE_APPLIED,
+            HeaderValue::from_str(&applied).expect("valid header value"),
+        );
+    }
+
+    if let Some(poll_interval) = state.poll_interval {
+        if matches!(response.status(), StatusCode::OK | StatusCode::NOT_MODIFIED) {
+            let max_age = format!("max-age={}", poll_interval.as_secs());
+            response.headers_mut().insert(
+                header::CACHE_CONTROL,
+                HeaderValue::from_str(&max_age).expect("valid header value"),
+            );
+        }
+    }
+    response
+}
+
+fn manifest_response(state: &AppState, request: &ManifestRequest, headers: &HeaderMap) -> Response {
+    let snapshot = state.store.snapshot();
+    let Some(image) = request.find(&snapshot) else {
+        return match request {
+            ManifestRequest::Name(_) => StatusCode::NOT_FOUND.into_response(),
+            // Nothing to install for this target (yet)
+            ManifestRequest::Catalog(_) => StatusCode::NO_CONTENT.into_response(),
+        };
+    };
+
+    if if_none_match(headers, &image.etag) {
+        return not_modified(&image.etag);
+    }
+
+    if !snapshot.offered(image, device_id(headers)) {
+        return not_offered(state);
+    }
+
+    let mut manifest = image.manifest();
+    manifest.delta = find_patch(&snapshot, image, headers);
+
+    (
+        [
+            (header::ETAG, image.etag.clone()),
+            (header::VARY, format!("{}, {}", APP_ELF_SHA256, DEVICE_ID)),
+        ],
+        Json(manifest),
+    )
+        .into_response()
+}
+
+/// Content type of heatshrink compressed firmware images
+const HEATSHRINK_CONTENT_TYPE: &str = "application/x-heatshrink";
+
+/// Serve the compressed variant of a firmware image, compressed once when the
+/// image is inspected.
+/// The device resumes an interrupted download with the image itself, so range
+/// requests are not supported.
+/// A device sending its ID and left out of the staged rollout of the image gets
+/// `204 No Content`, as for the manifest.
+pub async fn compressed(
+    State(state): State<AppState>,
+    Path(name): Path<String>,
+    headers: HeaderMap,
+) -> Response {
+    let snapshot = state.store.snapshot();
+    let Some(image) = snapshot.image(&name) else {
+        return StatusCode::NOT_FOUND.into_response();
+    };
+    let Some(compressed) = image.compressed.clone() else {
+        return StatusCode::NOT_FOUND.into_response();
+    };
+
+    if if_none_match(&headers, &image.compressed_etag) {
+        return not_modified(&image.compressed_etag);
+    }
+    if download_held_back(&snapshot, image, &headers) {
+        return not_offered(&state);
+    }
+    let Some(ticket) = state.admission.admit() else {
+        return busy(&state.admission);
+    };
+
+    (
+        [
+            (header::CONTENT_TYPE, HEATSHRINK_CONTENT_TYPE.to_string()),
+            (header::ETAG, image.compressed_etag.clone()),
+            (header::CONTENT_LENGTH, compressed.len().to_string()),
+        ],
+        ticket.body(compressed),
+    )
+        .into_response()
+}
+
+/// Serve the block list of a firmware image, built when the image is
+/// inspected. It is small and fetched once per download, like a manifest it
+/// is not subject to admission control.
+pub async fn blocks(
+    State(state): State<AppState>,
+    Path(name): Path<String>,
+    headers: HeaderMap,
+) -> Response {
+    let snapshot = state.store.snapshot();
+    let Some(image) = snapshot.image(&name) else {
+        return StatusCode::NOT_FOUND.into_response();
+    };
+
+    let etag = image.blocks_etag();
+    if if_none_match(&headers, &etag) {
+        return not_modified(&etag);
+    }
+    (
+        [
+            (header::CONTENT_TYPE, "application/octet-stream".to_string()),
+            (header::ETAG, etag),
+        ],
+        image.blocks.clone(),
+    )
+        .into_response()
+}
+
+/// Serve a delta patch, read when the serving directory was loaded.
+/// A device sending its ID and left out of the staged rollout of the image the
+/// patch rebuilds gets `204 No Content`, as for the manifest.
+pub async fn patch(
+    State(state): State<AppState>,
+    Path(name): Path<String>,
+    headers: HeaderMap,
+) -> Response {
+    let snapshot = state.store.snapshot();
+    let Some(patch) = snapshot.patch_file(&name) else {
+        return StatusCode::NOT_FOUND.into_response();
+    };
+
+    if if_none_match(&headers, &patch.etag) {
+        return not_modified(&patch.etag);
+    }
+    let target = snapshot.images().find(|image| image.sha256 == patch.header.target_sha256);
+    if target.is_some_and(|image| download_held_back(&snapshot, image, &headers)) {
+        return not_offered(&state);
+    }
+    let Some(ticket) = state.admission.admit() else {
+        return busy(&state.admission);
+    };
+    serve_bytes(&patch.data, &patch.etag, &headers, ticket)
+}
+
+/// Serve a firmware image from memory, with an ETag and conditional request
+/// support, or any other file from the serving directory.
+/// Image, compressed image and patch downloads go through admission control:
+/// over the limit the server answers `503 Service Unavailable` with a
+/// `Retry-After`.
+/// Range requests are served as `206 Partial Content`, so interrupted downloads
+/// can be resumed, as long as `If-Range` still matches the image.
+/// Staged rollouts are enforced on the manifest: a download request only gets
+/// `204 No Content` when it carries the ID of a device left out of the rollout.
+/// Devices fetching the image without polling the manifest or sending their ID
+/// get it whatever the rollout.
+pub async fn firmware(State(state): State<AppState>, request: Request) -> Response {
+    let name = request.uri().path().trim_start_matches('/');
+    let snapshot = state.store.snapshot();
+    let Some(image) = snapshot.image(name) else {
+        return serve_file(state.files, request).await;
+    };
+
+    if if_none_match(request.headers(), &image.etag) {
+        return not_modified(&image.etag);
+    }
+    if download_held_back(&snapshot, image, request.headers()) {
+        return not_offered(&state);
+    }
+    let Some(ticket) = state.admission.admit() else {
+        return busy(&state.admission);
+    };
+    serve_bytes(&image.data, &image.etag, request.headers(), ticket)
+}
+
+/// Serve the TLS handshake statistics, to check that devices resume their
+/// sessions instead of doing full handshakes
+pub async fn tls_stats(State(state): State<AppState>) -> Response {
+    Json(state.tls_stats.report()).into_response()
+}
+
+/// Serve the list of images, signatures, rollouts and patches, that mirrors
+/// of the server copy
+pub async fn index(State(state): State<AppState>) -> Response {
+    Json(state.store.snapshot().index()).into_response()
+}
+
+/// Record the summary a device sends after each update check
+pub async fn report(State(state): State<AppState>, Json(report): Json<DeviceReport>) -> StatusCode {
+    info!(
+        "Report from {}: {} {} ({}), {} bytes in {} ms",
+        report.device_id.as_deref().unwrap_or("unknown device"),
+        report.version.as_deref().unwrap_or("unknown version"),
+        report.result,
+        report.failure,
+        report.bytes.unwrap_or(0),
+        report.download_ms.unwrap_or(0),
+    );
+    state.fleet.record(&report);
+    StatusCode::NO_CONTENT
+}
+
+/// Serve the server and fleet metrics in the Prometheus text format
+pub async fn metrics(State(state): State<AppState>) -> Response {
+    let body = crate::metrics::render(state.admission.stats(), &state.tls_stats, &state.fleet);
+    ([(header::CONTENT_TYPE, "text/plain; version=0.0.4")], body).into_response()
+}
+
+async fn serve_file(files: ServeDir, request: Request) -> Response {
+    match files.oneshot(request).await {
+        Ok(response) => response.into_response(),
+        Err(never) => match never {},
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use axum::http::HeaderName;
+    use ota_https_server::firmware::DELTA_DIR;
+    use ota_https_server::{blocks, heatshrink};
+
+    // Fixture shared with the host tests, see host/test/make_fixtures.py
+    const NEW: &[u8] = include_bytes!("../../host/test/fixtures/new.bin");
+    const PATCH: &[u8] = include_bytes!("../../host/test/fixtures/new.bin.delta");
+    const ETAG: &str = "\"0123abcd\"";
+
+    fn headers(pairs: &[(HeaderName, &str)]) -> HeaderMap {
+        pairs
+            .iter()
+            .map(|(name, value)| (name.clone(), HeaderValue::from_str(value).unwrap()))
+            .collect()
+    }
+
+    fn header<'a>(response: &'a Response, name: HeaderName) -> Option<&'a str> {
+        response.headers().get(name).map(|value| value.to_str().unwrap())
+    }
+
+    async fn body(response: Response) -> Bytes {
+        axum::body::to_bytes(response.into_body(), usize::MAX).await.unwrap()
+    }
+
+    fn admission() -> Arc<Admission> {
+        Arc::new(Admission::new(0, 0, Duration::from_secs(1)))
+    }
+
+    /// State serving the fixture image and the `files` next to it, loaded from a
+    /// directory of its own
+    fn state_with(test: &str, files: &[(&str, &[u8])]) -> AppState {
+        let dir = std::env::temp_dir().join(format!("ota_routes_{}_{}", std::process::id(), test));
+        std::fs::create_dir_all(dir.join(DELTA_DIR)).unwrap();
+        std::fs::write(dir.join("new.bin"), NEW).unwrap();
+        for (name, data) in files {
+            std::fs::write(dir.join(name), data).unwrap();
+        }
+        let store = Arc::new(FirmwareStore::new(&dir, None));
+        store.reload().unwrap();
+        std::fs::remove_dir_all(&dir).unwrap();
+
+        AppState {
+            store,
+            files: ServeDir::new(&dir),
+            admission: admission(),
+            poll_interval: None,
+            max_wait: None,
+            tls_stats: Arc::default(),
+            fleet: Arc::default(),
+        }
+    }
+
+    fn state(test: &str) -> AppState {
+        state_with(test, &[])
+    }
+
+    #[test]
+    fn byte_ranges() {
+        assert_eq!(parse_range("0-99", 1000), RangeRequest::Part(0..100));
+        assert_eq!(parse_range("100-", 1000), RangeRequest::Part(100..1000));
+        assert_eq!(parse_range(" 990 - 2000 ", 1000), RangeRequest::Part(990..1000));
+        assert_eq!(parse_range("999-999", 1000), RangeRequest::Part(999..1000));
+    }
+
+    #[test]
+    fn suffix_ranges() {
+        assert_eq!(parse_range("-100", 1000), RangeRequest::Part(900..1000));
+        assert_eq!(parse_range("-1000", 1000), RangeRequest::Part(0..1000));
+        assert_eq!(parse_range("-2000", 1000), RangeRequest::Part(0..1000));
+        assert_eq!(parse_range("-0", 1000), RangeRequest::Unsatisfiable);
+        assert_eq!(parse_range("-x", 1000), RangeRequest::Whole);
+    }
+
+    #[test]
+    fn ranges_past_the_end() {
+        assert_eq!(parse_range("1000-", 1000), RangeRequest::Unsatisfiable);
+        assert_eq!(parse_range("1000-1999", 1000), RangeRequest::Unsatisfiable);
+        assert_eq!(parse_range("5000-", 1000), RangeRequest::Unsatisfiable);
+        assert_eq!(parse_range("0-", 0), RangeRequest::Unsatisfiable);
+    }
+
+    #[test]
+    fn whole_entity_ranges() {
+        // Several ranges are served as the whole entity, as are invalid ones
+        assert_eq!(parse_range("0-99,200-299", 1000), RangeRequest::Whole);
+        assert_eq!(parse_range("-100, 0-1", 1000), RangeRequest::Whole);
+        assert_eq!(parse_range("99-0", 1000), RangeRequest::Whole);
+        assert_eq!(parse_range("x-1", 1000), RangeRequest::Whole);
+        assert_eq!(parse_range("", 1000), RangeRequest::Whole);
+        assert_eq!(range(&headers(&[(header::RANGE, "items=0-99")]), 1000), RangeRequest::Whole);
+        assert_eq!(range(&HeaderMap::new(), 1000), RangeRequest::Whole);
+        assert_eq!(range(&headers(&[(header::RANGE, "bytes=0-99")]), 1000), RangeRequest::Part(0..100));
+    }
+
+    #[test]
+    fn if_range_validators() {
+        assert!(if_range(&HeaderMap::new(), ETAG));
+        assert!(if_range(&headers(&[(header::IF_RANGE, ETAG)]), ETAG));
+        // Weak tags, other tags and dates do not match
+        assert!(!if_range(&headers(&[(header::IF_RANGE, "W/\"0123abcd\"")]), ETAG));
+        assert!(!if_range(&headers(&[(header::IF_RANGE, "\"4567ef\"")]), ETAG));
+        assert!(!if_range(&headers(&[(header::IF_RANGE, "Wed, 21 Oct 2015 07:28:00 GMT")]), ETAG));
+    }
+
+    #[tokio::test]
+    async fn serve_parts() {
+        let data = Bytes::from_static(NEW);
+        let len = NEW.len();
+
+        let response = serve_bytes(&data, ETAG, &HeaderMap::new(), admission().admit().unwrap());
+        assert_eq!(response.status(), StatusCode::OK);
+        assert_eq!(header(&response, header::ACCEPT_RANGES), Some("bytes"));
+        assert_eq!(header(&response, header::ETAG), Some(ETAG));
+        assert_eq!(body(response).await, NEW);
+
+        let request = headers(&[(header::RANGE, "bytes=100-199"), (header::IF_RANGE, ETAG)]);
+        let response = serve_bytes(&data, ETAG, &request, admission().admit().unwrap());
+        assert_eq!(response.status(), StatusCode::PARTIAL_CONTENT);
+        let content_range = format!("bytes 100-199/{}", len);
+        assert_eq!(header(&response, header::CONTENT_RANGE), Some(content_range.as_str()));
+        assert_eq!(header(&response, header::CONTENT_LENGTH), Some("100"));
+        assert_eq!(body(response).await, NEW[100..200]);
+
+        let request = headers(&[(header::RANGE, "bytes=-100")]);
+        let response = serve_bytes(&data, ETAG, &request, admission().admit().unwrap());
+        assert_eq!(response.status(), StatusCode::PARTIAL_CONTENT);
+        assert_eq!(body(response).await, NEW[len - 100..]);
+
+        let request = headers(&[(header::RANGE, &format!("bytes={}-", len))]);
+        let response = serve_bytes(&data, ETAG, &request, admission().admit().unwrap());
+        assert_eq!(response.status(), StatusCode::RANGE_NOT_SATISFIABLE);
+        let content_range = format!("bytes */{}", len);
+        assert_eq!(header(&response, header::CONTENT_RANGE), Some(content_range.as_str()));
+    }
+
+    #[tokio::test]
+    async fn serve_whole_entity() {
+        let data = Bytes::from_static(NEW);
+        for request in [
+            headers(&[(header::RANGE, "bytes=0-99,200-299")]),
+            // The image changed since the first part was downloaded
+            headers(&[(header::RANGE, "bytes=100-"), (header::IF_RANGE, "\"4567ef\"")]),
+            headers(&[(header::RANGE, "bytes=100-"), (header::IF_RANGE, "W/\"0123abcd\"")]),
+        ] {
+            let response = serve_bytes(&data, ETAG, &request, admission().admit().unwrap());
+            assert_eq!(response.status(), StatusCode::OK);
+            assert_eq!(header(&response, header::CONTENT_RANGE), None);
+            assert_eq!(body(response).await, NEW);
+        }
+    }
+
+    #[tokio::test]
+    async fn image_ranges() {
+        let state = state("image_ranges");
+        let etag = state.store.snapshot().image("new.bin").unwrap().etag.clone();
+        let request = Request::builder()
+            .uri("/new.bin")
+            .header(header::RANGE, "bytes=4096-")
+            .header(header::IF_RANGE, &etag)
+            .body(Default::default())
+            .unwrap();
+        let response = firmware(State(state), request).await;
+        assert_eq!(response.status(), StatusCode::PARTIAL_CONTENT);
+        assert_eq!(body(response).await, NEW[4096..]);
+    }
+
+    #[tokio::test]
+    async fn variant_ranges() {
+        // Compressed images and block lists are only served whole
+        let state = state("variant_ranges");
+        let request = headers(&[(header::RANGE, "bytes=100-")]);
+
+        let response = compressed(State(state.clone()), Path("new.bin".to_string()), request.clone()).await;
+        assert_eq!(response.status(), StatusCode::OK);
+        assert_eq!(header(&response, header::ACCEPT_RANGES), None);
+        assert_eq!(body(response).await, heatshrink::compress_image(NEW));
+
+        let response = blocks(State(state), Path("new.bin".to_string()), request).await;
+        assert_eq!(response.status(), StatusCode::OK);
+        assert_eq!(header(&response, header::ACCEPT_RANGES), None);
+        assert_eq!(body(response).await, blocks::build(NEW));
+    }
+
+    /// Download the image, compressed image or patch at `uri`
+    async fn download(state: &AppState, uri: &str, device_id: Option<&str>) -> Response {
+        let mut request = Request::builder().uri(uri);
+        if let Some(device_id) = device_id {
+            request = request.header(DEVICE_ID, device_id);
+        }
+        let request = request.body(Default::default()).unwrap();
+        let name = uri.rsplit('/').next().unwrap().to_string();
+        let headers = request.headers().clone();
+        match uri.split('/').nth(1).unwrap() {
+            "compressed" => compressed(State(state.clone()), Path(name), headers).await,
+            "deltas" => patch(State(state.clone()), Path(name), headers).await,
+            _ => firmware(State(state.clone()), request).await,
+        }
+    }
+
+    #[tokio::test]
+    async fn downloads_follow_the_rollout() {
+        // Only offered to the canary device
+        let rollout: &[u8] = br#"{"percent": 0, "devices": ["canary"]}"#;
+        let state = state_with(
+            "downloads_follow_the_rollout",
+            &[("new.bin.rollout", rollout), ("deltas/new.bin.delta", PATCH)],
+        );
+        for uri in ["/new.bin", "/compressed/new.bin", "/deltas/new.bin.delta"] {
+            let response = download(&state, uri, Some("other")).await;
+            assert_eq!(response.status(), StatusCode::NO_CONTENT, "{}", uri);
+            assert_eq!(header(&response, header::RETRY_AFTER), Some("1"));
+            assert_eq!(header(&response, header::VARY), Some(DEVICE_ID));
+
+            assert_eq!(download(&state, uri, Some("canary")).await.status(), StatusCode::OK, "{}", uri);
+            // Firmware that does not send its ID relies on the manifest
+            assert_eq!(download(&state, uri, None).await.status(), StatusCode::OK, "{}", uri);
+        }
+    }
+}
@@ -0,0 +1,137 @@
+//! Signatures of the firmware manifests
+use ring::rand::SystemRandom;
+use ring::signature::{ECDSA_P256_SHA256_ASN1, ECDSA_P256_SHA256_ASN1_SIGNING, EcdsaKeyPair, UnparsedPublicKey};
+
+/// Suffix of the file holding the manifest signature of an image made
+/// elsewhere (hex encoded DER), e.g. `esp32_secure_ota.bin.sig`. It is sent instead of
+/// signing the image, so that the key can stay off the server, and a mirror
+/// passes on the signature of the origin.
+pub const SIGNATURE_SUFFIX: &str = ".sig";
+/// Suffix of the signature file of the block list of an image, e.g.
+/// `esp32_secure_ota.bin.blocks.sig`, the signature of `/blocks/<image>`
+pub const BLOCKS_SIGNATURE_SUFFIX: &str = ".blocks.sig";
+/// First line of the signed manifest fields, naming the format
+const MANIFEST_CONTEXT: &str = "ota-manifest-v1";
+
+/// Get the bytes signed for the manifest of an image: its name, version,
+/// secure version, size and SHA-256 (lowercase hex), one per line after
+/// `ota-manifest-v1`. Devices rebuild them from the manifest they received,
+/// so that none of the fields deciding what they install can be altered.
+pub fn manifest_message(
+    name: &str,
+    version: &str,
+    secure_version: u32,
+    size: u64,
+    sha256: &[u8; 32],
+) -> anyhow::Result<Vec<u8>> {
+    // A field holding a line break could pass for other fields
+    if name.contains('\n') || version.contains('\n') {
+        anyhow::bail!("The name and version of a signed image cannot hold line breaks");
+    }
+    Ok(format!(
+        "{}\n{}\n{}\n{}\n{}\n{}\n",
+        MANIFEST_CONTEXT,
+        name,
+        version,
+        secure_version,
+        size,
+        hex::encode(sha256)
+    )
+    .into_bytes())
+}
+
+/// ECDSA P-256 key signing the images advertised in the manifests.
+///
+/// The manifest signature is computed over `manifest_message()`, which holds
+/// the SHA-256 digest of the image that devices hash every written byte
+/// against. Block lists are signed as they are.
+pub struct ImageSigner {
+    key: EcdsaKeyPair,
+    rng: SystemRandom,
+}
+
+impl ImageSigner {
+    /// Create a signer from a PKCS#8 (DER) P-256 private key
+    pub fn from_pkcs8(der: &[u8]) -> anyhow::Result<ImageSigner> {
+        let rng = SystemRandom::new();
+        let key = EcdsaKeyPair::from_pkcs8(&ECDSA_P256_SHA256_ASN1_SIGNING, der, &rng)
+            .map_err(|e| anyhow::anyhow!("Not a PKCS#8 ECDSA P-256 key: {}", e))?;
+        Ok(ImageSigner { key, rng })
+    }
+
+    /// Sign a message, returns the DER encoded signature
+    pub fn sign(&self, message: &[u8]) -> anyhow::Result<Vec<u8>> {
+        let signature = self
+            .key
+            .sign(&self.rng, message)
+            .map_err(|e| anyhow::anyhow!("Failed to sign: {}", e))?;
+        Ok(signature.as_ref().to_vec())
+    }
+}
+
+/// DER encoding of the SubjectPublicKeyInfo of a P-256 key up to the key
+/// itself, the uncompressed point that follows
+const P256_SPKI_PREFIX: [u8; 26] = [
+    0x30, 0x59, 0x30, 0x13, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01, 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce,
+    0x3d, 0x03, 0x01, 0x07, 0x03, 0x42, 0x00,
+];
+
+/// ECDSA P-256 public key checking signatures made by an `ImageSigner`, the
+/// key the devices embed
+pub struct ImageVerifier {
+    key: UnparsedPublicKey<Vec<u8>>,
+}
+
+impl ImageVerifier {
+    /// Create a verifier from the SubjectPublicKeyInfo (DER) of a P-256 key
+    pub fn from_spki(der: &[u8]) -> anyhow::Result<ImageVerifier> {
+        let point = der
+            .strip_prefix(&P256_SPKI_PREFIX[..])
+            .filter(|point| point.len() == 65)
+            .ok_or_else(|| anyhow::anyhow!("Not an ECDSA P-256 public key"))?;
+        Ok(ImageVerifier {
+            key: UnparsedPublicKey::new(&ECDSA_P256_SHA256_ASN1, point.to_vec()),
+        })
+    }
+
+    /// Check a hex encoded DER signature of a message
+    pub fn verify(&self, message: &[u8], signature: &str) -> anyhow::Result<()> {
+        let signature = hex::decode(signature.trim())?;
+        self.key
+            .verify(message, &signature)
+            .map_err(|_| anyhow::anyhow!("Invalid signature"))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn manifest_message_layout() {
+        let message = manifest_message("esp32_secure_ota.bin", "1.1", 2, 912304, &[0xab; 32]).unwrap();
+        let expected = format!("ota-manifest-v1\nesp32_secure_ota.bin\n1.1\n2\n912304\n{}\n", "ab".repeat(32));
+        assert_eq!(message, expected.as_bytes());
+    }
+
+    #[test]
+    fn verifier_checks_signer() {
+        let rng = SystemRandom::new();
+        let pkcs8 = EcdsaKeyPair::generate_pkcs8(&ECDSA_P256_SHA256_ASN1_SIGNING, &rng).unwrap();
+        let signer = ImageSigner::from_pkcs8(pkcs8.as_ref()).unwrap();
+        let mut spki = P256_SPKI_PREFIX.to_vec();
+        spki.extend_from_slice(ring::signature::KeyPair::public_key(&signer.key).as_ref());
+        let verifier = ImageVerifier::from_spki(&spki).unwrap();
+
+        let signature = hex::encode(signer.sign(b"message").unwrap());
+        verifier.verify(b"message", &signature).unwrap();
+        assert!(verifier.verify(b"other message", &signature).is_err());
+        assert!(ImageVerifier::from_spki(&spki[1..]).is_err());
+    }
+
+    #[test]
+    fn manifest_message_refuses_line_breaks() {
+        assert!(manifest_message("a\nb", "1.1", 0, 1, &[0; 32]).is_err());
+        assert!(manifest_message("a", "1.1\n2", 0, 1, &[0; 32]).is_err());
+    }
+}
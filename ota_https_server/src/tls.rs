@@ -0,0 +1,130 @@
+use rustls::pki_types::{CertificateDer, PrivateKeyDer};
+use rustls::server::ServerSessionMemoryCache;
+use rustls::{HandshakeKind, ServerConfig};
+use serde::Serialize;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Duration;
+
+/// Sessions kept for the clients resuming with a session ID instead of a
+/// ticket
+const SESSION_CACHE_SIZE: usize = 1024;
+
+/// Create the TLS configuration of the server.
+///
+/// Devices poll the server every few seconds, often on a new connection, so
+/// sessions can be resumed with stateless tickets (TLS 1.2 and 1.3) or session
+/// IDs, saving them the cost of a full handshake.
+pub fn server_config(
+    certs: Vec<CertificateDer<'static>>,
+    key: PrivateKeyDer<'static>,
+) -> anyhow::Result<ServerConfig> {
+    let mut config = ServerConfig::builder()
+        .with_no_client_auth()
+        .with_single_cert(certs, key)
+        .map_err(|e| anyhow::anyhow!("Failed to create TLS config: {}", e))?;
+
+    // The ticket keys are rotated every 6 hours
+    config.ticketer = rustls::crypto::ring::Ticketer::new()
+        .map_err(|e| anyhow::anyhow!("Failed to create TLS ticketer: {}", e))?;
+    config.session_storage = ServerSessionMemoryCache::new(SESSION_CACHE_SIZE);
+    Ok(config)
+}
+
+/// Upper bounds of the buckets of the handshake duration histograms, in
+/// milliseconds
+pub const HANDSHAKE_BUCKETS_MS: [u64; 10] = [1, 2, 5, 10, 20, 50, 100, 200, 500, 1000];
+
+/// TLS handshakes since the server started, to check that devices resume
+/// their sessions
+#[derive(Default)]
+pub struct TlsStats {
+    full: AtomicU64,
+    resumed: AtomicU64,
+    failed: AtomicU64,
+    full_us: AtomicU64,
+    resumed_us: AtomicU64,
+    /// Handshakes per duration bucket, the last one for the longer ones
+    full_buckets: [AtomicU64; HANDSHAKE_BUCKETS_MS.len() + 1],
+    resumed_buckets: [AtomicU64; HANDSHAKE_BUCKETS_MS.len() + 1],
+}
+
+/// Duration histogram of a kind of handshake
+pub struct HandshakeHistogram {
+    /// Handshakes that took at most each of `HANDSHAKE_BUCKETS_MS`
+    pub cumulative: Vec<u64>,
+    pub count: u64,
+    pub sum_us: u64,
+}
+
+/// Snapshot of the handshake statistics, served at `/stats/tls`
+#[derive(Debug, Serialize)]
+pub struct TlsStatsReport {
+    pub full_handshakes: u64,
+    pub resumed_handshakes: u64,
+    pub failed_handshakes: u64,
+    /// Average duration, from the connection to the end of the handshake
+    pub full_handshake_avg_us: u64,
+    pub resumed_handshake_avg_us: u64,
+}
+
+impl TlsStats {
+    /// Count a completed handshake
+    pub fn record(&self, kind: Option<HandshakeKind>, duration: Duration) {
+        let us = duration.as_micros() as u64;
+        let bucket = HANDSHAKE_BUCKETS_MS
+            .iter()
+            .position(|&bound_ms| us <= bound_ms * 1000)
+            .unwrap_or(HANDSHAKE_BUCKETS_MS.len());
+        if kind == Some(HandshakeKind::Resumed) {
+            self.resumed.fetch_add(1, Ordering::Relaxed);
+            self.resumed_us.fetch_add(us, Ordering::Relaxed);
+            self.resumed_buckets[bucket].fetch_add(1, Ordering::Relaxed);
+        } else {
+            self.full.fetch_add(1, Ordering::Relaxed);
+            self.full_us.fetch_add(us, Ordering::Relaxed);
+            self.full_buckets[bucket].fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    pub fn record_failure(&self) {
+        self.failed.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn failed(&self) -> u64 {
+        self.failed.load(Ordering::Relaxed)
+    }
+
+    /// Get the duration histogram of the full or resumed handshakes
+    pub fn histogram(&self, resumed: bool) -> HandshakeHistogram {
+        let (buckets, sum_us) = if resumed {
+            (&self.resumed_buckets, &self.resumed_us)
+        } else {
+            (&self.full_buckets, &self.full_us)
+        };
+        let counts: Vec<u64> = buckets.iter().map(|count| count.load(Ordering::Relaxed)).collect();
+        let cumulative = counts[..HANDSHAKE_BUCKETS_MS.len()]
+            .iter()
+            .scan(0, |total, count| {
+                *total += count;
+                Some(*total)
+            })
+            .collect();
+        HandshakeHistogram {
+            cumulative,
+            count: counts.iter().sum(),
+            sum_us: sum_us.load(Ordering::Relaxed),
+        }
+    }
+
+    pub fn report(&self) -> TlsStatsReport {
+        let full = self.full.load(Ordering::Relaxed);
+        let resumed = self.resumed.load(Ordering::Relaxed);
+        TlsStatsReport {
+            full_handshakes: full,
+            resumed_handshakes: resumed,
+            failed_handshakes: self.failed.load(Ordering::Relaxed),
+            full_handshake_avg_us: self.full_us.load(Ordering::Relaxed) / full.max(1),
+            resumed_handshake_avg_us: self.resumed_us.load(Ordering::Relaxed) / resumed.max(1),
+        }
+    }
+}
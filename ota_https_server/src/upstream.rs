@@ -0,0 +1,109 @@
+use bytes::Bytes;
+use http_body_util::{BodyExt, Empty};
+use hyper::client::conn::http1;
+use hyper::{Request, StatusCode, Uri, header};
+use hyper_util::rt::TokioIo;
+use rustls::pki_types::ServerName;
+use rustls::{ClientConfig, RootCertStore};
+use std::path::Path;
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::net::TcpStream;
+use tokio_rustls::TlsConnector;
+use tracing::warn;
+
+/// Longest time a request to the upstream server may take, image included
+const REQUEST_TIMEOUT: Duration = Duration::from_secs(300);
+
+/// Client of the server a mirror copies its firmware from.
+///
+/// Every request opens a connection of its own: the mirror only polls the
+/// index every few seconds and downloads an image once per release.
+pub struct Upstream {
+    host: String,
+    port: u16,
+    /// Path prefix of the server, without the trailing slash
+    base_path: String,
+    tls: Option<(TlsConnector, ServerName<'static>)>,
+}
+
+impl Upstream {
+    /// Create a client of the server at `url`, an `https` one trusting the
+    /// certificates of the PEM file `ca`
+    pub fn new(url: &str, ca: Option<&Path>) -> anyhow::Result<Upstream> {
+        let uri: Uri = url.parse()?;
+        let https = match uri.scheme_str() {
+            Some("https") => true,
+            Some("http") => false,
+            _ => anyhow::bail!("Upstream URL {} is not http or https", url),
+        };
+        let host = uri
+            .host()
+            .ok_or_else(|| anyhow::anyhow!("Upstream URL {} has no host", url))?
+            .to_string();
+
+        let tls = if https {
+            let Some(ca) = ca else {
+                anyhow::bail!("An https upstream needs --upstream-ca");
+            };
+            let mut roots = RootCertStore::empty();
+            for cert in crate::load_certs(ca)? {
+                roots.add(cert)?;
+            }
+            let config = ClientConfig::builder()
+                .with_root_certificates(roots)
+                .with_no_client_auth();
+            let name = ServerName::try_from(host.clone())?;
+            Some((TlsConnector::from(Arc::new(config)), name))
+        } else {
+            None
+        };
+
+        Ok(Upstream {
+            port: uri.port_u16().unwrap_or(if https { 443 } else { 80 }),
+            host,
+            base_path: uri.path().trim_end_matches('/').to_string(),
+            tls,
+        })
+    }
+
+    /// GET `path` on the upstream server, returns the status and the body
+    pub async fn get(&self, path: &str) -> anyhow::Result<(StatusCode, Bytes)> {
+        tokio::time::timeout(REQUEST_TIMEOUT, self.request(path))
+            .await
+            .map_err(|_| anyhow::anyhow!("GET {} timed out", path))?
+    }
+
+    async fn request(&self, path: &str) -> anyhow::Result<(StatusCode, Bytes)> {
+        let stream = TcpStream::connect((self.host.as_str(), self.port)).await?;
+        let request = Request::get(format!("{}{}", self.base_path, path))
+            .header(header::HOST, format!("{}:{}", self.host, self.port))
+            .body(Empty::<Bytes>::new())?;
+
+        let response = match &self.tls {
+            Some((connector, name)) => {
+                let stream = connector.connect(name.clone(), stream).await?;
+                send(TokioIo::new(stream), request).await?
+            }
+            None => send(TokioIo::new(stream), request).await?,
+        };
+        Ok(response)
+    }
+}
+
+/// Send a request on a new HTTP/1.1 connection and read the whole response
+async fn send<T>(io: T, request: Request<Empty<Bytes>>) -> anyhow::Result<(StatusCode, Bytes)>
+where
+    T: hyper::rt::Read + hyper::rt::Write + Unpin + Send + 'static,
+{
+    let (mut sender, connection) = http1::handshake(io).await?;
+    tokio::spawn(async move {
+        if let Err(e) = connection.await {
+            warn!("Upstream connection failed: {}", e);
+        }
+    });
+    let response = sender.send_request(request).await?;
+    let status = response.status();
+    let body = response.into_body().collect().await?.to_bytes();
+    Ok((status, body))
+}
@@ -0,0 +1,60 @@
+use notify::event::{AccessKind, AccessMode};
+use notify::{Event, EventKind, RecursiveMode, Watcher};
+use ota_https_server::firmware::FirmwareStore;
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::sync::mpsc;
+use tracing::{error, info, warn};
+
+/// Time without any change in the serving directory before it is reloaded, so
+/// that an image being copied is not loaded half written
+const SETTLE_TIME: Duration = Duration::from_millis(500);
+
+/// Check if an event may have changed a file. Reading the files (as a reload
+/// does) is not a change.
+fn is_change(kind: &EventKind) -> bool {
+    match kind {
+        EventKind::Access(AccessKind::Close(AccessMode::Write)) => true,
+        EventKind::Access(_) => false,
+        _ => true,
+    }
+}
+
+/// Watch the serving directory, patches included, and reload the store once
+/// it settles after a change.
+/// Requests in progress keep the snapshot they started with.
+pub fn spawn(store: Arc<FirmwareStore>) -> anyhow::Result<()> {
+    let (tx, mut rx) = mpsc::unbounded_channel();
+    let mut watcher = notify::recommended_watcher(move |event: notify::Result<Event>| match event {
+        Ok(event) if is_change(&event.kind) => {
+            let _ = tx.send(());
+        }
+        Ok(_) => {}
+        Err(e) => warn!("Failed to watch the serving directory: {}", e),
+    })?;
+    watcher.watch(store.dir(), RecursiveMode::Recursive)?;
+
+    tokio::spawn(async move {
+        // Watching stops when the watcher is dropped
+        let _watcher = watcher;
+        while rx.recv().await.is_some() {
+            // Wait until nothing changed for SETTLE_TIME
+            loop {
+                match tokio::time::timeout(SETTLE_TIME, rx.recv()).await {
+                    Ok(Some(())) => continue,
+                    Ok(None) => return,
+                    Err(_) => break,
+                }
+            }
+
+            info!("Serving directory changed, reloading");
+            let store = store.clone();
+            match tokio::task::spawn_blocking(move || store.reload()).await {
+                Ok(Ok(())) => {}
+                Ok(Err(e)) => error!("Failed to reload the serving directory: {}", e),
+                Err(e) => error!("Reload task failed: {}", e),
+            }
+        }
+    });
+    Ok(())
+}